@@ -9,12 +9,33 @@ typedef struct engine_handle engine_handle_t;
 typedef void (*token_callback)(uint32_t token_id, const char *text, void *user);
 
 struct engine_config {
-    uint32_t n_threads;
+    uint32_t n_threads;       // compute threads (0 = all online CPUs)
     uint32_t batch_size;
-    uint32_t prefetch_depth;  // 2 or 3
+    uint32_t prefetch_depth;  // arena sized for this many of the largest layer (2 or 3)
+    uint32_t prefetch_mb;     // prefetch arena size in MiB (0 = from prefetch_depth)
+    uint32_t prefetch_lookahead; // layers queued ahead (0 = adapt to read/compute time)
     uint32_t kv_block_size;
-    uint32_t kv_quant;        // 0=Q8_0, 1=Q4_0
+    uint32_t max_context;     // KV positions (0 = default 2048); memory grows with use
+    uint32_t kv_quant;        // 0=Q8_0, 1=Q4_0, 2=F16, 3=tiered by age (F16, Q8_0, Q4_0)
+    uint32_t kv_tier_f16;     // tiered: newest tokens kept in F16 (0 = default 64)
+    uint32_t kv_tier_q8;      // tiered: tokens after those kept in Q8_0 (0 = default 1024)
+    uint32_t kv_evict;        // at max_context: 0 = stop, 1 = sinks + sliding window,
+                              // 2 = sinks + recent + heavy hitters (H2O)
+    uint32_t kv_sink;         // leading tokens eviction keeps (0 = default 4)
+    uint32_t kv_recent;       // newest tokens H2O keeps (0 = max_context / 4)
+    const char *kv_spill_path; // file for cold KV blocks (NULL = keep all in RAM)
+    uint32_t kv_resident;     // newest tokens per layer kept in RAM when spilling (0 = default 256)
+    uint32_t kv_select;       // decode attends about this many tokens, in blocks chosen
+                              // by key bounds (0 = attend everything)
+    uint32_t kv_select_recent; // newest tokens always attended when selecting (0 = default 128)
+    uint32_t prefill_chunk;   // prompt tokens per layer pass (0 = default 64)
+    uint32_t q8_activations;  // 1 = quantize matmul inputs to Q8_K (integer kernels)
+    uint32_t io_depth;        // prefetch reads in flight (0 = default 8)
+    uint32_t io_chunk_kb;     // prefetch read size in KiB (0 = default 1024)
+    uint64_t mem_budget;      // bytes for weights, KV and buffers; layers that fit
+                              // stay resident (0 = stream every layer)
     int use_mmap;
+    int direct_io;            // 1 = stream layers with O_DIRECT (bypass page cache)
 };
 
 engine_handle_t *engine_open(const char *model_path, const struct engine_config *cfg);
@@ -58,5 +58,35 @@ const void *gguf_map_tensor(gguf_file_t *f, const gguf_tensor_t *t);
 int gguf_read_tensor_data(gguf_file_t *f, const gguf_tensor_t *t, void *dst, size_t dst_size);
 int gguf_read_span(gguf_file_t *f, uint64_t offset, uint64_t size, void *dst);
 
+// One tensor read: size bytes at data offset `offset` into dst.
+struct gguf_read_seg {
+    uint64_t offset;
+    uint64_t size;
+    void *dst;
+};
+
+// Scatter-reads n segments straight into their destinations. Segments are
+// sorted by offset in place; neighbours separated by small gaps (alignment
+// padding) share one preadv, the gap bytes going to a scratch buffer.
+// *out_bytes (optional) receives the bytes read from the file.
+int gguf_read_scatter(gguf_file_t *f, struct gguf_read_seg *segs, uint32_t n,
+                      uint64_t *out_bytes);
+
+// Opens a second descriptor that bypasses the page cache (O_DIRECT on Linux,
+// F_NOCACHE on macOS) for gguf_read_direct. Returns -1 if unsupported.
+int gguf_enable_direct_io(gguf_file_t *f, const char *path);
+// Required buffer/offset/length alignment of direct reads (0 when disabled).
+uint32_t gguf_direct_io_align(const gguf_file_t *f);
+// Rounds the data range [offset, offset + size) out to direct I/O blocks:
+// *file_start/*file_len are the absolute block-aligned range, and the byte at
+// offset sits *skip bytes into it.
+int gguf_direct_span(const gguf_file_t *f, uint64_t offset, uint64_t size,
+                     uint64_t *file_start, uint64_t *file_len, size_t *skip);
+// Reads file_len bytes at the absolute block-aligned file_start into dst
+// (aligned to gguf_direct_io_align). Stops early only at end of file.
+// Thread-safe; *out_bytes (optional) is the amount read.
+int gguf_read_direct(gguf_file_t *f, uint64_t file_start, uint64_t file_len, void *dst,
+                     uint64_t *out_bytes);
+
 int64_t gguf_get_n_tensors(gguf_file_t *f);
 int gguf_get_tensor(gguf_file_t *f, int64_t idx, gguf_tensor_t *out);
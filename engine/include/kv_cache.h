@@ -1,10 +1,27 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 enum kv_quant_type {
     KV_Q8_0 = 0,
     KV_Q4_0 = 1,
+    KV_F16 = 2,
+};
+
+enum kv_layout {
+    KV_LAYOUT_TOKEN_MAJOR = 0,  // a token row holds every KV head, scales inline
+    KV_LAYOUT_HEAD_MAJOR = 1,   // per (block, KV head) aligned tiles, scales apart
+};
+
+// What kv_cache_reserve gives up once max_seq_len positions are in use.
+// Whole blocks are evicted and the blocks after them move down, so the
+// cached sequence stays dense and its positions stay below max_seq_len
+// however long a session runs.
+enum kv_evict_policy {
+    KV_EVICT_NONE = 0,    // a full cache refuses new tokens
+    KV_EVICT_WINDOW = 1,  // attention sinks plus a sliding window: drop the oldest
+    KV_EVICT_H2O = 2,     // heavy hitters: drop the least attended block
 };
 
 struct kv_cache_config {
@@ -12,8 +29,30 @@ struct kv_cache_config {
     uint32_t n_kv_heads;
     uint32_t head_dim;
     uint32_t block_size;
-    uint32_t max_seq_len;
+    uint32_t max_seq_len;   // positions addressable; blocks are allocated on first append
     enum kv_quant_type quant;
+    enum kv_layout layout;
+    enum kv_evict_policy evict;
+    uint32_t n_sink;        // leading tokens never evicted (attention sinks)
+    uint32_t n_recent;      // newest tokens KV_EVICT_H2O never evicts
+    // Age tiers (head-major only): quant is ignored and each layer keeps its
+    // newest tier_f16 blocks in KV_F16, the tier_q8 blocks before them in
+    // KV_Q8_0 and older ones in KV_Q4_0. New tokens land in F16 and blocks
+    // are re-quantized as they age, by kv_cache_compact.
+    int tiered;
+    uint32_t tier_f16;      // blocks (at least 1, the one being filled)
+    uint32_t tier_q8;       // blocks
+    // Disk backing: with spill_path set, kv_cache_compact writes every full
+    // block but each layer's newest resident_blocks to a scratch file there
+    // (created, and unlinked at once) and frees its memory; only the block
+    // headers stay. kv_cache_prefetch reads a layer's blocks back ahead of
+    // its attention, and any access to a spilled block reads it inline.
+    const char *spill_path;
+    uint32_t resident_blocks;
+    // Keep per-channel min/max of every block's keys, as appended, in
+    // memory next to the block (op_kv_head_span k_min / k_max) for
+    // op_kv_select_spans.
+    int key_bounds;
 };
 
 typedef struct kv_cache kv_cache_t;
@@ -22,6 +61,8 @@ kv_cache_t *kv_cache_create(const struct kv_cache_config *cfg);
 void kv_cache_destroy(kv_cache_t *c);
 int kv_cache_append(kv_cache_t *c, uint32_t layer, uint32_t pos,
                     const float *k, const float *v);
+int kv_cache_append_batch(kv_cache_t *c, uint32_t layer, uint32_t pos, uint32_t n_tokens,
+                          const float *k, const float *v);
 int kv_cache_read_block(kv_cache_t *c, uint32_t layer, uint32_t block_id,
                         float *k_out, float *v_out);
 int kv_cache_read_range(kv_cache_t *c, uint32_t layer,
@@ -33,5 +74,60 @@ typedef void (*kv_block_cb)(uint32_t block_idx,
 int kv_cache_iterate(kv_cache_t *c, uint32_t layer,
                      uint32_t seq_start, uint32_t seq_end,
                      kv_block_cb cb, void *user);
+// Like kv_cache_iterate without dequantizing: k and v point at the cached
+// rows of tokens [pos0, pos0 + n_tokens) clipped to [seq_start, seq_end),
+// consecutive tokens back to back. Each token row is n_kv_heads * head_dim
+// values in the cache's quant format (layout in op_kv_row_size). Fails
+// once eviction has moved blocks, as op_kv_span cannot carry a rope_shift.
+typedef void (*kv_block_quant_cb)(uint32_t pos0, const void *k, const void *v,
+                                  uint32_t n_tokens, void *user);
+int kv_cache_iterate_quant(kv_cache_t *c, uint32_t layer,
+                           uint32_t seq_start, uint32_t seq_end,
+                           kv_block_quant_cb cb, void *user);
+// The same walk over a KV_LAYOUT_HEAD_MAJOR cache: each run is described by
+// an op_kv_head_span (see ops.h) whose per-head tiles start 64-byte aligned
+// at the block's first token. Each layout only supports its own iterator.
+struct op_kv_head_span;
+typedef void (*kv_block_heads_cb)(uint32_t pos0, const struct op_kv_head_span *span, void *user);
+int kv_cache_iterate_heads(kv_cache_t *c, uint32_t layer,
+                           uint32_t seq_start, uint32_t seq_end,
+                           kv_block_heads_cb cb, void *user);
+// Makes room for n_tokens more tokens in every layer, evicting blocks by the
+// configured policy when they would not fit. Returns -1 if they cannot fit
+// (no policy, or the protected tokens leave too little room).
+int kv_cache_reserve(kv_cache_t *c, uint32_t n_tokens);
+// Largest n_tokens kv_cache_reserve can make room for right now: the free
+// positions plus, under an eviction policy, the unprotected blocks.
+uint32_t kv_cache_room(kv_cache_t *c);
+// Position the key cached at pos was rotated at, or is to be rotated at by
+// the caller before appending it. Eviction moves later tokens down without
+// touching their keys; kv_cache_iterate_heads reports the difference as
+// each run's rope_shift so the attention kernels can turn the queries to
+// match, and relative positions follow the sequence as cached.
+uint32_t kv_cache_rope_pos(kv_cache_t *c, uint32_t layer, uint32_t pos);
+// Adds attention probability mass to a layer's blocks: mass[i] belongs to
+// its i-th block, i.e. the i-th run kv_cache_iterate_heads reports from
+// position 0. KV_EVICT_H2O evicts the unprotected block with the least.
+int kv_cache_add_attention(kv_cache_t *c, uint32_t layer, const float *mass, uint32_t n_blocks);
+// Queues a layer for background upkeep: re-quantizing the blocks of a
+// tiered cache that aged past their tier, then writing the cold blocks of a
+// disk-backed one out to the spill file (only those changed since they were
+// last read) and releasing their memory. A background thread does the work;
+// calls touching that layer wait for it, so call this right after a layer's
+// attention and it is done long before the layer comes round again. No-op
+// on other caches.
+int kv_cache_compact(kv_cache_t *c, uint32_t layer);
+// Queues reading a disk-backed layer's spilled blocks back into memory on
+// the same background thread, so the read overlaps whatever the caller does
+// until it next touches the layer. No-op without a spill file.
+int kv_cache_prefetch(kv_cache_t *c, uint32_t layer);
+// Returns every block to the cache's pool for reuse by later appends.
 void kv_cache_clear(kv_cache_t *c);
 uint32_t kv_cache_get_seq_len(kv_cache_t *c, uint32_t layer);
+// Bytes held by the cache: the blocks allocated so far (in use or pooled)
+// plus the block tables.
+size_t kv_cache_memory_size(kv_cache_t *c);
+// Bytes it would hold with all max_seq_len positions cached in every layer
+// (for a tiered cache, each in its tier's format; for a disk-backed one,
+// the spilled blocks of two layers at a time).
+size_t kv_cache_memory_limit(const kv_cache_t *c);
@@ -82,28 +82,70 @@ struct model_info {
 struct streaming_stats {
     uint64_t layer_loads;
     uint64_t layer_bytes_read;
+    uint64_t layer_read_ns;   // wall time spent in layer reads
     size_t max_layer_size;
     size_t peak_buffer_usage;
     size_t peak_rss;
     uint32_t max_concurrent_buffers;
     uint32_t prefetch_hits;
     uint32_t prefetch_misses;
+    uint64_t prefetch_wait_ns;      // total time blocked on misses
+    uint64_t prefetch_max_wait_ns;  // longest single miss
+    uint32_t lookahead;             // current adaptive prefetch lookahead
+    uint32_t lookahead_max;
+    uint32_t lookahead_changes;
+    uint64_t layer_read_ema_ns;     // moving averages driving the lookahead
+    uint64_t layer_compute_ema_ns;
+    uint32_t direct_io;       // 1 = layers are read with O_DIRECT
+    uint32_t pinned_layers;   // layers kept resident under the memory budget
+    size_t pinned_bytes;
+};
+
+// Tensor groups of a layer, in the order the forward pass needs them:
+// attn_norm/q/k/v/o, then ffn_norm/gate/up/down.
+enum layer_group {
+    LAYER_GROUP_ATTN = 1u << 0,
+    LAYER_GROUP_FFN = 1u << 1,
+    LAYER_GROUP_ALL = LAYER_GROUP_ATTN | LAYER_GROUP_FFN,
+};
+
+// One read of a chunked layer load: size bytes at offset (data-relative, or
+// absolute and block-aligned in direct I/O mode) into dst. groups are the
+// tensor groups that need this chunk.
+struct layer_read_chunk {
+    uint64_t offset;
+    uint64_t size;
+    void *dst;
+    uint32_t groups;
 };
 
 struct model_config {
     int prefer_gguf;
     int use_mmap;
+    int direct_io;
 };
 
 model_handle_t *model_open(const char *path, const struct model_config *cfg);
 int model_load_resident(model_handle_t *m);
 int model_get_resident(model_handle_t *m, struct resident_tensors *out);
+int model_get_resident_size(model_handle_t *m, size_t *out);
 int model_get_info(model_handle_t *m, struct model_info *out);
 int model_get_layer_view(model_handle_t *m, uint32_t layer_id, const struct layer_view **out);
 int model_get_layer_buffer_size(model_handle_t *m, uint32_t layer_id, size_t *out);
 int model_get_max_layer_size(model_handle_t *m, size_t *out);
+// Required alignment of buffers passed to model_load_layer.
+size_t model_get_buffer_alignment(model_handle_t *m);
 int model_load_layer(model_handle_t *m, uint32_t layer_id, void *buffer, size_t buffer_size,
                      struct layer_view *out_view, size_t *out_used);
+// Lays the layer out in buffer like model_load_layer but reads nothing: the
+// file ranges are split into chunks of at most chunk_size bytes for
+// model_read_chunk, attention chunks first. Fails if more than max_chunks
+// are needed.
+int model_plan_layer(model_handle_t *m, uint32_t layer_id, void *buffer, size_t buffer_size,
+                     struct layer_view *out_view, size_t *out_used, size_t chunk_size,
+                     struct layer_read_chunk *chunks, uint32_t max_chunks, uint32_t *out_n_chunks);
+// Thread-safe; chunks of one or several layers may be read concurrently.
+int model_read_chunk(model_handle_t *m, const struct layer_read_chunk *c);
 uint32_t model_get_layer_count(model_handle_t *m);
 int model_get_vocab_size(model_handle_t *m, uint32_t *out);
 int model_get_token_string(model_handle_t *m, uint32_t token_id, const char **out);
@@ -1,11 +1,20 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
+struct thread_pool;
+
 struct op_context {
     uint32_t n_threads;
+    // Matmuls are split by rows and attention by heads across the pool;
+    // NULL runs everything on the calling thread.
+    struct thread_pool *pool;
 };
 
+// Name of the CPU matmul kernel set selected at startup ("scalar", "avx2", ...).
+const char *op_cpu_kernels_name(void);
+
 int op_rmsnorm(const struct op_context *ctx, const float *x, const float *w, float *y,
                uint32_t n, uint32_t d);
 int op_rope(const struct op_context *ctx, void *qk,
@@ -25,10 +34,134 @@ int op_matmul_q5_k(const struct op_context *ctx,
 int op_matmul_q6_k(const struct op_context *ctx,
                    const void *a_q6k, const float *b_f32, float *c,
                    uint32_t m, uint32_t k);
+// Multi-column variants: b_f32 holds n activation rows of length k and c
+// receives n output rows of length m.
+int op_matmul_q4_k_gemm(const struct op_context *ctx,
+                        const void *a_q4k, const float *b_f32, float *c,
+                        uint32_t m, uint32_t n, uint32_t k);
+int op_matmul_q5_k_gemm(const struct op_context *ctx,
+                        const void *a_q5k, const float *b_f32, float *c,
+                        uint32_t m, uint32_t n, uint32_t k);
+int op_matmul_q6_k_gemm(const struct op_context *ctx,
+                        const void *a_q6k, const float *b_f32, float *c,
+                        uint32_t m, uint32_t n, uint32_t k);
+// Q8_K activations: 256-value blocks of int8 with one float scale and
+// per-16 sums. Quantizing a matmul input once lets every projection that
+// reads it run the integer-domain kernels below.
+size_t op_q8_k_row_size(uint32_t k);
+int op_quantize_q8_k(const struct op_context *ctx, const float *x, void *y_q8k,
+                     uint32_t n, uint32_t k);
+// b_q8k holds n Q8_K rows of length k (from op_quantize_q8_k); c receives n
+// output rows of length m.
+int op_matmul_q4_k_q8_k(const struct op_context *ctx,
+                        const void *a_q4k, const void *b_q8k, float *c,
+                        uint32_t m, uint32_t n, uint32_t k);
+int op_matmul_q5_k_q8_k(const struct op_context *ctx,
+                        const void *a_q5k, const void *b_q8k, float *c,
+                        uint32_t m, uint32_t n, uint32_t k);
+int op_matmul_q6_k_q8_k(const struct op_context *ctx,
+                        const void *a_q6k, const void *b_q8k, float *c,
+                        uint32_t m, uint32_t n, uint32_t k);
+// Streaming matmul. K-quant rows are independent, so a weight matrix that
+// is still arriving from disk can be consumed in row bands as they land.
+// a_rows holds rows [row0, row0 + n_rows) of an m-row matrix of GGUF type
+// dtype (Q4_K, Q5_K or Q6_K); their outputs land in c at the same places a
+// whole-matrix call writes them (n output rows of length m). b_q8k selects
+// the Q8_K kernels, otherwise b_f32 goes through the GEMV/GEMM kernels.
+size_t op_k_quant_row_size(uint32_t dtype, uint32_t k);
+int op_matmul_k_quant_rows(const struct op_context *ctx, uint32_t dtype,
+                           const void *a_rows, const float *b_f32, const void *b_q8k,
+                           float *c, uint32_t row0, uint32_t n_rows,
+                           uint32_t m, uint32_t n, uint32_t k);
+// KV cache rows: n values as 32-value groups of {float scale; int8_t q[32]}
+// for KV_Q8_0 or {float scale; uint8_t q[16]} (4-bit, offset 8) for KV_Q4_0
+// (kv_quant is an enum kv_quant_type); the last group is zero padded.
+// KV_F16 rows are n plain halves, with values below the smallest normal
+// flushed to zero. Quantization rounds to nearest even, identically on
+// every kernel set.
+size_t op_kv_row_size(uint32_t kv_quant, uint32_t n);
+void op_quantize_kv_row(uint32_t kv_quant, const float *x, void *y, uint32_t n);
+void op_dequantize_kv_row(uint32_t kv_quant, const void *x, float *y, uint32_t n);
 int op_attention(const struct op_context *ctx, const float *q,
                  const float *k, const float *v, float *out,
                  uint32_t n_heads, uint32_t n_kv_heads, uint32_t head_dim,
                  uint32_t seq_len, float scale, const float *mask);
+// Attention read straight from a Q8 KV cache. Every token row holds
+// n_kv_heads * head_dim values as groups of {float scale; int8_t q[32]} (the
+// kv_cache layout); spans list runs of consecutive cached tokens in position
+// order and the first seq_len tokens are attended. Keys are dotted in the
+// int8 domain with one scale per group, the softmax is a streaming max/sum
+// and V is accumulated in place, so nothing scales with seq_len. Query heads
+// are processed per KV group (consecutive heads share a KV head), so each K
+// and V row is read once per group rather than once per query head.
+struct op_kv_span {
+    const void *k;
+    const void *v;
+    uint32_t n_tokens;
+};
+int op_attention_q8_kv(const struct op_context *ctx, const float *q,
+                       const struct op_kv_span *spans, uint32_t n_spans, float *out,
+                       uint32_t n_heads, uint32_t n_kv_heads, uint32_t head_dim,
+                       uint32_t seq_len, float scale);
+// Blocked causal variant for prefill chunks: q holds n_q query rows for the
+// last n_q positions of seq_len, and row r attends to the first
+// seq_len - n_q + r + 1 tokens. The mask is implicit (tokens past a row are
+// skipped), each row keeps its own online softmax, and every K/V row is read
+// once per block of query rows instead of once per row.
+int op_attention_q8_kv_causal(const struct op_context *ctx, const float *q, uint32_t n_q,
+                              const struct op_kv_span *spans, uint32_t n_spans, float *out,
+                              uint32_t n_heads, uint32_t n_kv_heads, uint32_t head_dim,
+                              uint32_t seq_len, float scale);
+// Same kernel over a KV_Q4_0 cache.
+int op_attention_q4_kv_causal(const struct op_context *ctx, const float *q, uint32_t n_q,
+                              const struct op_kv_span *spans, uint32_t n_spans, float *out,
+                              uint32_t n_heads, uint32_t n_kv_heads, uint32_t head_dim,
+                              uint32_t seq_len, float scale);
+// Head-major KV runs: each KV head owns a tile of token rows holding only
+// its head_dim values (whole 32-value groups, int8 for KV_Q8_0 or packed
+// nibbles for KV_Q4_0, or head_dim halves for KV_F16) and a separate array
+// of per-group float scales (none for KV_F16), so a head's keys are
+// unit-stride and aligned; runs of one call may differ in format. KV head
+// h's row for token t of the run starts at k + h * head_stride + t * row
+// bytes and its scales at k_scale + h * scale_stride +
+// t * ceil(head_dim / 32); likewise for v.
+struct op_kv_head_span {
+    const void *k;
+    const void *v;
+    const float *k_scale;
+    const float *v_scale;
+    size_t head_stride;   // bytes between consecutive KV heads' rows
+    size_t scale_stride;  // floats between consecutive KV heads' scales
+    uint32_t n_tokens;
+    uint32_t rope_shift;  // positions past its place the run's keys were rotated at
+    uint32_t quant;       // enum kv_quant_type of the run's rows
+    // Optional per-channel bounds of every key in the run's block, as
+    // n_kv_heads * head_dim floats (NULL when the cache keeps none).
+    const float *k_min;
+    const float *k_max;
+};
+// op_attention_q8_kv_causal / op_attention_q4_kv_causal over head-major
+// runs. Queries meet a run with a rope_shift turned that much further
+// (op_rope with rope_theta), which gives the scores of keys rotated at
+// their current positions. If span_mass is set, span_mass[i] is increased
+// by the softmax probability all query rows and heads put on run i.
+int op_attention_kv_heads_causal(const struct op_context *ctx, const float *q, uint32_t n_q,
+                                 const struct op_kv_head_span *spans, uint32_t n_spans,
+                                 float *out, uint32_t n_heads, uint32_t n_kv_heads,
+                                 uint32_t head_dim, uint32_t seq_len, float scale,
+                                 float rope_theta, float *span_mass);
+// Query-aware run selection for decode (Quest): a run's keys lie inside
+// its k_min / k_max box, so a query head's score with any of them is at
+// most sum_d max(q_d * k_min_d, q_d * k_max_d) (q turned by the run's
+// rope_shift as above). Runs rank by how close that bound comes to the
+// best run's for some query head. keep receives, in order, the indices of
+// the first n_first runs, the last n_last, runs without bounds, and the
+// best ranked others until budget runs are chosen; *n_keep their count.
+int op_kv_select_spans(const struct op_context *ctx, const float *q,
+                       const struct op_kv_head_span *spans, uint32_t n_spans,
+                       uint32_t n_heads, uint32_t n_kv_heads, uint32_t head_dim,
+                       float rope_theta, uint32_t budget, uint32_t n_first, uint32_t n_last,
+                       uint32_t *keep, uint32_t *n_keep);
 int op_mlp_swiglu(const struct op_context *ctx,
                   const float *x, const void *w_gate, const void *w_up,
                   const void *w_down, float *y, uint32_t n,
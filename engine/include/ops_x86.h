@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define OPS_X86_SIMD 1
+#endif
+
+enum x86_simd_level {
+    X86_SIMD_NONE = 0,
+    X86_SIMD_AVX2 = 1,
+    X86_SIMD_AVX512 = 2,
+};
+
+// Highest level supported by the CPU and OS (__builtin_cpu_supports).
+int x86_simd_detect(void);
+
+#if defined(OPS_X86_SIMD)
+// Fused dequant-dot kernels: dot(x, dequant(blocks)) over nb super-blocks,
+// unpacking scales and quants in registers (no temporary float row).
+float x86_avx2_dot_q4_k(const void *blocks, const float *x, uint32_t nb);
+float x86_avx2_dot_q5_k(const void *blocks, const float *x, uint32_t nb);
+float x86_avx2_dot_q6_k(const void *blocks, const float *x, uint32_t nb);
+float x86_avx512_dot_q4_k(const void *blocks, const float *x, uint32_t nb);
+float x86_avx512_dot_q5_k(const void *blocks, const float *x, uint32_t nb);
+float x86_avx512_dot_q6_k(const void *blocks, const float *x, uint32_t nb);
+
+// Dequantize one 256-value super-block into y (AVX2; also used on AVX-512).
+void x86_avx2_dequant_q4_k(const void *block, float *y);
+void x86_avx2_dequant_q5_k(const void *block, float *y);
+void x86_avx2_dequant_q6_k(const void *block, float *y);
+
+// acc[j] += dot(w[0..256), b + j * ldb) for j < n. Inner loop of the GEMM
+// kernels once a super-block has been dequantized.
+void x86_avx2_dot_cols_256(const float *w, const float *b, uint64_t ldb,
+                           float *acc, uint32_t n);
+void x86_avx512_dot_cols_256(const float *w, const float *b, uint64_t ldb,
+                             float *acc, uint32_t n);
+
+// Integer-domain dots against Q8_K activations (maddubs + madd). Also used on
+// AVX-512 machines.
+float x86_avx2_dot_q4_k_q8_k(const void *blocks, const void *y_q8k, uint32_t nb);
+float x86_avx2_dot_q5_k_q8_k(const void *blocks, const void *y_q8k, uint32_t nb);
+float x86_avx2_dot_q6_k_q8_k(const void *blocks, const void *y_q8k, uint32_t nb);
+
+// KV cache groups (see op_quantize_kv_row) for nb whole 32-value groups;
+// bit-identical to the scalar quantizers.
+void x86_avx2_quantize_q8_0(const float *x, void *y, uint32_t nb);
+void x86_avx2_quantize_q4_0(const float *x, void *y, uint32_t nb);
+#endif
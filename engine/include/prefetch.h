@@ -23,10 +23,14 @@ struct layer_buffer {
 };
 
 struct prefetcher_config {
-    uint32_t depth;
+    uint32_t depth;         // arena = depth x largest layer unless arena_size is set
     model_handle_t *model;
-    size_t buffer_size;
+    size_t buffer_size;     // overrides the largest layer in the depth sizing
+    size_t arena_size;      // bytes of the layer ring arena (0 = from depth)
     struct streaming_stats *stats;
+    uint32_t io_depth;      // reader threads = chunk reads in flight (0 = default 8)
+    size_t io_chunk_size;   // bytes per read (0 = default 1 MiB)
+    uint32_t lookahead;     // layers kept queued ahead (0 = adaptive)
 };
 
 typedef struct prefetcher prefetcher_t;
@@ -34,15 +38,41 @@ typedef struct prefetch_request prefetch_request_t;
 
 struct prefetch_metrics {
     uint64_t total_bytes_read;
-    uint64_t total_read_time_us;
+    uint64_t total_read_time_us;  // time with at least one read in flight
     uint64_t cache_hits;
     uint64_t cache_misses;
 };
 
+// Layers are packed at their real size into one ring arena, so the number
+// in flight grows as far as the arena allows rather than a fixed depth.
 prefetcher_t *prefetcher_create(const struct prefetcher_config *cfg);
+// Upper bound on simultaneously outstanding requests.
+uint32_t prefetcher_max_requests(const prefetcher_t *p);
+// Layers the caller should keep requested ahead of the one it computes on.
+// Adapts to the measured per-layer read and compute times unless fixed in
+// the config; the arena still bounds what actually gets requested.
+uint32_t prefetcher_lookahead(prefetcher_t *p);
+// Reports how long the caller computed on the last layer.
+void prefetcher_note_compute(prefetcher_t *p, uint64_t compute_ns);
 int prefetcher_start(prefetcher_t *p);
+// Claims a free buffer for layer_id, or returns NULL if all are taken. The
+// handle is owned by the prefetcher and stays valid until it is waited on.
 prefetch_request_t *prefetcher_request(prefetcher_t *p, uint32_t layer_id);
+// Blocks on the slot's own condvar until the layer is read; returns NULL if
+// the load failed or the prefetcher was cancelled.
 struct layer_buffer *prefetcher_wait(prefetch_request_t *req);
+// Like prefetcher_wait but returns as soon as the LAYER_GROUP_* bits in
+// groups are read; the rest keeps streaming into the buffer. Use
+// prefetcher_wait_groups before touching the other tensors.
+struct layer_buffer *prefetcher_wait_partial(prefetch_request_t *req, uint32_t groups);
+int prefetcher_wait_groups(prefetcher_t *p, struct layer_buffer *buf, uint32_t groups);
+// Finer than groups: blocks until the size bytes at addr (inside buf) are
+// read, so a large tensor can be consumed chunk by chunk as it lands.
+int prefetcher_wait_range(prefetcher_t *p, struct layer_buffer *buf, const void *addr, size_t size);
+// LAYER_GROUP_* bits of buf already read; never blocks.
+uint32_t prefetcher_ready_groups(prefetcher_t *p, struct layer_buffer *buf);
+// Bytes per read, i.e. the granularity at which ranges become ready.
+size_t prefetcher_chunk_size(const prefetcher_t *p);
 void prefetcher_release(prefetcher_t *p, struct layer_buffer *buf);
 void prefetcher_cancel(prefetcher_t *p);
 int prefetcher_get_metrics(prefetcher_t *p, struct prefetch_metrics *out);
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct thread_pool thread_pool_t;
+
+// Work item run on every thread of the pool: ith is the thread index in
+// [0, nth). The calling thread always takes ith = 0.
+typedef void (*thread_pool_fn)(void *arg, uint32_t ith, uint32_t nth);
+
+// n_threads counts the calling thread, so n_threads - 1 workers are started.
+thread_pool_t *thread_pool_create(uint32_t n_threads);
+void thread_pool_destroy(thread_pool_t *p);
+uint32_t thread_pool_size(const thread_pool_t *p);
+
+// Fork/join: runs fn on all threads and returns once every thread finished.
+// Workers spin briefly between jobs before sleeping, so back-to-back calls
+// cost microseconds. Not reentrant; one dispatching thread at a time.
+void thread_pool_run(thread_pool_t *p, thread_pool_fn fn, void *arg);
+
+// Online CPU count (at least 1).
+uint32_t thread_pool_cpu_count(void);
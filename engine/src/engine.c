@@ -3,12 +3,19 @@
 #include "ops.h"
 #include "kv_cache.h"
 #include "prefetch.h"
+#include "thread_pool.h"
 
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/resource.h>
+#include <time.h>
+
+struct pinned_layer {
+    void *data;
+    struct layer_view view;
+};
 
 struct engine_handle {
     struct engine_config cfg;
@@ -16,6 +23,27 @@ struct engine_handle {
     struct model_info info;
     kv_cache_t *kv;
     prefetcher_t *prefetch;
+    // Outstanding prefetch requests in layer-stream order. The stream wraps
+    // from the last layer to layer 0 of the next pass, so the queue front is
+    // always the layer the forward pass needs next.
+    prefetch_request_t **pf_queue;
+    uint32_t pf_cap;
+    uint32_t pf_head;
+    uint32_t pf_count;
+    uint32_t pf_next_layer;
+    // Layers kept in RAM under cfg.mem_budget (data == NULL: streamed).
+    struct pinned_layer *pinned;
+    uint32_t n_pinned;
+    size_t pinned_bytes;
+    // One span per KV block, filled by kv_cache_iterate_heads for attention.
+    struct op_kv_head_span *kv_spans;
+    uint32_t kv_spans_cap;
+    // Attention mass per KV block of a layer, for heavy-hitter eviction.
+    float *kv_mass;
+    // Blocks decode attends to under cfg.kv_select.
+    uint32_t *kv_keep;
+    thread_pool_t *pool;
+    struct op_context ops;
     struct streaming_stats stats;
     char *prompt;
 };
@@ -60,22 +88,130 @@ static uint32_t q4k_rows_from_bytes(uint64_t size_bytes, uint32_t k) {
     return (uint32_t)(values / k);
 }
 
-static int matmul_quant(uint32_t dtype, const void *a, const float *b, float *c, uint32_t m, uint32_t k) {
+// b holds n_cols activation rows of length k; c receives n_cols rows of
+// length m. A single column goes through the GEMV kernels, anything wider
+// through the GEMM kernels that dequantize each weight block once. When b_q8
+// is set (b already quantized to Q8_K) the integer kernels are used instead.
+static int matmul_quant(const struct op_context *ctx, uint32_t dtype, const void *a,
+                        const float *b, const void *b_q8,
+                        float *c, uint32_t m, uint32_t k, uint32_t n_cols) {
+    if (b_q8) {
+        if (dtype == 12) {
+            return op_matmul_q4_k_q8_k(ctx, a, b_q8, c, m, n_cols, k);
+        }
+        if (dtype == 13) {
+            return op_matmul_q5_k_q8_k(ctx, a, b_q8, c, m, n_cols, k);
+        }
+        if (dtype == 14) {
+            return op_matmul_q6_k_q8_k(ctx, a, b_q8, c, m, n_cols, k);
+        }
+        return -1;
+    }
+    if (n_cols == 1) {
+        if (dtype == 12) {
+            return op_matmul_q4_k(ctx, a, b, c, m, k);
+        }
+        if (dtype == 13) {
+            return op_matmul_q5_k(ctx, a, b, c, m, k);
+        }
+        if (dtype == 14) {
+            return op_matmul_q6_k(ctx, a, b, c, m, k);
+        }
+        return -1;
+    }
     if (dtype == 12) {
-        return op_matmul_q4_k(NULL, a, b, c, m, k);
+        return op_matmul_q4_k_gemm(ctx, a, b, c, m, n_cols, k);
     }
     if (dtype == 13) {
-        return op_matmul_q5_k(NULL, a, b, c, m, k);
+        return op_matmul_q5_k_gemm(ctx, a, b, c, m, n_cols, k);
     }
     if (dtype == 14) {
-        return op_matmul_q6_k(NULL, a, b, c, m, k);
+        return op_matmul_q6_k_gemm(ctx, a, b, c, m, n_cols, k);
     }
     return -1;
 }
 
+// matmul_quant for weights that may still be arriving: with a pending
+// prefetch buffer the rows are multiplied in bands of about one read chunk,
+// each as soon as its bytes have landed, instead of after the whole tensor.
+static int matmul_streamed(engine_handle_t *h, struct layer_buffer *pending, uint32_t dtype,
+                           const void *a, const float *b, const void *b_q8,
+                           float *c, uint32_t m, uint32_t k, uint32_t n_cols) {
+    size_t row_bytes = op_k_quant_row_size(dtype, k);
+    if (!pending || row_bytes == 0) {
+        if (pending && prefetcher_wait_groups(h->prefetch, pending, LAYER_GROUP_FFN) != 0) {
+            return -1;
+        }
+        return matmul_quant(&h->ops, dtype, a, b, b_q8, c, m, k, n_cols);
+    }
+    size_t band = prefetcher_chunk_size(h->prefetch) / row_bytes;
+    if (band == 0) {
+        band = 1;
+    }
+    for (uint32_t r0 = 0; r0 < m; r0 += (uint32_t)band) {
+        uint32_t nr = m - r0 < band ? m - r0 : (uint32_t)band;
+        const uint8_t *rows = (const uint8_t *)a + (size_t)r0 * row_bytes;
+        if (prefetcher_wait_range(h->prefetch, pending, rows, (size_t)nr * row_bytes) != 0) {
+            return -1;
+        }
+        if (op_matmul_k_quant_rows(&h->ops, dtype, rows, b, b_q8, c, r0, nr, m, n_cols, k) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Quantizes n rows of x into q8 when Q8_K activations are enabled. Returns
+// the buffer to pass to matmul_quant as b_q8, or NULL for the fp32 kernels.
+static const void *quantize_act(const engine_handle_t *h, const float *x, void *q8,
+                                uint32_t n, uint32_t k, int *err) {
+    if (!h->cfg.q8_activations) {
+        return NULL;
+    }
+    if (op_quantize_q8_k(&h->ops, x, q8, n, k) != 0) {
+        *err = 1;
+        return NULL;
+    }
+    return q8;
+}
+
+static enum kv_quant_type engine_kv_quant(const engine_handle_t *h) {
+    return h->cfg.kv_quant == 1 ? KV_Q4_0 : h->cfg.kv_quant == 2 ? KV_F16 : KV_Q8_0;
+}
+
+struct kv_span_list {
+    struct op_kv_head_span *spans;
+    uint32_t n;
+    uint32_t cap;
+};
+
+// n keeps counting past cap so an undersized list is detected.
+static void collect_kv_span(uint32_t pos0, const struct op_kv_head_span *span, void *user) {
+    (void)pos0;
+    struct kv_span_list *list = (struct kv_span_list *)user;
+    if (list->n < list->cap) {
+        list->spans[list->n] = *span;
+    }
+    list->n++;
+}
+
+// Cache position for the next n tokens. Under an eviction policy the cache
+// first drops blocks to make room, so positions stop growing at max_context
+// while the session goes on; without one a full cache fails.
+static int engine_kv_reserve(engine_handle_t *h, uint32_t n, uint32_t *pos) {
+    if (kv_cache_reserve(h->kv, n) != 0) {
+        return -1;
+    }
+    *pos = kv_cache_get_seq_len(h->kv, 0);
+    return 0;
+}
+
+// pending is the prefetch buffer behind lv while its FFN tensors are still
+// being read (NULL when the whole layer is in memory).
 static int forward_layer_view(engine_handle_t *h, const struct layer_view *lv,
-                              uint32_t layer_id, uint32_t pos, float *hidden) {
-    if (!lv) {
+                              uint32_t layer_id, uint32_t pos, uint32_t n_tokens,
+                              float *hidden, struct layer_buffer *pending) {
+    if (!lv || n_tokens == 0) {
         return -1;
     }
 
@@ -83,6 +219,8 @@ static int forward_layer_view(engine_handle_t *h, const struct layer_view *lv,
     uint32_t n_heads = h->info.n_heads;
     uint32_t n_kv_heads = h->info.n_kv_heads;
     uint32_t head_dim = h->info.head_dim;
+    uint32_t q_dim = n_heads * head_dim;
+    uint32_t kv_dim = n_kv_heads * head_dim;
     float rope_theta = h->info.rope_theta > 0.0f ? h->info.rope_theta : 10000.0f;
 
     if (debug_enabled()) {
@@ -91,149 +229,459 @@ static int forward_layer_view(engine_handle_t *h, const struct layer_view *lv,
                lv->ffn_gate_dtype, lv->ffn_up_dtype, lv->ffn_down_dtype);
     }
 
-    float *normed = (float *)malloc((size_t)n_embd * sizeof(float));
-    float *q = (float *)malloc((size_t)n_heads * head_dim * sizeof(float));
-    float *k = (float *)malloc((size_t)n_kv_heads * head_dim * sizeof(float));
-    float *v = (float *)malloc((size_t)n_kv_heads * head_dim * sizeof(float));
-    float *attn_out = (float *)malloc((size_t)n_heads * head_dim * sizeof(float));
-    float *attn_proj = (float *)malloc((size_t)n_embd * sizeof(float));
-    if (!normed || !q || !k || !v || !attn_out || !attn_proj) {
+    // Activations are row-major: n_tokens rows, one per prompt position.
+    float *normed = (float *)malloc((size_t)n_tokens * n_embd * sizeof(float));
+    float *q = (float *)malloc((size_t)n_tokens * q_dim * sizeof(float));
+    float *k = (float *)malloc((size_t)n_tokens * kv_dim * sizeof(float));
+    float *v = (float *)malloc((size_t)n_tokens * kv_dim * sizeof(float));
+    float *attn_out = (float *)malloc((size_t)n_tokens * q_dim * sizeof(float));
+    float *attn_proj = (float *)malloc((size_t)n_tokens * n_embd * sizeof(float));
+    // Q8_K copy of the current matmul input, shared by every projection that
+    // reads it (Q/K/V, then gate/up).
+    size_t act_q8_row = op_q8_k_row_size(n_embd > q_dim ? n_embd : q_dim);
+    void *act_q8 = h->cfg.q8_activations ? malloc((size_t)n_tokens * act_q8_row) : NULL;
+    if (!normed || !q || !k || !v || !attn_out || !attn_proj ||
+        (h->cfg.q8_activations && !act_q8)) {
         free(normed); free(q); free(k); free(v); free(attn_out); free(attn_proj);
+        free(act_q8);
         return -1;
     }
+    int q8_err = 0;
+    const void *xq = NULL;
 
     int dbg = (debug_enabled() && layer_id == 0 && pos == 0);
     // Attention block
-    if (op_rmsnorm(NULL, hidden, (const float *)lv->attn_norm, normed, 1, n_embd) != 0) {
+    if (op_rmsnorm(&h->ops, hidden, (const float *)lv->attn_norm, normed, n_tokens, n_embd) != 0) {
         goto fail;
     }
     if (dbg) debug_check("attn_norm", normed, n_embd);
-    if (matmul_quant(lv->attn_q_dtype, lv->attn_q, normed, q, n_heads * head_dim, n_embd) != 0) {
+    xq = quantize_act(h, normed, act_q8, n_tokens, n_embd, &q8_err);
+    if (q8_err) {
         goto fail;
     }
-    if (dbg) debug_check("Q", q, n_heads * head_dim);
-    if (matmul_quant(lv->attn_k_dtype, lv->attn_k, normed, k, n_kv_heads * head_dim, n_embd) != 0) {
+    if (matmul_quant(&h->ops, lv->attn_q_dtype, lv->attn_q, normed, xq, q, q_dim, n_embd, n_tokens) != 0) {
         goto fail;
     }
-    if (dbg) debug_check("K", k, n_kv_heads * head_dim);
-    if (matmul_quant(lv->attn_v_dtype, lv->attn_v, normed, v, n_kv_heads * head_dim, n_embd) != 0) {
+    if (dbg) debug_check("Q", q, q_dim);
+    if (matmul_quant(&h->ops, lv->attn_k_dtype, lv->attn_k, normed, xq, k, kv_dim, n_embd, n_tokens) != 0) {
         goto fail;
     }
-    if (dbg) debug_check("V", v, n_kv_heads * head_dim);
-
-    if (op_rope(NULL, q, n_heads, head_dim, pos, rope_theta) != 0) {
+    if (dbg) debug_check("K", k, kv_dim);
+    if (matmul_quant(&h->ops, lv->attn_v_dtype, lv->attn_v, normed, xq, v, kv_dim, n_embd, n_tokens) != 0) {
         goto fail;
     }
-    if (op_rope(NULL, k, n_kv_heads, head_dim, pos, rope_theta) != 0) {
-        goto fail;
+    if (dbg) debug_check("V", v, kv_dim);
+
+    // Queries sit at their cache positions. Keys take the position the
+    // cache rotates their block at, which only differs from pos + t when
+    // eviction has moved a partly filled block down.
+    for (uint32_t t = 0; t < n_tokens; ++t) {
+        if (op_rope(&h->ops, q + (size_t)t * q_dim, n_heads, head_dim, pos + t, rope_theta) != 0) {
+            goto fail;
+        }
+        if (op_rope(&h->ops, k + (size_t)t * kv_dim, n_kv_heads, head_dim,
+                    kv_cache_rope_pos(h->kv, layer_id, pos + t), rope_theta) != 0) {
+            goto fail;
+        }
     }
-    if (dbg) debug_check("Q_rope", q, n_heads * head_dim);
-    if (dbg) debug_check("K_rope", k, n_kv_heads * head_dim);
+    if (dbg) debug_check("Q_rope", q, q_dim);
+    if (dbg) debug_check("K_rope", k, kv_dim);
 
-    if (kv_cache_append(h->kv, layer_id, pos, k, v) != 0) {
+    if (kv_cache_append_batch(h->kv, layer_id, pos, n_tokens, k, v) != 0) {
         goto fail;
     }
 
-    uint32_t seq_len = pos + 1;
-    uint32_t kv_dim = n_kv_heads * head_dim;
-    float *k_cache = (float *)malloc((size_t)seq_len * kv_dim * sizeof(float));
-    float *v_cache = (float *)malloc((size_t)seq_len * kv_dim * sizeof(float));
-    if (!k_cache || !v_cache) {
-        free(k_cache); free(v_cache);
+    // The cache is walked in place: one span per KV block serves the whole
+    // chunk, and the blocked kernel applies the causal mask itself (token t
+    // attends to [0, pos + t]) while reading each K/V row once per row block.
+    uint32_t seq_len = pos + n_tokens;
+    struct kv_span_list spans = { h->kv_spans, 0, h->kv_spans_cap };
+    if (kv_cache_iterate_heads(h->kv, layer_id, 0, seq_len, collect_kv_span, &spans) != 0 ||
+        spans.n > spans.cap) {
         goto fail;
     }
-    if (kv_cache_read_range(h->kv, layer_id, 0, seq_len, k_cache, v_cache) != 0) {
-        free(k_cache); free(v_cache);
+    float scale = 1.0f / sqrtf((float)head_dim);
+    float *mass = h->cfg.kv_evict == KV_EVICT_H2O ? h->kv_mass : NULL;
+    if (mass) {
+        memset(mass, 0, spans.n * sizeof(float));
+    }
+    uint32_t n_attend = spans.n;
+    uint32_t attend_len = seq_len;
+    if (h->cfg.kv_select && n_tokens == 1) {
+        // Decode keeps the sink and recent blocks plus the ones whose key
+        // bounds allow the highest scores for this query; the kept spans
+        // move to the front in order and the kernel sees only their tokens.
+        uint32_t bs = h->cfg.kv_block_size;
+        uint32_t recent = h->cfg.kv_select_recent < seq_len ? seq_len - h->cfg.kv_select_recent : 0;
+        if (op_kv_select_spans(&h->ops, q, spans.spans, spans.n, n_heads, n_kv_heads, head_dim,
+                               rope_theta, (h->cfg.kv_select + bs - 1) / bs,
+                               (h->cfg.kv_sink + bs - 1) / bs, spans.n - recent / bs,
+                               h->kv_keep, &n_attend) != 0) {
+            goto fail;
+        }
+        attend_len = 0;
+        for (uint32_t i = 0; i < n_attend; ++i) {
+            spans.spans[i] = spans.spans[h->kv_keep[i]];
+            attend_len += spans.spans[i].n_tokens;
+        }
+    }
+    if (op_attention_kv_heads_causal(&h->ops, q, n_tokens, spans.spans, n_attend, attn_out,
+                                     n_heads, n_kv_heads, head_dim, attend_len, scale, rope_theta,
+                                     mass) != 0) {
         goto fail;
     }
-    if (dbg) debug_check("K_cache", k_cache, seq_len * kv_dim);
-    if (dbg) debug_check("V_cache", v_cache, seq_len * kv_dim);
-    float scale = 1.0f / sqrtf((float)head_dim);
-    if (op_attention(NULL, q, k_cache, v_cache, attn_out, n_heads, n_kv_heads, head_dim, seq_len, scale, NULL) != 0) {
-        free(k_cache); free(v_cache);
+    if (mass && n_attend < spans.n) {
+        // Masses come back per attended span; each goes to its block.
+        for (uint32_t i = n_attend; i-- > 0;) {
+            float m = mass[i];
+            mass[i] = 0.0f;
+            mass[h->kv_keep[i]] = m;
+        }
+    }
+    if (mass && kv_cache_add_attention(h->kv, layer_id, mass, spans.n) != 0) {
         goto fail;
     }
-    if (dbg) debug_check("attn_out", attn_out, n_heads * head_dim);
-    free(k_cache);
-    free(v_cache);
+    // Aged blocks of a tiered cache are re-quantized, and cold blocks of a
+    // disk-backed one written out, in the background while the other layers
+    // run; the cache waits for it before this layer's next append.
+    if (kv_cache_compact(h->kv, layer_id) != 0) {
+        goto fail;
+    }
+    if (dbg) debug_check("attn_out", attn_out, q_dim);
 
-    if (matmul_quant(lv->attn_o_dtype, lv->attn_o, attn_out, attn_proj, n_embd, n_heads * head_dim) != 0) {
+    xq = quantize_act(h, attn_out, act_q8, n_tokens, q_dim, &q8_err);
+    if (q8_err) {
+        goto fail;
+    }
+    if (matmul_quant(&h->ops, lv->attn_o_dtype, lv->attn_o, attn_out, xq, attn_proj, n_embd, q_dim, n_tokens) != 0) {
         goto fail;
     }
     if (dbg) debug_check("attn_proj", attn_proj, n_embd);
-    for (uint32_t i = 0; i < n_embd; ++i) {
+    for (size_t i = 0; i < (size_t)n_tokens * n_embd; ++i) {
         hidden[i] += attn_proj[i];
     }
     if (dbg) debug_check("hidden_after_attn", hidden, n_embd);
 
-    // MLP block
+    // MLP block: the attention half above overlapped the FFN reads. Whatever
+    // is still in flight is consumed by matmul_streamed as it lands.
+    if (pending && (prefetcher_ready_groups(h->prefetch, pending) & LAYER_GROUP_FFN)) {
+        pending = NULL;
+    }
+    if (pending && prefetcher_wait_range(h->prefetch, pending, lv->ffn_norm,
+                                         (size_t)n_embd * sizeof(float)) != 0) {
+        goto fail;
+    }
     uint32_t d_ff = q4k_rows_from_bytes(lv->ffn_gate_size, n_embd);
-    float *mlp_out = (float *)malloc((size_t)n_embd * sizeof(float));
+    float *mlp_out = (float *)malloc((size_t)n_tokens * n_embd * sizeof(float));
     if (!mlp_out || d_ff == 0) {
         free(mlp_out);
         goto fail;
     }
-    if (op_rmsnorm(NULL, hidden, (const float *)lv->ffn_norm, normed, 1, n_embd) != 0) {
+    if (op_rmsnorm(&h->ops, hidden, (const float *)lv->ffn_norm, normed, n_tokens, n_embd) != 0) {
         free(mlp_out);
         goto fail;
     }
     if (dbg) debug_check("ffn_norm", normed, n_embd);
-    if (lv->ffn_gate_dtype == 12 && lv->ffn_up_dtype == 12 && lv->ffn_down_dtype == 12) {
-        if (op_mlp_swiglu(NULL, normed, lv->ffn_gate, lv->ffn_up, lv->ffn_down, mlp_out, 1, n_embd, d_ff) != 0) {
+    if (!pending && !h->cfg.q8_activations && n_tokens == 1 && lv->ffn_gate_dtype == 12 && lv->ffn_up_dtype == 12 && lv->ffn_down_dtype == 12) {
+        if (op_mlp_swiglu(&h->ops, normed, lv->ffn_gate, lv->ffn_up, lv->ffn_down, mlp_out, 1, n_embd, d_ff) != 0) {
             free(mlp_out);
             goto fail;
         }
     } else {
-        float *gate = (float *)malloc((size_t)d_ff * sizeof(float));
-        float *up = (float *)malloc((size_t)d_ff * sizeof(float));
-        float *hidden_mlp = (float *)malloc((size_t)d_ff * sizeof(float));
-        if (!gate || !up || !hidden_mlp) {
-            free(gate); free(up); free(hidden_mlp);
+        size_t ff_len = (size_t)n_tokens * d_ff;
+        float *gate = (float *)malloc(ff_len * sizeof(float));
+        float *up = (float *)malloc(ff_len * sizeof(float));
+        float *hidden_mlp = (float *)malloc(ff_len * sizeof(float));
+        void *hidden_q8 = h->cfg.q8_activations ?
+            malloc((size_t)n_tokens * op_q8_k_row_size(d_ff)) : NULL;
+        if (!gate || !up || !hidden_mlp || (h->cfg.q8_activations && !hidden_q8)) {
+            free(gate); free(up); free(hidden_mlp); free(hidden_q8);
             free(mlp_out);
             goto fail;
         }
-        if (matmul_quant(lv->ffn_gate_dtype, lv->ffn_gate, normed, gate, d_ff, n_embd) != 0) {
-            free(gate); free(up); free(hidden_mlp); free(mlp_out);
+        xq = quantize_act(h, normed, act_q8, n_tokens, n_embd, &q8_err);
+        if (q8_err) {
+            free(gate); free(up); free(hidden_mlp); free(hidden_q8); free(mlp_out);
             goto fail;
         }
-        if (matmul_quant(lv->ffn_up_dtype, lv->ffn_up, normed, up, d_ff, n_embd) != 0) {
-            free(gate); free(up); free(hidden_mlp); free(mlp_out);
+        if (matmul_streamed(h, pending, lv->ffn_gate_dtype, lv->ffn_gate, normed, xq, gate, d_ff, n_embd, n_tokens) != 0) {
+            free(gate); free(up); free(hidden_mlp); free(hidden_q8); free(mlp_out);
             goto fail;
         }
-        for (uint32_t i = 0; i < d_ff; ++i) {
+        if (matmul_streamed(h, pending, lv->ffn_up_dtype, lv->ffn_up, normed, xq, up, d_ff, n_embd, n_tokens) != 0) {
+            free(gate); free(up); free(hidden_mlp); free(hidden_q8); free(mlp_out);
+            goto fail;
+        }
+        for (size_t i = 0; i < ff_len; ++i) {
             float g = gate[i];
             float sig = 1.0f / (1.0f + expf(-g));
             float silu = g * sig;
             hidden_mlp[i] = silu * up[i];
         }
-        if (matmul_quant(lv->ffn_down_dtype, lv->ffn_down, hidden_mlp, mlp_out, n_embd, d_ff) != 0) {
-            free(gate); free(up); free(hidden_mlp); free(mlp_out);
+        xq = quantize_act(h, hidden_mlp, hidden_q8, n_tokens, d_ff, &q8_err);
+        if (q8_err) {
+            free(gate); free(up); free(hidden_mlp); free(hidden_q8); free(mlp_out);
+            goto fail;
+        }
+        if (matmul_streamed(h, pending, lv->ffn_down_dtype, lv->ffn_down, hidden_mlp, xq, mlp_out, n_embd, d_ff, n_tokens) != 0) {
+            free(gate); free(up); free(hidden_mlp); free(hidden_q8); free(mlp_out);
             goto fail;
         }
         free(gate);
         free(up);
         free(hidden_mlp);
+        free(hidden_q8);
     }
     if (dbg) debug_check("mlp_out", mlp_out, n_embd);
-    for (uint32_t i = 0; i < n_embd; ++i) {
+    for (size_t i = 0; i < (size_t)n_tokens * n_embd; ++i) {
         hidden[i] += mlp_out[i];
     }
     if (dbg) debug_check("hidden_after_mlp", hidden, n_embd);
     free(mlp_out);
 
     free(normed); free(q); free(k); free(v); free(attn_out); free(attn_proj);
+    free(act_q8);
     return 0;
 fail:
     free(normed); free(q); free(k); free(v); free(attn_out); free(attn_proj);
+    free(act_q8);
     return -1;
 }
 
-static int forward_layer(engine_handle_t *h, uint32_t layer_id, uint32_t pos, float *hidden) {
+static int forward_layer(engine_handle_t *h, uint32_t layer_id, uint32_t pos, uint32_t n_tokens,
+                         float *hidden) {
     const struct layer_view *lv = NULL;
     if (model_get_layer_view(h->model, layer_id, &lv) != 0 || !lv) {
         return -1;
     }
-    return forward_layer_view(h, lv, layer_id, pos, hidden);
+    return forward_layer_view(h, lv, layer_id, pos, n_tokens, hidden, NULL);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int is_pinned(const engine_handle_t *h, uint32_t layer_id) {
+    return h->pinned && h->pinned[layer_id].data != NULL;
+}
+
+// Requests layers in stream order while prefetch buffers are free. With wrap
+// set the stream continues into layer 0, 1, ... of the next pass, so the disk
+// keeps working through the last layers, lm_head and sampling.
+static void prefetch_fill(engine_handle_t *h, int wrap) {
+    uint32_t n_layers = h->info.n_layers;
+    // The queue holds the layer about to be computed plus the lookahead.
+    uint32_t limit = prefetcher_lookahead(h->prefetch) + 1;
+    if (limit > h->pf_cap) {
+        limit = h->pf_cap;
+    }
+    while (h->pf_count < limit) {
+        while (h->pf_next_layer < n_layers && is_pinned(h, h->pf_next_layer)) {
+            h->pf_next_layer++;
+        }
+        if (h->pf_next_layer >= n_layers) {
+            if (!wrap || h->n_pinned >= n_layers) {
+                return;
+            }
+            h->pf_next_layer = 0;
+            continue;
+        }
+        prefetch_request_t *req = prefetcher_request(h->prefetch, h->pf_next_layer);
+        if (!req) {
+            return;
+        }
+        h->pf_queue[(h->pf_head + h->pf_count) % h->pf_cap] = req;
+        h->pf_count++;
+        h->pf_next_layer++;
+    }
+}
+
+static prefetch_request_t *prefetch_pop(engine_handle_t *h) {
+    if (h->pf_count == 0) {
+        return NULL;
+    }
+    prefetch_request_t *req = h->pf_queue[h->pf_head];
+    h->pf_head = (h->pf_head + 1) % h->pf_cap;
+    h->pf_count--;
+    return req;
+}
+
+// Waits out and returns every queued buffer; the stream restarts at layer 0.
+static void prefetch_drain(engine_handle_t *h) {
+    prefetch_request_t *req;
+    while ((req = prefetch_pop(h)) != NULL) {
+        struct layer_buffer *buf = prefetcher_wait(req);
+        if (buf) {
+            prefetcher_release(h->prefetch, buf);
+        }
+    }
+    h->pf_next_layer = 0;
+}
+
+// Spilled KV blocks of the layer after l are read back while l computes,
+// like its weights; after the last layer that is layer 0 of the next pass.
+static int prefetch_kv(engine_handle_t *h, uint32_t l, int wrap) {
+    uint32_t next = l + 1 < h->info.n_layers ? l + 1 : 0;
+    if (next == 0 && !wrap) {
+        return 0;
+    }
+    return kv_cache_prefetch(h->kv, next);
+}
+
+// Runs n_tokens consecutive positions through every layer. Each layer is
+// requested from the prefetcher once and the whole chunk is pushed through it
+// before moving on, so a prompt chunk streams the weights a single time.
+// wrap = another pass follows, so its first layers may be prefetched early.
+static int forward_all_layers(engine_handle_t *h, uint32_t pos, uint32_t n_tokens,
+                              float *hidden, const char *phase, int wrap) {
+    uint32_t n_layers = h->info.n_layers;
+    if (!h->prefetch) {
+        for (uint32_t l = 0; l < n_layers; ++l) {
+            if (prefetch_kv(h, l, wrap) != 0) {
+                return -1;
+            }
+            int rc = is_pinned(h, l)
+                ? forward_layer_view(h, &h->pinned[l].view, l, pos, n_tokens, hidden, NULL)
+                : forward_layer(h, l, pos, n_tokens, hidden);
+            if (rc != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    if (h->pf_count == 0) {
+        h->pf_next_layer = 0;
+    }
+    for (uint32_t l = 0; l < n_layers; ++l) {
+        prefetch_fill(h, wrap);
+        uint64_t t0 = now_ns();
+        if (prefetch_kv(h, l, wrap) != 0) {
+            prefetch_drain(h);
+            return -1;
+        }
+        if (is_pinned(h, l)) {
+            // Resident layers give the readers compute time to hide behind.
+            if (forward_layer_view(h, &h->pinned[l].view, l, pos, n_tokens, hidden, NULL) != 0) {
+                prefetch_drain(h);
+                fprintf(stderr, "engine: forward failed at layer %u (%s)\n", l, phase);
+                return -1;
+            }
+            prefetcher_note_compute(h->prefetch, now_ns() - t0);
+            continue;
+        }
+        // Attention can start while the FFN tensors are still arriving.
+        struct layer_buffer *buf = prefetcher_wait_partial(prefetch_pop(h), LAYER_GROUP_ATTN);
+        if (!buf) {
+            fprintf(stderr, "engine: prefetch wait failed at layer %u (%s)\n", l, phase);
+            prefetch_drain(h);
+            return -1;
+        }
+        if (buf->view.layer_id != l) {
+            fprintf(stderr, "engine: prefetch out of order at layer %u (%s)\n", l, phase);
+            prefetcher_release(h->prefetch, buf);
+            prefetch_drain(h);
+            return -1;
+        }
+        t0 = now_ns();
+        if (forward_layer_view(h, &buf->view, l, pos, n_tokens, hidden, buf) != 0) {
+            prefetcher_release(h->prefetch, buf);
+            prefetch_drain(h);
+            fprintf(stderr, "engine: forward failed at layer %u (%s)\n", l, phase);
+            return -1;
+        }
+        prefetcher_note_compute(h->prefetch, now_ns() - t0);
+        prefetcher_release(h->prefetch, buf);
+    }
+    // Refill right away: the freed buffers start on the next pass while the
+    // caller runs lm_head and sampling.
+    if (wrap) {
+        prefetch_fill(h, 1);
+    }
+    return 0;
+}
+
+static void unpin_layers(engine_handle_t *h) {
+    if (h->pinned) {
+        for (uint32_t l = 0; l < h->info.n_layers; ++l) {
+            free(h->pinned[l].data);
+        }
+        free(h->pinned);
+    }
+    h->pinned = NULL;
+    h->n_pinned = 0;
+    h->pinned_bytes = 0;
+}
+
+// Spends cfg.mem_budget, after resident tensors, the KV cache and the
+// prefetch buffers, on keeping layers in RAM. Pinned layers are spread evenly
+// so every streamed layer has resident compute nearby to overlap with.
+// Returns the prefetch depth to use (0 when every layer fits).
+static uint32_t pin_layers(engine_handle_t *h, uint32_t depth) {
+    uint32_t n_layers = h->info.n_layers;
+    uint64_t budget = h->cfg.mem_budget;
+    size_t resident = 0, max_layer = 0, all_layers = 0;
+    if (budget == 0 || n_layers == 0 ||
+        model_get_resident_size(h->model, &resident) != 0 ||
+        model_get_max_layer_size(h->model, &max_layer) != 0 || max_layer == 0) {
+        return depth;
+    }
+    for (uint32_t l = 0; l < n_layers; ++l) {
+        size_t sz = 0;
+        if (model_get_layer_buffer_size(h->model, l, &sz) != 0) {
+            return depth;
+        }
+        all_layers += sz;
+    }
+    // The KV cache grows on demand; keep room for a full context.
+    uint64_t fixed = (uint64_t)resident + kv_cache_memory_limit(h->kv);
+    uint64_t avail = budget > fixed ? budget - fixed : 0;
+    uint32_t n_pin = 0;
+    if (all_layers <= avail) {
+        n_pin = n_layers;
+        depth = 0;
+    } else {
+        uint64_t buffers = h->cfg.prefetch_mb ? (uint64_t)h->cfg.prefetch_mb << 20
+                                              : (uint64_t)depth * max_layer;
+        avail = avail > buffers ? avail - buffers : 0;
+        uint64_t fit = avail / max_layer;
+        n_pin = fit < n_layers ? (uint32_t)fit : n_layers - 1;
+    }
+    if (n_pin == 0) {
+        return depth;
+    }
+    h->pinned = (struct pinned_layer *)calloc(n_layers, sizeof(*h->pinned));
+    if (!h->pinned) {
+        return depth ? depth : 2;
+    }
+    size_t align = model_get_buffer_alignment(h->model);
+    for (uint32_t l = 0; l < n_layers; ++l) {
+        // Layer l is pinned when the running share l * n_pin / n_layers steps.
+        if ((uint64_t)(l + 1) * n_pin / n_layers == (uint64_t)l * n_pin / n_layers) {
+            continue;
+        }
+        size_t sz = 0;
+        void *data = NULL;
+        if (model_get_layer_buffer_size(h->model, l, &sz) != 0 ||
+            posix_memalign(&data, align, sz) != 0) {
+            break;
+        }
+        if (model_load_layer(h->model, l, data, sz, &h->pinned[l].view, NULL) != 0) {
+            free(data);
+            break;
+        }
+        h->pinned[l].data = data;
+        h->n_pinned++;
+        h->pinned_bytes += sz;
+    }
+    if (h->n_pinned < n_pin) {
+        fprintf(stderr, "engine: pinned %u of %u layers\n", h->n_pinned, n_pin);
+    }
+    if (h->n_pinned < n_layers && depth == 0) {
+        depth = 2;
+    }
+    return depth;
 }
 
 engine_handle_t *engine_open(const char *model_path, const struct engine_config *cfg) {
@@ -247,6 +695,7 @@ engine_handle_t *engine_open(const char *model_path, const struct engine_config
     struct model_config mcfg;
     mcfg.prefer_gguf = 1;
     mcfg.use_mmap = cfg ? cfg->use_mmap : 0;
+    mcfg.direct_io = cfg ? cfg->direct_io : 0;
     h->model = model_open(model_path, &mcfg);
     if (!h->model) {
         free(h);
@@ -262,10 +711,48 @@ engine_handle_t *engine_open(const char *model_path, const struct engine_config
     kcfg.n_kv_heads = h->info.n_kv_heads;
     kcfg.head_dim = h->info.head_dim;
     kcfg.block_size = h->cfg.kv_block_size ? h->cfg.kv_block_size : 32;
-    kcfg.max_seq_len = 2048;
-    kcfg.quant = KV_Q8_0;
+    if (h->cfg.max_context == 0) {
+        h->cfg.max_context = 2048;
+    }
+    kcfg.max_seq_len = h->cfg.max_context;
+    kcfg.quant = engine_kv_quant(h);
+    // Head-major tiles give attention unit-stride, aligned rows per KV head.
+    kcfg.layout = KV_LAYOUT_HEAD_MAJOR;
+    kcfg.evict = h->cfg.kv_evict == 2 ? KV_EVICT_H2O :
+                 h->cfg.kv_evict == 1 ? KV_EVICT_WINDOW : KV_EVICT_NONE;
+    h->cfg.kv_evict = kcfg.evict;
+    // The sink and newest blocks are never evicted; a short context split
+    // into only those would have nothing to free.
+    while (kcfg.evict != KV_EVICT_NONE && kcfg.block_size > 1 &&
+           kcfg.max_seq_len < 4 * kcfg.block_size) {
+        kcfg.block_size /= 2;
+    }
+    kcfg.n_sink = h->cfg.kv_sink ? h->cfg.kv_sink : 4;
+    kcfg.n_recent = h->cfg.kv_recent ? h->cfg.kv_recent : h->cfg.max_context / 4;
+    kcfg.tiered = h->cfg.kv_quant == 3;
+    kcfg.tier_f16 = ((h->cfg.kv_tier_f16 ? h->cfg.kv_tier_f16 : 64) + kcfg.block_size - 1) / kcfg.block_size;
+    kcfg.tier_q8 = ((h->cfg.kv_tier_q8 ? h->cfg.kv_tier_q8 : 1024) + kcfg.block_size - 1) / kcfg.block_size;
+    kcfg.spill_path = h->cfg.kv_spill_path;
+    kcfg.resident_blocks = ((h->cfg.kv_resident ? h->cfg.kv_resident : 256) + kcfg.block_size - 1) / kcfg.block_size;
+    kcfg.key_bounds = h->cfg.kv_select != 0;
+    h->cfg.kv_block_size = kcfg.block_size;
+    h->cfg.kv_sink = kcfg.n_sink;
+    if (h->cfg.kv_select_recent == 0) {
+        h->cfg.kv_select_recent = 128;
+    }
+    if (h->cfg.prefill_chunk == 0) {
+        h->cfg.prefill_chunk = 64;
+    }
     h->kv = kv_cache_create(&kcfg);
-    if (!h->kv) {
+    h->kv_spans_cap = (kcfg.max_seq_len + kcfg.block_size - 1) / kcfg.block_size;
+    h->kv_spans = (struct op_kv_head_span *)calloc(h->kv_spans_cap, sizeof(*h->kv_spans));
+    h->kv_mass = (float *)calloc(h->kv_spans_cap, sizeof(float));
+    h->kv_keep = (uint32_t *)calloc(h->kv_spans_cap, sizeof(uint32_t));
+    if (!h->kv || !h->kv_spans || !h->kv_mass || !h->kv_keep) {
+        kv_cache_destroy(h->kv);
+        free(h->kv_spans);
+        free(h->kv_mass);
+        free(h->kv_keep);
         model_close(h->model);
         free(h);
         return NULL;
@@ -273,14 +760,35 @@ engine_handle_t *engine_open(const char *model_path, const struct engine_config
     memset(&h->stats, 0, sizeof(h->stats));
     struct prefetcher_config pcfg;
     memset(&pcfg, 0, sizeof(pcfg));
-    pcfg.depth = h->cfg.prefetch_depth ? h->cfg.prefetch_depth : 2;
+    pcfg.depth = pin_layers(h, h->cfg.prefetch_depth ? h->cfg.prefetch_depth : 2);
     pcfg.model = h->model;
     pcfg.buffer_size = 0;
+    pcfg.arena_size = (size_t)h->cfg.prefetch_mb << 20;
+    pcfg.lookahead = h->cfg.prefetch_lookahead;
     pcfg.stats = &h->stats;
-    h->prefetch = prefetcher_create(&pcfg);
+    pcfg.io_depth = h->cfg.io_depth;
+    pcfg.io_chunk_size = (size_t)h->cfg.io_chunk_kb * 1024;
+    h->prefetch = pcfg.depth ? prefetcher_create(&pcfg) : NULL;
     if (h->prefetch) {
-        prefetcher_start(h->prefetch);
+        h->pf_cap = prefetcher_max_requests(h->prefetch);
+        h->pf_queue = (prefetch_request_t **)calloc(h->pf_cap, sizeof(*h->pf_queue));
+        if (!h->pf_queue || prefetcher_start(h->prefetch) != 0) {
+            // Fall back to synchronous layer loads.
+            free(h->pf_queue);
+            h->pf_queue = NULL;
+            prefetcher_stop(h->prefetch);
+            h->prefetch = NULL;
+        }
     }
+    // More compute threads than cores would only spin against each other.
+    uint32_t n_cpu = thread_pool_cpu_count();
+    uint32_t n_threads = h->cfg.n_threads ? h->cfg.n_threads : n_cpu;
+    if (n_threads > n_cpu) {
+        n_threads = n_cpu;
+    }
+    h->pool = thread_pool_create(n_threads);
+    h->ops.n_threads = thread_pool_size(h->pool);
+    h->ops.pool = h->pool;
     return h;
 }
 
@@ -337,87 +845,74 @@ int engine_generate(engine_handle_t *h, uint32_t max_tokens) {
         }
         prompt_tokens[0] = 1;
     }
-    uint32_t n_layers = h->info.n_layers;
+    if (h->cfg.kv_evict == KV_EVICT_NONE && prompt_len > h->cfg.max_context) {
+        fprintf(stderr, "engine: prompt of %u tokens exceeds max context %u\n",
+                prompt_len, h->cfg.max_context);
+        free(hidden);
+        free(prompt_tokens);
+        return -1;
+    }
     uint32_t pos = 0;
 
-    for (uint32_t i = 0; i < prompt_len; ++i) {
-        uint32_t tok = prompt_tokens[i];
-        if (op_embed(NULL, resident.token_embd, resident.token_embd_dtype, &tok, hidden, 1, n_embd) != 0) {
-            free(hidden);
+    // Layer-major prefill: the prompt is processed in chunks and every layer
+    // is loaded once per chunk instead of once per prompt token.
+    uint32_t chunk = h->cfg.prefill_chunk ? h->cfg.prefill_chunk : 1;
+    if (chunk > prompt_len) {
+        chunk = prompt_len;
+    }
+    float *hidden_chunk = (float *)malloc((size_t)chunk * n_embd * sizeof(float));
+    if (!hidden_chunk) {
+        free(hidden);
+        free(prompt_tokens);
+        return -1;
+    }
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < prompt_len; i += n) {
+        n = prompt_len - i < chunk ? prompt_len - i : chunk;
+        // An evicting cache only frees the blocks between its sinks and its
+        // recent tokens, so a full one may hold less than a chunk at once.
+        uint32_t room = kv_cache_room(h->kv);
+        n = n < room ? n : room;
+        if (n == 0) {
+            fprintf(stderr, "engine: no KV room for the prompt (max context %u)\n",
+                    h->cfg.max_context);
+            free(hidden_chunk); free(hidden); free(prompt_tokens);
+            return -1;
+        }
+        if (op_embed(&h->ops, resident.token_embd, resident.token_embd_dtype, prompt_tokens + i,
+                     hidden_chunk, n, n_embd) != 0) {
+            free(hidden_chunk); free(hidden); free(prompt_tokens);
             return -1;
         }
         if (i == 0 && debug_enabled()) {
-            debug_check("embed", hidden, n_embd);
+            debug_check("embed", hidden_chunk, n_embd);
         }
-        if (h->prefetch) {
-            prefetch_request_t *req0 = prefetcher_request(h->prefetch, 0);
-            prefetch_request_t *req1 = (n_layers > 1) ? prefetcher_request(h->prefetch, 1) : NULL;
-            if (!req0) {
-                free(hidden);
-                return -1;
-            }
-            for (uint32_t l = 0; l < n_layers; ++l) {
-                prefetch_request_t *next_req = NULL;
-                uint32_t ahead = l + 2;
-                if (ahead < n_layers) {
-                    next_req = prefetcher_request(h->prefetch, ahead);
-                }
-                struct layer_buffer *buf = prefetcher_wait(req0);
-                if (!buf) {
-                    fprintf(stderr, "engine: prefetch wait failed at layer %u (prefill)\n", l);
-                    free(hidden);
-                    return -1;
-                }
-                if (forward_layer_view(h, &buf->view, l, pos, hidden) != 0) {
-                    prefetcher_release(h->prefetch, buf);
-                    fprintf(stderr, "engine: forward failed at layer %u (prefill)\n", l);
-                    free(hidden);
-                    return -1;
-                }
-                prefetcher_release(h->prefetch, buf);
-                req0 = req1;
-                req1 = next_req;
-                if (l + 1 < n_layers && !req0) {
-                    free(hidden);
-                    return -1;
-                }
-            }
-        } else {
-            for (uint32_t l = 0; l < n_layers; ++l) {
-                if (forward_layer(h, l, pos, hidden) != 0) {
-                    free(hidden);
-                    return -1;
-                }
-            }
+        if (engine_kv_reserve(h, n, &pos) != 0 ||
+            forward_all_layers(h, pos, n, hidden_chunk, "prefill", 1) != 0) {
+            free(hidden_chunk); free(hidden); free(prompt_tokens);
+            return -1;
+        }
+        if (i + n >= prompt_len) {
+            memcpy(hidden, hidden_chunk + (size_t)(n - 1) * n_embd, (size_t)n_embd * sizeof(float));
         }
-        pos++;
     }
+    free(hidden_chunk);
 
     uint32_t n_vocab_use = n_vocab;
     float *logits = (float *)malloc((size_t)n_vocab_use * sizeof(float));
-    if (!logits) {
+    void *hidden_q8 = h->cfg.q8_activations ? malloc(op_q8_k_row_size(n_embd)) : NULL;
+    if (!logits || (h->cfg.q8_activations && !hidden_q8)) {
+        free(logits); free(hidden_q8);
         free(hidden);
         return -1;
     }
+    int q8_err = 0;
 
     for (uint32_t t = 0; t < max_tokens; ++t) {
-        if (resident.lm_head_dtype == 12) {
-            if (op_matmul_q4_k(NULL, resident.lm_head, hidden, logits, n_vocab_use, n_embd) != 0) {
-                free(logits); free(hidden);
-                return -1;
-            }
-        } else if (resident.lm_head_dtype == 13) {
-            if (op_matmul_q5_k(NULL, resident.lm_head, hidden, logits, n_vocab_use, n_embd) != 0) {
-                free(logits); free(hidden);
-                return -1;
-            }
-        } else if (resident.lm_head_dtype == 14) {
-            if (op_matmul_q6_k(NULL, resident.lm_head, hidden, logits, n_vocab_use, n_embd) != 0) {
-                free(logits); free(hidden);
-                return -1;
-            }
-        } else {
-            free(logits); free(hidden);
+        const void *hq = quantize_act(h, hidden, hidden_q8, 1, n_embd, &q8_err);
+        if (q8_err || matmul_quant(&h->ops, resident.lm_head_dtype, resident.lm_head, hidden, hq,
+                                   logits, n_vocab_use, n_embd, 1) != 0) {
+            free(logits); free(hidden_q8); free(hidden);
             return -1;
         }
 
@@ -437,52 +932,18 @@ int engine_generate(engine_handle_t *h, uint32_t max_tokens) {
             printf("<%u>", next);
         }
 
-        if (op_embed(NULL, resident.token_embd, resident.token_embd_dtype, &next, hidden, 1, n_embd) != 0) {
-            free(logits); free(hidden);
+        if (engine_kv_reserve(h, 1, &pos) != 0) {
+            fprintf(stderr, "\nengine: max context %u reached\n", h->cfg.max_context);
+            break;
+        }
+        if (op_embed(&h->ops, resident.token_embd, resident.token_embd_dtype, &next, hidden, 1, n_embd) != 0) {
+            free(logits); free(hidden_q8); free(hidden);
             return -1;
         }
-        if (h->prefetch) {
-            prefetch_request_t *req0 = prefetcher_request(h->prefetch, 0);
-            prefetch_request_t *req1 = (n_layers > 1) ? prefetcher_request(h->prefetch, 1) : NULL;
-            if (!req0) {
-                free(logits); free(hidden);
-                return -1;
-            }
-            for (uint32_t l = 0; l < n_layers; ++l) {
-                prefetch_request_t *next_req = NULL;
-                uint32_t ahead = l + 2;
-                if (ahead < n_layers) {
-                    next_req = prefetcher_request(h->prefetch, ahead);
-                }
-                struct layer_buffer *buf = prefetcher_wait(req0);
-                if (!buf) {
-                    fprintf(stderr, "engine: prefetch wait failed at layer %u (decode)\n", l);
-                    free(logits); free(hidden);
-                    return -1;
-                }
-                if (forward_layer_view(h, &buf->view, l, pos, hidden) != 0) {
-                    prefetcher_release(h->prefetch, buf);
-                    fprintf(stderr, "engine: forward failed at layer %u (decode)\n", l);
-                    free(logits); free(hidden);
-                    return -1;
-                }
-                prefetcher_release(h->prefetch, buf);
-                req0 = req1;
-                req1 = next_req;
-                if (l + 1 < n_layers && !req0) {
-                    free(logits); free(hidden);
-                    return -1;
-                }
-            }
-        } else {
-            for (uint32_t l = 0; l < n_layers; ++l) {
-                if (forward_layer(h, l, pos, hidden) != 0) {
-                    free(logits); free(hidden);
-                    return -1;
-                }
-            }
+        if (forward_all_layers(h, pos, 1, hidden, "decode", t + 1 < max_tokens) != 0) {
+            free(logits); free(hidden_q8); free(hidden);
+            return -1;
         }
-        pos++;
         struct rusage ru;
         if (getrusage(RUSAGE_SELF, &ru) == 0) {
 #if defined(__APPLE__)
@@ -495,6 +956,7 @@ int engine_generate(engine_handle_t *h, uint32_t max_tokens) {
     }
     printf("\n");
     free(logits);
+    free(hidden_q8);
     free(hidden);
     free(prompt_tokens);
     return 0;
@@ -530,9 +992,16 @@ void engine_close(engine_handle_t *h) {
     }
     free(h->prompt);
     if (h->prefetch) {
+        prefetch_drain(h);
         prefetcher_stop(h->prefetch);
     }
+    free(h->pf_queue);
+    unpin_layers(h);
+    thread_pool_destroy(h->pool);
     kv_cache_destroy(h->kv);
+    free(h->kv_spans);
+    free(h->kv_mass);
+    free(h->kv_keep);
     model_close(h->model);
     free(h);
 }
@@ -553,5 +1022,16 @@ int engine_get_streaming_stats(engine_handle_t *h, struct streaming_stats *out)
     out->max_concurrent_buffers = h->stats.max_concurrent_buffers;
     out->prefetch_hits = h->stats.prefetch_hits;
     out->prefetch_misses = h->stats.prefetch_misses;
+    out->prefetch_wait_ns = h->stats.prefetch_wait_ns;
+    out->prefetch_max_wait_ns = h->stats.prefetch_max_wait_ns;
+    out->lookahead = h->stats.lookahead;
+    out->lookahead_max = h->stats.lookahead_max;
+    out->lookahead_changes = h->stats.lookahead_changes;
+    out->layer_read_ema_ns = h->stats.layer_read_ema_ns;
+    out->layer_compute_ema_ns = h->stats.layer_compute_ema_ns;
+    // Prefetched reads overlap, so their time is the prefetcher's busy time.
+    out->layer_read_ns += h->stats.layer_read_ns;
+    out->pinned_layers = h->n_pinned;
+    out->pinned_bytes = h->pinned_bytes;
     return 0;
 }
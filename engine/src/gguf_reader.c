@@ -7,10 +7,18 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #define GGUF_MAGIC "GGUF"
 #define GGUF_DEFAULT_ALIGNMENT 32
+// Largest hole between two tensors that is read and discarded rather than
+// split into a separate preadv.
+#define GGUF_SCATTER_MAX_GAP 4096
+#define GGUF_SCATTER_MAX_IOV 64
+// Smallest direct I/O alignment. 4 KiB satisfies both 512-byte and
+// 4K-sector devices; a file that reports a larger one (statx) gets that.
+#define GGUF_DIRECT_ALIGN 4096
 
 enum gguf_type {
     GGUF_TYPE_UINT8   = 0,
@@ -55,6 +63,8 @@ struct gguf_file {
     uint64_t data_start;
     uint64_t file_size;
     uint32_t alignment;
+    int direct_fd;
+    uint32_t direct_align;
 
     struct gguf_kv_internal *kvs;
     struct gguf_tensor_internal *tensors;
@@ -139,6 +149,7 @@ gguf_file_t *gguf_open(const char *path, int use_mmap) {
         return NULL;
     }
     f->fd = fileno(f->fp);
+    f->direct_fd = -1;
     f->use_mmap = use_mmap;
     f->file_size = file_size_bytes(f->fp);
 
@@ -164,6 +175,9 @@ void gguf_close(gguf_file_t *f) {
     if (f->fp) {
         fclose(f->fp);
     }
+    if (f->direct_fd >= 0) {
+        close(f->direct_fd);
+    }
     if (f->kvs) {
         for (int64_t i = 0; i < f->n_kv; ++i) {
             free(f->kvs[i].key);
@@ -510,6 +524,183 @@ int gguf_read_span(gguf_file_t *f, uint64_t offset, uint64_t size, void *dst) {
     return 0;
 }
 
+static int seg_cmp_offset(const void *a, const void *b) {
+    const struct gguf_read_seg *sa = (const struct gguf_read_seg *)a;
+    const struct gguf_read_seg *sb = (const struct gguf_read_seg *)b;
+    return (sa->offset > sb->offset) - (sa->offset < sb->offset);
+}
+
+// preadv until the whole iovec list is filled, advancing past short reads.
+static int preadv_full(int fd, struct iovec *iov, int iovcnt, uint64_t file_off) {
+    while (iovcnt > 0) {
+        ssize_t n = preadv(fd, iov, iovcnt, (off_t)file_off);
+        if (n <= 0) {
+            return -1;
+        }
+        file_off += (uint64_t)n;
+        size_t left = (size_t)n;
+        while (iovcnt > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return 0;
+}
+
+int gguf_read_scatter(gguf_file_t *f, struct gguf_read_seg *segs, uint32_t n,
+                      uint64_t *out_bytes) {
+    if (!f || !segs || n == 0 || !f->fp) {
+        return -1;
+    }
+    qsort(segs, n, sizeof(*segs), seg_cmp_offset);
+    uint64_t total = 0;
+    if (f->use_mmap && f->map_base) {
+        for (uint32_t i = 0; i < n; ++i) {
+            if (gguf_read_span(f, segs[i].offset, segs[i].size, segs[i].dst) != 0) {
+                return -1;
+            }
+            total += segs[i].size;
+        }
+        if (out_bytes) {
+            *out_bytes = total;
+        }
+        return 0;
+    }
+    uint8_t gap_buf[GGUF_SCATTER_MAX_GAP];
+    struct iovec iov[GGUF_SCATTER_MAX_IOV];
+    uint32_t i = 0;
+    while (i < n) {
+        uint64_t run_start = segs[i].offset;
+        uint64_t run_end = run_start;
+        int iovcnt = 0;
+        // Extend the run while the next segment follows within a small gap
+        // and there is room for its (gap, data) iovecs.
+        while (i < n && iovcnt + 2 <= GGUF_SCATTER_MAX_IOV) {
+            if (segs[i].size == 0 || !segs[i].dst || segs[i].offset < run_end) {
+                return -1;
+            }
+            uint64_t gap = segs[i].offset - run_end;
+            if (iovcnt > 0 && gap > GGUF_SCATTER_MAX_GAP) {
+                break;
+            }
+            if (gap > 0) {
+                iov[iovcnt].iov_base = gap_buf;
+                iov[iovcnt].iov_len = (size_t)gap;
+                iovcnt++;
+            }
+            iov[iovcnt].iov_base = segs[i].dst;
+            iov[iovcnt].iov_len = (size_t)segs[i].size;
+            iovcnt++;
+            run_end = segs[i].offset + segs[i].size;
+            i++;
+        }
+        if (preadv_full(f->fd, iov, iovcnt, f->data_start + run_start) != 0) {
+            return -1;
+        }
+        total += run_end - run_start;
+    }
+    if (out_bytes) {
+        *out_bytes = total;
+    }
+    return 0;
+}
+
+int gguf_enable_direct_io(gguf_file_t *f, const char *path) {
+    if (!f || !path) {
+        return -1;
+    }
+    if (f->direct_fd >= 0) {
+        return 0;
+    }
+#if defined(O_DIRECT)
+    int fd = open(path, O_RDONLY | O_DIRECT);
+    if (fd < 0) {
+        return -1;
+    }
+#elif defined(F_NOCACHE)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fcntl(fd, F_NOCACHE, 1) != 0) {
+        close(fd);
+        return -1;
+    }
+#else
+    return -1;
+#endif
+    f->direct_fd = fd;
+    f->direct_align = GGUF_DIRECT_ALIGN;
+#if defined(STATX_DIOALIGN)
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+        (stx.stx_mask & STATX_DIOALIGN)) {
+        uint32_t need = stx.stx_dio_offset_align > stx.stx_dio_mem_align ?
+                        stx.stx_dio_offset_align : stx.stx_dio_mem_align;
+        if (need > f->direct_align && (need & (need - 1)) == 0) {
+            f->direct_align = need;
+        }
+    }
+#endif
+    return 0;
+}
+
+uint32_t gguf_direct_io_align(const gguf_file_t *f) {
+    return (f && f->direct_fd >= 0) ? f->direct_align : 0;
+}
+
+int gguf_direct_span(const gguf_file_t *f, uint64_t offset, uint64_t size,
+                     uint64_t *file_start, uint64_t *file_len, size_t *skip) {
+    if (!f || size == 0 || f->direct_fd < 0 || !file_start || !file_len) {
+        return -1;
+    }
+    const uint64_t a = f->direct_align;
+    uint64_t start = f->data_start + offset;
+    uint64_t a_start = start / a * a;
+    uint64_t a_end = (start + size + a - 1) / a * a;
+    *file_start = a_start;
+    *file_len = a_end - a_start;
+    if (skip) {
+        *skip = (size_t)(start - a_start);
+    }
+    return 0;
+}
+
+int gguf_read_direct(gguf_file_t *f, uint64_t file_start, uint64_t file_len, void *dst,
+                     uint64_t *out_bytes) {
+    if (!f || !dst || file_len == 0 || f->direct_fd < 0) {
+        return -1;
+    }
+    const uint64_t a = f->direct_align;
+    if ((file_start % a) != 0 || (file_len % a) != 0 || ((uintptr_t)dst % a) != 0) {
+        return -1;
+    }
+    uint8_t *out = (uint8_t *)dst;
+    uint64_t pos = file_start;
+    uint64_t end = file_start + file_len;
+    // The rounded tail may run past EOF; the read just comes back short there.
+    while (pos < end) {
+        ssize_t n = pread(f->direct_fd, out, (size_t)(end - pos), (off_t)pos);
+        if (n < 0 || (n == 0 && pos < f->file_size)) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        out += (size_t)n;
+        pos += (uint64_t)n;
+    }
+    if (out_bytes) {
+        *out_bytes = pos - file_start;
+    }
+    return 0;
+}
+
 int64_t gguf_get_n_tensors(gguf_file_t *f) {
     return f ? f->n_tensors : 0;
 }
@@ -1,75 +1,264 @@
 #include "kv_cache.h"
+#include "ops.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-struct q8_block {
-    float scale;
-    int8_t data[32];
-};
+#define KV_FORMATS 3
+#define NO_LAYER UINT32_MAX
+
+// Work queued for the background thread, per layer.
+#define JOB_COMPACT 1u
+#define JOB_LOAD 2u
 
+// Blocks come from pools shared by all layers: headers from one free list,
+// K and V data from one per format. A block is allocated the first time a
+// token lands in it and goes back to the pools on clear, so memory follows
+// the tokens actually cached rather than max_seq_len. Eviction drops a
+// block from its layer's table and shifts the entries after it down;
+// rope_pos0 keeps the position its keys were rotated at. With a spill file
+// a cold block gives its data back and only the header stays in memory.
 struct kv_block {
-    struct q8_block *k;
-    struct q8_block *v;
+    uint8_t *k;                   // NULL while the block lives in the spill file
+    uint8_t *v;
     uint32_t seq_len;
+    uint32_t rope_pos0;
+    uint32_t quant;               // enum kv_quant_type of its data
+    uint32_t slot;                // its place in the spill file
+    int dirty;                    // data changed since it was last written out
+    float score;                  // attention mass received (KV_EVICT_H2O)
+    float *k_min;                 // key_bounds: vec_dim minima, then vec_dim maxima
+    struct kv_block *next_free;
+};
+
+// A block holds K then V, each side_bytes long and 64-byte aligned. Token-
+// major sides are block_size rows of op_kv_row_size(quant, vec_dim) bytes.
+// Head-major sides are one tile per KV head of block_size rows holding only
+// that head's group data (tile_bytes apart, each rounded to a cache line),
+// followed by all the group scales: [head][token][group] floats (none for
+// KV_F16, whose rows are plain halves).
+struct kv_format {
+    size_t row_bytes;             // token-major row; head-major: one head's row
+    size_t tile_bytes;
+    size_t side_bytes;
+    size_t group_bytes;           // op_kv_row_size of one group: scale + data
+    void *free_data;              // spare K+V buffers, linked through their first bytes
+    uint32_t n_allocated;         // K+V buffers owned by the pool, in use or free
 };
 
 struct kv_cache {
     struct kv_cache_config cfg;
-    uint32_t n_blocks;
+    uint32_t n_blocks;            // block table entries per layer
     uint32_t vec_dim;
-    uint32_t q8_blocks_per_token;
-    uint32_t q8_blocks_per_block;
-    struct kv_block *blocks;
+    uint32_t head_groups;         // 32-value groups per head (head-major)
+    struct kv_format fmt[KV_FORMATS];
+    struct kv_block *free_headers;
+    uint32_t n_headers;           // headers allocated; each owns spill slot n
+    uint8_t *head_tmp;            // one head as op_kv_row_size groups (appends)
+    struct kv_block **table;      // n_layers x n_blocks, NULL until first append
     uint32_t *layer_seq_len;
+    int spill_fd;                 // -1 without a spill file
+    size_t slot_bytes;            // K+V of the largest format
+    // Tiered and spilling caches re-quantize, write out and read back blocks
+    // on a worker thread. It owns the layer it works on; every other call
+    // waits until a layer it touches is neither queued nor in progress, and
+    // the shared pools are only used under lock.
+    int has_worker;
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t *pending;             // per layer: JOB_* bits queued
+    uint32_t busy;                // layer being worked on, or NO_LAYER
+    int stop;
+    float *compact_row;           // vec_dim floats for the worker
+    uint8_t *compact_tmp;         // the worker's head_tmp
 };
 
-static void q8_quantize_vec(const float *x, uint32_t n, struct q8_block *out) {
-    uint32_t n_blocks = (n + 31u) / 32u;
-    for (uint32_t b = 0; b < n_blocks; ++b) {
-        uint32_t base = b * 32u;
-        float max_abs = 0.0f;
-        for (uint32_t i = 0; i < 32u; ++i) {
-            uint32_t idx = base + i;
-            float v = (idx < n) ? x[idx] : 0.0f;
-            float a = fabsf(v);
-            if (a > max_abs) {
-                max_abs = a;
-            }
+static size_t round_up_64(size_t n) {
+    return (n + 63u) & ~(size_t)63u;
+}
+
+static uint32_t quant_bits(uint32_t quant) {
+    return quant == KV_F16 ? 16u : quant == KV_Q8_0 ? 8u : 4u;
+}
+
+// Format block b of a layer holding used blocks should be in.
+static uint32_t tier_quant(const kv_cache_t *c, uint32_t b, uint32_t used) {
+    if (!c->cfg.tiered) {
+        return c->cfg.quant;
+    }
+    uint32_t age = used - 1 - b;
+    return age < c->cfg.tier_f16 ? KV_F16 : age - c->cfg.tier_f16 < c->cfg.tier_q8 ? KV_Q8_0 : KV_Q4_0;
+}
+
+// Quantizes one token row of vec_dim values into slot t of a block side in
+// format quant; tmp holds one head as op_kv_row_size groups.
+static void store_row(const kv_cache_t *c, uint32_t quant, uint8_t *side, uint32_t t,
+                      const float *x, uint8_t *tmp) {
+    const struct kv_format *f = &c->fmt[quant];
+    if (c->cfg.layout == KV_LAYOUT_TOKEN_MAJOR) {
+        op_quantize_kv_row(quant, x, side + (size_t)t * f->row_bytes, c->vec_dim);
+        return;
+    }
+    if (quant == KV_F16) {
+        for (uint32_t h = 0; h < c->cfg.n_kv_heads; ++h) {
+            op_quantize_kv_row(quant, x + (size_t)h * c->cfg.head_dim,
+                               side + h * f->tile_bytes + (size_t)t * f->row_bytes, c->cfg.head_dim);
+        }
+        return;
+    }
+    // Each head is quantized on its own, then split into data and scales.
+    size_t data_bytes = f->group_bytes - sizeof(float);
+    float *scales = (float *)(side + (size_t)c->cfg.n_kv_heads * f->tile_bytes);
+    for (uint32_t h = 0; h < c->cfg.n_kv_heads; ++h) {
+        op_quantize_kv_row(quant, x + (size_t)h * c->cfg.head_dim, tmp, c->cfg.head_dim);
+        uint8_t *row = side + h * f->tile_bytes + (size_t)t * f->row_bytes;
+        float *sc = scales + ((size_t)h * c->cfg.block_size + t) * c->head_groups;
+        for (uint32_t g = 0; g < c->head_groups; ++g) {
+            const uint8_t *grp = tmp + g * f->group_bytes;
+            memcpy(&sc[g], grp, sizeof(float));
+            memcpy(row + g * data_bytes, grp + sizeof(float), data_bytes);
+        }
+    }
+}
+
+static void load_row(const kv_cache_t *c, uint32_t quant, const uint8_t *side, uint32_t t,
+                     float *out, uint8_t *tmp) {
+    const struct kv_format *f = &c->fmt[quant];
+    if (c->cfg.layout == KV_LAYOUT_TOKEN_MAJOR) {
+        op_dequantize_kv_row(quant, side + (size_t)t * f->row_bytes, out, c->vec_dim);
+        return;
+    }
+    if (quant == KV_F16) {
+        for (uint32_t h = 0; h < c->cfg.n_kv_heads; ++h) {
+            op_dequantize_kv_row(quant, side + h * f->tile_bytes + (size_t)t * f->row_bytes,
+                                 out + (size_t)h * c->cfg.head_dim, c->cfg.head_dim);
         }
-        float scale = max_abs / 127.0f;
-        if (scale == 0.0f) {
-            scale = 1.0f;
+        return;
+    }
+    size_t data_bytes = f->group_bytes - sizeof(float);
+    const float *scales = (const float *)(side + (size_t)c->cfg.n_kv_heads * f->tile_bytes);
+    for (uint32_t h = 0; h < c->cfg.n_kv_heads; ++h) {
+        const uint8_t *row = side + h * f->tile_bytes + (size_t)t * f->row_bytes;
+        const float *sc = scales + ((size_t)h * c->cfg.block_size + t) * c->head_groups;
+        for (uint32_t g = 0; g < c->head_groups; ++g) {
+            uint8_t *grp = tmp + g * f->group_bytes;
+            memcpy(grp, &sc[g], sizeof(float));
+            memcpy(grp + sizeof(float), row + g * data_bytes, data_bytes);
         }
-        out[b].scale = scale;
-        for (uint32_t i = 0; i < 32u; ++i) {
-            uint32_t idx = base + i;
-            float v = (idx < n) ? x[idx] : 0.0f;
-            int q = (int)lrintf(v / scale);
-            if (q > 127) q = 127;
-            if (q < -127) q = -127;
-            out[b].data[i] = (int8_t)q;
+        op_dequantize_kv_row(quant, tmp, out + (size_t)h * c->cfg.head_dim, c->cfg.head_dim);
+    }
+}
+
+static void init_format(kv_cache_t *c, uint32_t quant) {
+    const struct kv_cache_config *cfg = &c->cfg;
+    struct kv_format *f = &c->fmt[quant];
+    f->group_bytes = op_kv_row_size(quant, 32);
+    if (cfg->layout == KV_LAYOUT_HEAD_MAJOR) {
+        size_t scales = 0;
+        if (quant == KV_F16) {
+            f->row_bytes = op_kv_row_size(quant, cfg->head_dim);
+        } else {
+            f->row_bytes = (size_t)c->head_groups * (f->group_bytes - sizeof(float));
+            scales = round_up_64((size_t)cfg->n_kv_heads * cfg->block_size * c->head_groups * sizeof(float));
         }
+        f->tile_bytes = round_up_64((size_t)cfg->block_size * f->row_bytes);
+        f->side_bytes = (size_t)cfg->n_kv_heads * f->tile_bytes + scales;
+    } else {
+        f->row_bytes = op_kv_row_size(quant, c->vec_dim);
+        f->side_bytes = round_up_64((size_t)cfg->block_size * f->row_bytes);
     }
 }
 
-static void q8_dequantize_vec(const struct q8_block *in, uint32_t n, float *out) {
-    uint32_t n_blocks = (n + 31u) / 32u;
-    for (uint32_t b = 0; b < n_blocks; ++b) {
-        uint32_t base = b * 32u;
-        float scale = in[b].scale;
-        for (uint32_t i = 0; i < 32u; ++i) {
-            uint32_t idx = base + i;
-            if (idx < n) {
-                out[idx] = (float)in[b].data[i] * scale;
+static void maintain_layer(kv_cache_t *c, uint32_t layer);
+static int load_layer(kv_cache_t *c, uint32_t layer);
+
+static void *worker_main(void *arg) {
+    kv_cache_t *c = (kv_cache_t *)arg;
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        // Layers done attending are written back before the next one is
+        // read, so at most two layers' spilled blocks are ever in memory;
+        // then reads, as the forward pass is about to wait on them.
+        uint32_t layer = NO_LAYER;
+        for (uint32_t l = 0; l < c->cfg.n_layers && layer == NO_LAYER; ++l) {
+            if (c->pending[l] == JOB_COMPACT) {
+                layer = l;
+            }
+        }
+        for (uint32_t l = 0; l < c->cfg.n_layers && layer == NO_LAYER; ++l) {
+            if (c->pending[l] & JOB_LOAD) {
+                layer = l;
             }
         }
+        for (uint32_t l = 0; l < c->cfg.n_layers && layer == NO_LAYER; ++l) {
+            if (c->pending[l]) {
+                layer = l;
+            }
+        }
+        if (c->stop) {
+            break;
+        }
+        if (layer == NO_LAYER) {
+            pthread_cond_wait(&c->cond, &c->lock);
+            continue;
+        }
+        uint8_t jobs = c->pending[layer];
+        c->pending[layer] = 0;
+        c->busy = layer;
+        pthread_mutex_unlock(&c->lock);
+        if (jobs & JOB_COMPACT) {
+            maintain_layer(c, layer);
+        }
+        if (jobs & JOB_LOAD) {
+            // A failed read leaves the blocks on disk; the caller retries.
+            (void)load_layer(c, layer);
+        }
+        pthread_mutex_lock(&c->lock);
+        c->busy = NO_LAYER;
+        pthread_cond_broadcast(&c->cond);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+static void queue_job(kv_cache_t *c, uint32_t layer, uint8_t job) {
+    pthread_mutex_lock(&c->lock);
+    c->pending[layer] |= job;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Waits until the worker is done with layer (every layer if NO_LAYER).
+static void sync_layer(kv_cache_t *c, uint32_t layer) {
+    if (!c->has_worker) {
+        return;
+    }
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        int waiting = c->busy != NO_LAYER && (layer == NO_LAYER || c->busy == layer);
+        for (uint32_t l = 0; l < c->cfg.n_layers && !waiting; ++l) {
+            waiting = c->pending[l] && (layer == NO_LAYER || l == layer);
+        }
+        if (!waiting) {
+            break;
+        }
+        pthread_cond_wait(&c->cond, &c->lock);
     }
+    pthread_mutex_unlock(&c->lock);
 }
 
 kv_cache_t *kv_cache_create(const struct kv_cache_config *cfg) {
-    if (!cfg || cfg->block_size == 0 || cfg->max_seq_len == 0) {
+    if (!cfg || cfg->block_size == 0 || cfg->max_seq_len == 0 ||
+        (cfg->quant != KV_Q8_0 && cfg->quant != KV_Q4_0 && cfg->quant != KV_F16) ||
+        (cfg->layout != KV_LAYOUT_TOKEN_MAJOR && cfg->layout != KV_LAYOUT_HEAD_MAJOR) ||
+        (cfg->evict != KV_EVICT_NONE && cfg->evict != KV_EVICT_WINDOW && cfg->evict != KV_EVICT_H2O) ||
+        (cfg->tiered && cfg->layout != KV_LAYOUT_HEAD_MAJOR)) {
         return NULL;
     }
     kv_cache_t *c = (kv_cache_t *)calloc(1, sizeof(*c));
@@ -77,37 +266,56 @@ kv_cache_t *kv_cache_create(const struct kv_cache_config *cfg) {
         return NULL;
     }
     c->cfg = *cfg;
+    c->spill_fd = -1;
+    if (cfg->tiered && c->cfg.tier_f16 == 0) {
+        c->cfg.tier_f16 = 1;
+    }
     c->vec_dim = cfg->n_kv_heads * cfg->head_dim;
     c->n_blocks = (cfg->max_seq_len + cfg->block_size - 1) / cfg->block_size;
-    c->q8_blocks_per_token = (c->vec_dim + 31u) / 32u;
-    c->q8_blocks_per_block = c->q8_blocks_per_token * cfg->block_size;
-
-    uint32_t total_blocks = cfg->n_layers * c->n_blocks;
-    c->blocks = (struct kv_block *)calloc(total_blocks, sizeof(*c->blocks));
-    if (!c->blocks) {
-        free(c);
-        return NULL;
+    c->head_groups = (cfg->head_dim + 31u) / 32u;
+    for (uint32_t q = 0; q < KV_FORMATS; ++q) {
+        init_format(c, q);
+        if (2 * c->fmt[q].side_bytes > c->slot_bytes) {
+            c->slot_bytes = 2 * c->fmt[q].side_bytes;
+        }
     }
+    c->busy = NO_LAYER;
+
+    size_t tmp_bytes = op_kv_row_size(KV_Q8_0, cfg->head_dim ? cfg->head_dim : 1);
+    c->table = (struct kv_block **)calloc((size_t)cfg->n_layers * c->n_blocks, sizeof(*c->table));
     c->layer_seq_len = (uint32_t *)calloc(cfg->n_layers, sizeof(uint32_t));
-    if (!c->layer_seq_len) {
-        free(c->blocks);
-        free(c);
+    c->head_tmp = (uint8_t *)malloc(tmp_bytes);
+    if (!c->table || !c->layer_seq_len || !c->head_tmp) {
+        kv_cache_destroy(c);
         return NULL;
     }
-
-    for (uint32_t l = 0; l < cfg->n_layers; ++l) {
-        for (uint32_t b = 0; b < c->n_blocks; ++b) {
-            struct kv_block *blk = &c->blocks[l * c->n_blocks + b];
-            blk->seq_len = 0;
-            blk->k = (struct q8_block *)calloc(c->q8_blocks_per_block, sizeof(struct q8_block));
-            blk->v = (struct q8_block *)calloc(c->q8_blocks_per_block, sizeof(struct q8_block));
-            if (!blk->k || !blk->v) {
-                kv_cache_destroy(c);
-                return NULL;
-            }
+    if (cfg->spill_path) {
+        // Scratch space only: unlinked right away, so it goes with the process.
+        c->spill_fd = open(cfg->spill_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (c->spill_fd < 0) {
+            kv_cache_destroy(c);
+            return NULL;
         }
+        unlink(cfg->spill_path);
+    }
+    if (cfg->tiered || c->spill_fd >= 0) {
+        c->pending = (uint8_t *)calloc(cfg->n_layers, 1);
+        c->compact_row = (float *)malloc((c->vec_dim ? c->vec_dim : 1) * sizeof(float));
+        c->compact_tmp = (uint8_t *)malloc(tmp_bytes);
+        if (!c->pending || !c->compact_row || !c->compact_tmp) {
+            kv_cache_destroy(c);
+            return NULL;
+        }
+        pthread_mutex_init(&c->lock, NULL);
+        pthread_cond_init(&c->cond, NULL);
+        if (pthread_create(&c->worker, NULL, worker_main, c) != 0) {
+            pthread_mutex_destroy(&c->lock);
+            pthread_cond_destroy(&c->cond);
+            kv_cache_destroy(c);
+            return NULL;
+        }
+        c->has_worker = 1;
     }
-
     return c;
 }
 
@@ -115,34 +323,278 @@ void kv_cache_destroy(kv_cache_t *c) {
     if (!c) {
         return;
     }
-    if (c->blocks) {
-        uint32_t total_blocks = c->cfg.n_layers * c->n_blocks;
-        for (uint32_t i = 0; i < total_blocks; ++i) {
-            free(c->blocks[i].k);
-            free(c->blocks[i].v);
+    if (c->has_worker) {
+        pthread_mutex_lock(&c->lock);
+        c->stop = 1;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->lock);
+        pthread_join(c->worker, NULL);
+        pthread_mutex_destroy(&c->lock);
+        pthread_cond_destroy(&c->cond);
+        c->has_worker = 0;
+    }
+    kv_cache_clear(c);
+    for (uint32_t q = 0; q < KV_FORMATS; ++q) {
+        while (c->fmt[q].free_data) {
+            void *next;
+            memcpy(&next, c->fmt[q].free_data, sizeof(next));
+            free(c->fmt[q].free_data);
+            c->fmt[q].free_data = next;
         }
     }
-    free(c->blocks);
+    while (c->free_headers) {
+        struct kv_block *next = c->free_headers->next_free;
+        free(c->free_headers);
+        c->free_headers = next;
+    }
+    if (c->spill_fd >= 0) {
+        close(c->spill_fd);
+    }
+    free(c->table);
     free(c->layer_seq_len);
+    free(c->head_tmp);
+    free(c->pending);
+    free(c->compact_row);
+    free(c->compact_tmp);
     free(c);
 }
 
-int kv_cache_append(kv_cache_t *c, uint32_t layer, uint32_t pos,
-                    const float *k, const float *v) {
-    if (!c || !k || !v) {
+static void pool_lock(kv_cache_t *c) {
+    if (c->has_worker) {
+        pthread_mutex_lock(&c->lock);
+    }
+}
+
+static void pool_unlock(kv_cache_t *c) {
+    if (c->has_worker) {
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+// K+V data of format quant from its pool, allocating if the pool is dry.
+static uint8_t *data_take(kv_cache_t *c, uint32_t quant) {
+    struct kv_format *f = &c->fmt[quant];
+    pool_lock(c);
+    void *mem = f->free_data;
+    if (mem) {
+        memcpy(&f->free_data, mem, sizeof(void *));
+    } else if (posix_memalign(&mem, 64, 2 * f->side_bytes) == 0) {
+        // K and V of a block share one cache-line aligned allocation.
+        f->n_allocated++;
+    } else {
+        mem = NULL;
+    }
+    pool_unlock(c);
+    if (mem) {
+        memset(mem, 0, 2 * f->side_bytes);
+    }
+    return (uint8_t *)mem;
+}
+
+static void data_put(kv_cache_t *c, uint32_t quant, uint8_t *mem) {
+    struct kv_format *f = &c->fmt[quant];
+    pool_lock(c);
+    memcpy(mem, &f->free_data, sizeof(void *));
+    f->free_data = mem;
+    pool_unlock(c);
+}
+
+static size_t header_bytes(const kv_cache_t *c) {
+    return sizeof(struct kv_block) + (c->cfg.key_bounds ? 2 * (size_t)c->vec_dim * sizeof(float) : 0);
+}
+
+// A block with data of format quant.
+static struct kv_block *pool_take(kv_cache_t *c, uint32_t quant) {
+    uint8_t *mem = data_take(c, quant);
+    if (!mem) {
+        return NULL;
+    }
+    pool_lock(c);
+    struct kv_block *blk = c->free_headers;
+    if (blk) {
+        c->free_headers = blk->next_free;
+    } else if ((blk = (struct kv_block *)calloc(1, header_bytes(c))) != NULL) {
+        blk->slot = c->n_headers++;
+        // Key bounds live right behind the header.
+        blk->k_min = c->cfg.key_bounds ? (float *)(blk + 1) : NULL;
+    }
+    pool_unlock(c);
+    if (!blk) {
+        data_put(c, quant, mem);
+        return NULL;
+    }
+    blk->k = mem;
+    blk->v = mem + c->fmt[quant].side_bytes;
+    blk->quant = quant;
+    blk->dirty = 1;
+    blk->next_free = NULL;
+    return blk;
+}
+
+static void pool_put(kv_cache_t *c, struct kv_block *blk) {
+    if (blk->k) {
+        data_put(c, blk->quant, blk->k);
+        blk->k = NULL;
+        blk->v = NULL;
+    }
+    pool_lock(c);
+    blk->next_free = c->free_headers;
+    c->free_headers = blk;
+    pool_unlock(c);
+}
+
+// Table entry for block b of layer, taking a block from the pool when alloc
+// is set and it has none yet. New blocks start in the newest tier's format.
+static struct kv_block *get_block(kv_cache_t *c, uint32_t layer, uint32_t b, int alloc) {
+    struct kv_block **slot = &c->table[(size_t)layer * c->n_blocks + b];
+    if (*slot || !alloc) {
+        return *slot;
+    }
+    struct kv_block *blk = pool_take(c, c->cfg.tiered ? KV_F16 : c->cfg.quant);
+    if (!blk) {
+        return NULL;
+    }
+    blk->seq_len = 0;
+    blk->rope_pos0 = b * c->cfg.block_size;
+    blk->score = 0.0f;
+    for (uint32_t i = 0; blk->k_min && i < c->vec_dim; ++i) {
+        blk->k_min[i] = INFINITY;
+        blk->k_min[c->vec_dim + i] = -INFINITY;
+    }
+    *slot = blk;
+    return blk;
+}
+
+static int pio_full(int fd, uint8_t *buf, size_t size, off_t off, int write) {
+    while (size > 0) {
+        ssize_t n = write ? pwrite(fd, buf, size, off) : pread(fd, buf, size, off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        size -= (size_t)n;
+        off += n;
+    }
+    return 0;
+}
+
+// Writes a block's data to its slot if the file copy is stale, then gives
+// the data back to the pool.
+static int spill_block(kv_cache_t *c, struct kv_block *blk) {
+    size_t bytes = 2 * c->fmt[blk->quant].side_bytes;
+    if (blk->dirty &&
+        pio_full(c->spill_fd, blk->k, bytes, (off_t)blk->slot * (off_t)c->slot_bytes, 1) != 0) {
         return -1;
     }
-    if (layer >= c->cfg.n_layers || pos >= c->cfg.max_seq_len) {
+    blk->dirty = 0;
+    data_put(c, blk->quant, blk->k);
+    blk->k = NULL;
+    blk->v = NULL;
+    return 0;
+}
+
+// Reads a spilled block back into memory; no-op for one already there.
+static int load_block(kv_cache_t *c, struct kv_block *blk) {
+    if (!blk || blk->k) {
+        return 0;
+    }
+    size_t bytes = 2 * c->fmt[blk->quant].side_bytes;
+    uint8_t *mem = data_take(c, blk->quant);
+    if (!mem || pio_full(c->spill_fd, mem, bytes, (off_t)blk->slot * (off_t)c->slot_bytes, 0) != 0) {
+        if (mem) {
+            data_put(c, blk->quant, mem);
+        }
         return -1;
     }
+    blk->k = mem;
+    blk->v = mem + c->fmt[blk->quant].side_bytes;
+    return 0;
+}
+
+static int load_layer(kv_cache_t *c, uint32_t layer) {
+    if (c->spill_fd < 0) {
+        return 0;
+    }
+    uint32_t used = (c->layer_seq_len[layer] + c->cfg.block_size - 1) / c->cfg.block_size;
+    for (uint32_t b = 0; b < used; ++b) {
+        if (load_block(c, get_block(c, layer, b, 0)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Re-quantizes every full block of layer whose format is finer than its age
+// calls for.
+static void compact_layer(kv_cache_t *c, uint32_t layer) {
+    uint32_t bs = c->cfg.block_size;
+    uint32_t used = (c->layer_seq_len[layer] + bs - 1) / bs;
+    struct kv_block **row = &c->table[(size_t)layer * c->n_blocks];
+    for (uint32_t b = 0; b < used; ++b) {
+        struct kv_block *blk = row[b];
+        uint32_t want = tier_quant(c, b, used);
+        if (!blk || !blk->k || blk->seq_len < bs || quant_bits(blk->quant) <= quant_bits(want)) {
+            continue;
+        }
+        uint8_t *mem = data_take(c, want);
+        if (!mem) {
+            return;
+        }
+        uint8_t *k = mem;
+        uint8_t *v = mem + c->fmt[want].side_bytes;
+        for (uint32_t t = 0; t < blk->seq_len; ++t) {
+            load_row(c, blk->quant, blk->k, t, c->compact_row, c->compact_tmp);
+            store_row(c, want, k, t, c->compact_row, c->compact_tmp);
+            load_row(c, blk->quant, blk->v, t, c->compact_row, c->compact_tmp);
+            store_row(c, want, v, t, c->compact_row, c->compact_tmp);
+        }
+        data_put(c, blk->quant, blk->k);
+        blk->k = k;
+        blk->v = v;
+        blk->quant = want;
+        blk->dirty = 1;
+    }
+}
+
+// Background upkeep of a layer after its attention: tiers are re-quantized,
+// then every full block but the newest resident_blocks goes to the spill
+// file. A block whose write fails simply stays in memory.
+static void maintain_layer(kv_cache_t *c, uint32_t layer) {
+    if (c->cfg.tiered) {
+        compact_layer(c, layer);
+    }
+    if (c->spill_fd < 0) {
+        return;
+    }
+    uint32_t bs = c->cfg.block_size;
+    uint32_t used = (c->layer_seq_len[layer] + bs - 1) / bs;
+    struct kv_block **row = &c->table[(size_t)layer * c->n_blocks];
+    for (uint32_t b = 0; b + c->cfg.resident_blocks < used; ++b) {
+        if (row[b] && row[b]->k && row[b]->seq_len == bs) {
+            (void)spill_block(c, row[b]);
+        }
+    }
+}
+
+static int append_row(kv_cache_t *c, uint32_t layer, uint32_t pos, const float *k, const float *v) {
     uint32_t block_id = pos / c->cfg.block_size;
     uint32_t token_in_block = pos % c->cfg.block_size;
-    struct kv_block *blk = &c->blocks[layer * c->n_blocks + block_id];
+    struct kv_block *blk = get_block(c, layer, block_id, 1);
+    if (!blk || load_block(c, blk) != 0) {
+        return -1;
+    }
 
-    struct q8_block *k_dst = blk->k + token_in_block * c->q8_blocks_per_token;
-    struct q8_block *v_dst = blk->v + token_in_block * c->q8_blocks_per_token;
-    q8_quantize_vec(k, c->vec_dim, k_dst);
-    q8_quantize_vec(v, c->vec_dim, v_dst);
+    blk->dirty = 1;
+    store_row(c, blk->quant, blk->k, token_in_block, k, c->head_tmp);
+    for (uint32_t i = 0; blk->k_min && i < c->vec_dim; ++i) {
+        float *mx = blk->k_min + c->vec_dim;
+        blk->k_min[i] = k[i] < blk->k_min[i] ? k[i] : blk->k_min[i];
+        mx[i] = k[i] > mx[i] ? k[i] : mx[i];
+    }
+    store_row(c, blk->quant, blk->v, token_in_block, v, c->head_tmp);
 
     uint32_t new_len = token_in_block + 1;
     if (new_len > blk->seq_len) {
@@ -154,6 +606,37 @@ int kv_cache_append(kv_cache_t *c, uint32_t layer, uint32_t pos,
     return 0;
 }
 
+int kv_cache_append(kv_cache_t *c, uint32_t layer, uint32_t pos,
+                    const float *k, const float *v) {
+    if (!c || !k || !v) {
+        return -1;
+    }
+    if (layer >= c->cfg.n_layers || pos >= c->cfg.max_seq_len) {
+        return -1;
+    }
+    sync_layer(c, layer);
+    return append_row(c, layer, pos, k, v);
+}
+
+int kv_cache_append_batch(kv_cache_t *c, uint32_t layer, uint32_t pos, uint32_t n_tokens,
+                          const float *k, const float *v) {
+    if (!c || !k || !v || n_tokens == 0) {
+        return -1;
+    }
+    if (layer >= c->cfg.n_layers || pos + n_tokens > c->cfg.max_seq_len) {
+        return -1;
+    }
+    sync_layer(c, layer);
+    for (uint32_t t = 0; t < n_tokens; ++t) {
+        const float *k_src = k + (size_t)t * c->vec_dim;
+        const float *v_src = v + (size_t)t * c->vec_dim;
+        if (append_row(c, layer, pos + t, k_src, v_src) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 int kv_cache_read_block(kv_cache_t *c, uint32_t layer, uint32_t block_id,
                         float *k_out, float *v_out) {
     if (!c || !k_out || !v_out) {
@@ -162,12 +645,20 @@ int kv_cache_read_block(kv_cache_t *c, uint32_t layer, uint32_t block_id,
     if (layer >= c->cfg.n_layers || block_id >= c->n_blocks) {
         return -1;
     }
-    struct kv_block *blk = &c->blocks[layer * c->n_blocks + block_id];
+    sync_layer(c, layer);
+    struct kv_block *blk = get_block(c, layer, block_id, 0);
+    if (load_block(c, blk) != 0) {
+        return -1;
+    }
+    if (!blk) {
+        // Never written: reads back as zeros, like an empty block.
+        memset(k_out, 0, (size_t)c->cfg.block_size * c->vec_dim * sizeof(float));
+        memset(v_out, 0, (size_t)c->cfg.block_size * c->vec_dim * sizeof(float));
+        return 0;
+    }
     for (uint32_t t = 0; t < c->cfg.block_size; ++t) {
-        struct q8_block *k_src = blk->k + t * c->q8_blocks_per_token;
-        struct q8_block *v_src = blk->v + t * c->q8_blocks_per_token;
-        q8_dequantize_vec(k_src, c->vec_dim, k_out + t * c->vec_dim);
-        q8_dequantize_vec(v_src, c->vec_dim, v_out + t * c->vec_dim);
+        load_row(c, blk->quant, blk->k, t, k_out + (size_t)t * c->vec_dim, c->head_tmp);
+        load_row(c, blk->quant, blk->v, t, v_out + (size_t)t * c->vec_dim, c->head_tmp);
     }
     return 0;
 }
@@ -184,15 +675,17 @@ int kv_cache_read_range(kv_cache_t *c, uint32_t layer,
     if (seq_end > c->cfg.max_seq_len) {
         return -1;
     }
+    sync_layer(c, layer);
     uint32_t out_idx = 0;
     for (uint32_t pos = seq_start; pos < seq_end; ++pos) {
         uint32_t block_id = pos / c->cfg.block_size;
         uint32_t token_in_block = pos % c->cfg.block_size;
-        struct kv_block *blk = &c->blocks[layer * c->n_blocks + block_id];
-        struct q8_block *k_src = blk->k + token_in_block * c->q8_blocks_per_token;
-        struct q8_block *v_src = blk->v + token_in_block * c->q8_blocks_per_token;
-        q8_dequantize_vec(k_src, c->vec_dim, k_out + out_idx * c->vec_dim);
-        q8_dequantize_vec(v_src, c->vec_dim, v_out + out_idx * c->vec_dim);
+        struct kv_block *blk = get_block(c, layer, block_id, 0);
+        if (!blk || load_block(c, blk) != 0) {
+            return -1;
+        }
+        load_row(c, blk->quant, blk->k, token_in_block, k_out + (size_t)out_idx * c->vec_dim, c->head_tmp);
+        load_row(c, blk->quant, blk->v, token_in_block, v_out + (size_t)out_idx * c->vec_dim, c->head_tmp);
         out_idx++;
     }
     return 0;
@@ -217,9 +710,9 @@ int kv_cache_iterate(kv_cache_t *c, uint32_t layer,
         return -1;
     }
     for (uint32_t b = start_block; b < end_block; ++b) {
-        struct kv_block *blk = &c->blocks[layer * c->n_blocks + b];
         kv_cache_read_block(c, layer, b, k_tmp, v_tmp);
-        uint32_t valid = blk->seq_len;
+        const struct kv_block *blk = get_block(c, layer, b, 0);
+        uint32_t valid = blk ? blk->seq_len : 0;
         cb(b, k_tmp, v_tmp, valid, user);
     }
     free(k_tmp);
@@ -227,13 +720,238 @@ int kv_cache_iterate(kv_cache_t *c, uint32_t layer,
     return 0;
 }
 
-void kv_cache_clear(kv_cache_t *c) {
+// End (in-block index) of the cached tokens of block b below seq_end.
+static uint32_t cached_end(kv_cache_t *c, uint32_t layer, uint32_t b, uint32_t seq_end) {
+    uint32_t bs = c->cfg.block_size;
+    const struct kv_block *blk = get_block(c, layer, b, 0);
+    uint32_t end = !blk ? 0 : blk->seq_len < bs ? blk->seq_len : bs;
+    return end > seq_end - b * bs ? seq_end - b * bs : end;
+}
+
+int kv_cache_iterate_quant(kv_cache_t *c, uint32_t layer,
+                           uint32_t seq_start, uint32_t seq_end,
+                           kv_block_quant_cb cb, void *user) {
+    if (!c || !cb || seq_end < seq_start) {
+        return -1;
+    }
+    if (layer >= c->cfg.n_layers || seq_end > c->cfg.max_seq_len ||
+        c->cfg.layout != KV_LAYOUT_TOKEN_MAJOR) {
+        return -1;
+    }
+    sync_layer(c, layer);
+    if (load_layer(c, layer) != 0) {
+        return -1;
+    }
+    uint32_t bs = c->cfg.block_size;
+    size_t row_bytes = c->fmt[c->cfg.quant].row_bytes;
+    for (uint32_t pos = seq_start; pos < seq_end;) {
+        uint32_t b = pos / bs;
+        uint32_t first = pos % bs;
+        uint32_t end = cached_end(c, layer, b, seq_end);
+        if (end <= first) {
+            // Nothing cached here yet.
+            return -1;
+        }
+        const struct kv_block *blk = get_block(c, layer, b, 0);
+        if (blk->rope_pos0 != b * bs) {
+            return -1;
+        }
+        size_t row = (size_t)first * row_bytes;
+        cb(pos, blk->k + row, blk->v + row, end - first, user);
+        pos = b * bs + end;
+    }
+    return 0;
+}
+
+int kv_cache_iterate_heads(kv_cache_t *c, uint32_t layer,
+                           uint32_t seq_start, uint32_t seq_end,
+                           kv_block_heads_cb cb, void *user) {
+    if (!c || !cb || seq_end < seq_start) {
+        return -1;
+    }
+    if (layer >= c->cfg.n_layers || seq_end > c->cfg.max_seq_len ||
+        c->cfg.layout != KV_LAYOUT_HEAD_MAJOR) {
+        return -1;
+    }
+    sync_layer(c, layer);
+    if (load_layer(c, layer) != 0) {
+        return -1;
+    }
+    uint32_t bs = c->cfg.block_size;
+    for (uint32_t pos = seq_start; pos < seq_end;) {
+        uint32_t b = pos / bs;
+        uint32_t first = pos % bs;
+        uint32_t end = cached_end(c, layer, b, seq_end);
+        if (end <= first) {
+            return -1;
+        }
+        const struct kv_block *blk = get_block(c, layer, b, 0);
+        const struct kv_format *f = &c->fmt[blk->quant];
+        size_t scales_off = (size_t)c->cfg.n_kv_heads * f->tile_bytes;
+        struct op_kv_head_span span;
+        span.k = blk->k + (size_t)first * f->row_bytes;
+        span.v = blk->v + (size_t)first * f->row_bytes;
+        span.k_scale = NULL;
+        span.v_scale = NULL;
+        span.scale_stride = 0;
+        if (blk->quant != KV_F16) {
+            span.k_scale = (const float *)(blk->k + scales_off) + (size_t)first * c->head_groups;
+            span.v_scale = (const float *)(blk->v + scales_off) + (size_t)first * c->head_groups;
+            span.scale_stride = (size_t)bs * c->head_groups;
+        }
+        span.head_stride = f->tile_bytes;
+        span.n_tokens = end - first;
+        span.rope_shift = blk->rope_pos0 - b * bs;
+        span.quant = blk->quant;
+        span.k_min = blk->k_min;
+        span.k_max = blk->k_min ? blk->k_min + c->vec_dim : NULL;
+        cb(pos, &span, user);
+        pos = b * bs + end;
+    }
+    return 0;
+}
+
+// Blocks of a layer holding [0, seq_len) the policy may never evict: the
+// sinks at the front, then the tail: the newest block (which may be partial)
+// and, for KV_EVICT_H2O, every block holding one of the n_recent newest.
+// The counts only depend on seq_len, and evicting one of the blocks between
+// them leaves the same counts, so every layer evicts alike.
+static void protected_blocks(const kv_cache_t *c, uint32_t seq_len,
+                             uint32_t *n_head, uint32_t *n_tail, uint32_t *n_used) {
+    uint32_t bs = c->cfg.block_size;
+    uint32_t used = (seq_len + bs - 1) / bs;
+    uint32_t head = (c->cfg.n_sink + bs - 1) / bs;
+    uint32_t recent = c->cfg.evict == KV_EVICT_H2O && c->cfg.n_recent > 1 ? c->cfg.n_recent : 1;
+    uint32_t tail = recent >= seq_len ? used : used - (seq_len - recent) / bs;
+    *n_used = used;
+    *n_head = head < used ? head : used;
+    *n_tail = tail < used - *n_head ? tail : used - *n_head;
+}
+
+// Drops block i of layer: it goes back to the pool and the later blocks move
+// down one entry, keeping the positions their keys were rotated at.
+static void evict_block(kv_cache_t *c, uint32_t layer, uint32_t i, uint32_t n_used) {
+    struct kv_block **row = &c->table[(size_t)layer * c->n_blocks];
+    struct kv_block *blk = row[i];
+    memmove(&row[i], &row[i + 1], (size_t)(n_used - i - 1) * sizeof(*row));
+    row[n_used - 1] = NULL;
+    pool_put(c, blk);
+    c->layer_seq_len[layer] -= c->cfg.block_size;
+}
+
+int kv_cache_reserve(kv_cache_t *c, uint32_t n_tokens) {
+    if (!c) {
+        return -1;
+    }
+    sync_layer(c, NO_LAYER);
+    uint32_t bs = c->cfg.block_size;
+    for (uint32_t l = 0; l < c->cfg.n_layers; ++l) {
+        uint32_t seq_len = c->layer_seq_len[l];
+        if ((uint64_t)seq_len + n_tokens <= c->cfg.max_seq_len) {
+            continue;
+        }
+        if (c->cfg.evict == KV_EVICT_NONE || n_tokens > c->cfg.max_seq_len) {
+            return -1;
+        }
+        uint32_t head, tail, used;
+        protected_blocks(c, seq_len, &head, &tail, &used);
+        uint32_t excess = seq_len + n_tokens - c->cfg.max_seq_len;
+        uint32_t n_evict = (excess + bs - 1) / bs;
+        if (n_evict > used - head - tail) {
+            return -1;
+        }
+        struct kv_block **row = &c->table[(size_t)l * c->n_blocks];
+        for (uint32_t e = 0; e < n_evict; ++e, --used) {
+            uint32_t victim = head;
+            if (c->cfg.evict == KV_EVICT_H2O) {
+                for (uint32_t i = head + 1; i < used - tail; ++i) {
+                    if (row[i]->score < row[victim]->score) {
+                        victim = i;
+                    }
+                }
+            }
+            evict_block(c, l, victim, used);
+        }
+    }
+    return 0;
+}
+
+uint32_t kv_cache_room(kv_cache_t *c) {
     if (!c) {
+        return 0;
+    }
+    sync_layer(c, NO_LAYER);
+    uint32_t room = c->cfg.max_seq_len;
+    for (uint32_t l = 0; l < c->cfg.n_layers; ++l) {
+        uint32_t seq_len = c->layer_seq_len[l];
+        uint32_t r = c->cfg.max_seq_len - seq_len;
+        if (c->cfg.evict != KV_EVICT_NONE) {
+            uint32_t head, tail, used;
+            protected_blocks(c, seq_len, &head, &tail, &used);
+            r += (used - head - tail) * c->cfg.block_size;
+        }
+        room = r < room ? r : room;
+    }
+    return room;
+}
+
+uint32_t kv_cache_rope_pos(kv_cache_t *c, uint32_t layer, uint32_t pos) {
+    if (!c || layer >= c->cfg.n_layers || pos >= c->cfg.max_seq_len) {
+        return pos;
+    }
+    sync_layer(c, layer);
+    const struct kv_block *blk = get_block(c, layer, pos / c->cfg.block_size, 0);
+    return blk ? blk->rope_pos0 + pos % c->cfg.block_size : pos;
+}
+
+int kv_cache_add_attention(kv_cache_t *c, uint32_t layer, const float *mass, uint32_t n_blocks) {
+    if (!c || !mass || layer >= c->cfg.n_layers || n_blocks > c->n_blocks) {
+        return -1;
+    }
+    sync_layer(c, layer);
+    for (uint32_t i = 0; i < n_blocks; ++i) {
+        struct kv_block *blk = get_block(c, layer, i, 0);
+        if (!blk) {
+            return -1;
+        }
+        blk->score += mass[i];
+    }
+    return 0;
+}
+
+int kv_cache_compact(kv_cache_t *c, uint32_t layer) {
+    if (!c || layer >= c->cfg.n_layers) {
+        return -1;
+    }
+    if (c->has_worker) {
+        queue_job(c, layer, JOB_COMPACT);
+    }
+    return 0;
+}
+
+int kv_cache_prefetch(kv_cache_t *c, uint32_t layer) {
+    if (!c || layer >= c->cfg.n_layers) {
+        return -1;
+    }
+    if (c->spill_fd >= 0) {
+        queue_job(c, layer, JOB_LOAD);
+    }
+    return 0;
+}
+
+// Every block goes back to the pool; the memory stays allocated for reuse.
+void kv_cache_clear(kv_cache_t *c) {
+    if (!c || !c->table) {
         return;
     }
-    uint32_t total_blocks = c->cfg.n_layers * c->n_blocks;
-    for (uint32_t i = 0; i < total_blocks; ++i) {
-        c->blocks[i].seq_len = 0;
+    sync_layer(c, NO_LAYER);
+    size_t n = (size_t)c->cfg.n_layers * c->n_blocks;
+    for (size_t i = 0; i < n; ++i) {
+        struct kv_block *blk = c->table[i];
+        if (blk) {
+            pool_put(c, blk);
+            c->table[i] = NULL;
+        }
     }
     for (uint32_t l = 0; l < c->cfg.n_layers; ++l) {
         c->layer_seq_len[l] = 0;
@@ -246,3 +964,42 @@ uint32_t kv_cache_get_seq_len(kv_cache_t *c, uint32_t layer) {
     }
     return c->layer_seq_len[layer];
 }
+
+size_t kv_cache_memory_size(kv_cache_t *c) {
+    if (!c) {
+        return 0;
+    }
+    sync_layer(c, NO_LAYER);
+    size_t bytes = (size_t)c->cfg.n_layers * c->n_blocks * sizeof(*c->table) +
+                   (size_t)c->cfg.n_layers * sizeof(uint32_t) +
+                   (size_t)c->n_headers * header_bytes(c);
+    for (uint32_t q = 0; q < KV_FORMATS; ++q) {
+        bytes += (size_t)c->fmt[q].n_allocated * 2 * c->fmt[q].side_bytes;
+    }
+    return bytes;
+}
+
+size_t kv_cache_memory_limit(const kv_cache_t *c) {
+    if (!c) {
+        return 0;
+    }
+    size_t per_layer = (size_t)c->n_blocks * (sizeof(*c->table) + header_bytes(c)) +
+                       sizeof(uint32_t);
+    size_t cold = 0;
+    for (uint32_t b = 0; b < c->n_blocks; ++b) {
+        size_t data = 2 * c->fmt[tier_quant(c, b, c->n_blocks)].side_bytes;
+        if (c->spill_fd >= 0 && b + c->cfg.resident_blocks < c->n_blocks) {
+            cold += data;
+        } else {
+            per_layer += data;
+        }
+    }
+    if (c->cfg.tiered) {
+        // A new block is in F16 until the worker demotes the one before it.
+        per_layer += 2 * c->fmt[KV_F16].side_bytes;
+    }
+    // Spilled blocks are in memory for two layers at a time: the one
+    // attending and the one being read back for it.
+    size_t staged = c->cfg.n_layers < 2 ? c->cfg.n_layers : 2;
+    return (size_t)c->cfg.n_layers * per_layer + staged * cold;
+}
@@ -4,12 +4,29 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include "engine.h"
+#include "ops.h"
 #if defined(__APPLE__)
 #include "metal_ops.h"
 #endif
 
 static void print_usage(const char *argv0) {
-    fprintf(stderr, "Usage: %s <model.lstr> [--prompt \"...\"] [--max-tokens N]\n", argv0);
+    fprintf(stderr, "Usage: %s <model.lstr> [--prompt \"...\"] [--max-tokens N] [--mem-budget SIZE[K|M|G]] [--max-context N]\n", argv0);
+}
+
+// "512M", "8G", "4096K" or plain bytes.
+static uint64_t parse_size(const char *s) {
+    char *end = NULL;
+    double v = strtod(s, &end);
+    if (!end || v < 0.0) {
+        return 0;
+    }
+    switch (*end) {
+        case 'k': case 'K': v *= 1024.0; break;
+        case 'm': case 'M': v *= 1024.0 * 1024.0; break;
+        case 'g': case 'G': v *= 1024.0 * 1024.0 * 1024.0; break;
+        default: break;
+    }
+    return (uint64_t)v;
 }
 
 static void print_peak_rss(void) {
@@ -43,6 +60,8 @@ int main(int argc, char **argv) {
     }
 #endif
 
+    fprintf(stderr, "CPU kernels: %s\n", op_cpu_kernels_name());
+
     uint32_t max_tokens = 16;
     const char *prompt = NULL;
     const char *prefetch_env = getenv("SHUKUCHI_PREFETCH_DEPTH");
@@ -53,12 +72,122 @@ int main(int argc, char **argv) {
             prefetch_depth = 2;
         }
     }
+    const char *prefetch_mb_env = getenv("SHUKUCHI_PREFETCH_MB");
+    uint32_t prefetch_mb = 0;
+    if (prefetch_mb_env && prefetch_mb_env[0] != '\0') {
+        prefetch_mb = (uint32_t)strtoul(prefetch_mb_env, NULL, 10);
+    }
+    const char *lookahead_env = getenv("SHUKUCHI_LOOKAHEAD");
+    uint32_t lookahead = 0;
+    if (lookahead_env && lookahead_env[0] != '\0') {
+        lookahead = (uint32_t)strtoul(lookahead_env, NULL, 10);
+    }
+    const char *threads_env = getenv("SHUKUCHI_THREADS");
+    uint32_t n_threads = 0;
+    if (threads_env && threads_env[0] != '\0') {
+        n_threads = (uint32_t)strtoul(threads_env, NULL, 10);
+    }
+    const char *chunk_env = getenv("SHUKUCHI_PREFILL_CHUNK");
+    uint32_t prefill_chunk = 0;
+    if (chunk_env && chunk_env[0] != '\0') {
+        prefill_chunk = (uint32_t)strtoul(chunk_env, NULL, 10);
+    }
+    // Q8_K activations feed the CPU integer kernels; Metal consumes fp32.
+    uint32_t q8_activations = 1;
+#if defined(__APPLE__)
+    if (!metal_disabled && metal_available()) {
+        q8_activations = 0;
+    }
+#endif
+    const char *q8_env = getenv("SHUKUCHI_Q8_ACT");
+    if (q8_env && q8_env[0] != '\0') {
+        q8_activations = (q8_env[0] != '0') ? 1u : 0u;
+    }
+    const char *kv_env = getenv("SHUKUCHI_KV_QUANT");
+    uint32_t kv_quant = 0;
+    if (kv_env && strcmp(kv_env, "q4") == 0) {
+        kv_quant = 1;
+    } else if (kv_env && strcmp(kv_env, "f16") == 0) {
+        kv_quant = 2;
+    } else if (kv_env && strcmp(kv_env, "tiered") == 0) {
+        kv_quant = 3;
+    }
+    const char *tier_f16_env = getenv("SHUKUCHI_KV_TIER_F16");
+    uint32_t kv_tier_f16 = 0;
+    if (tier_f16_env && tier_f16_env[0] != '\0') {
+        kv_tier_f16 = (uint32_t)strtoul(tier_f16_env, NULL, 10);
+    }
+    const char *tier_q8_env = getenv("SHUKUCHI_KV_TIER_Q8");
+    uint32_t kv_tier_q8 = 0;
+    if (tier_q8_env && tier_q8_env[0] != '\0') {
+        kv_tier_q8 = (uint32_t)strtoul(tier_q8_env, NULL, 10);
+    }
+    const char *evict_env = getenv("SHUKUCHI_KV_EVICT");
+    uint32_t kv_evict = 0;
+    if (evict_env && strcmp(evict_env, "window") == 0) {
+        kv_evict = 1;
+    } else if (evict_env && strcmp(evict_env, "h2o") == 0) {
+        kv_evict = 2;
+    }
+    const char *sink_env = getenv("SHUKUCHI_KV_SINK");
+    uint32_t kv_sink = 0;
+    if (sink_env && sink_env[0] != '\0') {
+        kv_sink = (uint32_t)strtoul(sink_env, NULL, 10);
+    }
+    const char *recent_env = getenv("SHUKUCHI_KV_RECENT");
+    uint32_t kv_recent = 0;
+    if (recent_env && recent_env[0] != '\0') {
+        kv_recent = (uint32_t)strtoul(recent_env, NULL, 10);
+    }
+    const char *kv_spill_path = getenv("SHUKUCHI_KV_SPILL");
+    if (kv_spill_path && kv_spill_path[0] == '\0') {
+        kv_spill_path = NULL;
+    }
+    const char *resident_env = getenv("SHUKUCHI_KV_RESIDENT");
+    uint32_t kv_resident = 0;
+    if (resident_env && resident_env[0] != '\0') {
+        kv_resident = (uint32_t)strtoul(resident_env, NULL, 10);
+    }
+    const char *select_env = getenv("SHUKUCHI_KV_SELECT");
+    uint32_t kv_select = 0;
+    if (select_env && select_env[0] != '\0') {
+        kv_select = (uint32_t)strtoul(select_env, NULL, 10);
+    }
+    const char *select_recent_env = getenv("SHUKUCHI_KV_SELECT_RECENT");
+    uint32_t kv_select_recent = 0;
+    if (select_recent_env && select_recent_env[0] != '\0') {
+        kv_select_recent = (uint32_t)strtoul(select_recent_env, NULL, 10);
+    }
+    const char *direct_env = getenv("SHUKUCHI_DIRECT_IO");
+    int direct_io = (direct_env && direct_env[0] != '\0' && direct_env[0] != '0') ? 1 : 0;
+    const char *io_depth_env = getenv("SHUKUCHI_IO_DEPTH");
+    uint32_t io_depth = 0;
+    if (io_depth_env && io_depth_env[0] != '\0') {
+        io_depth = (uint32_t)strtoul(io_depth_env, NULL, 10);
+    }
+    const char *io_chunk_env = getenv("SHUKUCHI_IO_CHUNK_KB");
+    uint32_t io_chunk_kb = 0;
+    if (io_chunk_env && io_chunk_env[0] != '\0') {
+        io_chunk_kb = (uint32_t)strtoul(io_chunk_env, NULL, 10);
+    }
+    uint64_t mem_budget = 0;
+    uint32_t max_context = 0;
     for (int i = 2; i < argc; ++i) {
         if (strcmp(argv[i], "--max-tokens") == 0 && i + 1 < argc) {
             max_tokens = (uint32_t)strtoul(argv[i + 1], NULL, 10);
             i++;
             continue;
         }
+        if (strcmp(argv[i], "--mem-budget") == 0 && i + 1 < argc) {
+            mem_budget = parse_size(argv[i + 1]);
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "--max-context") == 0 && i + 1 < argc) {
+            max_context = (uint32_t)strtoul(argv[i + 1], NULL, 10);
+            i++;
+            continue;
+        }
         if (strcmp(argv[i], "--prompt") == 0 && i + 1 < argc) {
             prompt = argv[i + 1];
             i++;
@@ -69,12 +198,30 @@ int main(int argc, char **argv) {
     {
         struct engine_config cfg;
         memset(&cfg, 0, sizeof(cfg));
-        cfg.n_threads = 4;
+        cfg.n_threads = n_threads;
         cfg.batch_size = 1;
         cfg.prefetch_depth = prefetch_depth;
+        cfg.prefetch_mb = prefetch_mb;
+        cfg.prefetch_lookahead = lookahead;
         cfg.kv_block_size = 32;
-        cfg.kv_quant = 0;
+        cfg.max_context = max_context;
+        cfg.kv_quant = kv_quant;
+        cfg.kv_tier_f16 = kv_tier_f16;
+        cfg.kv_tier_q8 = kv_tier_q8;
+        cfg.kv_evict = kv_evict;
+        cfg.kv_sink = kv_sink;
+        cfg.kv_recent = kv_recent;
+        cfg.kv_spill_path = kv_spill_path;
+        cfg.kv_resident = kv_resident;
+        cfg.kv_select = kv_select;
+        cfg.kv_select_recent = kv_select_recent;
+        cfg.prefill_chunk = prefill_chunk;
+        cfg.q8_activations = q8_activations;
         cfg.use_mmap = 0;
+        cfg.direct_io = direct_io;
+        cfg.io_depth = io_depth;
+        cfg.io_chunk_kb = io_chunk_kb;
+        cfg.mem_budget = mem_budget;
 
         engine_handle_t *h = engine_open(argv[1], &cfg);
         if (!h) {
@@ -96,6 +243,22 @@ int main(int argc, char **argv) {
                     stats.max_concurrent_buffers,
                     stats.prefetch_hits,
                     stats.prefetch_misses);
+            double read_s = (double)stats.layer_read_ns * 1e-9;
+            fprintf(stderr, "layer_io: direct_io=%u bytes_read=%llu read_time=%.3fs read_bw=%.2f GB/s\n",
+                    stats.direct_io,
+                    (unsigned long long)stats.layer_bytes_read,
+                    read_s,
+                    read_s > 0.0 ? (double)stats.layer_bytes_read / read_s * 1e-9 : 0.0);
+            fprintf(stderr, "prefetch_wait: total=%.3fms max=%.3fms avg_miss=%.3fms\n",
+                    (double)stats.prefetch_wait_ns * 1e-6,
+                    (double)stats.prefetch_max_wait_ns * 1e-6,
+                    stats.prefetch_misses ? (double)stats.prefetch_wait_ns * 1e-6 / stats.prefetch_misses : 0.0);
+            fprintf(stderr, "lookahead: current=%u max=%u changes=%u layer_read_ema=%.3fms layer_compute_ema=%.3fms\n",
+                    stats.lookahead, stats.lookahead_max, stats.lookahead_changes,
+                    (double)stats.layer_read_ema_ns * 1e-6,
+                    (double)stats.layer_compute_ema_ns * 1e-6);
+            fprintf(stderr, "residency: pinned_layers=%u pinned_bytes=%zu\n",
+                    stats.pinned_layers, stats.pinned_bytes);
         }
         engine_close(h);
     }
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
 
 int build_layer_specs(gguf_file_t *f,
                       struct resident_spec *resident,
@@ -21,11 +23,11 @@ struct model_handle {
     void *layer_buf;
     size_t layer_buf_size;
     struct layer_view layer_view;
+    // Layer loads may run on several reader threads at once.
+    pthread_mutex_t stats_mu;
     struct streaming_stats stats;
     uint32_t bos_token_id;
     int has_bos;
-    void *layer_io_buf;
-    size_t layer_io_buf_size;
 };
 
 struct prefetch_handle {
@@ -37,6 +39,31 @@ static size_t align_up_size(size_t x, size_t a) {
     return (x + mask) & ~mask;
 }
 
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// File range [*start, *end) covering all tensors of a layer.
+static void layer_span(const struct layer_spec *ls, uint64_t *start, uint64_t *end) {
+    const struct tensor_ref *refs[] = {
+        &ls->attn_norm, &ls->attn_q, &ls->attn_k, &ls->attn_v, &ls->attn_o,
+        &ls->ffn_norm, &ls->ffn_gate, &ls->ffn_up, &ls->ffn_down
+    };
+    uint64_t lo = UINT64_MAX, hi = 0;
+    for (size_t i = 0; i < sizeof(refs) / sizeof(refs[0]); ++i) {
+        if (refs[i]->offset < lo) {
+            lo = refs[i]->offset;
+        }
+        if (refs[i]->offset + refs[i]->size > hi) {
+            hi = refs[i]->offset + refs[i]->size;
+        }
+    }
+    *start = lo;
+    *end = hi;
+}
+
 static void resident_clear(struct resident_tensors *r) {
     if (!r) {
         return;
@@ -47,19 +74,6 @@ static void resident_clear(struct resident_tensors *r) {
     memset(r, 0, sizeof(*r));
 }
 
-static int ensure_io_buf(struct model_handle *m, size_t size) {
-    if (m->layer_io_buf_size >= size) {
-        return 0;
-    }
-    void *nbuf = realloc(m->layer_io_buf, size);
-    if (!nbuf) {
-        return -1;
-    }
-    m->layer_io_buf = nbuf;
-    m->layer_io_buf_size = size;
-    return 0;
-}
-
 model_handle_t *model_open(const char *path, const struct model_config *cfg) {
     int use_mmap = cfg ? cfg->use_mmap : 0;
     gguf_file_t *f = gguf_open(path, use_mmap);
@@ -77,11 +91,22 @@ model_handle_t *model_open(const char *path, const struct model_config *cfg) {
         return NULL;
     }
     m->gguf = f;
+    pthread_mutex_init(&m->stats_mu, NULL);
     memset(&m->stats, 0, sizeof(m->stats));
+    if (cfg && cfg->direct_io) {
+        if (use_mmap) {
+            fprintf(stderr, "model_open: direct I/O ignored with mmap\n");
+        } else if (gguf_enable_direct_io(f, path) != 0) {
+            fprintf(stderr, "model_open: direct I/O unavailable, using buffered reads\n");
+        } else {
+            m->stats.direct_io = 1;
+        }
+    }
 
     // TODO: hardcoded llama mapping for now
     if (build_layer_specs(f, &m->resident_spec, &m->layers, &m->n_layers) != 0) {
         gguf_close(f);
+        pthread_mutex_destroy(&m->stats_mu);
         free(m);
         return NULL;
     }
@@ -89,6 +114,7 @@ model_handle_t *model_open(const char *path, const struct model_config *cfg) {
     if (model_load_resident(m) != 0) {
         gguf_close(f);
         free(m->layers);
+        pthread_mutex_destroy(&m->stats_mu);
         free(m);
         return NULL;
     }
@@ -196,6 +222,14 @@ int model_get_layer_buffer_size(model_handle_t *m, uint32_t layer_id, size_t *ou
         total = align_up_size(total, align);
         total += (size_t)refs[i]->size;
     }
+    size_t direct_align = gguf_direct_io_align(m->gguf);
+    if (direct_align) {
+        // Whole span rounded out to blocks: one block for the leading edge,
+        // the rounded length for the rest.
+        uint64_t start = 0, end = 0;
+        layer_span(ls, &start, &end);
+        total = align_up_size((size_t)(end - start), direct_align) + direct_align;
+    }
     *out = total;
     return 0;
 }
@@ -218,11 +252,21 @@ int model_get_max_layer_size(model_handle_t *m, size_t *out) {
     return 0;
 }
 
-int model_load_layer(model_handle_t *m, uint32_t layer_id, void *buffer, size_t buffer_size,
-                     struct layer_view *out_view, size_t *out_used) {
-    if (!m || !buffer || !out_view || layer_id >= m->n_layers) {
-        return -1;
-    }
+size_t model_get_buffer_alignment(model_handle_t *m) {
+    size_t a = m ? gguf_direct_io_align(m->gguf) : 0;
+    return a ? a : 32;
+}
+
+#define LAYER_N_TENSORS 9
+#define LAYER_N_ATTN_TENSORS 5
+
+// Places every tensor of the layer in buffer (filling the view) and returns
+// the matching read ranges in segs. Buffered mode packs tensors in field
+// order, 32-byte aligned, with one data-relative range per tensor; direct
+// mode keeps the file layout and uses a single absolute block-aligned range.
+static int layout_layer(model_handle_t *m, uint32_t layer_id, void *buffer, size_t buffer_size,
+                        struct layer_view *out_view, size_t *out_used,
+                        struct gguf_read_seg segs[LAYER_N_TENSORS], uint32_t *out_n_segs) {
     const struct layer_spec *ls = &m->layers[layer_id];
     size_t need = 0;
     if (model_get_layer_buffer_size(m, layer_id, &need) != 0) {
@@ -234,23 +278,23 @@ int model_load_layer(model_handle_t *m, uint32_t layer_id, void *buffer, size_t
                 layer_id, need, buffer_size);
         return -1;
     }
+    pthread_mutex_lock(&m->stats_mu);
     if (need > m->stats.max_layer_size) {
         m->stats.max_layer_size = need;
     }
     if (buffer_size > m->stats.peak_buffer_usage) {
         m->stats.peak_buffer_usage = buffer_size;
     }
+    pthread_mutex_unlock(&m->stats_mu);
     memset(out_view, 0, sizeof(*out_view));
     out_view->layer_id = layer_id;
 
-    const size_t align = 32;
-    size_t off = 0;
     struct {
         const struct tensor_ref *ref;
         const void **dst;
         uint32_t *dtype;
         uint64_t *size;
-    } fields[] = {
+    } fields[LAYER_N_TENSORS] = {
         { &ls->attn_norm, &out_view->attn_norm, &out_view->attn_norm_dtype, NULL },
         { &ls->attn_q, &out_view->attn_q, &out_view->attn_q_dtype, &out_view->attn_q_size },
         { &ls->attn_k, &out_view->attn_k, &out_view->attn_k_dtype, &out_view->attn_k_size },
@@ -262,59 +306,187 @@ int model_load_layer(model_handle_t *m, uint32_t layer_id, void *buffer, size_t
         { &ls->ffn_down, &out_view->ffn_down, &out_view->ffn_down_dtype, &out_view->ffn_down_size },
     };
 
-    uint64_t span_start = UINT64_MAX;
-    uint64_t span_end = 0;
-    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+    if (gguf_direct_io_align(m->gguf)) {
+        // Direct I/O: the block-rounded span lands in the buffer as is and
+        // the views skip the leading edge.
+        uint64_t start = 0, end = 0, file_start = 0, file_len = 0;
+        size_t skip = 0;
+        layer_span(ls, &start, &end);
+        if (gguf_direct_span(m->gguf, start, end - start, &file_start, &file_len, &skip) != 0 ||
+            file_len > buffer_size) {
+            return -1;
+        }
+        const uint8_t *base = (const uint8_t *)buffer + skip;
+        for (size_t i = 0; i < LAYER_N_TENSORS; ++i) {
+            const struct tensor_ref *ref = fields[i].ref;
+            *fields[i].dst = base + (ref->offset - start);
+            *fields[i].dtype = ref->dtype;
+            if (fields[i].size) {
+                *fields[i].size = ref->size;
+            }
+        }
+        segs[0].offset = file_start;
+        segs[0].size = file_len;
+        segs[0].dst = buffer;
+        *out_n_segs = 1;
+        *out_used = skip + (size_t)(end - start);
+        return 0;
+    }
+
+    const size_t align = 32;
+    size_t off = 0;
+    for (size_t i = 0; i < LAYER_N_TENSORS; ++i) {
         const struct tensor_ref *ref = fields[i].ref;
         if (ref->size == 0) {
             return -1;
         }
-        if (ref->offset < span_start) {
-            span_start = ref->offset;
-        }
-        uint64_t end = ref->offset + ref->size;
-        if (end > span_end) {
-            span_end = end;
+        off = align_up_size(off, align);
+        uint8_t *dst = (uint8_t *)buffer + off;
+        segs[i].offset = ref->offset;
+        segs[i].size = ref->size;
+        segs[i].dst = dst;
+        *fields[i].dst = dst;
+        *fields[i].dtype = ref->dtype;
+        if (fields[i].size) {
+            *fields[i].size = ref->size;
         }
+        off += (size_t)ref->size;
     }
-    if (span_start == UINT64_MAX || span_end <= span_start) {
+    *out_n_segs = LAYER_N_TENSORS;
+    *out_used = off;
+    return 0;
+}
+
+static void account_read(model_handle_t *m, uint64_t bytes, uint64_t ns, uint64_t loads) {
+    pthread_mutex_lock(&m->stats_mu);
+    m->stats.layer_bytes_read += bytes;
+    m->stats.layer_read_ns += ns;
+    m->stats.layer_loads += loads;
+    pthread_mutex_unlock(&m->stats_mu);
+}
+
+int model_load_layer(model_handle_t *m, uint32_t layer_id, void *buffer, size_t buffer_size,
+                     struct layer_view *out_view, size_t *out_used) {
+    if (!m || !buffer || !out_view || layer_id >= m->n_layers) {
         return -1;
     }
-    uint64_t span_size = span_end - span_start;
-    if (ensure_io_buf(m, (size_t)span_size) != 0) {
-        fprintf(stderr, "model_load_layer: io buf alloc failed (layer %u, size=%llu)\n",
-                layer_id, (unsigned long long)span_size);
+    struct gguf_read_seg segs[LAYER_N_TENSORS];
+    uint32_t n_segs = 0;
+    size_t used = 0;
+    if (layout_layer(m, layer_id, buffer, buffer_size, out_view, &used, segs, &n_segs) != 0) {
         return -1;
     }
-    if (gguf_read_span(m->gguf, span_start, span_size, m->layer_io_buf) != 0) {
-        fprintf(stderr, "model_load_layer: read span failed (layer %u, off=%llu size=%llu)\n",
-                layer_id, (unsigned long long)span_start, (unsigned long long)span_size);
+    uint64_t bytes_read = 0;
+    uint64_t t0 = now_ns();
+    if (gguf_direct_io_align(m->gguf)) {
+        if (gguf_read_direct(m->gguf, segs[0].offset, segs[0].size, segs[0].dst, &bytes_read) != 0) {
+            fprintf(stderr, "model_load_layer: direct read failed (layer %u)\n", layer_id);
+            return -1;
+        }
+    } else if (gguf_read_scatter(m->gguf, segs, n_segs, &bytes_read) != 0) {
+        fprintf(stderr, "model_load_layer: scatter read failed (layer %u)\n", layer_id);
         return -1;
     }
-    m->stats.layer_bytes_read += span_size;
+    account_read(m, bytes_read, now_ns() - t0, 1);
+    if (out_used) {
+        *out_used = used;
+    }
+    return 0;
+}
 
-    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
-        const struct tensor_ref *ref = fields[i].ref;
-        off = align_up_size(off, align);
-        uint8_t *dst = (uint8_t *)buffer + off;
-        uint64_t rel = ref->offset - span_start;
-        if (rel + ref->size > span_size) {
-            fprintf(stderr, "model_load_layer: span bounds error (layer %u)\n", layer_id);
-            return -1;
+// Tensors [0, LAYER_N_ATTN_TENSORS) of the field order feed attention.
+static uint32_t field_group(uint32_t field) {
+    return field < LAYER_N_ATTN_TENSORS ? LAYER_GROUP_ATTN : LAYER_GROUP_FFN;
+}
+
+// Groups whose (block-rounded) tensors overlap the absolute file range.
+static uint32_t span_groups(model_handle_t *m, const struct layer_spec *ls,
+                            uint64_t file_off, uint64_t len) {
+    const struct tensor_ref *refs[LAYER_N_TENSORS] = {
+        &ls->attn_norm, &ls->attn_q, &ls->attn_k, &ls->attn_v, &ls->attn_o,
+        &ls->ffn_norm, &ls->ffn_gate, &ls->ffn_up, &ls->ffn_down
+    };
+    uint32_t groups = 0;
+    for (uint32_t i = 0; i < LAYER_N_TENSORS; ++i) {
+        uint64_t t_start = 0, t_len = 0;
+        if (gguf_direct_span(m->gguf, refs[i]->offset, refs[i]->size, &t_start, &t_len, NULL) != 0) {
+            return LAYER_GROUP_ALL;
         }
-        memcpy(dst, (const uint8_t *)m->layer_io_buf + rel, (size_t)ref->size);
-        *fields[i].dst = dst;
-        *fields[i].dtype = ref->dtype;
-        if (fields[i].size) {
-            *fields[i].size = ref->size;
+        if (t_start < file_off + len && file_off < t_start + t_len) {
+            groups |= field_group(i);
         }
-        off += (size_t)ref->size;
     }
+    return groups;
+}
 
-    m->stats.layer_loads += 1;
+int model_plan_layer(model_handle_t *m, uint32_t layer_id, void *buffer, size_t buffer_size,
+                     struct layer_view *out_view, size_t *out_used, size_t chunk_size,
+                     struct layer_read_chunk *chunks, uint32_t max_chunks, uint32_t *out_n_chunks) {
+    if (!m || !buffer || !out_view || !chunks || !out_n_chunks || layer_id >= m->n_layers) {
+        return -1;
+    }
+    size_t align = model_get_buffer_alignment(m);
+    chunk_size = chunk_size / align * align;
+    if (chunk_size == 0) {
+        chunk_size = align;
+    }
+    struct gguf_read_seg segs[LAYER_N_TENSORS];
+    uint32_t n_segs = 0;
+    size_t used = 0;
+    if (layout_layer(m, layer_id, buffer, buffer_size, out_view, &used, segs, &n_segs) != 0) {
+        return -1;
+    }
+    const struct layer_spec *ls = &m->layers[layer_id];
+    const int direct = gguf_direct_io_align(m->gguf) != 0;
+    uint32_t n = 0;
+    // Two passes: chunks the attention half needs go first, so it becomes
+    // ready while the FFN bytes are still on their way.
+    for (int pass = 0; pass < 2; ++pass) {
+        for (uint32_t i = 0; i < n_segs; ++i) {
+            for (uint64_t off = 0; off < segs[i].size; off += chunk_size) {
+                uint64_t len = segs[i].size - off;
+                if (len > chunk_size) {
+                    len = chunk_size;
+                }
+                uint32_t groups = direct ? span_groups(m, ls, segs[i].offset + off, len)
+                                         : field_group(i);
+                if (((groups & LAYER_GROUP_ATTN) != 0) != (pass == 0)) {
+                    continue;
+                }
+                if (n == max_chunks) {
+                    return -1;
+                }
+                chunks[n].offset = segs[i].offset + off;
+                chunks[n].size = len;
+                chunks[n].dst = (uint8_t *)segs[i].dst + off;
+                chunks[n].groups = groups;
+                n++;
+            }
+        }
+    }
+    account_read(m, 0, 0, 1);
+    *out_n_chunks = n;
     if (out_used) {
-        *out_used = off;
+        *out_used = used;
+    }
+    return 0;
+}
+
+int model_read_chunk(model_handle_t *m, const struct layer_read_chunk *c) {
+    if (!m || !c || !c->dst || c->size == 0) {
+        return -1;
+    }
+    uint64_t bytes_read = c->size;
+    int rc;
+    if (gguf_direct_io_align(m->gguf)) {
+        rc = gguf_read_direct(m->gguf, c->offset, c->size, c->dst, &bytes_read);
+    } else {
+        rc = gguf_read_span(m->gguf, c->offset, c->size, c->dst);
+    }
+    if (rc != 0) {
+        return -1;
     }
+    account_read(m, bytes_read, 0, 0);
     return 0;
 }
 
@@ -326,6 +498,15 @@ int model_get_resident(model_handle_t *m, struct resident_tensors *out) {
     return 0;
 }
 
+int model_get_resident_size(model_handle_t *m, size_t *out) {
+    if (!m || !out) {
+        return -1;
+    }
+    *out = (size_t)(m->resident_spec.token_embd.size + m->resident_spec.output_norm.size +
+                    m->resident_spec.lm_head.size);
+    return 0;
+}
+
 int model_get_info(model_handle_t *m, struct model_info *out) {
     if (!m || !out) {
         return -1;
@@ -363,10 +544,11 @@ int model_get_layer_view(model_handle_t *m, uint32_t layer_id, const struct laye
         return -1;
     }
     if (m->layer_buf_size < need) {
-        void *nbuf = realloc(m->layer_buf, need);
-        if (!nbuf) {
+        void *nbuf = NULL;
+        if (posix_memalign(&nbuf, model_get_buffer_alignment(m), need) != 0) {
             return -1;
         }
+        free(m->layer_buf);
         m->layer_buf = nbuf;
         m->layer_buf_size = need;
     }
@@ -411,7 +593,9 @@ int model_get_streaming_stats(model_handle_t *m, struct streaming_stats *out) {
     if (!m || !out) {
         return -1;
     }
+    pthread_mutex_lock(&m->stats_mu);
     *out = m->stats;
+    pthread_mutex_unlock(&m->stats_mu);
     return 0;
 }
 
@@ -419,9 +603,11 @@ int model_update_peak_rss(model_handle_t *m, size_t rss_bytes) {
     if (!m) {
         return -1;
     }
+    pthread_mutex_lock(&m->stats_mu);
     if (rss_bytes > m->stats.peak_rss) {
         m->stats.peak_rss = rss_bytes;
     }
+    pthread_mutex_unlock(&m->stats_mu);
     return 0;
 }
 
@@ -544,7 +730,7 @@ void model_close(model_handle_t *m) {
     gguf_close(m->gguf);
     resident_clear(&m->resident_loaded);
     free(m->layer_buf);
-    free(m->layer_io_buf);
     free(m->layers);
+    pthread_mutex_destroy(&m->stats_mu);
     free(m);
 }
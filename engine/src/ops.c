@@ -1,6 +1,10 @@
 #include "ops.h"
+#include "kv_cache.h"
+#include "ops_x86.h"
+#include "thread_pool.h"
 
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
@@ -30,6 +34,13 @@ struct q8_block {
     int8_t data[32];
 };
 
+// Q4_0 KV group: value i is the low nibble of data[i] for i < 16 and the high
+// nibble of data[i - 16] otherwise, stored with a +8 offset.
+struct q4_block {
+    float scale;
+    uint8_t data[16];
+};
+
 #define QK_K 256
 #define K_SCALE_SIZE 12
 
@@ -55,6 +66,12 @@ struct block_q6_k {
     uint16_t d;
 };
 
+struct block_q8_k {
+    float d;
+    int8_t qs[QK_K];
+    int16_t bsums[QK_K / 16];
+};
+
 static float half_to_float(uint16_t h) {
     uint16_t h_exp = (h & 0x7C00u);
     uint16_t h_sig = (h & 0x03FFu);
@@ -192,6 +209,225 @@ static void dequantize_row_q6_k(const struct block_q6_k *x, float *y, uint32_t k
     }
 }
 
+typedef float (*vec_dot_k_fn)(const void *blocks, const float *x, uint32_t nb);
+typedef void (*dequant_block_fn)(const void *blk, float *y);
+typedef void (*dot_cols_fn)(const float *w, const float *b, uint64_t ldb,
+                            float *acc, uint32_t n);
+typedef float (*vec_dot_q8_k_fn)(const void *blocks, const void *y_q8k, uint32_t nb);
+typedef void (*quantize_groups_fn)(const float *x, void *y, uint32_t nb);
+
+// CPU fast paths picked once from cpuid. NULL entries fall back to the scalar
+// dequantize + dot reference code.
+struct cpu_kernels {
+    const char *name;
+    vec_dot_k_fn dot_q4_k;
+    vec_dot_k_fn dot_q5_k;
+    vec_dot_k_fn dot_q6_k;
+    dequant_block_fn dequant_q4_k;
+    dequant_block_fn dequant_q5_k;
+    dequant_block_fn dequant_q6_k;
+    dot_cols_fn dot_cols_256;
+    vec_dot_q8_k_fn dot_q4_k_q8_k;
+    vec_dot_q8_k_fn dot_q5_k_q8_k;
+    vec_dot_q8_k_fn dot_q6_k_q8_k;
+    quantize_groups_fn quantize_q8_0;
+    quantize_groups_fn quantize_q4_0;
+};
+
+static struct cpu_kernels cpu_kernels_table;
+// Pool workers and the KV cache's compaction thread may be first to ask.
+static pthread_once_t cpu_kernels_once = PTHREAD_ONCE_INIT;
+
+static void cpu_kernels_init(void) {
+    struct cpu_kernels k;
+    memset(&k, 0, sizeof(k));
+    k.name = "scalar";
+    int level = x86_simd_detect();
+    const char *env = getenv("SHUKUCHI_SIMD");
+    if (env && env[0] != '\0') {
+        if (env[0] == '0' || strcmp(env, "scalar") == 0) {
+            level = X86_SIMD_NONE;
+        } else if (strcmp(env, "avx2") == 0 && level > X86_SIMD_AVX2) {
+            level = X86_SIMD_AVX2;
+        }
+    }
+#if defined(OPS_X86_SIMD)
+    if (level == X86_SIMD_AVX512) {
+        k.name = "avx512";
+        k.dot_q4_k = x86_avx512_dot_q4_k;
+        k.dot_q5_k = x86_avx512_dot_q5_k;
+        k.dot_q6_k = x86_avx512_dot_q6_k;
+        k.dequant_q4_k = x86_avx2_dequant_q4_k;
+        k.dequant_q5_k = x86_avx2_dequant_q5_k;
+        k.dequant_q6_k = x86_avx2_dequant_q6_k;
+        k.dot_cols_256 = x86_avx512_dot_cols_256;
+        k.dot_q4_k_q8_k = x86_avx2_dot_q4_k_q8_k;
+        k.dot_q5_k_q8_k = x86_avx2_dot_q5_k_q8_k;
+        k.dot_q6_k_q8_k = x86_avx2_dot_q6_k_q8_k;
+        k.quantize_q8_0 = x86_avx2_quantize_q8_0;
+        k.quantize_q4_0 = x86_avx2_quantize_q4_0;
+    } else if (level == X86_SIMD_AVX2) {
+        k.name = "avx2";
+        k.dot_q4_k = x86_avx2_dot_q4_k;
+        k.dot_q5_k = x86_avx2_dot_q5_k;
+        k.dot_q6_k = x86_avx2_dot_q6_k;
+        k.dequant_q4_k = x86_avx2_dequant_q4_k;
+        k.dequant_q5_k = x86_avx2_dequant_q5_k;
+        k.dequant_q6_k = x86_avx2_dequant_q6_k;
+        k.dot_cols_256 = x86_avx2_dot_cols_256;
+        k.dot_q4_k_q8_k = x86_avx2_dot_q4_k_q8_k;
+        k.dot_q5_k_q8_k = x86_avx2_dot_q5_k_q8_k;
+        k.dot_q6_k_q8_k = x86_avx2_dot_q6_k_q8_k;
+        k.quantize_q8_0 = x86_avx2_quantize_q8_0;
+        k.quantize_q4_0 = x86_avx2_quantize_q4_0;
+    }
+#else
+    (void)level;
+#endif
+    cpu_kernels_table = k;
+}
+
+static const struct cpu_kernels *cpu_kernels(void) {
+    pthread_once(&cpu_kernels_once, cpu_kernels_init);
+    return &cpu_kernels_table;
+}
+
+const char *op_cpu_kernels_name(void) {
+    return cpu_kernels()->name;
+}
+
+static void quantize_q8_0_ref(const float *x, void *y, uint32_t nb) {
+    struct q8_block *out = (struct q8_block *)y;
+    for (uint32_t b = 0; b < nb; ++b, x += 32) {
+        float max_abs = 0.0f;
+        for (uint32_t i = 0; i < 32u; ++i) {
+            float a = fabsf(x[i]);
+            max_abs = a > max_abs ? a : max_abs;
+        }
+        float scale = max_abs / 127.0f;
+        if (scale == 0.0f) {
+            scale = 1.0f;
+        }
+        out[b].scale = scale;
+        for (uint32_t i = 0; i < 32u; ++i) {
+            long q = lrintf(x[i] / scale);
+            out[b].data[i] = (int8_t)(q > 127 ? 127 : q < -127 ? -127 : q);
+        }
+    }
+}
+
+// Scale from the largest-magnitude value, signed so that it lands on -8 and
+// the full [-8, 7] range is used.
+static void quantize_q4_0_ref(const float *x, void *y, uint32_t nb) {
+    struct q4_block *out = (struct q4_block *)y;
+    for (uint32_t b = 0; b < nb; ++b, x += 32) {
+        float mx = -INFINITY, mn = INFINITY;
+        for (uint32_t i = 0; i < 32u; ++i) {
+            mx = x[i] > mx ? x[i] : mx;
+            mn = x[i] < mn ? x[i] : mn;
+        }
+        float d = (mx >= -mn ? mx : mn) / -8.0f;
+        if (d == 0.0f) {
+            d = 1.0f;
+        }
+        out[b].scale = d;
+        uint8_t q[32];
+        for (uint32_t i = 0; i < 32u; ++i) {
+            long v = lrintf(x[i] / d);
+            q[i] = (uint8_t)((v > 7 ? 7 : v < -8 ? -8 : v) + 8);
+        }
+        for (uint32_t i = 0; i < 16u; ++i) {
+            out[b].data[i] = (uint8_t)(q[i] | (q[i + 16] << 4));
+        }
+    }
+}
+
+static void dequant_q4_row(const struct q4_block *row, uint32_t n, float *out) {
+    for (uint32_t b = 0; b * 32u < n; ++b) {
+        float v[32];
+        for (uint32_t i = 0; i < 16u; ++i) {
+            v[i] = (float)((int)(row[b].data[i] & 15u) - 8) * row[b].scale;
+            v[i + 16] = (float)((int)(row[b].data[i] >> 4) - 8) * row[b].scale;
+        }
+        uint32_t cnt = n - b * 32u < 32u ? n - b * 32u : 32u;
+        memcpy(out + b * 32u, v, cnt * sizeof(float));
+    }
+}
+
+// KV_F16 rows only ever hold normal halves and signed zeros: values below
+// the smallest normal flush to zero and large ones saturate, so widening is
+// a shift and a rebias the compiler can vectorize.
+static uint16_t kv_float_to_half(float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000u);
+    float a = fabsf(x);
+    if (!(a >= 6.103515625e-05f)) {
+        return sign;
+    }
+    if (a >= 65504.0f) {
+        return sign | 0x7BFFu;
+    }
+    uint32_t m;
+    memcpy(&m, &a, sizeof(m));
+    m += 0x0FFFu + ((m >> 13) & 1u);  // round to nearest even
+    uint32_t h = (m >> 13) - ((127u - 15u) << 10);
+    return sign | (uint16_t)(h > 0x7BFFu ? 0x7BFFu : h);
+}
+
+static inline float kv_half_to_float(uint16_t h) {
+    uint32_t mag = h & 0x7FFFu;
+    uint32_t bits = ((uint32_t)(h & 0x8000u) << 16) | (mag ? (mag << 13) + ((127u - 15u) << 23) : 0u);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+size_t op_kv_row_size(uint32_t kv_quant, uint32_t n) {
+    if (kv_quant == KV_F16) {
+        return (size_t)n * sizeof(uint16_t);
+    }
+    size_t group = kv_quant == KV_Q4_0 ? sizeof(struct q4_block) : sizeof(struct q8_block);
+    return (size_t)((n + 31u) / 32u) * group;
+}
+
+void op_quantize_kv_row(uint32_t kv_quant, const float *x, void *y, uint32_t n) {
+    if (kv_quant == KV_F16) {
+        uint16_t *h = (uint16_t *)y;
+        for (uint32_t i = 0; i < n; ++i) {
+            h[i] = kv_float_to_half(x[i]);
+        }
+        return;
+    }
+    const struct cpu_kernels *kern = cpu_kernels();
+    quantize_groups_fn fn = kv_quant == KV_Q4_0
+        ? (kern->quantize_q4_0 ? kern->quantize_q4_0 : quantize_q4_0_ref)
+        : (kern->quantize_q8_0 ? kern->quantize_q8_0 : quantize_q8_0_ref);
+    uint32_t full = n / 32u;
+    if (full) {
+        fn(x, y, full);
+    }
+    if (n % 32u) {
+        // Zero-pad the last group.
+        float tail[32] = {0};
+        memcpy(tail, x + full * 32u, (n % 32u) * sizeof(float));
+        fn(tail, (uint8_t *)y + op_kv_row_size(kv_quant, full * 32u), 1);
+    }
+}
+
+void op_dequantize_kv_row(uint32_t kv_quant, const void *x, float *y, uint32_t n) {
+    if (kv_quant == KV_F16) {
+        const uint16_t *h = (const uint16_t *)x;
+        for (uint32_t i = 0; i < n; ++i) {
+            y[i] = kv_half_to_float(h[i]);
+        }
+    } else if (kv_quant == KV_Q4_0) {
+        dequant_q4_row((const struct q4_block *)x, n, y);
+    } else {
+        dequant_q8_row((const struct q8_block *)x, n, y);
+    }
+}
+
 int op_rmsnorm(const struct op_context *ctx, const float *x, const float *w, float *y,
                uint32_t n, uint32_t d) {
     (void)ctx;
@@ -263,10 +499,108 @@ int op_matmul_q8_0(const struct op_context *ctx,
     return 0;
 }
 
+// Runs fn on every thread of the context's pool, or inline without one.
+static void op_parallel(const struct op_context *ctx, thread_pool_fn fn, void *arg) {
+    thread_pool_run(ctx ? ctx->pool : NULL, fn, arg);
+}
+
+static uint32_t op_n_threads(const struct op_context *ctx) {
+    return thread_pool_size(ctx ? ctx->pool : NULL);
+}
+
+// Contiguous share [*begin, *end) of n items for thread ith of nth.
+static void split_range(uint32_t n, uint32_t ith, uint32_t nth, uint32_t *begin, uint32_t *end) {
+    *begin = (uint32_t)((uint64_t)n * ith / nth);
+    *end = (uint32_t)((uint64_t)n * (ith + 1) / nth);
+}
+
+// Scalar dequantize + dot references, used when no SIMD kernel is selected.
+static float vec_dot_q4_k_ref(const void *blocks, const float *x, uint32_t nb) {
+    const struct block_q4_k *bl = (const struct block_q4_k *)blocks;
+    float tmp[QK_K];
+    float sum = 0.0f;
+    for (uint32_t b = 0; b < nb; ++b) {
+        dequantize_row_q4_k(&bl[b], tmp, QK_K);
+        const float *bv = x + (uint64_t)b * QK_K;
+        for (uint32_t i = 0; i < QK_K; ++i) {
+            sum += tmp[i] * bv[i];
+        }
+    }
+    return sum;
+}
+
+static float vec_dot_q5_k_ref(const void *blocks, const float *x, uint32_t nb) {
+    const struct block_q5_k *bl = (const struct block_q5_k *)blocks;
+    float tmp[QK_K];
+    float sum = 0.0f;
+    for (uint32_t b = 0; b < nb; ++b) {
+        dequantize_row_q5_k(&bl[b], tmp, QK_K);
+        const float *bv = x + (uint64_t)b * QK_K;
+        for (uint32_t i = 0; i < QK_K; ++i) {
+            sum += tmp[i] * bv[i];
+        }
+    }
+    return sum;
+}
+
+static float vec_dot_q6_k_ref(const void *blocks, const float *x, uint32_t nb) {
+    const struct block_q6_k *bl = (const struct block_q6_k *)blocks;
+    float tmp[QK_K];
+    float sum = 0.0f;
+    for (uint32_t b = 0; b < nb; ++b) {
+        dequantize_row_q6_k(&bl[b], tmp, QK_K);
+        const float *bv = x + (uint64_t)b * QK_K;
+        for (uint32_t i = 0; i < QK_K; ++i) {
+            sum += tmp[i] * bv[i];
+        }
+    }
+    return sum;
+}
+
+struct gemv_job {
+    vec_dot_k_fn dot;
+    const uint8_t *a;
+    size_t row_bytes;
+    const float *x;
+    float *c;
+    uint32_t m;
+    uint32_t nb;
+};
+
+static void gemv_worker(void *arg, uint32_t ith, uint32_t nth) {
+    const struct gemv_job *job = (const struct gemv_job *)arg;
+    uint32_t begin, end;
+    split_range(job->m, ith, nth, &begin, &end);
+    for (uint32_t row = begin; row < end; ++row) {
+        job->c[row] = job->dot(job->a + (uint64_t)row * job->row_bytes, job->x, job->nb);
+    }
+}
+
+// c[row] = dot(a[row], x), rows split across the pool.
+static int matmul_k_quant_gemv(const struct op_context *ctx, const void *a, size_t block_bytes,
+                               vec_dot_k_fn dot, const float *x, float *c,
+                               uint32_t m, uint32_t k) {
+    if (!a || !x || !c) {
+        return -1;
+    }
+    if (k == 0 || (k % QK_K) != 0) {
+        return -1;
+    }
+    struct gemv_job job;
+    job.dot = dot;
+    job.a = (const uint8_t *)a;
+    job.nb = k / QK_K;
+    job.row_bytes = (size_t)job.nb * block_bytes;
+    job.x = x;
+    job.c = c;
+    job.m = m;
+    op_parallel(ctx, gemv_worker, &job);
+    return 0;
+}
+
 int op_matmul_q4_k(const struct op_context *ctx,
                    const void *a_q4k, const float *b_f32, float *c,
                    uint32_t m, uint32_t k) {
-    (void)ctx;
 #if defined(__APPLE__)
     static void *metal_ctx = NULL;
     static int metal_ready = 0;
@@ -286,37 +620,17 @@ int op_matmul_q4_k(const struct op_context *ctx,
         metal_note_cpu_fallback();
     }
 #endif
-    if (!a_q4k || !b_f32 || !c) {
-        return -1;
-    }
-    if (k == 0 || (k % QK_K) != 0) {
-        return -1;
-    }
-    uint32_t nb = k / QK_K;
 #if defined(__APPLE__)
     metal_note_cpu_fallback();
 #endif
-    const struct block_q4_k *a = (const struct block_q4_k *)a_q4k;
-    float tmp[QK_K];
-    for (uint32_t row = 0; row < m; ++row) {
-        float sum = 0.0f;
-        const struct block_q4_k *row_blocks = a + (uint64_t)row * nb;
-        for (uint32_t b = 0; b < nb; ++b) {
-            dequantize_row_q4_k(&row_blocks[b], tmp, QK_K);
-            const float *bv = b_f32 + (uint64_t)b * QK_K;
-            for (uint32_t i = 0; i < QK_K; ++i) {
-                sum += tmp[i] * bv[i];
-            }
-        }
-        c[row] = sum;
-    }
-    return 0;
+    vec_dot_k_fn dot = cpu_kernels()->dot_q4_k;
+    return matmul_k_quant_gemv(ctx, a_q4k, sizeof(struct block_q4_k),
+                               dot ? dot : vec_dot_q4_k_ref, b_f32, c, m, k);
 }
 
 int op_matmul_q5_k(const struct op_context *ctx,
                    const void *a_q5k, const float *b_f32, float *c,
                    uint32_t m, uint32_t k) {
-    (void)ctx;
 #if defined(__APPLE__)
     static void *metal_ctx = NULL;
     static int metal_ready = 0;
@@ -334,34 +648,14 @@ int op_matmul_q5_k(const struct op_context *ctx,
         }
     }
 #endif
-    if (!a_q5k || !b_f32 || !c) {
-        return -1;
-    }
-    if (k == 0 || (k % QK_K) != 0) {
-        return -1;
-    }
-    uint32_t nb = k / QK_K;
-    const struct block_q5_k *a = (const struct block_q5_k *)a_q5k;
-    float tmp[QK_K];
-    for (uint32_t row = 0; row < m; ++row) {
-        float sum = 0.0f;
-        const struct block_q5_k *row_blocks = a + (uint64_t)row * nb;
-        for (uint32_t b = 0; b < nb; ++b) {
-            dequantize_row_q5_k(&row_blocks[b], tmp, QK_K);
-            const float *bv = b_f32 + (uint64_t)b * QK_K;
-            for (uint32_t i = 0; i < QK_K; ++i) {
-                sum += tmp[i] * bv[i];
-            }
-        }
-        c[row] = sum;
-    }
-    return 0;
+    vec_dot_k_fn dot = cpu_kernels()->dot_q5_k;
+    return matmul_k_quant_gemv(ctx, a_q5k, sizeof(struct block_q5_k),
+                               dot ? dot : vec_dot_q5_k_ref, b_f32, c, m, k);
 }
 
 int op_matmul_q6_k(const struct op_context *ctx,
                    const void *a_q6k, const float *b_f32, float *c,
                    uint32_t m, uint32_t k) {
-    (void)ctx;
 #if defined(__APPLE__)
     static void *metal_ctx = NULL;
     static int metal_ready = 0;
@@ -379,57 +673,511 @@ int op_matmul_q6_k(const struct op_context *ctx,
         }
     }
 #endif
-    if (!a_q6k || !b_f32 || !c) {
+    vec_dot_k_fn dot = cpu_kernels()->dot_q6_k;
+    return matmul_k_quant_gemv(ctx, a_q6k, sizeof(struct block_q6_k),
+                               dot ? dot : vec_dot_q6_k_ref, b_f32, c, m, k);
+}
+
+// GEMM columns that share one dequantized super-block in registers.
+#define GEMM_COL_BLOCK 4
+
+static void dequant_block_q4_k(const void *blk, float *y) {
+    dequantize_row_q4_k((const struct block_q4_k *)blk, y, QK_K);
+}
+
+static void dequant_block_q5_k(const void *blk, float *y) {
+    dequantize_row_q5_k((const struct block_q5_k *)blk, y, QK_K);
+}
+
+static void dequant_block_q6_k(const void *blk, float *y) {
+    dequantize_row_q6_k((const struct block_q6_k *)blk, y, QK_K);
+}
+
+struct gemm_job {
+    const uint8_t *a;
+    size_t block_bytes;
+    dequant_block_fn dequant;
+    dot_cols_fn dot_cols;
+    const float *b;
+    float *c;
+    float *acc;   // n floats per thread
+    uint32_t m;
+    uint32_t ldc;  // distance between output columns of c
+    uint32_t n;
+    uint32_t k;
+};
+
+static void gemm_worker(void *arg, uint32_t ith, uint32_t nth) {
+    const struct gemm_job *job = (const struct gemm_job *)arg;
+    const uint32_t n = job->n;
+    const uint32_t k = job->k;
+    const uint32_t nb = k / QK_K;
+    float *acc = job->acc + (size_t)ith * n;
+    float tmp[QK_K];
+    uint32_t begin, end;
+    split_range(job->m, ith, nth, &begin, &end);
+    for (uint32_t row = begin; row < end; ++row) {
+        const uint8_t *row_blocks = job->a + (uint64_t)row * nb * job->block_bytes;
+        memset(acc, 0, (size_t)n * sizeof(float));
+        for (uint32_t blk = 0; blk < nb; ++blk) {
+            job->dequant(row_blocks + (uint64_t)blk * job->block_bytes, tmp);
+            const float *bb = job->b + (uint64_t)blk * QK_K;
+            if (job->dot_cols) {
+                job->dot_cols(tmp, bb, k, acc, n);
+                continue;
+            }
+            uint32_t j = 0;
+            for (; j + GEMM_COL_BLOCK <= n; j += GEMM_COL_BLOCK) {
+                const float *b0 = bb + (uint64_t)(j + 0) * k;
+                const float *b1 = bb + (uint64_t)(j + 1) * k;
+                const float *b2 = bb + (uint64_t)(j + 2) * k;
+                const float *b3 = bb + (uint64_t)(j + 3) * k;
+                float s0 = acc[j + 0];
+                float s1 = acc[j + 1];
+                float s2 = acc[j + 2];
+                float s3 = acc[j + 3];
+                for (uint32_t i = 0; i < QK_K; ++i) {
+                    float w = tmp[i];
+                    s0 += w * b0[i];
+                    s1 += w * b1[i];
+                    s2 += w * b2[i];
+                    s3 += w * b3[i];
+                }
+                acc[j + 0] = s0;
+                acc[j + 1] = s1;
+                acc[j + 2] = s2;
+                acc[j + 3] = s3;
+            }
+            for (; j < n; ++j) {
+                const float *bv = bb + (uint64_t)j * k;
+                float s = acc[j];
+                for (uint32_t i = 0; i < QK_K; ++i) {
+                    s += tmp[i] * bv[i];
+                }
+                acc[j] = s;
+            }
+        }
+        for (uint32_t j = 0; j < n; ++j) {
+            job->c[(uint64_t)j * job->ldc + row] = acc[j];
+        }
+    }
+}
+
+// c[j * m + row] = dot(a[row], b[j]) for n activation rows b[j] of length k.
+// Each super-block is dequantized once and then dotted against all n columns,
+// GEMM_COL_BLOCK at a time, so the dequant cost is shared by the whole batch.
+// With the scalar kernels, per-column accumulation order matches the GEMV
+// kernels exactly. Rows are split across the pool.
+static int matmul_k_quant_gemm(const struct op_context *ctx,
+                               const void *a, size_t block_bytes, dequant_block_fn dequant,
+                               const float *b, float *c, uint32_t m, uint32_t ldc,
+                               uint32_t n, uint32_t k) {
+    if (!a || !b || !c || n == 0) {
+        return -1;
+    }
+    if (k == 0 || (k % QK_K) != 0) {
+        return -1;
+    }
+    struct gemm_job job;
+    job.acc = (float *)malloc((size_t)n * op_n_threads(ctx) * sizeof(float));
+    if (!job.acc) {
+        return -1;
+    }
+    job.a = (const uint8_t *)a;
+    job.block_bytes = block_bytes;
+    job.dequant = dequant;
+    job.dot_cols = cpu_kernels()->dot_cols_256;
+    job.b = b;
+    job.c = c;
+    job.m = m;
+    job.ldc = ldc;
+    job.n = n;
+    job.k = k;
+    op_parallel(ctx, gemm_worker, &job);
+    free(job.acc);
+    return 0;
+}
+
+int op_matmul_q4_k_gemm(const struct op_context *ctx,
+                        const void *a_q4k, const float *b_f32, float *c,
+                        uint32_t m, uint32_t n, uint32_t k) {
+#if defined(__APPLE__)
+    if (metal_enabled()) {
+        for (uint32_t j = 0; j < n; ++j) {
+            if (op_matmul_q4_k(ctx, a_q4k, b_f32 + (uint64_t)j * k, c + (uint64_t)j * m, m, k) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+#endif
+    dequant_block_fn dequant = cpu_kernels()->dequant_q4_k;
+    return matmul_k_quant_gemm(ctx, a_q4k, sizeof(struct block_q4_k),
+                               dequant ? dequant : dequant_block_q4_k,
+                               b_f32, c, m, m, n, k);
+}
+
+int op_matmul_q5_k_gemm(const struct op_context *ctx,
+                        const void *a_q5k, const float *b_f32, float *c,
+                        uint32_t m, uint32_t n, uint32_t k) {
+#if defined(__APPLE__)
+    if (metal_enabled()) {
+        for (uint32_t j = 0; j < n; ++j) {
+            if (op_matmul_q5_k(ctx, a_q5k, b_f32 + (uint64_t)j * k, c + (uint64_t)j * m, m, k) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+#endif
+    dequant_block_fn dequant = cpu_kernels()->dequant_q5_k;
+    return matmul_k_quant_gemm(ctx, a_q5k, sizeof(struct block_q5_k),
+                               dequant ? dequant : dequant_block_q5_k,
+                               b_f32, c, m, m, n, k);
+}
+
+int op_matmul_q6_k_gemm(const struct op_context *ctx,
+                        const void *a_q6k, const float *b_f32, float *c,
+                        uint32_t m, uint32_t n, uint32_t k) {
+#if defined(__APPLE__)
+    if (metal_enabled()) {
+        for (uint32_t j = 0; j < n; ++j) {
+            if (op_matmul_q6_k(ctx, a_q6k, b_f32 + (uint64_t)j * k, c + (uint64_t)j * m, m, k) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+#endif
+    dequant_block_fn dequant = cpu_kernels()->dequant_q6_k;
+    return matmul_k_quant_gemm(ctx, a_q6k, sizeof(struct block_q6_k),
+                               dequant ? dequant : dequant_block_q6_k,
+                               b_f32, c, m, m, n, k);
+}
+
+size_t op_q8_k_row_size(uint32_t k) {
+    return (size_t)(k / QK_K) * sizeof(struct block_q8_k);
+}
+
+// Symmetric per-block quantization to [-127, 127]; bsums keeps the sum of
+// each 16-value group for the min/offset terms of the K-quant dots.
+int op_quantize_q8_k(const struct op_context *ctx, const float *x, void *y_q8k,
+                     uint32_t n, uint32_t k) {
+    (void)ctx;
+    if (!x || !y_q8k) {
         return -1;
     }
     if (k == 0 || (k % QK_K) != 0) {
         return -1;
     }
     uint32_t nb = k / QK_K;
-    const struct block_q6_k *a = (const struct block_q6_k *)a_q6k;
-    float tmp[QK_K];
-    for (uint32_t row = 0; row < m; ++row) {
-        float sum = 0.0f;
-        const struct block_q6_k *row_blocks = a + (uint64_t)row * nb;
-        for (uint32_t b = 0; b < nb; ++b) {
-            dequantize_row_q6_k(&row_blocks[b], tmp, QK_K);
-            const float *bv = b_f32 + (uint64_t)b * QK_K;
-            for (uint32_t i = 0; i < QK_K; ++i) {
-                sum += tmp[i] * bv[i];
+    struct block_q8_k *y = (struct block_q8_k *)y_q8k;
+    for (uint64_t b = 0; b < (uint64_t)n * nb; ++b) {
+        const float *xb = x + b * QK_K;
+        float amax = 0.0f;
+        for (uint32_t i = 0; i < QK_K; ++i) {
+            float av = fabsf(xb[i]);
+            if (av > amax) {
+                amax = av;
             }
         }
-        c[row] = sum;
+        if (amax == 0.0f) {
+            memset(&y[b], 0, sizeof(y[b]));
+            continue;
+        }
+        const float iscale = 127.0f / amax;
+        for (uint32_t i = 0; i < QK_K; ++i) {
+            long v = lrintf(xb[i] * iscale);
+            y[b].qs[i] = (int8_t)(v > 127 ? 127 : (v < -127 ? -127 : v));
+        }
+        for (uint32_t g = 0; g < QK_K / 16; ++g) {
+            int32_t sum = 0;
+            for (uint32_t i = 0; i < 16; ++i) {
+                sum += y[b].qs[g * 16 + i];
+            }
+            y[b].bsums[g] = (int16_t)sum;
+        }
+        y[b].d = 1.0f / iscale;
     }
     return 0;
 }
 
-int op_attention(const struct op_context *ctx, const float *q,
-                 const float *k, const float *v, float *out,
-                 uint32_t n_heads, uint32_t n_kv_heads, uint32_t head_dim,
-                 uint32_t seq_len, float scale, const float *mask) {
-    (void)ctx;
-    if (!q || !k || !v || !out || head_dim == 0 || n_heads == 0 || seq_len == 0) {
+static float vec_dot_q4_k_q8_k_ref(const void *blocks, const void *y_q8k, uint32_t nb) {
+    const struct block_q4_k *x = (const struct block_q4_k *)blocks;
+    const struct block_q8_k *y = (const struct block_q8_k *)y_q8k;
+    float sum = 0.0f;
+    for (uint32_t i = 0; i < nb; ++i) {
+        const uint8_t *q = x[i].qs;
+        const int8_t *a = y[i].qs;
+        int32_t sumi = 0;
+        int32_t summ = 0;
+        for (int j = 0; j < 4; ++j) {
+            uint8_t sc1, m1, sc2, m2;
+            get_scale_min_k4(2 * j + 0, x[i].scales, &sc1, &m1);
+            get_scale_min_k4(2 * j + 1, x[i].scales, &sc2, &m2);
+            int32_t s1 = 0;
+            int32_t s2 = 0;
+            for (int l = 0; l < 32; ++l) {
+                s1 += (q[l] & 0xF) * a[l];
+                s2 += (q[l] >> 4) * a[32 + l];
+            }
+            sumi += sc1 * s1 + sc2 * s2;
+            summ += m1 * (y[i].bsums[4 * j + 0] + y[i].bsums[4 * j + 1]);
+            summ += m2 * (y[i].bsums[4 * j + 2] + y[i].bsums[4 * j + 3]);
+            q += 32;
+            a += 64;
+        }
+        sum += y[i].d * (half_to_float(x[i].d) * (float)sumi -
+                         half_to_float(x[i].dmin) * (float)summ);
+    }
+    return sum;
+}
+
+static float vec_dot_q5_k_q8_k_ref(const void *blocks, const void *y_q8k, uint32_t nb) {
+    const struct block_q5_k *x = (const struct block_q5_k *)blocks;
+    const struct block_q8_k *y = (const struct block_q8_k *)y_q8k;
+    float sum = 0.0f;
+    for (uint32_t i = 0; i < nb; ++i) {
+        int32_t sumi = 0;
+        int32_t summ = 0;
+        for (uint32_t sb = 0; sb < 8; ++sb) {
+            uint8_t sc, m;
+            get_scale_min_k4((int)sb, x[i].scales, &sc, &m);
+            int32_t s = 0;
+            for (uint32_t l = 0; l < 32; ++l) {
+                uint32_t idx = sb * 32 + l;
+                int32_t ql = (idx & 1u) ? (x[i].qs[idx / 2] >> 4) : (x[i].qs[idx / 2] & 0xF);
+                int32_t qh = (x[i].qh[idx / 8] >> (idx & 7u)) & 0x1;
+                s += (ql | (qh << 4)) * y[i].qs[idx];
+            }
+            sumi += sc * s;
+            summ += m * (y[i].bsums[2 * sb + 0] + y[i].bsums[2 * sb + 1]);
+        }
+        sum += y[i].d * (half_to_float(x[i].d) * (float)sumi -
+                         half_to_float(x[i].dmin) * (float)summ);
+    }
+    return sum;
+}
+
+static float vec_dot_q6_k_q8_k_ref(const void *blocks, const void *y_q8k, uint32_t nb) {
+    const struct block_q6_k *x = (const struct block_q6_k *)blocks;
+    const struct block_q8_k *y = (const struct block_q8_k *)y_q8k;
+    float sum = 0.0f;
+    for (uint32_t i = 0; i < nb; ++i) {
+        int8_t qv[QK_K];
+        const uint8_t *ql = x[i].ql;
+        const uint8_t *qh = x[i].qh;
+        for (uint32_t n = 0; n < QK_K; n += 128) {
+            for (uint32_t l = 0; l < 32; ++l) {
+                qv[n + l +  0] = (int8_t)((ql[l +  0] & 0xF) | (((qh[l] >> 0) & 3) << 4)) - 32;
+                qv[n + l + 32] = (int8_t)((ql[l + 32] & 0xF) | (((qh[l] >> 2) & 3) << 4)) - 32;
+                qv[n + l + 64] = (int8_t)((ql[l +  0] >> 4) | (((qh[l] >> 4) & 3) << 4)) - 32;
+                qv[n + l + 96] = (int8_t)((ql[l + 32] >> 4) | (((qh[l] >> 6) & 3) << 4)) - 32;
+            }
+            ql += 64;
+            qh += 32;
+        }
+        int32_t sumi = 0;
+        for (uint32_t g = 0; g < QK_K / 16; ++g) {
+            int32_t s = 0;
+            for (uint32_t l = 0; l < 16; ++l) {
+                s += qv[g * 16 + l] * y[i].qs[g * 16 + l];
+            }
+            sumi += x[i].scales[g] * s;
+        }
+        sum += y[i].d * half_to_float(x[i].d) * (float)sumi;
+    }
+    return sum;
+}
+
+struct q8_k_job {
+    vec_dot_q8_k_fn dot;
+    const uint8_t *a;
+    size_t row_bytes;
+    const struct block_q8_k *b;
+    float *c;
+    uint32_t m;
+    uint32_t ldc;  // distance between output columns of c
+    uint32_t n;
+    uint32_t nb;
+};
+
+static void q8_k_worker(void *arg, uint32_t ith, uint32_t nth) {
+    const struct q8_k_job *job = (const struct q8_k_job *)arg;
+    uint32_t begin, end;
+    split_range(job->m, ith, nth, &begin, &end);
+    for (uint32_t row = begin; row < end; ++row) {
+        const uint8_t *row_blocks = job->a + (uint64_t)row * job->row_bytes;
+        for (uint32_t j = 0; j < job->n; ++j) {
+            job->c[(uint64_t)j * job->ldc + row] =
+                job->dot(row_blocks, job->b + (uint64_t)j * job->nb, job->nb);
+        }
+    }
+}
+
+// c[j * m + row] = dot(a[row], b[j]) with b already in Q8_K. A weight row is
+// small enough to stay in L1 while it is dotted against all n columns.
+static int matmul_k_quant_q8_k(const struct op_context *ctx,
+                               const void *a, size_t block_bytes, vec_dot_q8_k_fn dot,
+                               const void *b_q8k, float *c, uint32_t m, uint32_t ldc,
+                               uint32_t n, uint32_t k) {
+    if (!a || !b_q8k || !c || n == 0) {
         return -1;
     }
-    if (n_kv_heads == 0) {
+    if (k == 0 || (k % QK_K) != 0) {
         return -1;
     }
-    float *scores = (float *)malloc((size_t)seq_len * sizeof(float));
-    if (!scores) {
+    struct q8_k_job job;
+    job.dot = dot;
+    job.a = (const uint8_t *)a;
+    job.nb = k / QK_K;
+    job.row_bytes = (size_t)job.nb * block_bytes;
+    job.b = (const struct block_q8_k *)b_q8k;
+    job.c = c;
+    job.m = m;
+    job.ldc = ldc;
+    job.n = n;
+    op_parallel(ctx, q8_k_worker, &job);
+    return 0;
+}
+
+int op_matmul_q4_k_q8_k(const struct op_context *ctx,
+                        const void *a_q4k, const void *b_q8k, float *c,
+                        uint32_t m, uint32_t n, uint32_t k) {
+    vec_dot_q8_k_fn dot = cpu_kernels()->dot_q4_k_q8_k;
+    return matmul_k_quant_q8_k(ctx, a_q4k, sizeof(struct block_q4_k),
+                               dot ? dot : vec_dot_q4_k_q8_k_ref,
+                               b_q8k, c, m, m, n, k);
+}
+
+int op_matmul_q5_k_q8_k(const struct op_context *ctx,
+                        const void *a_q5k, const void *b_q8k, float *c,
+                        uint32_t m, uint32_t n, uint32_t k) {
+    vec_dot_q8_k_fn dot = cpu_kernels()->dot_q5_k_q8_k;
+    return matmul_k_quant_q8_k(ctx, a_q5k, sizeof(struct block_q5_k),
+                               dot ? dot : vec_dot_q5_k_q8_k_ref,
+                               b_q8k, c, m, m, n, k);
+}
+
+int op_matmul_q6_k_q8_k(const struct op_context *ctx,
+                        const void *a_q6k, const void *b_q8k, float *c,
+                        uint32_t m, uint32_t n, uint32_t k) {
+    vec_dot_q8_k_fn dot = cpu_kernels()->dot_q6_k_q8_k;
+    return matmul_k_quant_q8_k(ctx, a_q6k, sizeof(struct block_q6_k),
+                               dot ? dot : vec_dot_q6_k_q8_k_ref,
+                               b_q8k, c, m, m, n, k);
+}
+
+size_t op_k_quant_row_size(uint32_t dtype, uint32_t k) {
+    size_t nb = k / QK_K;
+    switch (dtype) {
+        case 12: return nb * sizeof(struct block_q4_k); // Q4_K
+        case 13: return nb * sizeof(struct block_q5_k); // Q5_K
+        case 14: return nb * sizeof(struct block_q6_k); // Q6_K
+        default: return 0;
+    }
+}
+
+// Shifts c to row0 and keeps the full matrix height as the column stride, so
+// each band writes exactly the outputs a whole-matrix call would.
+int op_matmul_k_quant_rows(const struct op_context *ctx, uint32_t dtype,
+                           const void *a_rows, const float *b_f32, const void *b_q8k,
+                           float *c, uint32_t row0, uint32_t n_rows,
+                           uint32_t m, uint32_t n, uint32_t k) {
+    if (!c || n == 0 || n_rows == 0 || row0 > m || n_rows > m - row0) {
         return -1;
     }
-    for (uint32_t h = 0; h < n_heads; ++h) {
-        const float *qh = q + (uint64_t)h * head_dim;
-        uint32_t kvh = h % n_kv_heads;
+    float *c_rows = c + row0;
+    if (b_q8k) {
+        vec_dot_q8_k_fn dot = NULL;
+        size_t block_bytes = 0;
+        if (dtype == 12) {
+            dot = cpu_kernels()->dot_q4_k_q8_k;
+            dot = dot ? dot : vec_dot_q4_k_q8_k_ref;
+            block_bytes = sizeof(struct block_q4_k);
+        } else if (dtype == 13) {
+            dot = cpu_kernels()->dot_q5_k_q8_k;
+            dot = dot ? dot : vec_dot_q5_k_q8_k_ref;
+            block_bytes = sizeof(struct block_q5_k);
+        } else if (dtype == 14) {
+            dot = cpu_kernels()->dot_q6_k_q8_k;
+            dot = dot ? dot : vec_dot_q6_k_q8_k_ref;
+            block_bytes = sizeof(struct block_q6_k);
+        } else {
+            return -1;
+        }
+        return matmul_k_quant_q8_k(ctx, a_rows, block_bytes, dot, b_q8k, c_rows,
+                                   n_rows, m, n, k);
+    }
+    if (n == 1) {
+        if (dtype == 12) {
+            return op_matmul_q4_k(ctx, a_rows, b_f32, c_rows, n_rows, k);
+        }
+        if (dtype == 13) {
+            return op_matmul_q5_k(ctx, a_rows, b_f32, c_rows, n_rows, k);
+        }
+        if (dtype == 14) {
+            return op_matmul_q6_k(ctx, a_rows, b_f32, c_rows, n_rows, k);
+        }
+        return -1;
+    }
+    dequant_block_fn dequant = NULL;
+    size_t block_bytes = 0;
+    if (dtype == 12) {
+        dequant = cpu_kernels()->dequant_q4_k;
+        dequant = dequant ? dequant : dequant_block_q4_k;
+        block_bytes = sizeof(struct block_q4_k);
+    } else if (dtype == 13) {
+        dequant = cpu_kernels()->dequant_q5_k;
+        dequant = dequant ? dequant : dequant_block_q5_k;
+        block_bytes = sizeof(struct block_q5_k);
+    } else if (dtype == 14) {
+        dequant = cpu_kernels()->dequant_q6_k;
+        dequant = dequant ? dequant : dequant_block_q6_k;
+        block_bytes = sizeof(struct block_q6_k);
+    } else {
+        return -1;
+    }
+    return matmul_k_quant_gemm(ctx, a_rows, block_bytes, dequant, b_f32, c_rows,
+                               n_rows, m, n, k);
+}
+
+struct attention_job {
+    const float *q;
+    const float *k;
+    const float *v;
+    float *out;
+    float *scores;   // seq_len floats per thread
+    const float *mask;
+    uint32_t n_heads;
+    uint32_t n_kv_heads;
+    uint32_t head_dim;
+    uint32_t seq_len;
+    float scale;
+};
+
+static void attention_worker(void *arg, uint32_t ith, uint32_t nth) {
+    const struct attention_job *job = (const struct attention_job *)arg;
+    const uint32_t head_dim = job->head_dim;
+    const uint32_t n_kv_heads = job->n_kv_heads;
+    const uint32_t seq_len = job->seq_len;
+    float *scores = job->scores + (size_t)ith * seq_len;
+    float *out = job->out;
+    uint32_t begin, end;
+    split_range(job->n_heads, ith, nth, &begin, &end);
+    for (uint32_t h = begin; h < end; ++h) {
+        const float *qh = job->q + (uint64_t)h * head_dim;
+        // GQA: consecutive query heads share a KV head, as in llama.cpp.
+        uint32_t kvh = h / (job->n_heads / n_kv_heads);
         for (uint32_t i = 0; i < seq_len; ++i) {
-            const float *kh = k + ((uint64_t)i * n_kv_heads + kvh) * head_dim;
+            const float *kh = job->k + ((uint64_t)i * n_kv_heads + kvh) * head_dim;
             float dot = 0.0f;
             for (uint32_t d = 0; d < head_dim; ++d) {
                 dot += qh[d] * kh[d];
             }
-            float s = dot * scale;
-            if (mask) {
-                s += mask[i];
+            float s = dot * job->scale;
+            if (job->mask) {
+                s += job->mask[i];
             }
             scores[i] = s;
         }
@@ -449,14 +1197,800 @@ int op_attention(const struct op_context *ctx, const float *q,
             out[h * head_dim + d] = 0.0f;
         }
         for (uint32_t i = 0; i < seq_len; ++i) {
-            const float *vh = v + ((uint64_t)i * n_kv_heads + kvh) * head_dim;
+            const float *vh = job->v + ((uint64_t)i * n_kv_heads + kvh) * head_dim;
             float w = scores[i] * inv;
             for (uint32_t d = 0; d < head_dim; ++d) {
                 out[h * head_dim + d] += w * vh[d];
             }
         }
     }
-    free(scores);
+}
+
+// Heads are independent, so they are split across the pool.
+int op_attention(const struct op_context *ctx, const float *q,
+                 const float *k, const float *v, float *out,
+                 uint32_t n_heads, uint32_t n_kv_heads, uint32_t head_dim,
+                 uint32_t seq_len, float scale, const float *mask) {
+    if (!q || !k || !v || !out || head_dim == 0 || n_heads == 0 || seq_len == 0) {
+        return -1;
+    }
+    if (n_kv_heads == 0 || (n_heads % n_kv_heads) != 0) {
+        return -1;
+    }
+    struct attention_job job;
+    job.scores = (float *)malloc((size_t)seq_len * op_n_threads(ctx) * sizeof(float));
+    if (!job.scores) {
+        return -1;
+    }
+    job.q = q;
+    job.k = k;
+    job.v = v;
+    job.out = out;
+    job.mask = mask;
+    job.n_heads = n_heads;
+    job.n_kv_heads = n_kv_heads;
+    job.head_dim = head_dim;
+    job.seq_len = seq_len;
+    job.scale = scale;
+    op_parallel(ctx, attention_worker, &job);
+    free(job.scores);
+    return 0;
+}
+
+// Tokens scored per online-softmax step: one max update and rescale of the
+// accumulator per tile instead of per token.
+#define ATTN_KV_TILE 64
+
+// Query rows per work item of a prefill chunk: a K/V row fetched once serves
+// this many rows times the heads of its group.
+#define ATTN_KV_ROWS 16
+
+struct attention_kv_job {
+    const float *q;
+    const struct op_kv_span *spans;            // token-major runs, or
+    const struct op_kv_head_span *head_spans;  // head-major runs
+    uint32_t n_spans;
+    float *out;
+    float *scratch;  // per thread: accumulators, scores and softmax state
+    size_t scratch_floats;
+    uint32_t n_q;         // query rows, the last n_q positions of seq_len
+    uint32_t n_q_blocks;  // ceil(n_q / ATTN_KV_ROWS)
+    uint32_t n_heads;
+    uint32_t n_kv_heads;
+    uint32_t head_dim;
+    uint32_t seq_len;
+    uint32_t kv_quant;    // enum kv_quant_type of token-major rows (head-major
+                          // runs carry their own)
+    size_t row_bytes;     // one token-major row of K or V
+    uint32_t row_scales;  // scales per head-major row
+    float scale;
+    float rope_theta;
+    uint32_t rotate;      // some run has a rope_shift: scratch holds turned queries
+    float *span_mass;     // per-run probability mass, or NULL
+    uint32_t mass_rows;   // query rows per item with span_mass
+};
+
+// sum(x[i] * row[e0 + i]) for i < n, one scale multiply per 32-value group.
+// Heads aligned to whole groups take the fast path; its eight independent
+// lanes let the compiler vectorize the reduction without -ffast-math.
+static float dot_q8_row(const float *x, const struct q8_block *row, uint32_t e0, uint32_t n) {
+    if ((e0 % 32u) == 0 && (n % 32u) == 0) {
+        float sum = 0.0f;
+        for (const struct q8_block *g = row + e0 / 32u, *ge = g + n / 32u; g < ge; ++g, x += 32) {
+            float lane[8] = {0};
+            for (uint32_t i = 0; i < 32u; i += 8u) {
+                for (uint32_t l = 0; l < 8u; ++l) {
+                    lane[l] += x[i + l] * (float)g->data[i + l];
+                }
+            }
+            float s = ((lane[0] + lane[4]) + (lane[1] + lane[5])) +
+                      ((lane[2] + lane[6]) + (lane[3] + lane[7]));
+            sum += s * g->scale;
+        }
+        return sum;
+    }
+    float sum = 0.0f;
+    for (uint32_t e = e0, end = e0 + n; e < end;) {
+        const struct q8_block *g = row + e / 32u;
+        uint32_t i0 = e % 32u;
+        uint32_t cnt = 32u - i0 < end - e ? 32u - i0 : end - e;
+        float s = 0.0f;
+        for (uint32_t i = 0; i < cnt; ++i) {
+            s += x[i] * (float)g->data[i0 + i];
+        }
+        sum += s * g->scale;
+        x += cnt;
+        e += cnt;
+    }
+    return sum;
+}
+
+// Same eight-lane reduction over two fp32 vectors.
+static float dot_f32(const float *x, const float *y, uint32_t n) {
+    float lane[8] = {0};
+    uint32_t i = 0;
+    for (; i + 8u <= n; i += 8u) {
+        for (uint32_t l = 0; l < 8u; ++l) {
+            lane[l] += x[i + l] * y[i + l];
+        }
+    }
+    for (; i < n; ++i) {
+        lane[0] += x[i] * y[i];
+    }
+    return ((lane[0] + lane[4]) + (lane[1] + lane[5])) +
+           ((lane[2] + lane[6]) + (lane[3] + lane[7]));
+}
+
+// y[i] += w * row[e0 + i] for i < n.
+static void axpy_q8_row(float *y, float w, const struct q8_block *row, uint32_t e0, uint32_t n) {
+    for (uint32_t e = e0, end = e0 + n; e < end;) {
+        const struct q8_block *g = row + e / 32u;
+        uint32_t i0 = e % 32u;
+        uint32_t cnt = 32u - i0 < end - e ? 32u - i0 : end - e;
+        float ws = w * g->scale;
+        for (uint32_t i = 0; i < cnt; ++i) {
+            y[i] += ws * (float)g->data[i0 + i];
+        }
+        y += cnt;
+        e += cnt;
+    }
+}
+
+static inline int q4_at(const struct q4_block *g, uint32_t i) {
+    return (int)(i < 16u ? g->data[i] & 15u : g->data[i - 16u] >> 4) - 8;
+}
+
+// dot_q8_row for Q4_0 groups; the fast path unpacks both nibbles of a byte
+// into the same lane.
+static float dot_q4_row(const float *x, const struct q4_block *row, uint32_t e0, uint32_t n) {
+    if ((e0 % 32u) == 0 && (n % 32u) == 0) {
+        float sum = 0.0f;
+        for (const struct q4_block *g = row + e0 / 32u, *ge = g + n / 32u; g < ge; ++g, x += 32) {
+            float lane[8] = {0};
+            for (uint32_t i = 0; i < 16u; i += 8u) {
+                for (uint32_t l = 0; l < 8u; ++l) {
+                    lane[l] += x[i + l] * (float)((int)(g->data[i + l] & 15u) - 8) +
+                               x[i + l + 16] * (float)((int)(g->data[i + l] >> 4) - 8);
+                }
+            }
+            float s = ((lane[0] + lane[4]) + (lane[1] + lane[5])) +
+                      ((lane[2] + lane[6]) + (lane[3] + lane[7]));
+            sum += s * g->scale;
+        }
+        return sum;
+    }
+    float sum = 0.0f;
+    for (uint32_t e = e0, end = e0 + n; e < end;) {
+        const struct q4_block *g = row + e / 32u;
+        uint32_t i0 = e % 32u;
+        uint32_t cnt = 32u - i0 < end - e ? 32u - i0 : end - e;
+        float s = 0.0f;
+        for (uint32_t i = 0; i < cnt; ++i) {
+            s += x[i] * (float)q4_at(g, i0 + i);
+        }
+        sum += s * g->scale;
+        x += cnt;
+        e += cnt;
+    }
+    return sum;
+}
+
+static void axpy_q4_row(float *y, float w, const struct q4_block *row, uint32_t e0, uint32_t n) {
+    for (uint32_t e = e0, end = e0 + n; e < end;) {
+        const struct q4_block *g = row + e / 32u;
+        uint32_t i0 = e % 32u;
+        uint32_t cnt = 32u - i0 < end - e ? 32u - i0 : end - e;
+        float ws = w * g->scale;
+        for (uint32_t i = 0; i < cnt; ++i) {
+            y[i] += ws * (float)q4_at(g, i0 + i);
+        }
+        y += cnt;
+        e += cnt;
+    }
+}
+
+// Head-major rows: n values as consecutive groups with their scales in sc.
+// The fast path uses the same lane order as dot_q8_row, so both layouts give
+// identical scores for whole-group heads.
+static float dot_q8_tile_row(const float *x, const int8_t *q, const float *sc, uint32_t n) {
+    float sum = 0.0f;
+    uint32_t g = 0;
+    for (; (g + 1) * 32u <= n; ++g, x += 32, q += 32) {
+        float lane[8] = {0};
+        for (uint32_t i = 0; i < 32u; i += 8u) {
+            for (uint32_t l = 0; l < 8u; ++l) {
+                lane[l] += x[i + l] * (float)q[i + l];
+            }
+        }
+        float s = ((lane[0] + lane[4]) + (lane[1] + lane[5])) +
+                  ((lane[2] + lane[6]) + (lane[3] + lane[7]));
+        sum += s * sc[g];
+    }
+    if (g * 32u < n) {
+        float s = 0.0f;
+        for (uint32_t i = 0; i < n - g * 32u; ++i) {
+            s += x[i] * (float)q[i];
+        }
+        sum += s * sc[g];
+    }
+    return sum;
+}
+
+static void axpy_q8_tile_row(float *y, float w, const int8_t *q, const float *sc, uint32_t n) {
+    for (uint32_t e = 0, g = 0; e < n; e += 32u, ++g) {
+        uint32_t cnt = n - e < 32u ? n - e : 32u;
+        float ws = w * sc[g];
+        for (uint32_t i = 0; i < cnt; ++i) {
+            y[e + i] += ws * (float)q[e + i];
+        }
+    }
+}
+
+static float dot_q4_tile_row(const float *x, const uint8_t *q, const float *sc, uint32_t n) {
+    float sum = 0.0f;
+    uint32_t g = 0;
+    for (; (g + 1) * 32u <= n; ++g, x += 32, q += 16) {
+        float lane[8] = {0};
+        for (uint32_t i = 0; i < 16u; i += 8u) {
+            for (uint32_t l = 0; l < 8u; ++l) {
+                lane[l] += x[i + l] * (float)((int)(q[i + l] & 15u) - 8) +
+                           x[i + l + 16] * (float)((int)(q[i + l] >> 4) - 8);
+            }
+        }
+        float s = ((lane[0] + lane[4]) + (lane[1] + lane[5])) +
+                  ((lane[2] + lane[6]) + (lane[3] + lane[7]));
+        sum += s * sc[g];
+    }
+    if (g * 32u < n) {
+        float s = 0.0f;
+        for (uint32_t i = 0; i < n - g * 32u; ++i) {
+            s += x[i] * (float)((int)(i < 16u ? q[i] & 15u : q[i - 16u] >> 4) - 8);
+        }
+        sum += s * sc[g];
+    }
+    return sum;
+}
+
+static void axpy_q4_tile_row(float *y, float w, const uint8_t *q, const float *sc, uint32_t n) {
+    for (uint32_t e = 0, g = 0; e < n; e += 32u, ++g, q += 16) {
+        uint32_t cnt = n - e < 32u ? n - e : 32u;
+        float ws = w * sc[g];
+        for (uint32_t i = 0; i < cnt; ++i) {
+            y[e + i] += ws * (float)((int)(i < 16u ? q[i] & 15u : q[i - 16u] >> 4) - 8);
+        }
+    }
+}
+
+static float dot_f16_row(const float *x, const uint16_t *h, uint32_t n) {
+    float lane[8] = {0};
+    uint32_t i = 0;
+    for (; i + 8u <= n; i += 8u) {
+        for (uint32_t l = 0; l < 8u; ++l) {
+            lane[l] += x[i + l] * kv_half_to_float(h[i + l]);
+        }
+    }
+    float sum = ((lane[0] + lane[4]) + (lane[1] + lane[5])) +
+                ((lane[2] + lane[6]) + (lane[3] + lane[7]));
+    for (; i < n; ++i) {
+        sum += x[i] * kv_half_to_float(h[i]);
+    }
+    return sum;
+}
+
+static void axpy_f16_row(float *y, float w, const uint16_t *h, uint32_t n) {
+    for (uint32_t i = 0; i < n; ++i) {
+        y[i] += w * kv_half_to_float(h[i]);
+    }
+}
+
+// sc is NULL for token-major rows (inline scales, head at value e0) and
+// the head's scales for head-major tile rows. KV_F16 rows carry no scales:
+// the head starts at half e0 either way (0 in a head-major tile).
+static float dot_kv_row(uint32_t kv_quant, const float *x, const void *row, const float *sc,
+                        uint32_t e0, uint32_t n) {
+    if (kv_quant == KV_F16) {
+        return dot_f16_row(x, (const uint16_t *)row + e0, n);
+    }
+    if (sc) {
+        return kv_quant == KV_Q4_0 ? dot_q4_tile_row(x, (const uint8_t *)row, sc, n)
+                                   : dot_q8_tile_row(x, (const int8_t *)row, sc, n);
+    }
+    return kv_quant == KV_Q4_0 ? dot_q4_row(x, (const struct q4_block *)row, e0, n)
+                               : dot_q8_row(x, (const struct q8_block *)row, e0, n);
+}
+
+static void axpy_kv_row(uint32_t kv_quant, float *y, float w, const void *row, const float *sc,
+                        uint32_t e0, uint32_t n) {
+    if (kv_quant == KV_F16) {
+        axpy_f16_row(y, w, (const uint16_t *)row + e0, n);
+    } else if (sc) {
+        if (kv_quant == KV_Q4_0) {
+            axpy_q4_tile_row(y, w, (const uint8_t *)row, sc, n);
+        } else {
+            axpy_q8_tile_row(y, w, (const int8_t *)row, sc, n);
+        }
+    } else if (kv_quant == KV_Q4_0) {
+        axpy_q4_row(y, w, (const struct q4_block *)row, e0, n);
+    } else {
+        axpy_q8_row(y, w, (const struct q8_block *)row, e0, n);
+    }
+}
+
+// Writes the nr x group query heads at src (rows src_stride floats apart)
+// to dst back to back, turned shift positions further the way op_rope turns
+// them; cs receives the head_dim / 2 cosine and sine pairs.
+static void rope_turn(float *dst, const float *src, size_t src_stride, uint32_t nr, uint32_t group,
+                      uint32_t head_dim, uint32_t shift, float rope_theta, float *cs) {
+    const float inv_theta = 1.0f / rope_theta;
+    for (uint32_t i = 0; i + 1 < head_dim; i += 2) {
+        float angle = (float)shift * powf(inv_theta, (float)i / (float)head_dim);
+        cs[i] = cosf(angle);
+        cs[i + 1] = sinf(angle);
+    }
+    for (uint32_t r = 0; r < nr; ++r) {
+        for (uint32_t j = 0; j < group; ++j) {
+            const float *x = src + r * src_stride + (size_t)j * head_dim;
+            float *y = dst + ((size_t)r * group + j) * head_dim;
+            for (uint32_t i = 0; i + 1 < head_dim; i += 2) {
+                y[i]     = x[i] * cs[i] - x[i + 1] * cs[i + 1];
+                y[i + 1] = x[i] * cs[i + 1] + x[i + 1] * cs[i];
+            }
+            if (head_dim & 1u) {
+                y[head_dim - 1] = x[head_dim - 1];
+            }
+        }
+    }
+}
+
+// One work item is a KV head with its whole group of query heads over a
+// block of query rows, so every K and V row is fetched once and reused from
+// L1 by all heads and rows of the item. Row r sees the causal prefix
+// [0, seq_len - n_q + r]; later tokens are skipped rather than masked.
+static void attention_kv_worker(void *arg, uint32_t ith, uint32_t nth) {
+    const struct attention_kv_job *job = (const struct attention_kv_job *)arg;
+    const uint32_t head_dim = job->head_dim;
+    const uint32_t group = job->n_heads / job->n_kv_heads;
+    const uint32_t first_limit = job->seq_len - job->n_q + 1;
+    float *acc = job->scratch + (size_t)ith * job->scratch_floats;  // rows x group x head_dim
+    float *s = acc + (size_t)ATTN_KV_ROWS * group * head_dim;       // rows x group x tile
+    float *maxv = s + (size_t)ATTN_KV_ROWS * group * ATTN_KV_TILE;
+    float *sum = maxv + (size_t)ATTN_KV_ROWS * group;
+    float *row_f32 = sum + (size_t)ATTN_KV_ROWS * group;  // head_dim
+    float *qrot = row_f32 + head_dim;                     // rows x group x head_dim
+    float *rope_cs = qrot + (job->rotate ? (size_t)ATTN_KV_ROWS * group * head_dim : 0);
+    float *span_w = rope_cs + (job->rotate ? head_dim : 0);  // rows x group
+    float *span_lm = span_w + (size_t)ATTN_KV_ROWS * group;  // rows x group x runs: log mass
+    float *mass = span_lm + (size_t)job->mass_rows * group * job->n_spans;
+    uint32_t begin, end;
+    split_range(job->n_kv_heads * job->n_q_blocks, ith, nth, &begin, &end);
+    for (uint32_t item = begin; item < end; ++item) {
+        uint32_t kvh = item % job->n_kv_heads;
+        uint32_t r0 = (item / job->n_kv_heads) * ATTN_KV_ROWS;
+        uint32_t nr = job->n_q - r0 < ATTN_KV_ROWS ? job->n_q - r0 : ATTN_KV_ROWS;
+        uint32_t nu = nr * group;  // (row, head) pairs, row-major
+        uint32_t e0 = job->head_spans ? 0 : kvh * head_dim;
+        uint32_t item_limit = first_limit + r0 + nr - 1;  // tokens seen by the last row
+        const float *q_item = job->q + ((uint64_t)r0 * job->n_heads + (uint64_t)kvh * group) * head_dim;
+        uint32_t cur_shift = 0;
+        for (uint32_t u = 0; u < nu; ++u) {
+            maxv[u] = -INFINITY;
+            sum[u] = 0.0f;
+        }
+        memset(acc, 0, (size_t)nu * head_dim * sizeof(float));
+        uint32_t p0 = 0;
+        uint32_t sp = 0;
+        for (; sp < job->n_spans && p0 < item_limit; ++sp) {
+            const uint8_t *k, *v;
+            const float *ks = NULL, *vs = NULL;
+            uint32_t span_tokens;
+            uint32_t shift = 0;
+            uint32_t kq = job->kv_quant;
+            size_t row_bytes = job->row_bytes;
+            if (job->head_spans) {
+                const struct op_kv_head_span *hs = &job->head_spans[sp];
+                k = (const uint8_t *)hs->k + kvh * hs->head_stride;
+                v = (const uint8_t *)hs->v + kvh * hs->head_stride;
+                if (hs->quant != KV_F16) {
+                    ks = hs->k_scale + kvh * hs->scale_stride;
+                    vs = hs->v_scale + kvh * hs->scale_stride;
+                }
+                span_tokens = hs->n_tokens;
+                shift = hs->rope_shift;
+                kq = hs->quant;
+                row_bytes = kq == KV_F16 ? (size_t)head_dim * sizeof(uint16_t)
+                                         : (size_t)job->row_scales * (kq == KV_Q4_0 ? 16u : 32u);
+            } else {
+                k = (const uint8_t *)job->spans[sp].k;
+                v = (const uint8_t *)job->spans[sp].v;
+                span_tokens = job->spans[sp].n_tokens;
+            }
+            uint32_t n_tok = span_tokens;
+            if (n_tok > item_limit - p0) {
+                n_tok = item_limit - p0;
+            }
+            if (shift != cur_shift && shift != 0) {
+                rope_turn(qrot, q_item, (size_t)job->n_heads * head_dim, nr, group, head_dim,
+                          shift, job->rope_theta, rope_cs);
+            }
+            cur_shift = shift;
+            const float *qb = shift ? qrot : q_item;
+            size_t q_stride = (size_t)(shift ? group : job->n_heads) * head_dim;
+            if (job->span_mass) {
+                memset(span_w, 0, (size_t)nu * sizeof(float));
+            }
+            for (uint32_t t0 = 0; t0 < n_tok; t0 += ATTN_KV_TILE) {
+                uint32_t nt = n_tok - t0 < ATTN_KV_TILE ? n_tok - t0 : ATTN_KV_TILE;
+                uint32_t tile_pos = p0 + t0;
+                for (uint32_t t = 0; t < nt; ++t) {
+                    const uint8_t *kr = k + (size_t)(t0 + t) * row_bytes;
+                    const float *ksr = ks ? ks + (size_t)(t0 + t) * job->row_scales : NULL;
+                    if (nr > 1) {
+                        // Several rows share this key: widen it once.
+                        memset(row_f32, 0, head_dim * sizeof(float));
+                        axpy_kv_row(kq, row_f32, 1.0f, kr, ksr, e0, head_dim);
+                    }
+                    for (uint32_t r = 0; r < nr; ++r) {
+                        int visible = tile_pos + t < first_limit + r0 + r;
+                        for (uint32_t j = 0; j < group; ++j) {
+                            uint32_t u = r * group + j;
+                            const float *qh = qb + r * q_stride + (size_t)j * head_dim;
+                            float dot = 0.0f;
+                            if (visible && nr > 1) {
+                                dot = dot_f32(qh, row_f32, head_dim);
+                            } else if (visible) {
+                                dot = dot_kv_row(kq, qh, kr, ksr, e0, head_dim);
+                            }
+                            s[u * ATTN_KV_TILE + t] = visible ? dot * job->scale : -INFINITY;
+                        }
+                    }
+                }
+                for (uint32_t u = 0; u < nu; ++u) {
+                    const float *su = s + u * ATTN_KV_TILE;
+                    float tile_max = -INFINITY;
+                    for (uint32_t t = 0; t < nt; ++t) {
+                        tile_max = su[t] > tile_max ? su[t] : tile_max;
+                    }
+                    if (tile_max > maxv[u]) {
+                        // Rescale what was accumulated under the old maximum.
+                        float corr = expf(maxv[u] - tile_max);
+                        float *au = acc + (size_t)u * head_dim;
+                        sum[u] *= corr;
+                        if (job->span_mass) {
+                            span_w[u] *= corr;
+                        }
+                        for (uint32_t d = 0; d < head_dim; ++d) {
+                            au[d] *= corr;
+                        }
+                        maxv[u] = tile_max;
+                    }
+                }
+                for (uint32_t t = 0; t < nt; ++t) {
+                    const uint8_t *vr = v + (size_t)(t0 + t) * row_bytes;
+                    const float *vsr = vs ? vs + (size_t)(t0 + t) * job->row_scales : NULL;
+                    if (nr > 1) {
+                        memset(row_f32, 0, head_dim * sizeof(float));
+                        axpy_kv_row(kq, row_f32, 1.0f, vr, vsr, e0, head_dim);
+                    }
+                    for (uint32_t r = 0; r < nr; ++r) {
+                        if (tile_pos + t >= first_limit + r0 + r) {
+                            continue;
+                        }
+                        for (uint32_t j = 0; j < group; ++j) {
+                            uint32_t u = r * group + j;
+                            float w = expf(s[u * ATTN_KV_TILE + t] - maxv[u]);
+                            float *au = acc + (size_t)u * head_dim;
+                            sum[u] += w;
+                            if (job->span_mass) {
+                                span_w[u] += w;
+                            }
+                            if (nr > 1) {
+                                for (uint32_t d = 0; d < head_dim; ++d) {
+                                    au[d] += w * row_f32[d];
+                                }
+                            } else {
+                                axpy_kv_row(kq, au, w, vr, vsr, e0, head_dim);
+                            }
+                        }
+                    }
+                }
+            }
+            if (job->span_mass) {
+                // Kept as a log so it can be renormalized by the final max.
+                for (uint32_t u = 0; u < nu; ++u) {
+                    span_lm[(size_t)u * job->n_spans + sp] =
+                        span_w[u] > 0.0f ? maxv[u] + logf(span_w[u]) : -INFINITY;
+                }
+            }
+            p0 += span_tokens;
+        }
+        if (job->span_mass) {
+            for (uint32_t u = 0; u < nu; ++u) {
+                float inv = sum[u] > 0.0f ? 1.0f / sum[u] : 0.0f;
+                for (uint32_t i = 0; i < sp; ++i) {
+                    mass[i] += expf(span_lm[(size_t)u * job->n_spans + i] - maxv[u]) * inv;
+                }
+            }
+        }
+        for (uint32_t r = 0; r < nr; ++r) {
+            for (uint32_t j = 0; j < group; ++j) {
+                uint32_t u = r * group + j;
+                float inv = sum[u] > 0.0f ? 1.0f / sum[u] : 0.0f;
+                const float *au = acc + (size_t)u * head_dim;
+                float *oh = job->out +
+                    ((uint64_t)(r0 + r) * job->n_heads + (uint64_t)kvh * group + j) * head_dim;
+                for (uint32_t d = 0; d < head_dim; ++d) {
+                    oh[d] = au[d] * inv;
+                }
+            }
+        }
+    }
+}
+
+// Single pass over the quantized cache per work item; items (KV group x
+// query row block) are split across the pool. Exactly one of spans and
+// head_spans is set. Each thread sums run masses in its own scratch and the
+// sums are added to span_mass once the pool is done.
+static int attention_kv_causal(const struct op_context *ctx, uint32_t kv_quant,
+                               const float *q, uint32_t n_q,
+                               const struct op_kv_span *spans,
+                               const struct op_kv_head_span *head_spans, uint32_t n_spans,
+                               float *out, uint32_t n_heads, uint32_t n_kv_heads,
+                               uint32_t head_dim, uint32_t seq_len, float scale,
+                               float rope_theta, float *span_mass) {
+    if (!q || (!spans && !head_spans) || !out || head_dim == 0 || n_heads == 0 || n_kv_heads == 0) {
+        return -1;
+    }
+    if (n_q == 0 || seq_len < n_q || (n_heads % n_kv_heads) != 0) {
+        return -1;
+    }
+    for (uint32_t i = 0; head_spans && i < n_spans; ++i) {
+        uint32_t kq = head_spans[i].quant;
+        if (kq != KV_Q8_0 && kq != KV_Q4_0 && kq != KV_F16) {
+            return -1;
+        }
+    }
+    uint32_t available = 0;
+    for (uint32_t i = 0; i < n_spans && available < seq_len; ++i) {
+        available += spans ? spans[i].n_tokens : head_spans[i].n_tokens;
+    }
+    if (available < seq_len) {
+        return -1;
+    }
+    struct attention_kv_job job;
+    uint32_t group = n_heads / n_kv_heads;
+    job.rotate = 0;
+    for (uint32_t i = 0; head_spans && i < n_spans; ++i) {
+        job.rotate |= head_spans[i].rope_shift != 0;
+    }
+    if (job.rotate && !(rope_theta > 0.0f)) {
+        return -1;
+    }
+    job.span_mass = span_mass;
+    job.mass_rows = n_q < ATTN_KV_ROWS ? n_q : ATTN_KV_ROWS;
+    size_t mass_floats = span_mass ? (size_t)ATTN_KV_ROWS * group +
+                                     ((size_t)job.mass_rows * group + 1) * n_spans : 0;
+    job.scratch_floats = (size_t)ATTN_KV_ROWS * group * (head_dim + ATTN_KV_TILE + 2) + head_dim +
+                         (job.rotate ? (size_t)ATTN_KV_ROWS * group * head_dim + head_dim : 0) +
+                         mass_floats;
+    uint32_t n_threads = op_n_threads(ctx);
+    job.scratch = (float *)malloc(job.scratch_floats * n_threads * sizeof(float));
+    if (!job.scratch) {
+        return -1;
+    }
+    // Each thread's run masses sit at the end of its scratch.
+    for (uint32_t t = 0; span_mass && t < n_threads; ++t) {
+        memset(job.scratch + (t + 1) * job.scratch_floats - n_spans, 0, n_spans * sizeof(float));
+    }
+    job.q = q;
+    job.spans = spans;
+    job.head_spans = head_spans;
+    job.n_spans = n_spans;
+    job.out = out;
+    job.n_q = n_q;
+    job.n_q_blocks = (n_q + ATTN_KV_ROWS - 1) / ATTN_KV_ROWS;
+    job.n_heads = n_heads;
+    job.n_kv_heads = n_kv_heads;
+    job.head_dim = head_dim;
+    job.seq_len = seq_len;
+    job.kv_quant = kv_quant;
+    job.row_scales = (head_dim + 31u) / 32u;
+    job.row_bytes = op_kv_row_size(kv_quant, n_kv_heads * head_dim);
+    job.scale = scale;
+    job.rope_theta = rope_theta;
+    op_parallel(ctx, attention_kv_worker, &job);
+    for (uint32_t t = 0; span_mass && t < n_threads; ++t) {
+        const float *mass = job.scratch + (t + 1) * job.scratch_floats - n_spans;
+        for (uint32_t i = 0; i < n_spans; ++i) {
+            span_mass[i] += mass[i];
+        }
+    }
+    free(job.scratch);
+    return 0;
+}
+
+int op_attention_q8_kv_causal(const struct op_context *ctx, const float *q, uint32_t n_q,
+                              const struct op_kv_span *spans, uint32_t n_spans, float *out,
+                              uint32_t n_heads, uint32_t n_kv_heads, uint32_t head_dim,
+                              uint32_t seq_len, float scale) {
+    return attention_kv_causal(ctx, KV_Q8_0, q, n_q, spans, NULL, n_spans, out, n_heads,
+                               n_kv_heads, head_dim, seq_len, scale, 0.0f, NULL);
+}
+
+int op_attention_q4_kv_causal(const struct op_context *ctx, const float *q, uint32_t n_q,
+                              const struct op_kv_span *spans, uint32_t n_spans, float *out,
+                              uint32_t n_heads, uint32_t n_kv_heads, uint32_t head_dim,
+                              uint32_t seq_len, float scale) {
+    return attention_kv_causal(ctx, KV_Q4_0, q, n_q, spans, NULL, n_spans, out, n_heads,
+                               n_kv_heads, head_dim, seq_len, scale, 0.0f, NULL);
+}
+
+int op_attention_kv_heads_causal(const struct op_context *ctx, const float *q, uint32_t n_q,
+                                 const struct op_kv_head_span *spans, uint32_t n_spans,
+                                 float *out, uint32_t n_heads, uint32_t n_kv_heads,
+                                 uint32_t head_dim, uint32_t seq_len, float scale,
+                                 float rope_theta, float *span_mass) {
+    return attention_kv_causal(ctx, KV_Q8_0, q, n_q, NULL, spans, n_spans, out, n_heads,
+                               n_kv_heads, head_dim, seq_len, scale, rope_theta, span_mass);
+}
+
+int op_attention_q8_kv(const struct op_context *ctx, const float *q,
+                       const struct op_kv_span *spans, uint32_t n_spans, float *out,
+                       uint32_t n_heads, uint32_t n_kv_heads, uint32_t head_dim,
+                       uint32_t seq_len, float scale) {
+    return op_attention_q8_kv_causal(ctx, q, 1, spans, n_spans, out, n_heads, n_kv_heads,
+                                     head_dim, seq_len, scale);
+}
+
+struct kv_select_job {
+    const float *q;
+    const struct op_kv_head_span *spans;
+    uint32_t n_spans;
+    uint32_t n_heads;
+    uint32_t n_kv_heads;
+    uint32_t head_dim;
+    float rope_theta;
+    float *bounds;          // n_spans x n_heads
+    float *scratch;         // per thread: the turned query and its rope pairs
+    size_t scratch_floats;
+};
+
+// Score bounds of every query head against a share of the runs. The query
+// is turned once per distinct rope_shift in a row of runs.
+static void kv_select_worker(void *arg, uint32_t ith, uint32_t nth) {
+    const struct kv_select_job *job = (const struct kv_select_job *)arg;
+    const uint32_t head_dim = job->head_dim;
+    const uint32_t group = job->n_heads / job->n_kv_heads;
+    float *qrot = job->scratch + (size_t)ith * job->scratch_floats;
+    float *cs = qrot + (size_t)job->n_heads * head_dim;
+    uint32_t turned = 0;
+    uint32_t begin, end;
+    split_range(job->n_spans, ith, nth, &begin, &end);
+    for (uint32_t i = begin; i < end; ++i) {
+        const struct op_kv_head_span *sp = &job->spans[i];
+        if (!sp->k_min || !sp->k_max) {
+            continue;
+        }
+        const float *q = job->q;
+        if (sp->rope_shift != 0) {
+            if (sp->rope_shift != turned) {
+                rope_turn(qrot, job->q, 0, 1, job->n_heads, head_dim, sp->rope_shift,
+                          job->rope_theta, cs);
+                turned = sp->rope_shift;
+            }
+            q = qrot;
+        }
+        for (uint32_t h = 0; h < job->n_heads; ++h) {
+            const float *qh = q + (size_t)h * head_dim;
+            const float *mn = sp->k_min + (size_t)(h / group) * head_dim;
+            const float *mx = sp->k_max + (size_t)(h / group) * head_dim;
+            float b = 0.0f;
+            for (uint32_t d = 0; d < head_dim; ++d) {
+                float lo = qh[d] * mn[d];
+                float hi = qh[d] * mx[d];
+                b += lo > hi ? lo : hi;
+            }
+            job->bounds[(size_t)i * job->n_heads + h] = b;
+        }
+    }
+}
+
+struct kv_select_rank {
+    float score;
+    uint32_t index;
+};
+
+// Best score first; equal scores keep position order.
+static int kv_select_cmp(const void *a, const void *b) {
+    const struct kv_select_rank *x = (const struct kv_select_rank *)a;
+    const struct kv_select_rank *y = (const struct kv_select_rank *)b;
+    if (x->score != y->score) {
+        return x->score > y->score ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static int kv_index_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int op_kv_select_spans(const struct op_context *ctx, const float *q,
+                       const struct op_kv_head_span *spans, uint32_t n_spans,
+                       uint32_t n_heads, uint32_t n_kv_heads, uint32_t head_dim,
+                       float rope_theta, uint32_t budget, uint32_t n_first, uint32_t n_last,
+                       uint32_t *keep, uint32_t *n_keep) {
+    if (!q || !spans || !keep || !n_keep || head_dim == 0 || n_heads == 0 || n_kv_heads == 0 ||
+        (n_heads % n_kv_heads) != 0) {
+        return -1;
+    }
+    if (n_spans <= budget) {
+        for (uint32_t i = 0; i < n_spans; ++i) {
+            keep[i] = i;
+        }
+        *n_keep = n_spans;
+        return 0;
+    }
+    for (uint32_t i = 0; i < n_spans; ++i) {
+        if (spans[i].rope_shift != 0 && !(rope_theta > 0.0f)) {
+            return -1;
+        }
+    }
+    struct kv_select_job job;
+    uint32_t n_threads = op_n_threads(ctx);
+    job.q = q;
+    job.spans = spans;
+    job.n_spans = n_spans;
+    job.n_heads = n_heads;
+    job.n_kv_heads = n_kv_heads;
+    job.head_dim = head_dim;
+    job.rope_theta = rope_theta;
+    job.scratch_floats = (size_t)(n_heads + 1) * head_dim;
+    job.bounds = (float *)malloc(((size_t)n_spans * n_heads + job.scratch_floats * n_threads) *
+                                 sizeof(float));
+    struct kv_select_rank *rank = (struct kv_select_rank *)malloc(n_spans * sizeof(*rank));
+    if (!job.bounds || !rank) {
+        free(job.bounds);
+        free(rank);
+        return -1;
+    }
+    job.scratch = job.bounds + (size_t)n_spans * n_heads;
+    op_parallel(ctx, kv_select_worker, &job);
+
+    // A run's score is its bound less the best bound of the same head, for
+    // its most favourable head: 0 means some head may put most weight there.
+    float *best = job.scratch;
+    for (uint32_t h = 0; h < n_heads; ++h) {
+        best[h] = -INFINITY;
+    }
+    for (uint32_t i = 0; i < n_spans; ++i) {
+        for (uint32_t h = 0; spans[i].k_min && spans[i].k_max && h < n_heads; ++h) {
+            float b = job.bounds[(size_t)i * n_heads + h];
+            best[h] = b > best[h] ? b : best[h];
+        }
+    }
+    for (uint32_t i = 0; i < n_spans; ++i) {
+        float score = INFINITY;
+        if (i >= n_first && i + n_last < n_spans && spans[i].k_min && spans[i].k_max) {
+            score = -INFINITY;
+            for (uint32_t h = 0; h < n_heads; ++h) {
+                float s = job.bounds[(size_t)i * n_heads + h] - best[h];
+                score = s > score ? s : score;
+            }
+        }
+        rank[i].score = score;
+        rank[i].index = i;
+    }
+    qsort(rank, n_spans, sizeof(*rank), kv_select_cmp);
+    uint32_t n = 0;
+    while (n < n_spans && (n < budget || rank[n].score == INFINITY)) {
+        keep[n] = rank[n].index;
+        n++;
+    }
+    qsort(keep, n, sizeof(*keep), kv_index_cmp);
+    *n_keep = n;
+    free(job.bounds);
+    free(rank);
     return 0;
 }
 
@@ -0,0 +1,729 @@
+#include "ops_x86.h"
+
+#if defined(OPS_X86_SIMD)
+
+#include <immintrin.h>
+#include <math.h>
+#include <string.h>
+
+#define QK_K 256
+#define K_SCALE_SIZE 12
+
+#define TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define TARGET_AVX512 __attribute__((target("avx512f,f16c")))
+
+struct block_q4_k {
+    uint16_t d;
+    uint16_t dmin;
+    uint8_t scales[K_SCALE_SIZE];
+    uint8_t qs[QK_K / 2];
+};
+
+struct block_q5_k {
+    uint16_t d;
+    uint16_t dmin;
+    uint8_t scales[K_SCALE_SIZE];
+    uint8_t qh[QK_K / 8];
+    uint8_t qs[QK_K / 2];
+};
+
+struct block_q6_k {
+    uint8_t ql[QK_K / 2];
+    uint8_t qh[QK_K / 4];
+    int8_t scales[QK_K / 16];
+    uint16_t d;
+};
+
+struct block_q8_k {
+    float d;
+    int8_t qs[QK_K];
+    int16_t bsums[QK_K / 16];
+};
+
+static inline void get_scale_min_k4(int j, const uint8_t *q, uint8_t *d, uint8_t *m) {
+    if (j < 4) {
+        *d = q[j] & 63;
+        *m = q[j + 4] & 63;
+    } else {
+        *d = (q[j + 4] & 0xF) | ((q[j - 4] >> 6) << 4);
+        *m = (q[j + 4] >> 4) | ((q[j - 0] >> 6) << 4);
+    }
+}
+
+int x86_simd_detect(void) {
+    __builtin_cpu_init();
+    // F16C converts the fp16 super-block scales without leaving VEX code.
+    if (!__builtin_cpu_supports("f16c")) {
+        return X86_SIMD_NONE;
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        return X86_SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return X86_SIMD_AVX2;
+    }
+    return X86_SIMD_NONE;
+}
+
+// ---------------------------------------------------------------------------
+// AVX2 + FMA (8 lanes)
+// ---------------------------------------------------------------------------
+
+TARGET_AVX2 static inline float hsum_avx2(__m256 v) {
+    __m128 lo = _mm256_castps256_ps128(v);
+    __m128 hi = _mm256_extractf128_ps(v, 1);
+    lo = _mm_add_ps(lo, hi);
+    __m128 shuf = _mm_movehdup_ps(lo);
+    __m128 sums = _mm_add_ps(lo, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+
+TARGET_AVX2 static inline __m256 u8x8_to_ps(__m128i bytes) {
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+}
+
+// Per 32-value sub-block: sum((d*sc*q - dmin*m) * x) is accumulated as
+// d*sc*sum(q*x) - dmin*m*sum(x), so the min never touches the quant lanes.
+TARGET_AVX2 float x86_avx2_dot_q4_k(const void *blocks, const float *x, uint32_t nb) {
+    const struct block_q4_k *bl = (const struct block_q4_k *)blocks;
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    __m256 total = _mm256_setzero_ps();
+    for (uint32_t i = 0; i < nb; ++i) {
+        const float d = _cvtsh_ss(bl[i].d);
+        const float dmin = _cvtsh_ss(bl[i].dmin);
+        const uint8_t *q = bl[i].qs;
+        const float *xb = x + (uint64_t)i * QK_K;
+        for (int j = 0; j < 4; ++j) {
+            uint8_t sc1, m1, sc2, m2;
+            get_scale_min_k4(2 * j + 0, bl[i].scales, &sc1, &m1);
+            get_scale_min_k4(2 * j + 1, bl[i].scales, &sc2, &m2);
+            __m256 qx_lo = _mm256_setzero_ps();
+            __m256 qx_hi = _mm256_setzero_ps();
+            __m256 xs_lo = _mm256_setzero_ps();
+            __m256 xs_hi = _mm256_setzero_ps();
+            for (int l = 0; l < 32; l += 8) {
+                __m128i raw = _mm_loadl_epi64((const __m128i *)(q + l));
+                __m128i lo = _mm_and_si128(raw, mask);
+                __m128i hi = _mm_and_si128(_mm_srli_epi16(raw, 4), mask);
+                __m256 x_lo = _mm256_loadu_ps(xb + l);
+                __m256 x_hi = _mm256_loadu_ps(xb + 32 + l);
+                qx_lo = _mm256_fmadd_ps(u8x8_to_ps(lo), x_lo, qx_lo);
+                qx_hi = _mm256_fmadd_ps(u8x8_to_ps(hi), x_hi, qx_hi);
+                xs_lo = _mm256_add_ps(xs_lo, x_lo);
+                xs_hi = _mm256_add_ps(xs_hi, x_hi);
+            }
+            total = _mm256_fmadd_ps(_mm256_set1_ps(d * (float)sc1), qx_lo, total);
+            total = _mm256_fnmadd_ps(_mm256_set1_ps(dmin * (float)m1), xs_lo, total);
+            total = _mm256_fmadd_ps(_mm256_set1_ps(d * (float)sc2), qx_hi, total);
+            total = _mm256_fnmadd_ps(_mm256_set1_ps(dmin * (float)m2), xs_hi, total);
+            q += 32;
+            xb += 64;
+        }
+    }
+    return hsum_avx2(total);
+}
+
+// Same packing as dequantize_row_q5_k: value idx takes nibble (idx & 1) of
+// qs[idx / 2] and bit (idx & 7) of qh[idx / 8] as its fifth bit.
+TARGET_AVX2 float x86_avx2_dot_q5_k(const void *blocks, const float *x, uint32_t nb) {
+    const struct block_q5_k *bl = (const struct block_q5_k *)blocks;
+    const __m256i nib_shift = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
+    const __m256i bit_shift = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i m0f = _mm256_set1_epi32(0x0F);
+    const __m256i one = _mm256_set1_epi32(1);
+    __m256 total = _mm256_setzero_ps();
+    for (uint32_t i = 0; i < nb; ++i) {
+        const float d = _cvtsh_ss(bl[i].d);
+        const float dmin = _cvtsh_ss(bl[i].dmin);
+        const float *xb = x + (uint64_t)i * QK_K;
+        for (uint32_t sb = 0; sb < 8; ++sb) {
+            uint8_t sc, m;
+            get_scale_min_k4((int)sb, bl[i].scales, &sc, &m);
+            __m256 qx = _mm256_setzero_ps();
+            __m256 xs = _mm256_setzero_ps();
+            for (uint32_t l = 0; l < 32; l += 8) {
+                uint32_t base = sb * 32 + l;
+                uint32_t qs4;
+                memcpy(&qs4, bl[i].qs + base / 2, sizeof(qs4));
+                __m256i lo = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32((int)qs4), nib_shift), m0f);
+                __m256i hb = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(bl[i].qh[base / 8]), bit_shift), one);
+                __m256i qv = _mm256_or_si256(lo, _mm256_slli_epi32(hb, 4));
+                __m256 xv = _mm256_loadu_ps(xb + base);
+                qx = _mm256_fmadd_ps(_mm256_cvtepi32_ps(qv), xv, qx);
+                xs = _mm256_add_ps(xs, xv);
+            }
+            total = _mm256_fmadd_ps(_mm256_set1_ps(d * (float)sc), qx, total);
+            total = _mm256_fnmadd_ps(_mm256_set1_ps(dmin * (float)m), xs, total);
+        }
+    }
+    return hsum_avx2(total);
+}
+
+TARGET_AVX2 float x86_avx2_dot_q6_k(const void *blocks, const float *x, uint32_t nb) {
+    const struct block_q6_k *bl = (const struct block_q6_k *)blocks;
+    const __m256i m0f = _mm256_set1_epi32(0x0F);
+    const __m256i m03 = _mm256_set1_epi32(0x03);
+    const __m256i bias = _mm256_set1_epi32(32);
+    __m256 total = _mm256_setzero_ps();
+    for (uint32_t i = 0; i < nb; ++i) {
+        const float d = _cvtsh_ss(bl[i].d);
+        const uint8_t *ql = bl[i].ql;
+        const uint8_t *qh = bl[i].qh;
+        const int8_t *sc = bl[i].scales;
+        const float *xb = x + (uint64_t)i * QK_K;
+        for (uint32_t n = 0; n < QK_K; n += 128) {
+            for (uint32_t l = 0; l < 32; l += 8) {
+                uint32_t is = l / 16;
+                __m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(ql + l)));
+                __m256i b = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(ql + 32 + l)));
+                __m256i h = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(qh + l)));
+                __m256i q1 = _mm256_or_si256(_mm256_and_si256(a, m0f),
+                                             _mm256_slli_epi32(_mm256_and_si256(h, m03), 4));
+                __m256i q2 = _mm256_or_si256(_mm256_and_si256(b, m0f),
+                                             _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(h, 2), m03), 4));
+                __m256i q3 = _mm256_or_si256(_mm256_srli_epi32(a, 4),
+                                             _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(h, 4), m03), 4));
+                __m256i q4 = _mm256_or_si256(_mm256_srli_epi32(b, 4),
+                                             _mm256_slli_epi32(_mm256_srli_epi32(h, 6), 4));
+                __m256 p1 = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(q1, bias)), _mm256_loadu_ps(xb + l));
+                __m256 p2 = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(q2, bias)), _mm256_loadu_ps(xb + 32 + l));
+                __m256 p3 = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(q3, bias)), _mm256_loadu_ps(xb + 64 + l));
+                __m256 p4 = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(q4, bias)), _mm256_loadu_ps(xb + 96 + l));
+                total = _mm256_fmadd_ps(_mm256_set1_ps(d * (float)sc[is + 0]), p1, total);
+                total = _mm256_fmadd_ps(_mm256_set1_ps(d * (float)sc[is + 2]), p2, total);
+                total = _mm256_fmadd_ps(_mm256_set1_ps(d * (float)sc[is + 4]), p3, total);
+                total = _mm256_fmadd_ps(_mm256_set1_ps(d * (float)sc[is + 6]), p4, total);
+            }
+            xb += 128;
+            ql += 64;
+            qh += 32;
+            sc += 8;
+        }
+    }
+    return hsum_avx2(total);
+}
+
+// Single super-block dequantizers for the GEMM path, where one dequantized
+// block is reused across many activation columns.
+TARGET_AVX2 void x86_avx2_dequant_q4_k(const void *block, float *y) {
+    const struct block_q4_k *bl = (const struct block_q4_k *)block;
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    const float d = _cvtsh_ss(bl->d);
+    const float dmin = _cvtsh_ss(bl->dmin);
+    const uint8_t *q = bl->qs;
+    for (int j = 0; j < 4; ++j) {
+        uint8_t sc1, m1, sc2, m2;
+        get_scale_min_k4(2 * j + 0, bl->scales, &sc1, &m1);
+        get_scale_min_k4(2 * j + 1, bl->scales, &sc2, &m2);
+        const __m256 d1 = _mm256_set1_ps(d * (float)sc1);
+        const __m256 min1 = _mm256_set1_ps(dmin * (float)m1);
+        const __m256 d2 = _mm256_set1_ps(d * (float)sc2);
+        const __m256 min2 = _mm256_set1_ps(dmin * (float)m2);
+        for (int l = 0; l < 32; l += 8) {
+            __m128i raw = _mm_loadl_epi64((const __m128i *)(q + l));
+            __m128i lo = _mm_and_si128(raw, mask);
+            __m128i hi = _mm_and_si128(_mm_srli_epi16(raw, 4), mask);
+            _mm256_storeu_ps(y + l, _mm256_fmsub_ps(d1, u8x8_to_ps(lo), min1));
+            _mm256_storeu_ps(y + 32 + l, _mm256_fmsub_ps(d2, u8x8_to_ps(hi), min2));
+        }
+        q += 32;
+        y += 64;
+    }
+}
+
+TARGET_AVX2 void x86_avx2_dequant_q5_k(const void *block, float *y) {
+    const struct block_q5_k *bl = (const struct block_q5_k *)block;
+    const __m256i nib_shift = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
+    const __m256i bit_shift = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i m0f = _mm256_set1_epi32(0x0F);
+    const __m256i one = _mm256_set1_epi32(1);
+    const float d = _cvtsh_ss(bl->d);
+    const float dmin = _cvtsh_ss(bl->dmin);
+    for (uint32_t sb = 0; sb < 8; ++sb) {
+        uint8_t sc, m;
+        get_scale_min_k4((int)sb, bl->scales, &sc, &m);
+        const __m256 d1 = _mm256_set1_ps(d * (float)sc);
+        const __m256 min1 = _mm256_set1_ps(dmin * (float)m);
+        for (uint32_t l = 0; l < 32; l += 8) {
+            uint32_t base = sb * 32 + l;
+            uint32_t qs4;
+            memcpy(&qs4, bl->qs + base / 2, sizeof(qs4));
+            __m256i lo = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32((int)qs4), nib_shift), m0f);
+            __m256i hb = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(bl->qh[base / 8]), bit_shift), one);
+            __m256i qv = _mm256_or_si256(lo, _mm256_slli_epi32(hb, 4));
+            _mm256_storeu_ps(y + base, _mm256_fmsub_ps(d1, _mm256_cvtepi32_ps(qv), min1));
+        }
+    }
+}
+
+TARGET_AVX2 void x86_avx2_dequant_q6_k(const void *block, float *y) {
+    const struct block_q6_k *bl = (const struct block_q6_k *)block;
+    const __m256i m0f = _mm256_set1_epi32(0x0F);
+    const __m256i m03 = _mm256_set1_epi32(0x03);
+    const __m256i bias = _mm256_set1_epi32(32);
+    const float d = _cvtsh_ss(bl->d);
+    const uint8_t *ql = bl->ql;
+    const uint8_t *qh = bl->qh;
+    const int8_t *sc = bl->scales;
+    for (uint32_t n = 0; n < QK_K; n += 128) {
+        for (uint32_t l = 0; l < 32; l += 8) {
+            uint32_t is = l / 16;
+            __m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(ql + l)));
+            __m256i b = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(ql + 32 + l)));
+            __m256i h = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(qh + l)));
+            __m256i q1 = _mm256_or_si256(_mm256_and_si256(a, m0f),
+                                         _mm256_slli_epi32(_mm256_and_si256(h, m03), 4));
+            __m256i q2 = _mm256_or_si256(_mm256_and_si256(b, m0f),
+                                         _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(h, 2), m03), 4));
+            __m256i q3 = _mm256_or_si256(_mm256_srli_epi32(a, 4),
+                                         _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(h, 4), m03), 4));
+            __m256i q4 = _mm256_or_si256(_mm256_srli_epi32(b, 4),
+                                         _mm256_slli_epi32(_mm256_srli_epi32(h, 6), 4));
+            _mm256_storeu_ps(y + l, _mm256_mul_ps(_mm256_set1_ps(d * (float)sc[is + 0]),
+                                                  _mm256_cvtepi32_ps(_mm256_sub_epi32(q1, bias))));
+            _mm256_storeu_ps(y + 32 + l, _mm256_mul_ps(_mm256_set1_ps(d * (float)sc[is + 2]),
+                                                       _mm256_cvtepi32_ps(_mm256_sub_epi32(q2, bias))));
+            _mm256_storeu_ps(y + 64 + l, _mm256_mul_ps(_mm256_set1_ps(d * (float)sc[is + 4]),
+                                                       _mm256_cvtepi32_ps(_mm256_sub_epi32(q3, bias))));
+            _mm256_storeu_ps(y + 96 + l, _mm256_mul_ps(_mm256_set1_ps(d * (float)sc[is + 6]),
+                                                       _mm256_cvtepi32_ps(_mm256_sub_epi32(q4, bias))));
+        }
+        y += 128;
+        ql += 64;
+        qh += 32;
+        sc += 8;
+    }
+}
+
+TARGET_AVX2 void x86_avx2_dot_cols_256(const float *w, const float *b, uint64_t ldb,
+                                       float *acc, uint32_t n) {
+    uint32_t j = 0;
+    for (; j + 4 <= n; j += 4) {
+        const float *b0 = b + (uint64_t)(j + 0) * ldb;
+        const float *b1 = b + (uint64_t)(j + 1) * ldb;
+        const float *b2 = b + (uint64_t)(j + 2) * ldb;
+        const float *b3 = b + (uint64_t)(j + 3) * ldb;
+        __m256 s0 = _mm256_setzero_ps();
+        __m256 s1 = _mm256_setzero_ps();
+        __m256 s2 = _mm256_setzero_ps();
+        __m256 s3 = _mm256_setzero_ps();
+        for (uint32_t i = 0; i < QK_K; i += 8) {
+            __m256 wv = _mm256_loadu_ps(w + i);
+            s0 = _mm256_fmadd_ps(wv, _mm256_loadu_ps(b0 + i), s0);
+            s1 = _mm256_fmadd_ps(wv, _mm256_loadu_ps(b1 + i), s1);
+            s2 = _mm256_fmadd_ps(wv, _mm256_loadu_ps(b2 + i), s2);
+            s3 = _mm256_fmadd_ps(wv, _mm256_loadu_ps(b3 + i), s3);
+        }
+        acc[j + 0] += hsum_avx2(s0);
+        acc[j + 1] += hsum_avx2(s1);
+        acc[j + 2] += hsum_avx2(s2);
+        acc[j + 3] += hsum_avx2(s3);
+    }
+    for (; j < n; ++j) {
+        const float *bv = b + (uint64_t)j * ldb;
+        __m256 s = _mm256_setzero_ps();
+        for (uint32_t i = 0; i < QK_K; i += 8) {
+            s = _mm256_fmadd_ps(_mm256_loadu_ps(w + i), _mm256_loadu_ps(bv + i), s);
+        }
+        acc[j] += hsum_avx2(s);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// AVX-512F (16 lanes)
+// ---------------------------------------------------------------------------
+
+TARGET_AVX512 static inline __m512 u8x16_to_ps(__m128i bytes) {
+    return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(bytes));
+}
+
+TARGET_AVX512 float x86_avx512_dot_q4_k(const void *blocks, const float *x, uint32_t nb) {
+    const struct block_q4_k *bl = (const struct block_q4_k *)blocks;
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    __m512 total = _mm512_setzero_ps();
+    for (uint32_t i = 0; i < nb; ++i) {
+        const float d = _cvtsh_ss(bl[i].d);
+        const float dmin = _cvtsh_ss(bl[i].dmin);
+        const uint8_t *q = bl[i].qs;
+        const float *xb = x + (uint64_t)i * QK_K;
+        for (int j = 0; j < 4; ++j) {
+            uint8_t sc1, m1, sc2, m2;
+            get_scale_min_k4(2 * j + 0, bl[i].scales, &sc1, &m1);
+            get_scale_min_k4(2 * j + 1, bl[i].scales, &sc2, &m2);
+            __m512 qx_lo = _mm512_setzero_ps();
+            __m512 qx_hi = _mm512_setzero_ps();
+            __m512 xs_lo = _mm512_setzero_ps();
+            __m512 xs_hi = _mm512_setzero_ps();
+            for (int l = 0; l < 32; l += 16) {
+                __m128i raw = _mm_loadu_si128((const __m128i *)(q + l));
+                __m128i lo = _mm_and_si128(raw, mask);
+                __m128i hi = _mm_and_si128(_mm_srli_epi16(raw, 4), mask);
+                __m512 x_lo = _mm512_loadu_ps(xb + l);
+                __m512 x_hi = _mm512_loadu_ps(xb + 32 + l);
+                qx_lo = _mm512_fmadd_ps(u8x16_to_ps(lo), x_lo, qx_lo);
+                qx_hi = _mm512_fmadd_ps(u8x16_to_ps(hi), x_hi, qx_hi);
+                xs_lo = _mm512_add_ps(xs_lo, x_lo);
+                xs_hi = _mm512_add_ps(xs_hi, x_hi);
+            }
+            total = _mm512_fmadd_ps(_mm512_set1_ps(d * (float)sc1), qx_lo, total);
+            total = _mm512_fnmadd_ps(_mm512_set1_ps(dmin * (float)m1), xs_lo, total);
+            total = _mm512_fmadd_ps(_mm512_set1_ps(d * (float)sc2), qx_hi, total);
+            total = _mm512_fnmadd_ps(_mm512_set1_ps(dmin * (float)m2), xs_hi, total);
+            q += 32;
+            xb += 64;
+        }
+    }
+    return _mm512_reduce_add_ps(total);
+}
+
+TARGET_AVX512 float x86_avx512_dot_q5_k(const void *blocks, const float *x, uint32_t nb) {
+    const struct block_q5_k *bl = (const struct block_q5_k *)blocks;
+    const __m512i nib_shift = _mm512_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28,
+                                                0, 4, 8, 12, 16, 20, 24, 28);
+    const __m512i bit_shift = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                                                8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i m0f = _mm512_set1_epi32(0x0F);
+    const __m512i one = _mm512_set1_epi32(1);
+    __m512 total = _mm512_setzero_ps();
+    for (uint32_t i = 0; i < nb; ++i) {
+        const float d = _cvtsh_ss(bl[i].d);
+        const float dmin = _cvtsh_ss(bl[i].dmin);
+        const float *xb = x + (uint64_t)i * QK_K;
+        for (uint32_t sb = 0; sb < 8; ++sb) {
+            uint8_t sc, m;
+            get_scale_min_k4((int)sb, bl[i].scales, &sc, &m);
+            __m512 qx = _mm512_setzero_ps();
+            __m512 xs = _mm512_setzero_ps();
+            for (uint32_t l = 0; l < 32; l += 16) {
+                uint32_t base = sb * 32 + l;
+                uint32_t qs_lo, qs_hi;
+                uint16_t qh16;
+                memcpy(&qs_lo, bl[i].qs + base / 2, sizeof(qs_lo));
+                memcpy(&qs_hi, bl[i].qs + base / 2 + 4, sizeof(qs_hi));
+                memcpy(&qh16, bl[i].qh + base / 8, sizeof(qh16));
+                __m512i qs_v = _mm512_inserti64x4(_mm512_castsi256_si512(_mm256_set1_epi32((int)qs_lo)),
+                                                  _mm256_set1_epi32((int)qs_hi), 1);
+                __m512i lo = _mm512_and_si512(_mm512_srlv_epi32(qs_v, nib_shift), m0f);
+                __m512i hb = _mm512_and_si512(_mm512_srlv_epi32(_mm512_set1_epi32(qh16), bit_shift), one);
+                __m512i qv = _mm512_or_si512(lo, _mm512_slli_epi32(hb, 4));
+                __m512 xv = _mm512_loadu_ps(xb + base);
+                qx = _mm512_fmadd_ps(_mm512_cvtepi32_ps(qv), xv, qx);
+                xs = _mm512_add_ps(xs, xv);
+            }
+            total = _mm512_fmadd_ps(_mm512_set1_ps(d * (float)sc), qx, total);
+            total = _mm512_fnmadd_ps(_mm512_set1_ps(dmin * (float)m), xs, total);
+        }
+    }
+    return _mm512_reduce_add_ps(total);
+}
+
+TARGET_AVX512 float x86_avx512_dot_q6_k(const void *blocks, const float *x, uint32_t nb) {
+    const struct block_q6_k *bl = (const struct block_q6_k *)blocks;
+    const __m512i m0f = _mm512_set1_epi32(0x0F);
+    const __m512i m03 = _mm512_set1_epi32(0x03);
+    const __m512i bias = _mm512_set1_epi32(32);
+    __m512 total = _mm512_setzero_ps();
+    for (uint32_t i = 0; i < nb; ++i) {
+        const float d = _cvtsh_ss(bl[i].d);
+        const uint8_t *ql = bl[i].ql;
+        const uint8_t *qh = bl[i].qh;
+        const int8_t *sc = bl[i].scales;
+        const float *xb = x + (uint64_t)i * QK_K;
+        for (uint32_t n = 0; n < QK_K; n += 128) {
+            for (uint32_t l = 0; l < 32; l += 16) {
+                uint32_t is = l / 16;
+                __m512i a = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(ql + l)));
+                __m512i b = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(ql + 32 + l)));
+                __m512i h = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(qh + l)));
+                __m512i q1 = _mm512_or_si512(_mm512_and_si512(a, m0f),
+                                             _mm512_slli_epi32(_mm512_and_si512(h, m03), 4));
+                __m512i q2 = _mm512_or_si512(_mm512_and_si512(b, m0f),
+                                             _mm512_slli_epi32(_mm512_and_si512(_mm512_srli_epi32(h, 2), m03), 4));
+                __m512i q3 = _mm512_or_si512(_mm512_srli_epi32(a, 4),
+                                             _mm512_slli_epi32(_mm512_and_si512(_mm512_srli_epi32(h, 4), m03), 4));
+                __m512i q4 = _mm512_or_si512(_mm512_srli_epi32(b, 4),
+                                             _mm512_slli_epi32(_mm512_srli_epi32(h, 6), 4));
+                __m512 p1 = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_sub_epi32(q1, bias)), _mm512_loadu_ps(xb + l));
+                __m512 p2 = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_sub_epi32(q2, bias)), _mm512_loadu_ps(xb + 32 + l));
+                __m512 p3 = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_sub_epi32(q3, bias)), _mm512_loadu_ps(xb + 64 + l));
+                __m512 p4 = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_sub_epi32(q4, bias)), _mm512_loadu_ps(xb + 96 + l));
+                total = _mm512_fmadd_ps(_mm512_set1_ps(d * (float)sc[is + 0]), p1, total);
+                total = _mm512_fmadd_ps(_mm512_set1_ps(d * (float)sc[is + 2]), p2, total);
+                total = _mm512_fmadd_ps(_mm512_set1_ps(d * (float)sc[is + 4]), p3, total);
+                total = _mm512_fmadd_ps(_mm512_set1_ps(d * (float)sc[is + 6]), p4, total);
+            }
+            xb += 128;
+            ql += 64;
+            qh += 32;
+            sc += 8;
+        }
+    }
+    return _mm512_reduce_add_ps(total);
+}
+
+TARGET_AVX512 void x86_avx512_dot_cols_256(const float *w, const float *b, uint64_t ldb,
+                                           float *acc, uint32_t n) {
+    uint32_t j = 0;
+    for (; j + 4 <= n; j += 4) {
+        const float *b0 = b + (uint64_t)(j + 0) * ldb;
+        const float *b1 = b + (uint64_t)(j + 1) * ldb;
+        const float *b2 = b + (uint64_t)(j + 2) * ldb;
+        const float *b3 = b + (uint64_t)(j + 3) * ldb;
+        __m512 s0 = _mm512_setzero_ps();
+        __m512 s1 = _mm512_setzero_ps();
+        __m512 s2 = _mm512_setzero_ps();
+        __m512 s3 = _mm512_setzero_ps();
+        for (uint32_t i = 0; i < QK_K; i += 16) {
+            __m512 wv = _mm512_loadu_ps(w + i);
+            s0 = _mm512_fmadd_ps(wv, _mm512_loadu_ps(b0 + i), s0);
+            s1 = _mm512_fmadd_ps(wv, _mm512_loadu_ps(b1 + i), s1);
+            s2 = _mm512_fmadd_ps(wv, _mm512_loadu_ps(b2 + i), s2);
+            s3 = _mm512_fmadd_ps(wv, _mm512_loadu_ps(b3 + i), s3);
+        }
+        acc[j + 0] += _mm512_reduce_add_ps(s0);
+        acc[j + 1] += _mm512_reduce_add_ps(s1);
+        acc[j + 2] += _mm512_reduce_add_ps(s2);
+        acc[j + 3] += _mm512_reduce_add_ps(s3);
+    }
+    for (; j < n; ++j) {
+        const float *bv = b + (uint64_t)j * ldb;
+        __m512 s = _mm512_setzero_ps();
+        for (uint32_t i = 0; i < QK_K; i += 16) {
+            s = _mm512_fmadd_ps(_mm512_loadu_ps(w + i), _mm512_loadu_ps(bv + i), s);
+        }
+        acc[j] += _mm512_reduce_add_ps(s);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// AVX2 integer kernels (K-quant weights x Q8_K activations)
+// ---------------------------------------------------------------------------
+
+// maddubs multiplies unsigned weight quants by signed activation quants into
+// int16 pairs; madd then applies the int16 sub-block scale and widens to
+// int32. Weight quants stay in 0..63, so the pair sums cannot saturate.
+TARGET_AVX2 static inline __m256i mul_sum_scaled(__m256i q, __m256i y, __m256i scale) {
+    return _mm256_madd_epi16(_mm256_maddubs_epi16(q, y), scale);
+}
+
+// The min term dmin*m*sum(y) comes from the precomputed Q8_K block sums.
+TARGET_AVX2 float x86_avx2_dot_q4_k_q8_k(const void *blocks, const void *y_q8k, uint32_t nb) {
+    const struct block_q4_k *bl = (const struct block_q4_k *)blocks;
+    const struct block_q8_k *yb = (const struct block_q8_k *)y_q8k;
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    __m256 acc = _mm256_setzero_ps();
+    float mins = 0.0f;
+    for (uint32_t i = 0; i < nb; ++i) {
+        const uint8_t *q = bl[i].qs;
+        const int8_t *a = yb[i].qs;
+        const int16_t *bsums = yb[i].bsums;
+        __m256i sumi = _mm256_setzero_si256();
+        int32_t summ = 0;
+        for (int j = 0; j < 4; ++j) {
+            uint8_t sc1, m1, sc2, m2;
+            get_scale_min_k4(2 * j + 0, bl[i].scales, &sc1, &m1);
+            get_scale_min_k4(2 * j + 1, bl[i].scales, &sc2, &m2);
+            __m256i raw = _mm256_loadu_si256((const __m256i *)(q + 32 * j));
+            __m256i lo = _mm256_and_si256(raw, mask);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(raw, 4), mask);
+            __m256i y_lo = _mm256_loadu_si256((const __m256i *)(a + 64 * j));
+            __m256i y_hi = _mm256_loadu_si256((const __m256i *)(a + 64 * j + 32));
+            sumi = _mm256_add_epi32(sumi, mul_sum_scaled(lo, y_lo, _mm256_set1_epi16((int16_t)sc1)));
+            sumi = _mm256_add_epi32(sumi, mul_sum_scaled(hi, y_hi, _mm256_set1_epi16((int16_t)sc2)));
+            summ += (int32_t)m1 * (bsums[4 * j + 0] + bsums[4 * j + 1]);
+            summ += (int32_t)m2 * (bsums[4 * j + 2] + bsums[4 * j + 3]);
+        }
+        const float d = yb[i].d * _cvtsh_ss(bl[i].d);
+        const float dmin = yb[i].d * _cvtsh_ss(bl[i].dmin);
+        acc = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(sumi), acc);
+        mins += dmin * (float)summ;
+    }
+    return hsum_avx2(acc) - mins;
+}
+
+// Nibbles are interleaved (value idx in nibble idx & 1 of qs[idx / 2]), so
+// unpacking the low/high nibble vectors restores value order. The fifth bits
+// of a sub-block are 32 consecutive bits of qh, spread to bytes with a
+// shuffle + bit test.
+TARGET_AVX2 float x86_avx2_dot_q5_k_q8_k(const void *blocks, const void *y_q8k, uint32_t nb) {
+    const struct block_q5_k *bl = (const struct block_q5_k *)blocks;
+    const struct block_q8_k *yb = (const struct block_q8_k *)y_q8k;
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    const __m256i byte_sel = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                              2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i bit_sel = _mm256_set1_epi64x((long long)0x8040201008040201ULL);
+    const __m256i bit4 = _mm256_set1_epi8(0x10);
+    __m256 acc = _mm256_setzero_ps();
+    float mins = 0.0f;
+    for (uint32_t i = 0; i < nb; ++i) {
+        const int8_t *a = yb[i].qs;
+        const int16_t *bsums = yb[i].bsums;
+        __m256i sumi = _mm256_setzero_si256();
+        int32_t summ = 0;
+        for (int sb = 0; sb < 8; ++sb) {
+            uint8_t sc, m;
+            get_scale_min_k4(sb, bl[i].scales, &sc, &m);
+            __m128i raw = _mm_loadu_si128((const __m128i *)(bl[i].qs + 16 * sb));
+            __m128i lo = _mm_and_si128(raw, mask);
+            __m128i hi = _mm_and_si128(_mm_srli_epi16(raw, 4), mask);
+            __m256i q = _mm256_set_m128i(_mm_unpackhi_epi8(lo, hi), _mm_unpacklo_epi8(lo, hi));
+            int32_t bits;
+            memcpy(&bits, bl[i].qh + 4 * sb, sizeof(bits));
+            __m256i hb = _mm256_shuffle_epi8(_mm256_set1_epi32(bits), byte_sel);
+            hb = _mm256_cmpeq_epi8(_mm256_and_si256(hb, bit_sel), bit_sel);
+            q = _mm256_or_si256(q, _mm256_and_si256(hb, bit4));
+            __m256i y = _mm256_loadu_si256((const __m256i *)(a + 32 * sb));
+            sumi = _mm256_add_epi32(sumi, mul_sum_scaled(q, y, _mm256_set1_epi16((int16_t)sc)));
+            summ += (int32_t)m * (bsums[2 * sb + 0] + bsums[2 * sb + 1]);
+        }
+        const float d = yb[i].d * _cvtsh_ss(bl[i].d);
+        const float dmin = yb[i].d * _cvtsh_ss(bl[i].dmin);
+        acc = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(sumi), acc);
+        mins += dmin * (float)summ;
+    }
+    return hsum_avx2(acc) - mins;
+}
+
+// Quants are used unsigned (0..63) and the -32 offset is folded in through
+// the block sums, which share the 16-value granularity of the Q6_K scales.
+TARGET_AVX2 float x86_avx2_dot_q6_k_q8_k(const void *blocks, const void *y_q8k, uint32_t nb) {
+    const struct block_q6_k *bl = (const struct block_q6_k *)blocks;
+    const struct block_q8_k *yb = (const struct block_q8_k *)y_q8k;
+    const __m256i m0f = _mm256_set1_epi8(0x0F);
+    const __m256i m30 = _mm256_set1_epi8(0x30);
+    __m256 acc = _mm256_setzero_ps();
+    for (uint32_t i = 0; i < nb; ++i) {
+        const uint8_t *ql = bl[i].ql;
+        const uint8_t *qh = bl[i].qh;
+        const int8_t *sc = bl[i].scales;
+        const int8_t *a = yb[i].qs;
+        __m256i sumi = _mm256_setzero_si256();
+        int32_t offs = 0;
+        for (int g = 0; g < QK_K / 16; ++g) {
+            offs += (int32_t)sc[g] * yb[i].bsums[g];
+        }
+        for (int n = 0; n < 2; ++n) {
+            __m256i l0 = _mm256_loadu_si256((const __m256i *)(ql + 0));
+            __m256i l1 = _mm256_loadu_si256((const __m256i *)(ql + 32));
+            __m256i h = _mm256_loadu_si256((const __m256i *)qh);
+            __m256i q[4];
+            q[0] = _mm256_or_si256(_mm256_and_si256(l0, m0f),
+                                   _mm256_and_si256(_mm256_slli_epi16(h, 4), m30));
+            q[1] = _mm256_or_si256(_mm256_and_si256(l1, m0f),
+                                   _mm256_and_si256(_mm256_slli_epi16(h, 2), m30));
+            q[2] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(l0, 4), m0f),
+                                   _mm256_and_si256(h, m30));
+            q[3] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(l1, 4), m0f),
+                                   _mm256_and_si256(_mm256_srli_epi16(h, 2), m30));
+            for (int r = 0; r < 4; ++r) {
+                __m256i scale = _mm256_set_m128i(_mm_set1_epi16(sc[2 * r + 1]),
+                                                 _mm_set1_epi16(sc[2 * r + 0]));
+                __m256i y = _mm256_loadu_si256((const __m256i *)(a + 32 * r));
+                sumi = _mm256_add_epi32(sumi, mul_sum_scaled(q[r], y, scale));
+            }
+            ql += 64;
+            qh += 32;
+            sc += 8;
+            a += 128;
+        }
+        const float d = yb[i].d * _cvtsh_ss(bl[i].d);
+        __m256i ofs = _mm256_setr_epi32(32 * offs, 0, 0, 0, 0, 0, 0, 0);
+        acc = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(_mm256_sub_epi32(sumi, ofs)), acc);
+    }
+    return hsum_avx2(acc);
+}
+
+// ---------------------------------------------------------------------------
+// KV cache quantizers (32-value groups)
+// ---------------------------------------------------------------------------
+
+TARGET_AVX2 static inline float hmax_avx2(__m256 v) {
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_movehdup_ps(m));
+    return _mm_cvtss_f32(m);
+}
+
+TARGET_AVX2 static inline float hmin_avx2(__m256 v) {
+    __m128 m = _mm_min_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_min_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_min_ss(m, _mm_movehdup_ps(m));
+    return _mm_cvtss_f32(m);
+}
+
+// x / d rounded to nearest even (cvtps under the default MXCSR, the same
+// rounding as lrintf), clamped to [lo, hi] and packed to 32 bytes in element
+// order: signed as is, unsigned offset by -lo.
+TARGET_AVX2 static inline __m256i round_pack_32(const __m256 *v, __m256 d, int lo, int hi, int sign) {
+    const __m256i vlo = _mm256_set1_epi32(lo);
+    const __m256i vhi = _mm256_set1_epi32(hi);
+    const __m256i bias = _mm256_set1_epi32(sign ? 0 : -lo);
+    __m256i q[4];
+    for (int i = 0; i < 4; ++i) {
+        q[i] = _mm256_cvtps_epi32(_mm256_div_ps(v[i], d));
+        q[i] = _mm256_min_epi32(_mm256_max_epi32(q[i], vlo), vhi);
+        q[i] = _mm256_add_epi32(q[i], bias);
+    }
+    __m256i p01 = _mm256_packs_epi32(q[0], q[1]);
+    __m256i p23 = _mm256_packs_epi32(q[2], q[3]);
+    __m256i p = sign ? _mm256_packs_epi16(p01, p23) : _mm256_packus_epi16(p01, p23);
+    // The packs work per 128-bit lane; restore element order.
+    return _mm256_permutevar8x32_epi32(p, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
+
+TARGET_AVX2 void x86_avx2_quantize_q8_0(const float *x, void *y, uint32_t nb) {
+    uint8_t *out = (uint8_t *)y;
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    for (uint32_t b = 0; b < nb; ++b, x += 32, out += 36) {
+        __m256 v[4];
+        __m256 amax = _mm256_setzero_ps();
+        for (int i = 0; i < 4; ++i) {
+            v[i] = _mm256_loadu_ps(x + 8 * i);
+            amax = _mm256_max_ps(amax, _mm256_andnot_ps(sign, v[i]));
+        }
+        float scale = hmax_avx2(amax) / 127.0f;
+        if (scale == 0.0f) {
+            scale = 1.0f;
+        }
+        memcpy(out, &scale, sizeof(scale));
+        __m256i q = round_pack_32(v, _mm256_set1_ps(scale), -127, 127, 1);
+        _mm256_storeu_si256((__m256i *)(out + 4), q);
+    }
+}
+
+// Values i and i + 16 share byte i (low and high nibble), offset by 8.
+TARGET_AVX2 void x86_avx2_quantize_q4_0(const float *x, void *y, uint32_t nb) {
+    uint8_t *out = (uint8_t *)y;
+    for (uint32_t b = 0; b < nb; ++b, x += 32, out += 20) {
+        __m256 v[4];
+        __m256 vmax = _mm256_set1_ps(-INFINITY);
+        __m256 vmin = _mm256_set1_ps(INFINITY);
+        for (int i = 0; i < 4; ++i) {
+            v[i] = _mm256_loadu_ps(x + 8 * i);
+            vmax = _mm256_max_ps(vmax, v[i]);
+            vmin = _mm256_min_ps(vmin, v[i]);
+        }
+        float mx = hmax_avx2(vmax);
+        float mn = hmin_avx2(vmin);
+        float d = (mx >= -mn ? mx : mn) / -8.0f;
+        if (d == 0.0f) {
+            d = 1.0f;
+        }
+        memcpy(out, &d, sizeof(d));
+        __m256i q = round_pack_32(v, _mm256_set1_ps(d), -8, 7, 0);
+        __m128i lo = _mm256_castsi256_si128(q);
+        __m128i hi = _mm256_extracti128_si256(q, 1);
+        // Nibbles are < 16, so a 16-bit shift cannot carry across bytes.
+        _mm_storeu_si128((__m128i *)(out + 4), _mm_or_si128(lo, _mm_slli_epi16(hi, 4)));
+    }
+}
+
+#else
+
+int x86_simd_detect(void) {
+    return X86_SIMD_NONE;
+}
+
+#endif
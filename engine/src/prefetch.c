@@ -5,29 +5,90 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
 
+// Handle for one requested layer. It lives in its buffer slot, so issuing a
+// request allocates nothing; seq detects a handle outliving its request.
 struct prefetch_request {
     prefetcher_t *p;
     uint32_t buf_index;
+    uint64_t seq;
 };
 
+#define PREFETCH_DEFAULT_IO_DEPTH 8
+#define PREFETCH_DEFAULT_CHUNK (1u << 20)
+#define PREFETCH_MAX_SLOTS 256
+#define PREFETCH_INITIAL_LOOKAHEAD 2
+// Consecutive hits after which one miss-driven extra layer is dropped again.
+#define PREFETCH_BOOST_DECAY_HITS 16
+
+// Chunked read state of one buffer, guarded by the prefetcher mutex.
+struct buffer_io {
+    struct layer_read_chunk *chunks;
+    uint8_t *chunk_done;  // per chunk, for callers consuming byte ranges
+    uint32_t n_chunks;
+    uint32_t next_chunk;  // first chunk not yet claimed by a reader
+    uint32_t pending;     // chunks not yet completed
+    uint32_t pending_group[2];  // per tensor group (attention, FFN)
+    uint32_t ready_groups;      // LAYER_GROUP_* bits fully read
+    int failed;
+    uint64_t seq;         // request order; older layers are read first
+    size_t span;          // arena bytes held, including wrap padding
+    uint64_t start_ns;    // first chunk claimed
+    uint32_t range_waiters;  // callers blocked in prefetcher_wait_range
+    struct prefetch_request req;
+    pthread_cond_t done_cv;  // signalled when a group or the whole layer is read
+};
+
+// Layers live in one contiguous ring arena, each at its real size, and are
+// retired in request order. Slots describe the live layers and form a ring of
+// their own: [slot_head, slot_head + slot_count).
 struct prefetcher {
     struct prefetcher_config cfg;
+    uint8_t *arena;
+    size_t arena_cap;
+    size_t arena_head;    // start of the oldest live layer
+    size_t arena_tail;    // next free byte
+    size_t arena_used;    // live bytes, including padding skipped on wrap
+    size_t align;
+    uint32_t n_slots;
+    uint32_t slot_head;
+    uint32_t slot_count;
     struct layer_buffer *buffers;
-    pthread_t thread;
+    struct buffer_io *io;
+    uint32_t max_chunks;
+    pthread_t *readers;
+    uint32_t n_readers;
     pthread_mutex_t mu;
     pthread_cond_t cv;
     int running;
     int cancel;
+    uint64_t next_seq;
+    uint32_t in_flight;
+    uint64_t busy_start_ns;
+    // Lookahead controller: moving averages of per-layer read service time
+    // and per-layer compute time decide how many layers to keep queued.
+    uint64_t last_done_ns;
+    uint64_t read_ema_ns;
+    uint64_t compute_ema_ns;
+    uint32_t lookahead;
+    uint32_t miss_boost;
+    uint32_t hit_streak;
     struct prefetch_metrics metrics;
     struct streaming_stats *stats;
 };
 
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
 static uint32_t count_active_buffers(prefetcher_t *p) {
     uint32_t concurrent = 0;
-    for (uint32_t i = 0; i < p->cfg.depth; ++i) {
+    for (uint32_t i = 0; i < p->n_slots; ++i) {
         uint32_t st = p->buffers[i].state;
         if (st == BUF_LOADING || st == BUF_IN_USE) {
             concurrent++;
@@ -36,55 +97,202 @@ static uint32_t count_active_buffers(prefetcher_t *p) {
     return concurrent;
 }
 
-static void *prefetch_thread_main(void *arg) {
+static void ema_update(uint64_t *ema, uint64_t sample) {
+    if (*ema == 0) {
+        *ema = sample;
+        return;
+    }
+    int64_t delta = (int64_t)sample - (int64_t)*ema;
+    *ema = (uint64_t)((int64_t)*ema + delta / 8);
+}
+
+// Keeps enough layers queued to cover one read with compute: the reads of
+// ceil(read / compute) layers overlap the current one, plus one for jitter
+// and one per recent miss. Called with the mutex held.
+static void adapt_lookahead(prefetcher_t *p) {
+    uint32_t target = p->lookahead;
+    if (p->cfg.lookahead) {
+        target = p->cfg.lookahead;
+    } else if (p->compute_ema_ns > 0 && p->read_ema_ns > 0) {
+        uint64_t ratio = (p->read_ema_ns + p->compute_ema_ns - 1) / p->compute_ema_ns;
+        uint64_t t = ratio + 1 + p->miss_boost;
+        target = t > p->n_slots ? p->n_slots : (uint32_t)t;
+    }
+    if (target == 0) {
+        target = 1;
+    }
+    if (target > p->n_slots) {
+        target = p->n_slots;
+    }
+    if (target != p->lookahead) {
+        p->lookahead = target;
+        if (p->stats) {
+            p->stats->lookahead_changes += 1;
+        }
+    }
+    if (p->stats) {
+        p->stats->lookahead = p->lookahead;
+        if (p->lookahead > p->stats->lookahead_max) {
+            p->stats->lookahead_max = p->lookahead;
+        }
+        p->stats->layer_read_ema_ns = p->read_ema_ns;
+        p->stats->layer_compute_ema_ns = p->compute_ema_ns;
+    }
+}
+
+// Oldest loading buffer that still has unclaimed chunks, or n_slots if none.
+static uint32_t next_read_buffer(prefetcher_t *p) {
+    for (uint32_t k = 0; k < p->slot_count; ++k) {
+        uint32_t i = (p->slot_head + k) % p->n_slots;
+        const struct buffer_io *io = &p->io[i];
+        // Claimed (IN_USE) layers may still have FFN chunks left to read.
+        if (io->next_chunk < io->n_chunks) {
+            return i;
+        }
+    }
+    return p->n_slots;
+}
+
+// Carves len bytes off the arena tail; a layer never straddles the end, so
+// the unusable tail is skipped and charged to this allocation. Returns -1 if
+// the free space cannot hold it yet.
+static int arena_alloc(prefetcher_t *p, size_t len, size_t *out_off, size_t *out_span) {
+    if (p->arena_used == 0) {
+        p->arena_head = 0;
+        p->arena_tail = 0;
+    }
+    if (p->arena_used > 0 && p->arena_tail <= p->arena_head) {
+        // Free space is the single gap [tail, head).
+        if (p->arena_head - p->arena_tail < len) {
+            return -1;
+        }
+        *out_off = p->arena_tail;
+        *out_span = len;
+    } else if (p->arena_cap - p->arena_tail >= len) {
+        *out_off = p->arena_tail;
+        *out_span = len;
+    } else if (p->arena_head >= len) {
+        *out_off = 0;
+        *out_span = (p->arena_cap - p->arena_tail) + len;
+    } else {
+        return -1;
+    }
+    p->arena_tail = *out_off + len;
+    if (p->arena_tail == p->arena_cap) {
+        p->arena_tail = 0;
+    }
+    p->arena_used += *out_span;
+    return 0;
+}
+
+// Returns released layers at the head of the ring to the arena.
+static void retire_slots(prefetcher_t *p) {
+    while (p->slot_count > 0 && p->buffers[p->slot_head].state == BUF_EMPTY) {
+        struct buffer_io *io = &p->io[p->slot_head];
+        p->arena_used -= io->span;
+        p->arena_head = (p->arena_head + io->span) % p->arena_cap;
+        io->span = 0;
+        p->slot_head = (p->slot_head + 1) % p->n_slots;
+        p->slot_count--;
+    }
+}
+
+// Each reader claims one chunk at a time, so up to n_readers reads (across
+// one or several layers) are outstanding on the device at once.
+static void *prefetch_reader_main(void *arg) {
     prefetcher_t *p = (prefetcher_t *)arg;
+    pthread_mutex_lock(&p->mu);
     while (1) {
-        pthread_mutex_lock(&p->mu);
-        while (!p->cancel) {
-            int found = 0;
-            for (uint32_t i = 0; i < p->cfg.depth; ++i) {
-                if (p->buffers[i].state == BUF_LOADING) {
-                    found = 1;
-                    break;
-                }
-            }
-            if (found) {
-                break;
-            }
+        uint32_t idx;
+        while (!p->cancel && (idx = next_read_buffer(p)) == p->n_slots) {
             pthread_cond_wait(&p->cv, &p->mu);
         }
         if (p->cancel) {
-            pthread_mutex_unlock(&p->mu);
             break;
         }
+        struct buffer_io *io = &p->io[idx];
+        if (io->next_chunk == 0) {
+            io->start_ns = now_ns();
+        }
+        uint32_t ci = io->next_chunk++;
+        struct layer_read_chunk chunk = io->chunks[ci];
+        if (p->in_flight++ == 0) {
+            p->busy_start_ns = now_ns();
+        }
         pthread_mutex_unlock(&p->mu);
 
-        for (uint32_t i = 0; i < p->cfg.depth; ++i) {
-            struct layer_buffer *buf = &p->buffers[i];
-            pthread_mutex_lock(&p->mu);
-            if (buf->state != BUF_LOADING) {
-                pthread_mutex_unlock(&p->mu);
-                continue;
-            }
-            uint32_t layer_id = buf->layer_id;
-            pthread_mutex_unlock(&p->mu);
-
-            int ok = model_load_layer(p->cfg.model, layer_id, buf->data, buf->capacity, &buf->view, &buf->size);
+        int ok = model_read_chunk(p->cfg.model, &chunk);
 
-            pthread_mutex_lock(&p->mu);
-            if (ok != 0) {
-                fprintf(stderr, "prefetch: load failed for layer %u\n", layer_id);
-                buf->state = BUF_ERROR;
+        pthread_mutex_lock(&p->mu);
+        if (--p->in_flight == 0) {
+            uint64_t busy = now_ns() - p->busy_start_ns;
+            p->metrics.total_read_time_us += busy / 1000;
+            if (p->stats) {
+                p->stats->layer_read_ns += busy;
+            }
+        }
+        if (ok != 0) {
+            io->failed = 1;
+        } else {
+            p->metrics.total_bytes_read += chunk.size;
+        }
+        io->chunk_done[ci] = 1;
+        int signal = io->range_waiters > 0;
+        for (uint32_t g = 0; g < 2; ++g) {
+            if ((chunk.groups & (1u << g)) && --io->pending_group[g] == 0) {
+                io->ready_groups |= 1u << g;
+                signal = 1;
+            }
+        }
+        if (--io->pending == 0) {
+            struct layer_buffer *buf = &p->buffers[idx];
+            io->ready_groups = LAYER_GROUP_ALL;
+            signal = 1;
+            if (io->failed) {
+                fprintf(stderr, "prefetch: load failed for layer %u\n", buf->layer_id);
+                if (buf->state == BUF_LOADING) {
+                    buf->state = BUF_ERROR;
+                }
             } else {
-                buf->state = BUF_READY;
+                if (buf->state == BUF_LOADING) {
+                    buf->state = BUF_READY;
+                }
+                // Service time: reads of queued layers overlap, so a layer is
+                // only charged from when the previous one finished.
+                uint64_t t = now_ns();
+                uint64_t begin = io->start_ns > p->last_done_ns ? io->start_ns : p->last_done_ns;
+                p->last_done_ns = t;
+                ema_update(&p->read_ema_ns, t - begin);
+                adapt_lookahead(p);
             }
-            pthread_mutex_unlock(&p->mu);
-            pthread_cond_broadcast(&p->cv);
+        }
+        if (signal) {
+            pthread_cond_broadcast(&io->done_cv);
         }
     }
+    pthread_mutex_unlock(&p->mu);
     return NULL;
 }
 
+static void free_buffers(prefetcher_t *p) {
+    free(p->arena);
+    free(p->buffers);
+    if (p->io) {
+        for (uint32_t i = 0; i < p->n_slots; ++i) {
+            free(p->io[i].chunks);
+            free(p->io[i].chunk_done);
+            pthread_cond_destroy(&p->io[i].done_cv);
+        }
+        free(p->io);
+    }
+    free(p->readers);
+    free(p);
+}
+
+static size_t align_up(size_t x, size_t a) {
+    return (x + a - 1) / a * a;
+}
+
 prefetcher_t *prefetcher_create(const struct prefetcher_config *cfg) {
     if (!cfg || cfg->depth == 0 || !cfg->model) {
         return NULL;
@@ -94,32 +302,64 @@ prefetcher_t *prefetcher_create(const struct prefetcher_config *cfg) {
         return NULL;
     }
     p->cfg = *cfg;
-    p->buffers = (struct layer_buffer *)calloc(cfg->depth, sizeof(*p->buffers));
-    if (!p->buffers) {
-        free(p);
-        return NULL;
+    if (p->cfg.io_depth == 0) {
+        p->cfg.io_depth = PREFETCH_DEFAULT_IO_DEPTH;
     }
-    size_t buf_size = cfg->buffer_size;
-    if (buf_size == 0) {
-        if (model_get_max_layer_size(cfg->model, &buf_size) != 0 || buf_size == 0) {
-            free(p->buffers);
+    p->align = model_get_buffer_alignment(cfg->model);
+    size_t chunk = p->cfg.io_chunk_size ? p->cfg.io_chunk_size : PREFETCH_DEFAULT_CHUNK;
+    chunk = chunk / p->align * p->align;
+    p->cfg.io_chunk_size = chunk ? chunk : p->align;
+
+    size_t max_layer = 0;
+    size_t min_layer = SIZE_MAX;
+    uint32_t n_layers = model_get_layer_count(cfg->model);
+    for (uint32_t l = 0; l < n_layers; ++l) {
+        size_t sz = 0;
+        if (model_get_layer_buffer_size(cfg->model, l, &sz) != 0 || sz == 0) {
             free(p);
             return NULL;
         }
+        sz = align_up(sz, p->align);
+        max_layer = sz > max_layer ? sz : max_layer;
+        min_layer = sz < min_layer ? sz : min_layer;
+    }
+    if (max_layer == 0) {
+        free(p);
+        return NULL;
+    }
+    size_t slab = cfg->buffer_size ? align_up(cfg->buffer_size, p->align) : max_layer;
+    p->arena_cap = cfg->arena_size ? align_up(cfg->arena_size, p->align)
+                                   : (size_t)cfg->depth * slab;
+    if (p->arena_cap < max_layer) {
+        p->arena_cap = max_layer;
+    }
+    uint64_t n_slots = p->arena_cap / min_layer + 1;
+    p->n_slots = n_slots > PREFETCH_MAX_SLOTS ? PREFETCH_MAX_SLOTS : (uint32_t)n_slots;
+    // Every tensor range may end in a partial chunk, plus one for the edge
+    // of a block-rounded direct I/O span.
+    p->max_chunks = (uint32_t)(max_layer / p->cfg.io_chunk_size) + 10;
+
+    p->buffers = (struct layer_buffer *)calloc(p->n_slots, sizeof(*p->buffers));
+    p->io = (struct buffer_io *)calloc(p->n_slots, sizeof(*p->io));
+    if (p->io) {
+        for (uint32_t i = 0; i < p->n_slots; ++i) {
+            pthread_cond_init(&p->io[i].done_cv, NULL);
+        }
+    }
+    p->readers = (pthread_t *)calloc(p->cfg.io_depth, sizeof(*p->readers));
+    if (posix_memalign((void **)&p->arena, p->align, p->arena_cap) != 0) {
+        p->arena = NULL;
     }
-    for (uint32_t i = 0; i < cfg->depth; ++i) {
+    if (!p->buffers || !p->io || !p->readers || !p->arena) {
+        free_buffers(p);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < p->n_slots; ++i) {
         p->buffers[i].state = BUF_EMPTY;
-        p->buffers[i].layer_id = 0;
-        p->buffers[i].data = malloc(buf_size);
-        p->buffers[i].size = 0;
-        p->buffers[i].capacity = buf_size;
-        memset(&p->buffers[i].view, 0, sizeof(p->buffers[i].view));
-        if (!p->buffers[i].data) {
-            for (uint32_t j = 0; j < i; ++j) {
-                free(p->buffers[j].data);
-            }
-            free(p->buffers);
-            free(p);
+        p->io[i].chunks = (struct layer_read_chunk *)calloc(p->max_chunks, sizeof(*p->io[i].chunks));
+        p->io[i].chunk_done = (uint8_t *)calloc(p->max_chunks, 1);
+        if (!p->io[i].chunks || !p->io[i].chunk_done) {
+            free_buffers(p);
             return NULL;
         }
     }
@@ -129,25 +369,56 @@ prefetcher_t *prefetcher_create(const struct prefetcher_config *cfg) {
     p->cancel = 0;
     memset(&p->metrics, 0, sizeof(p->metrics));
     p->stats = cfg->stats;
-    if (p->stats) {
-        size_t total_buf = (size_t)cfg->depth * buf_size;
-        if (total_buf > p->stats->peak_buffer_usage) {
-            p->stats->peak_buffer_usage = total_buf;
-        }
-        if (buf_size > p->stats->max_layer_size) {
-            p->stats->max_layer_size = buf_size;
-        }
+    if (p->stats && max_layer > p->stats->max_layer_size) {
+        p->stats->max_layer_size = max_layer;
     }
+    p->lookahead = PREFETCH_INITIAL_LOOKAHEAD;
+    adapt_lookahead(p);
     return p;
 }
 
+uint32_t prefetcher_lookahead(prefetcher_t *p) {
+    if (!p) {
+        return 0;
+    }
+    pthread_mutex_lock(&p->mu);
+    uint32_t n = p->lookahead;
+    pthread_mutex_unlock(&p->mu);
+    return n;
+}
+
+void prefetcher_note_compute(prefetcher_t *p, uint64_t compute_ns) {
+    if (!p) {
+        return;
+    }
+    pthread_mutex_lock(&p->mu);
+    ema_update(&p->compute_ema_ns, compute_ns ? compute_ns : 1);
+    adapt_lookahead(p);
+    pthread_mutex_unlock(&p->mu);
+}
+
+uint32_t prefetcher_max_requests(const prefetcher_t *p) {
+    return p ? p->n_slots : 0;
+}
+
+size_t prefetcher_chunk_size(const prefetcher_t *p) {
+    return p ? p->cfg.io_chunk_size : 0;
+}
+
 int prefetcher_start(prefetcher_t *p) {
     if (!p || p->running) {
         return -1;
     }
     p->cancel = 0;
-    if (pthread_create(&p->thread, NULL, prefetch_thread_main, p) != 0) {
-        return -1;
+    for (uint32_t i = 0; i < p->cfg.io_depth; ++i) {
+        if (pthread_create(&p->readers[i], NULL, prefetch_reader_main, p) != 0) {
+            if (i == 0) {
+                return -1;
+            }
+            // Run with the readers that did start.
+            break;
+        }
+        p->n_readers = i + 1;
     }
     p->running = 1;
     return 0;
@@ -157,77 +428,207 @@ prefetch_request_t *prefetcher_request(prefetcher_t *p, uint32_t layer_id) {
     if (!p || !p->buffers) {
         return NULL;
     }
-    pthread_mutex_lock(&p->mu);
-    uint32_t idx = p->cfg.depth;
-    for (uint32_t i = 0; i < p->cfg.depth; ++i) {
-        if (p->buffers[i].state == BUF_EMPTY) {
-            idx = i;
-            break;
-        }
+    size_t need = 0;
+    if (model_get_layer_buffer_size(p->cfg.model, layer_id, &need) != 0) {
+        return NULL;
     }
-    if (idx == p->cfg.depth) {
+    need = align_up(need, p->align);
+    pthread_mutex_lock(&p->mu);
+    size_t off = 0, span = 0;
+    if (p->slot_count == p->n_slots || arena_alloc(p, need, &off, &span) != 0) {
         pthread_mutex_unlock(&p->mu);
         return NULL;
     }
-    p->buffers[idx].layer_id = layer_id;
-    p->buffers[idx].state = BUF_LOADING;
+    uint32_t idx = (p->slot_head + p->slot_count) % p->n_slots;
+    p->slot_count++;
+    struct layer_buffer *buf = &p->buffers[idx];
+    struct buffer_io *io = &p->io[idx];
+    buf->layer_id = layer_id;
+    buf->data = p->arena + off;
+    buf->capacity = need;
+    io->span = span;
+    io->next_chunk = 0;
+    io->failed = 0;
+    io->seq = p->next_seq++;
+    if (model_plan_layer(p->cfg.model, layer_id, buf->data, buf->capacity, &buf->view, &buf->size,
+                         p->cfg.io_chunk_size, io->chunks, p->max_chunks, &io->n_chunks) != 0) {
+        fprintf(stderr, "prefetch: cannot plan layer %u\n", layer_id);
+        io->n_chunks = 0;
+        buf->state = BUF_ERROR;
+    } else {
+        io->pending = io->n_chunks;
+        memset(io->chunk_done, 0, io->n_chunks);
+        io->pending_group[0] = 0;
+        io->pending_group[1] = 0;
+        for (uint32_t c = 0; c < io->n_chunks; ++c) {
+            io->pending_group[0] += (io->chunks[c].groups & LAYER_GROUP_ATTN) ? 1u : 0u;
+            io->pending_group[1] += (io->chunks[c].groups & LAYER_GROUP_FFN) ? 1u : 0u;
+        }
+        io->ready_groups = (io->pending_group[0] ? 0u : LAYER_GROUP_ATTN) |
+                           (io->pending_group[1] ? 0u : LAYER_GROUP_FFN);
+        buf->state = BUF_LOADING;
+    }
+    if (p->stats && p->arena_used > p->stats->peak_buffer_usage) {
+        p->stats->peak_buffer_usage = p->arena_used;
+    }
     if (p->stats) {
         uint32_t concurrent = count_active_buffers(p);
         if (concurrent > p->stats->max_concurrent_buffers) {
             p->stats->max_concurrent_buffers = concurrent;
         }
     }
+    io->req.p = p;
+    io->req.buf_index = idx;
+    io->req.seq = io->seq;
     pthread_cond_broadcast(&p->cv);
     pthread_mutex_unlock(&p->mu);
+    return &io->req;
+}
 
-    prefetch_request_t *req = (prefetch_request_t *)malloc(sizeof(*req));
-    if (!req) {
-        return NULL;
+static void account_stall(prefetcher_t *p, uint64_t wait_ns) {
+    if (p->stats) {
+        p->stats->prefetch_wait_ns += wait_ns;
+        if (wait_ns > p->stats->prefetch_max_wait_ns) {
+            p->stats->prefetch_max_wait_ns = wait_ns;
+        }
+    }
+}
+
+// Blocks until the groups are read, the load failed for good (every chunk
+// completed) or the prefetcher is cancelled. Returns the time blocked.
+static uint64_t wait_groups_locked(prefetcher_t *p, struct buffer_io *io, uint32_t groups) {
+    if (p->cancel || (io->ready_groups & groups) == groups) {
+        return 0;
+    }
+    uint64_t t0 = now_ns();
+    while (!p->cancel && (io->failed ? io->pending > 0 : (io->ready_groups & groups) != groups)) {
+        pthread_cond_wait(&io->done_cv, &p->mu);
     }
-    req->p = p;
-    req->buf_index = idx;
-    return req;
+    return now_ns() - t0;
 }
 
 struct layer_buffer *prefetcher_wait(prefetch_request_t *req) {
-    if (!req) {
+    return prefetcher_wait_partial(req, LAYER_GROUP_ALL);
+}
+
+struct layer_buffer *prefetcher_wait_partial(prefetch_request_t *req, uint32_t groups) {
+    if (!req || !req->p) {
         return NULL;
     }
     prefetcher_t *p = req->p;
     uint32_t idx = req->buf_index;
-    free(req);
-    if (!p || !p->buffers || idx >= p->cfg.depth) {
+    if (!p->buffers || idx >= p->n_slots) {
         return NULL;
     }
-    int waited = 0;
-    for (;;) {
-        pthread_mutex_lock(&p->mu);
-        uint32_t state = p->buffers[idx].state;
-        if (state == BUF_READY) {
-            p->buffers[idx].state = BUF_IN_USE;
-            if (p->stats) {
-                if (waited) {
-                    p->stats->prefetch_misses += 1;
-                } else {
-                    p->stats->prefetch_hits += 1;
-                }
-                uint32_t concurrent = count_active_buffers(p);
-                if (concurrent > p->stats->max_concurrent_buffers) {
-                    p->stats->max_concurrent_buffers = concurrent;
-                }
-            }
-            struct layer_buffer *buf = &p->buffers[idx];
-            pthread_mutex_unlock(&p->mu);
-            return buf;
-        }
-        if (state == BUF_ERROR || p->cancel) {
-            pthread_mutex_unlock(&p->mu);
-            return NULL;
+    struct layer_buffer *buf = &p->buffers[idx];
+    struct buffer_io *io = &p->io[idx];
+    pthread_mutex_lock(&p->mu);
+    if (io->seq != req->seq || buf->state == BUF_EMPTY || buf->state == BUF_IN_USE) {
+        pthread_mutex_unlock(&p->mu);
+        return NULL;
+    }
+    uint64_t wait_ns = buf->state == BUF_ERROR ? 0 : wait_groups_locked(p, io, groups);
+    if (io->failed || buf->state == BUF_ERROR || p->cancel) {
+        if (buf->state == BUF_ERROR) {
+            // The caller gets no buffer to release, so free the slot here.
+            buf->state = BUF_EMPTY;
+            retire_slots(p);
         }
-        waited = 1;
         pthread_mutex_unlock(&p->mu);
-        usleep(1000);
+        return NULL;
+    }
+    buf->state = BUF_IN_USE;
+    if (wait_ns) {
+        p->metrics.cache_misses += 1;
+        p->hit_streak = 0;
+        if (p->miss_boost < p->n_slots) {
+            p->miss_boost++;
+        }
+        adapt_lookahead(p);
+    } else {
+        p->metrics.cache_hits += 1;
+        if (++p->hit_streak >= PREFETCH_BOOST_DECAY_HITS && p->miss_boost > 0) {
+            p->miss_boost--;
+            p->hit_streak = 0;
+        }
+    }
+    if (p->stats) {
+        if (wait_ns) {
+            p->stats->prefetch_misses += 1;
+            account_stall(p, wait_ns);
+        } else {
+            p->stats->prefetch_hits += 1;
+        }
+        uint32_t concurrent = count_active_buffers(p);
+        if (concurrent > p->stats->max_concurrent_buffers) {
+            p->stats->max_concurrent_buffers = concurrent;
+        }
+    }
+    pthread_mutex_unlock(&p->mu);
+    return buf;
+}
+
+int prefetcher_wait_groups(prefetcher_t *p, struct layer_buffer *buf, uint32_t groups) {
+    if (!p || !buf) {
+        return -1;
+    }
+    struct buffer_io *io = &p->io[buf - p->buffers];
+    pthread_mutex_lock(&p->mu);
+    uint64_t wait_ns = wait_groups_locked(p, io, groups);
+    int rc = (io->failed || (io->ready_groups & groups) != groups) ? -1 : 0;
+    if (wait_ns) {
+        account_stall(p, wait_ns);
+    }
+    pthread_mutex_unlock(&p->mu);
+    return rc;
+}
+
+uint32_t prefetcher_ready_groups(prefetcher_t *p, struct layer_buffer *buf) {
+    if (!p || !buf) {
+        return 0;
     }
+    struct buffer_io *io = &p->io[buf - p->buffers];
+    pthread_mutex_lock(&p->mu);
+    uint32_t groups = io->failed ? 0u : io->ready_groups;
+    pthread_mutex_unlock(&p->mu);
+    return groups;
+}
+
+// Index of the first unread chunk overlapping [lo, hi), or n_chunks.
+static uint32_t first_unread_chunk(const struct buffer_io *io, const uint8_t *lo, const uint8_t *hi) {
+    for (uint32_t c = 0; c < io->n_chunks; ++c) {
+        const uint8_t *dst = (const uint8_t *)io->chunks[c].dst;
+        if (!io->chunk_done[c] && dst < hi && dst + io->chunks[c].size > lo) {
+            return c;
+        }
+    }
+    return io->n_chunks;
+}
+
+int prefetcher_wait_range(prefetcher_t *p, struct layer_buffer *buf, const void *addr, size_t size) {
+    if (!p || !buf || !addr) {
+        return -1;
+    }
+    struct buffer_io *io = &p->io[buf - p->buffers];
+    const uint8_t *lo = (const uint8_t *)addr;
+    const uint8_t *hi = lo + size;
+    pthread_mutex_lock(&p->mu);
+    uint64_t t0 = 0;
+    io->range_waiters++;
+    while (!p->cancel && !io->failed && io->pending > 0 &&
+           first_unread_chunk(io, lo, hi) < io->n_chunks) {
+        if (t0 == 0) {
+            t0 = now_ns();
+        }
+        pthread_cond_wait(&io->done_cv, &p->mu);
+    }
+    io->range_waiters--;
+    int rc = (io->failed || p->cancel) ? -1 : 0;
+    if (t0) {
+        account_stall(p, now_ns() - t0);
+    }
+    pthread_mutex_unlock(&p->mu);
+    return rc;
 }
 
 void prefetcher_release(prefetcher_t *p, struct layer_buffer *buf) {
@@ -235,10 +636,17 @@ void prefetcher_release(prefetcher_t *p, struct layer_buffer *buf) {
         return;
     }
     pthread_mutex_lock(&p->mu);
+    // Readers may still be filling the rest of a partially waited layer.
+    struct buffer_io *io = &p->io[buf - p->buffers];
+    while (io->pending > 0 && !p->cancel) {
+        pthread_cond_wait(&io->done_cv, &p->mu);
+    }
     buf->state = BUF_EMPTY;
     buf->layer_id = 0;
     buf->size = 0;
     memset(&buf->view, 0, sizeof(buf->view));
+    // Out-of-order releases keep their bytes until older layers go too.
+    retire_slots(p);
     pthread_mutex_unlock(&p->mu);
 }
 
@@ -249,6 +657,9 @@ void prefetcher_cancel(prefetcher_t *p) {
     pthread_mutex_lock(&p->mu);
     p->cancel = 1;
     pthread_cond_broadcast(&p->cv);
+    for (uint32_t i = 0; i < p->n_slots; ++i) {
+        pthread_cond_broadcast(&p->io[i].done_cv);
+    }
     pthread_mutex_unlock(&p->mu);
 }
 
@@ -256,7 +667,9 @@ int prefetcher_get_metrics(prefetcher_t *p, struct prefetch_metrics *out) {
     if (!p || !out) {
         return -1;
     }
+    pthread_mutex_lock(&p->mu);
     *out = p->metrics;
+    pthread_mutex_unlock(&p->mu);
     return 0;
 }
 
@@ -265,16 +678,10 @@ void prefetcher_stop(prefetcher_t *p) {
         return;
     }
     prefetcher_cancel(p);
-    if (p->running) {
-        pthread_join(p->thread, NULL);
+    for (uint32_t i = 0; i < p->n_readers; ++i) {
+        pthread_join(p->readers[i], NULL);
     }
     pthread_mutex_destroy(&p->mu);
     pthread_cond_destroy(&p->cv);
-    if (p->buffers) {
-        for (uint32_t i = 0; i < p->cfg.depth; ++i) {
-            free(p->buffers[i].data);
-        }
-        free(p->buffers);
-    }
-    free(p);
+    free_buffers(p);
 }
@@ -0,0 +1,161 @@
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define cpu_relax() _mm_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+// Polls before a worker falls back to the condvar (or the dispatcher to
+// sched_yield). Long enough to cover the gap between two matmuls of a layer.
+#define POOL_SPIN_ITERS 4096
+
+struct pool_worker {
+    thread_pool_t *pool;
+    uint32_t ith;
+    pthread_t thread;
+};
+
+struct thread_pool {
+    uint32_t n_threads;
+    struct pool_worker *workers;
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    // Bumped once per job; workers run the job when they see a new value.
+    atomic_uint generation;
+    // Workers still running the current job.
+    atomic_uint pending;
+    atomic_int stop;
+    thread_pool_fn fn;
+    void *arg;
+};
+
+static void *pool_worker_main(void *arg) {
+    struct pool_worker *w = (struct pool_worker *)arg;
+    thread_pool_t *p = w->pool;
+    // Jobs may be published before this thread first runs; counting from the
+    // initial generation makes sure none of them is skipped.
+    unsigned seen = 0;
+    while (1) {
+        unsigned gen;
+        uint32_t spins = 0;
+        while ((gen = atomic_load_explicit(&p->generation, memory_order_acquire)) == seen) {
+            if (++spins < POOL_SPIN_ITERS) {
+                cpu_relax();
+                continue;
+            }
+            pthread_mutex_lock(&p->mu);
+            while (atomic_load_explicit(&p->generation, memory_order_acquire) == seen) {
+                pthread_cond_wait(&p->cv, &p->mu);
+            }
+            pthread_mutex_unlock(&p->mu);
+            spins = 0;
+        }
+        seen = gen;
+        if (atomic_load_explicit(&p->stop, memory_order_acquire)) {
+            break;
+        }
+        p->fn(p->arg, w->ith, p->n_threads);
+        atomic_fetch_sub_explicit(&p->pending, 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static void pool_publish(thread_pool_t *p) {
+    // Bumping under the mutex pairs with the re-check in the worker sleep
+    // loop, so a worker about to sleep cannot miss the wakeup.
+    pthread_mutex_lock(&p->mu);
+    atomic_fetch_add_explicit(&p->generation, 1, memory_order_release);
+    pthread_cond_broadcast(&p->cv);
+    pthread_mutex_unlock(&p->mu);
+}
+
+uint32_t thread_pool_cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (uint32_t)n : 1u;
+}
+
+thread_pool_t *thread_pool_create(uint32_t n_threads) {
+    if (n_threads == 0) {
+        return NULL;
+    }
+    thread_pool_t *p = (thread_pool_t *)calloc(1, sizeof(*p));
+    if (!p) {
+        return NULL;
+    }
+    p->n_threads = n_threads;
+    atomic_init(&p->generation, 0);
+    atomic_init(&p->pending, 0);
+    atomic_init(&p->stop, 0);
+    pthread_mutex_init(&p->mu, NULL);
+    pthread_cond_init(&p->cv, NULL);
+    if (n_threads == 1) {
+        return p;
+    }
+    p->workers = (struct pool_worker *)calloc(n_threads - 1, sizeof(*p->workers));
+    if (!p->workers) {
+        thread_pool_destroy(p);
+        return NULL;
+    }
+    for (uint32_t i = 0; i + 1 < n_threads; ++i) {
+        p->workers[i].pool = p;
+        p->workers[i].ith = i + 1;
+        if (pthread_create(&p->workers[i].thread, NULL, pool_worker_main, &p->workers[i]) != 0) {
+            // Only the workers started so far are joined on destroy.
+            p->n_threads = i + 1;
+            thread_pool_destroy(p);
+            return NULL;
+        }
+    }
+    return p;
+}
+
+void thread_pool_destroy(thread_pool_t *p) {
+    if (!p) {
+        return;
+    }
+    if (p->workers && p->n_threads > 1) {
+        atomic_store_explicit(&p->stop, 1, memory_order_release);
+        pool_publish(p);
+        for (uint32_t i = 0; i + 1 < p->n_threads; ++i) {
+            pthread_join(p->workers[i].thread, NULL);
+        }
+    }
+    free(p->workers);
+    pthread_mutex_destroy(&p->mu);
+    pthread_cond_destroy(&p->cv);
+    free(p);
+}
+
+uint32_t thread_pool_size(const thread_pool_t *p) {
+    return p ? p->n_threads : 1u;
+}
+
+void thread_pool_run(thread_pool_t *p, thread_pool_fn fn, void *arg) {
+    if (!p || p->n_threads <= 1) {
+        fn(arg, 0, 1);
+        return;
+    }
+    p->fn = fn;
+    p->arg = arg;
+    atomic_store_explicit(&p->pending, p->n_threads - 1, memory_order_relaxed);
+    pool_publish(p);
+    fn(arg, 0, p->n_threads);
+    uint32_t spins = 0;
+    while (atomic_load_explicit(&p->pending, memory_order_acquire) != 0) {
+        if (++spins < POOL_SPIN_ITERS) {
+            cpu_relax();
+        } else {
+            sched_yield();
+        }
+    }
+}
@@ -0,0 +1,207 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kv_cache.h"
+#include "ops.h"
+
+// Decode attention for one query token: the per-head fp32 kernel on a
+// dequantized cache (what the engine used to do, dequantization included)
+// against the fused, GQA-grouped kernel reading the Q8 cache in place, on
+// the token-major layout and on head-major tiles. Sweeps head layouts and
+// context lengths, then times a prefill chunk of query rows ending each
+// context: one decode call per row against the blocked causal kernel.
+// Usage: attention_bench [head_dim] [iters]
+
+#define MAX_SPANS 1024
+#define PREFILL_ROWS 64
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+struct span_list {
+    struct op_kv_span spans[MAX_SPANS];
+    uint32_t n;
+};
+
+struct head_span_list {
+    struct op_kv_head_span spans[MAX_SPANS];
+    uint32_t n;
+};
+
+static void collect_span(uint32_t pos0, const void *k, const void *v, uint32_t n_tokens, void *user) {
+    (void)pos0;
+    struct span_list *l = (struct span_list *)user;
+    if (l->n < MAX_SPANS) {
+        l->spans[l->n].k = k;
+        l->spans[l->n].v = v;
+        l->spans[l->n].n_tokens = n_tokens;
+    }
+    l->n++;
+}
+
+static void collect_head_span(uint32_t pos0, const struct op_kv_head_span *span, void *user) {
+    (void)pos0;
+    struct head_span_list *l = (struct head_span_list *)user;
+    if (l->n < MAX_SPANS) {
+        l->spans[l->n] = *span;
+    }
+    l->n++;
+}
+
+int main(int argc, char **argv) {
+    uint32_t head_dim = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 10) : 128;
+    uint32_t iters = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 10) : 5;
+    if (head_dim == 0 || iters == 0) {
+        fprintf(stderr, "Usage: %s [head_dim] [iters]\n", argv[0]);
+        return 1;
+    }
+    const uint32_t heads[][2] = { {32, 32}, {32, 8}, {64, 8} };
+    const uint32_t ctxs[] = { 512, 2048, 8192 };
+    const uint32_t max_ctx = 8192;
+    const uint32_t block_size = 32;
+    struct span_list *spans = (struct span_list *)malloc(sizeof(*spans));
+    struct head_span_list *hspans = (struct head_span_list *)malloc(sizeof(*hspans));
+    float *q = (float *)malloc((size_t)PREFILL_ROWS * 64 * head_dim * sizeof(float));
+    float *out = (float *)malloc((size_t)PREFILL_ROWS * 64 * head_dim * sizeof(float));
+    float *k = (float *)malloc((size_t)max_ctx * 32 * head_dim * sizeof(float));
+    float *v = (float *)malloc((size_t)max_ctx * 32 * head_dim * sizeof(float));
+    if (!spans || !hspans || !q || !out || !k || !v) {
+        fprintf(stderr, "alloc failed\n");
+        return 1;
+    }
+    for (size_t i = 0; i < (size_t)PREFILL_ROWS * 64 * head_dim; ++i) {
+        q[i] = (float)(rand() % 2001 - 1000) * 1e-3f;
+    }
+    for (size_t i = 0; i < (size_t)max_ctx * 32 * head_dim; ++i) {
+        k[i] = (float)(rand() % 2001 - 1000) * 1e-3f;
+        v[i] = (float)(rand() % 2001 - 1000) * 1e-3f;
+    }
+    float scale = 1.0f / sqrtf((float)head_dim);
+
+    printf("head_dim=%u iters=%u\n", head_dim, iters);
+    for (size_t hi = 0; hi < sizeof(heads) / sizeof(heads[0]); ++hi) {
+        uint32_t n_heads = heads[hi][0];
+        uint32_t n_kv = heads[hi][1];
+        struct kv_cache_config cfg;
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.n_layers = 1;
+        cfg.n_kv_heads = n_kv;
+        cfg.head_dim = head_dim;
+        cfg.block_size = block_size;
+        cfg.max_seq_len = max_ctx;
+        cfg.quant = KV_Q8_0;
+        kv_cache_t *c = kv_cache_create(&cfg);
+        cfg.layout = KV_LAYOUT_HEAD_MAJOR;
+        kv_cache_t *hc = kv_cache_create(&cfg);
+        if (!c || !hc || kv_cache_append_batch(c, 0, 0, max_ctx, k, v) != 0 ||
+            kv_cache_append_batch(hc, 0, 0, max_ctx, k, v) != 0) {
+            fprintf(stderr, "kv cache setup failed\n");
+            return 1;
+        }
+        size_t kv_dim = (size_t)n_kv * head_dim;
+        float *k_deq = (float *)malloc((size_t)max_ctx * kv_dim * sizeof(float));
+        float *v_deq = (float *)malloc((size_t)max_ctx * kv_dim * sizeof(float));
+        if (!k_deq || !v_deq) {
+            fprintf(stderr, "alloc failed\n");
+            return 1;
+        }
+        for (size_t ci = 0; ci < sizeof(ctxs) / sizeof(ctxs[0]); ++ci) {
+            uint32_t seq = ctxs[ci];
+            double t0 = now_sec();
+            for (uint32_t it = 0; it < iters; ++it) {
+                if (kv_cache_read_range(c, 0, 0, seq, k_deq, v_deq) != 0 ||
+                    op_attention(NULL, q, k_deq, v_deq, out, n_heads, n_kv, head_dim,
+                                 seq, scale, NULL) != 0) {
+                    fprintf(stderr, "fp32 attention failed\n");
+                    return 1;
+                }
+            }
+            double t_f32 = (now_sec() - t0) / iters;
+            t0 = now_sec();
+            for (uint32_t it = 0; it < iters; ++it) {
+                spans->n = 0;
+                if (kv_cache_iterate_quant(c, 0, 0, seq, collect_span, spans) != 0 ||
+                    spans->n > MAX_SPANS ||
+                    op_attention_q8_kv(NULL, q, spans->spans, spans->n, out, n_heads, n_kv,
+                                       head_dim, seq, scale) != 0) {
+                    fprintf(stderr, "q8 attention failed\n");
+                    return 1;
+                }
+            }
+            double t_q8 = (now_sec() - t0) / iters;
+            t0 = now_sec();
+            for (uint32_t it = 0; it < iters; ++it) {
+                hspans->n = 0;
+                if (kv_cache_iterate_heads(hc, 0, 0, seq, collect_head_span, hspans) != 0 ||
+                    hspans->n > MAX_SPANS ||
+                    op_attention_kv_heads_causal(NULL, q, 1, hspans->spans, hspans->n, out,
+                                                 n_heads, n_kv, head_dim, seq, scale, 0.0f, NULL) != 0) {
+                    fprintf(stderr, "head-major attention failed\n");
+                    return 1;
+                }
+            }
+            double t_heads = (now_sec() - t0) / iters;
+            // Q8 bytes of K and V the grouped kernel has to stream.
+            double kv_bytes = 2.0 * seq * ((kv_dim + 31) / 32) * 36.0;
+            printf("heads=%2u/%-2u ctx=%-5u fp32_per_head=%8.3f ms q8_grouped=%8.3f ms (%5.2fx, %6.2f GB/s) head_major=%8.3f ms (%5.2fx)\n",
+                   n_heads, n_kv, seq, t_f32 * 1e3, t_q8 * 1e3, t_f32 / t_q8, kv_bytes / t_q8 * 1e-9,
+                   t_heads * 1e3, t_q8 / t_heads);
+
+            size_t q_dim = (size_t)n_heads * head_dim;
+            t0 = now_sec();
+            for (uint32_t it = 0; it < iters; ++it) {
+                for (uint32_t r = 0; r < PREFILL_ROWS; ++r) {
+                    if (op_attention_q8_kv(NULL, q + r * q_dim, spans->spans, spans->n,
+                                           out + r * q_dim, n_heads, n_kv, head_dim,
+                                           seq - PREFILL_ROWS + r + 1, scale) != 0) {
+                        fprintf(stderr, "q8 attention failed\n");
+                        return 1;
+                    }
+                }
+            }
+            double t_rows = (now_sec() - t0) / iters;
+            t0 = now_sec();
+            for (uint32_t it = 0; it < iters; ++it) {
+                if (op_attention_q8_kv_causal(NULL, q, PREFILL_ROWS, spans->spans, spans->n, out,
+                                              n_heads, n_kv, head_dim, seq, scale) != 0) {
+                    fprintf(stderr, "causal attention failed\n");
+                    return 1;
+                }
+            }
+            double t_blocked = (now_sec() - t0) / iters;
+            t0 = now_sec();
+            for (uint32_t it = 0; it < iters; ++it) {
+                if (op_attention_kv_heads_causal(NULL, q, PREFILL_ROWS, hspans->spans,
+                                                 hspans->n, out, n_heads, n_kv, head_dim, seq,
+                                                 scale, 0.0f, NULL) != 0) {
+                    fprintf(stderr, "head-major attention failed\n");
+                    return 1;
+                }
+            }
+            double t_blocked_heads = (now_sec() - t0) / iters;
+            printf("  prefill %u rows: per_row=%8.3f ms blocked=%8.3f ms (%5.2fx) head_major=%8.3f ms\n",
+                   PREFILL_ROWS, t_rows * 1e3, t_blocked * 1e3, t_rows / t_blocked,
+                   t_blocked_heads * 1e3);
+        }
+        free(k_deq);
+        free(v_deq);
+        kv_cache_destroy(c);
+        kv_cache_destroy(hc);
+    }
+    free(spans);
+    free(hspans);
+    free(q);
+    free(out);
+    free(k);
+    free(v);
+    return 0;
+}
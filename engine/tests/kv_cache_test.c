@@ -1,3 +1,5 @@
+// The checks call the code under test, so they must run in every build.
+#undef NDEBUG
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
@@ -52,6 +54,153 @@ int main(void) {
     kv_cache_clear(c);
     assert(kv_cache_get_seq_len(c, 0) == 0);
 
+    float k_batch[6 * 8];
+    float v_batch[6 * 8];
+    for (uint32_t t = 0; t < 6; ++t) {
+        for (uint32_t i = 0; i < vec_dim; ++i) {
+            k_batch[t * vec_dim + i] = (float)(t * 10 + (int)i) * 0.1f;
+            v_batch[t * vec_dim + i] = (float)(t * 10 + (int)i) * -0.1f;
+        }
+    }
+    assert(kv_cache_append_batch(c, 0, 0, 6, k_batch, v_batch) == 0);
+    assert(kv_cache_get_seq_len(c, 0) == 6);
+    assert(kv_cache_append_batch(c, 0, 6, 3, k_batch, v_batch) != 0);
+    float k_range[6 * 8];
+    float v_range[6 * 8];
+    assert(kv_cache_read_range(c, 0, 0, 6, k_range, v_range) == 0);
+    for (uint32_t i = 0; i < 6 * vec_dim; ++i) {
+        assert(approx_eq(k_range[i], k_batch[i], 0.05f));
+        assert(approx_eq(v_range[i], v_batch[i], 0.05f));
+    }
+
+    kv_cache_destroy(c);
+
+    // Blocks are paged in on first append: a long max_seq_len costs only its
+    // block table, cleared blocks are reused, and unwritten ranges stay gaps.
+    cfg.max_seq_len = 1u << 20;
+    cfg.n_layers = 2;
+    c = kv_cache_create(&cfg);
+    assert(c);
+    size_t empty = kv_cache_memory_size(c);
+    assert(empty < kv_cache_memory_limit(c) / 16);
+    assert(kv_cache_append_batch(c, 1, 0, 6, k_batch, v_batch) == 0);
+    size_t two_blocks = kv_cache_memory_size(c);
+    assert(two_blocks > empty);
+    assert(kv_cache_get_seq_len(c, 0) == 0);
+    assert(kv_cache_read_range(c, 1, 0, 6, k_range, v_range) == 0);
+    assert(approx_eq(k_range[5 * vec_dim + 3], k_batch[5 * vec_dim + 3], 0.05f));
+    assert(kv_cache_read_range(c, 0, 0, 1, k_range, v_range) != 0);
+    assert(kv_cache_append(c, 1, 1000000, k, v) == 0);
+    assert(kv_cache_memory_size(c) - two_blocks == (two_blocks - empty) / 2);
+    assert(kv_cache_get_seq_len(c, 1) == 1000001);
+    kv_cache_clear(c);
+    assert(kv_cache_append_batch(c, 0, 0, 6, k_batch, v_batch) == 0);
+    assert(kv_cache_append(c, 0, 4000, k, v) == 0);
+    assert(kv_cache_memory_size(c) == two_blocks + (two_blocks - empty) / 2);
+    assert(kv_cache_append(c, 0, 1u << 20, k, v) != 0);
+    kv_cache_destroy(c);
+
+    // Head-major blocks read back the same values through the usual accessors.
+    cfg.max_seq_len = 8;
+    cfg.n_layers = 1;
+    cfg.layout = KV_LAYOUT_HEAD_MAJOR;
+    c = kv_cache_create(&cfg);
+    assert(c);
+    assert(kv_cache_append_batch(c, 0, 0, 6, k_batch, v_batch) == 0);
+    assert(kv_cache_read_range(c, 0, 0, 6, k_range, v_range) == 0);
+    for (uint32_t i = 0; i < 6 * vec_dim; ++i) {
+        assert(approx_eq(k_range[i], k_batch[i], 0.05f));
+        assert(approx_eq(v_range[i], v_batch[i], 0.05f));
+    }
+    assert(kv_cache_read_block(c, 0, 1, k_out, v_out) == 0);
+    assert(approx_eq(k_out[vec_dim + 2], k_batch[5 * vec_dim + 2], 0.05f));
+    assert(kv_cache_reserve(c, 2) == 0);
+    assert(kv_cache_reserve(c, 3) != 0);
+    kv_cache_destroy(c);
+
+    // Eviction drops whole blocks and moves the later ones down; each keeps
+    // the position its keys were rotated at. Token t is stored as t + 1.
+    float k_seq[16 * 8];
+    float k_seq_out[16 * 8];
+    float v_seq_out[16 * 8];
+    for (uint32_t t = 0; t < 16; ++t) {
+        for (uint32_t i = 0; i < vec_dim; ++i) {
+            k_seq[t * vec_dim + i] = (float)(t + 1);
+        }
+    }
+    cfg.max_seq_len = 16;
+    cfg.evict = KV_EVICT_WINDOW;
+    cfg.n_sink = 2;
+    c = kv_cache_create(&cfg);
+    assert(c && kv_cache_append_batch(c, 0, 0, 16, k_seq, k_seq) == 0);
+    size_t full = kv_cache_memory_size(c);
+    assert(kv_cache_reserve(c, 1) == 0);
+    assert(kv_cache_get_seq_len(c, 0) == 12);
+    assert(kv_cache_read_range(c, 0, 0, 12, k_seq_out, v_seq_out) == 0);
+    assert(approx_eq(k_seq_out[3 * vec_dim], 4.0f, 0.05f) && approx_eq(k_seq_out[4 * vec_dim], 9.0f, 0.05f));
+    assert(kv_cache_rope_pos(c, 0, 4) == 8 && kv_cache_rope_pos(c, 0, 12) == 12);
+    // A partly filled block that moves keeps rotating where it started.
+    assert(kv_cache_append_batch(c, 0, 12, 2, k_seq, k_seq) == 0);
+    assert(kv_cache_reserve(c, 4) == 0);
+    assert(kv_cache_get_seq_len(c, 0) == 10);
+    assert(kv_cache_rope_pos(c, 0, 10) == 14);
+    assert(kv_cache_memory_size(c) == full);
+    // A chunk as long as the window cannot fit at once past the protected
+    // blocks; kv_cache_room says how much can.
+    kv_cache_clear(c);
+    assert(kv_cache_append_batch(c, 0, 0, 16, k_seq, k_seq) == 0);
+    assert(kv_cache_reserve(c, 16) != 0 && kv_cache_room(c) == 8);
+    assert(kv_cache_reserve(c, 8) == 0 && kv_cache_get_seq_len(c, 0) == 8);
+    kv_cache_destroy(c);
+
+    // Heavy hitters: the unprotected block with the least attention goes.
+    cfg.evict = KV_EVICT_H2O;
+    cfg.n_recent = 4;
+    c = kv_cache_create(&cfg);
+    assert(c && kv_cache_append_batch(c, 0, 0, 16, k_seq, k_seq) == 0);
+    const float mass[4] = {0.0f, 5.0f, 1.0f, 0.0f};
+    assert(kv_cache_add_attention(c, 0, mass, 4) == 0);
+    assert(kv_cache_reserve(c, 1) == 0);
+    assert(kv_cache_read_range(c, 0, 0, 12, k_seq_out, v_seq_out) == 0);
+    assert(approx_eq(k_seq_out[4 * vec_dim], 5.0f, 0.05f) && approx_eq(k_seq_out[8 * vec_dim], 13.0f, 0.05f));
+    assert(kv_cache_rope_pos(c, 0, 8) == 12);
+    assert(kv_cache_reserve(c, 6) == 0);
+    assert(kv_cache_get_seq_len(c, 0) == 8);
+    assert(kv_cache_reserve(c, 9) != 0);
+    kv_cache_destroy(c);
+
+    // Disk backing: compaction writes out every full block but the newest
+    // and frees its memory for the next appends; reads, eviction and
+    // prefetches see the same tokens.
+    cfg.evict = KV_EVICT_WINDOW;
+    cfg.n_layers = 4;
+    size_t in_ram = 0;
+    c = kv_cache_create(&cfg);
+    assert(c);
+    in_ram = kv_cache_memory_limit(c);
+    kv_cache_destroy(c);
+    cfg.spill_path = "kv_cache_test.spill";
+    cfg.resident_blocks = 1;
+    c = kv_cache_create(&cfg);
+    assert(c && kv_cache_memory_limit(c) < in_ram);
+    empty = kv_cache_memory_size(c);
+    assert(kv_cache_append_batch(c, 0, 0, 16, k_seq, k_seq) == 0);
+    full = kv_cache_memory_size(c);
+    assert(kv_cache_compact(c, 0) == 0);
+    assert(kv_cache_memory_size(c) == full);
+    assert(kv_cache_append_batch(c, 1, 0, 12, k_seq, k_seq) == 0);
+    assert(kv_cache_memory_size(c) - full < (full - empty) / 8);
+    assert(kv_cache_prefetch(c, 0) == 0);
+    assert(kv_cache_read_range(c, 0, 0, 16, k_seq_out, v_seq_out) == 0);
+    for (uint32_t t = 0; t < 16; ++t) {
+        assert(approx_eq(k_seq_out[t * vec_dim], (float)(t + 1), 0.05f));
+    }
+    assert(kv_cache_compact(c, 0) == 0 && kv_cache_compact(c, 1) == 0);
+    assert(kv_cache_reserve(c, 1) == 0);
+    assert(kv_cache_read_range(c, 0, 0, 12, k_seq_out, v_seq_out) == 0);
+    assert(approx_eq(k_seq_out[3 * vec_dim], 4.0f, 0.05f) && approx_eq(k_seq_out[4 * vec_dim], 9.0f, 0.05f));
+    assert(kv_cache_read_range(c, 1, 0, 12, k_seq_out, v_seq_out) == 0);
+    assert(approx_eq(k_seq_out[0], 1.0f, 0.05f) && approx_eq(k_seq_out[11 * vec_dim], 12.0f, 0.05f));
     kv_cache_destroy(c);
     printf("PASS\n");
     return 0;
@@ -0,0 +1,156 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ops.h"
+
+// Compares the per-token GEMV loop against the multi-column GEMM kernels and
+// the integer kernels on Q8_K activations (quantization time included).
+// Usage: matmul_bench [m] [k] [iters]
+
+#define QK_K 256
+
+enum {
+    BENCH_Q4_K = 12,
+    BENCH_Q5_K = 13,
+    BENCH_Q6_K = 14,
+};
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static size_t block_bytes(uint32_t dtype) {
+    switch (dtype) {
+        case BENCH_Q4_K: return 144;
+        case BENCH_Q5_K: return 176;
+        case BENCH_Q6_K: return 210;
+        default: return 0;
+    }
+}
+
+// Random quant payload with sane fp16 super-block scales (0x1C00 ~= 0.0039).
+static void fill_weights(uint32_t dtype, uint8_t *w, size_t n_blocks) {
+    size_t bb = block_bytes(dtype);
+    for (size_t i = 0; i < n_blocks * bb; ++i) {
+        w[i] = (uint8_t)(rand() & 0xFF);
+    }
+    for (size_t i = 0; i < n_blocks; ++i) {
+        uint8_t *blk = w + i * bb;
+        uint16_t d = 0x1C00;
+        if (dtype == BENCH_Q6_K) {
+            memcpy(blk + bb - sizeof(d), &d, sizeof(d));
+        } else {
+            memcpy(blk, &d, sizeof(d));
+            memcpy(blk + sizeof(d), &d, sizeof(d));
+        }
+    }
+}
+
+static int run_gemv(uint32_t dtype, const void *w, const float *b, float *c,
+                    uint32_t m, uint32_t n, uint32_t k) {
+    for (uint32_t j = 0; j < n; ++j) {
+        const float *bj = b + (size_t)j * k;
+        float *cj = c + (size_t)j * m;
+        int rc = -1;
+        if (dtype == BENCH_Q4_K) rc = op_matmul_q4_k(NULL, w, bj, cj, m, k);
+        if (dtype == BENCH_Q5_K) rc = op_matmul_q5_k(NULL, w, bj, cj, m, k);
+        if (dtype == BENCH_Q6_K) rc = op_matmul_q6_k(NULL, w, bj, cj, m, k);
+        if (rc != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int run_gemm(uint32_t dtype, const void *w, const float *b, float *c,
+                    uint32_t m, uint32_t n, uint32_t k) {
+    if (dtype == BENCH_Q4_K) return op_matmul_q4_k_gemm(NULL, w, b, c, m, n, k);
+    if (dtype == BENCH_Q5_K) return op_matmul_q5_k_gemm(NULL, w, b, c, m, n, k);
+    if (dtype == BENCH_Q6_K) return op_matmul_q6_k_gemm(NULL, w, b, c, m, n, k);
+    return -1;
+}
+
+static int run_q8_k(uint32_t dtype, const void *w, const float *b, void *bq, float *c,
+                    uint32_t m, uint32_t n, uint32_t k) {
+    if (op_quantize_q8_k(NULL, b, bq, n, k) != 0) {
+        return -1;
+    }
+    if (dtype == BENCH_Q4_K) return op_matmul_q4_k_q8_k(NULL, w, bq, c, m, n, k);
+    if (dtype == BENCH_Q5_K) return op_matmul_q5_k_q8_k(NULL, w, bq, c, m, n, k);
+    if (dtype == BENCH_Q6_K) return op_matmul_q6_k_q8_k(NULL, w, bq, c, m, n, k);
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    uint32_t m = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 10) : 1024;
+    uint32_t k = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 10) : 2048;
+    uint32_t iters = argc > 3 ? (uint32_t)strtoul(argv[3], NULL, 10) : 3;
+    if (m == 0 || k == 0 || (k % QK_K) != 0 || iters == 0) {
+        fprintf(stderr, "Usage: %s [m] [k (multiple of 256)] [iters]\n", argv[0]);
+        return 1;
+    }
+    const uint32_t dtypes[] = { BENCH_Q4_K, BENCH_Q5_K, BENCH_Q6_K };
+    const char *names[] = { "Q4_K", "Q5_K", "Q6_K" };
+    const uint32_t cols[] = { 1, 4, 16, 64 };
+    const uint32_t max_n = 64;
+    size_t n_blocks = (size_t)m * (k / QK_K);
+
+    float *b = (float *)malloc((size_t)max_n * k * sizeof(float));
+    float *c = (float *)malloc((size_t)max_n * m * sizeof(float));
+    uint8_t *w = (uint8_t *)malloc(n_blocks * 210);
+    void *bq = malloc((size_t)max_n * op_q8_k_row_size(k));
+    if (!b || !c || !w || !bq) {
+        fprintf(stderr, "alloc failed\n");
+        return 1;
+    }
+    for (size_t i = 0; i < (size_t)max_n * k; ++i) {
+        b[i] = (float)(rand() % 2001 - 1000) * 1e-3f;
+    }
+
+    printf("m=%u k=%u iters=%u\n", m, k, iters);
+    for (size_t t = 0; t < sizeof(dtypes) / sizeof(dtypes[0]); ++t) {
+        fill_weights(dtypes[t], w, n_blocks);
+        for (size_t ci = 0; ci < sizeof(cols) / sizeof(cols[0]); ++ci) {
+            uint32_t n = cols[ci];
+            double flops = 2.0 * (double)m * (double)k * (double)n * (double)iters;
+            double t0 = now_sec();
+            for (uint32_t it = 0; it < iters; ++it) {
+                if (run_gemv(dtypes[t], w, b, c, m, n, k) != 0) {
+                    fprintf(stderr, "gemv failed\n");
+                    return 1;
+                }
+            }
+            double t_gemv = now_sec() - t0;
+            t0 = now_sec();
+            for (uint32_t it = 0; it < iters; ++it) {
+                if (run_gemm(dtypes[t], w, b, c, m, n, k) != 0) {
+                    fprintf(stderr, "gemm failed\n");
+                    return 1;
+                }
+            }
+            double t_gemm = now_sec() - t0;
+            t0 = now_sec();
+            for (uint32_t it = 0; it < iters; ++it) {
+                if (run_q8_k(dtypes[t], w, b, bq, c, m, n, k) != 0) {
+                    fprintf(stderr, "q8_k matmul failed\n");
+                    return 1;
+                }
+            }
+            double t_q8 = now_sec() - t0;
+            printf("%s n=%-3u gemv_loop=%7.2f GFLOP/s gemm=%7.2f GFLOP/s q8_k=%7.2f GFLOP/s\n",
+                   names[t], n, flops / t_gemv * 1e-9, flops / t_gemm * 1e-9, flops / t_q8 * 1e-9);
+        }
+    }
+    free(b);
+    free(c);
+    free(w);
+    free(bq);
+    return 0;
+}
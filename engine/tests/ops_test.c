@@ -1,10 +1,17 @@
+#define _POSIX_C_SOURCE 200112L
+
+// The checks call the code under test, so they must run in every build.
+#undef NDEBUG
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
+#include "kv_cache.h"
 #include "ops.h"
+#include "ops_x86.h"
+#include "thread_pool.h"
 
 static int approx_eq(float a, float b, float eps) {
     return fabsf(a - b) <= eps;
@@ -116,6 +123,334 @@ static void test_op_matmul_q4_k(void) {
     assert(approx_eq(c[0], 15.0f, 1e-3f));
 }
 
+static void test_op_matmul_q4_k_gemm(void) {
+    const uint32_t m = 3;
+    const uint32_t k = 512;
+    const uint32_t n = 6;
+    const uint32_t nb = k / 256;
+    struct block_q4_k *a = (struct block_q4_k *)calloc(m * nb, sizeof(struct block_q4_k));
+    float *b = (float *)malloc((size_t)n * k * sizeof(float));
+    float *c = (float *)malloc((size_t)n * m * sizeof(float));
+    assert(a && b && c);
+    for (uint32_t i = 0; i < m * nb; ++i) {
+        a[i].d = float_to_half(0.01f * (float)(i + 1));
+        a[i].dmin = float_to_half(0.005f);
+        for (uint32_t j = 0; j < 12; ++j) {
+            a[i].scales[j] = (uint8_t)(i * 7 + j * 13);
+        }
+        for (uint32_t j = 0; j < 128; ++j) {
+            a[i].qs[j] = (uint8_t)(i * 31 + j * 17);
+        }
+    }
+    for (uint32_t i = 0; i < n * k; ++i) {
+        b[i] = (float)((int)(i % 29) - 14) * 0.05f;
+    }
+    struct op_context ctx = {0};
+    assert(op_matmul_q4_k_gemm(&ctx, a, b, c, m, n, k) == 0);
+    for (uint32_t j = 0; j < n; ++j) {
+        float ref[3];
+        assert(op_matmul_q4_k(&ctx, a, b + (size_t)j * k, ref, m, k) == 0);
+        for (uint32_t r = 0; r < m; ++r) {
+            assert(approx_eq(c[j * m + r], ref[r], 1e-4f));
+        }
+    }
+    free(a);
+    free(b);
+    free(c);
+}
+
+// Q4_K (t = 0, 144 bytes), Q5_K (t = 1, 176 bytes) or Q6_K (t = 2, 210
+// bytes) super-blocks filled with arbitrary bytes and small fp16 scales.
+static void fill_k_quant_blocks(uint8_t *w, uint32_t n_blocks, int t) {
+    const size_t bb = t == 0 ? 144 : t == 1 ? 176 : 210;
+    for (size_t i = 0; i < n_blocks * bb; ++i) {
+        w[i] = (uint8_t)((i * 131u + (size_t)t * 7u) >> 1);
+    }
+    for (uint32_t b = 0; b < n_blocks; ++b) {
+        uint16_t d = float_to_half(0.01f + 0.002f * (float)(b % 8));
+        uint16_t dmin = float_to_half(0.004f);
+        uint8_t *blk = w + b * bb;
+        if (t == 2) {
+            memcpy(blk + bb - 2, &d, 2);
+        } else {
+            memcpy(blk, &d, 2);
+            memcpy(blk + 2, &dmin, 2);
+        }
+    }
+}
+
+static void test_op_matmul_q5_q6_k_gemm(void) {
+    const uint32_t m = 3;
+    const uint32_t k = 512;
+    const uint32_t n = 6;
+    const uint32_t nb = k / 256;
+    uint8_t *a = (uint8_t *)malloc(m * nb * 210);
+    float *b = (float *)malloc((size_t)n * k * sizeof(float));
+    float *c = (float *)malloc((size_t)n * m * sizeof(float));
+    assert(a && b && c);
+    for (uint32_t i = 0; i < n * k; ++i) {
+        b[i] = (float)((int)(i % 29) - 14) * 0.05f;
+    }
+    struct op_context ctx = {0};
+    for (int t = 1; t <= 2; ++t) {
+        fill_k_quant_blocks(a, m * nb, t);
+        if (t == 1) assert(op_matmul_q5_k_gemm(&ctx, a, b, c, m, n, k) == 0);
+        if (t == 2) assert(op_matmul_q6_k_gemm(&ctx, a, b, c, m, n, k) == 0);
+        for (uint32_t j = 0; j < n; ++j) {
+            float ref[3];
+            if (t == 1) assert(op_matmul_q5_k(&ctx, a, b + (size_t)j * k, ref, m, k) == 0);
+            if (t == 2) assert(op_matmul_q6_k(&ctx, a, b + (size_t)j * k, ref, m, k) == 0);
+            for (uint32_t r = 0; r < m; ++r) {
+                assert(approx_eq(c[j * m + r], ref[r], 1e-3f * (1.0f + fabsf(ref[r]))));
+            }
+        }
+    }
+    free(a);
+    free(b);
+    free(c);
+}
+
+static void test_op_matmul_q8_k(void) {
+    const uint32_t m = 3;
+    const uint32_t k = 512;
+    const uint32_t n = 5;
+    const uint32_t nb = k / 256;
+    struct block_q4_k *a = (struct block_q4_k *)calloc(m * nb, sizeof(struct block_q4_k));
+    float *b = (float *)malloc((size_t)n * k * sizeof(float));
+    float *back = (float *)malloc((size_t)n * k * sizeof(float));
+    float *c = (float *)malloc((size_t)n * m * sizeof(float));
+    void *bq = malloc(n * op_q8_k_row_size(k));
+    assert(a && b && back && c && bq);
+    assert(op_q8_k_row_size(k) == nb * (sizeof(float) + 256 + 16 * sizeof(int16_t)));
+    for (uint32_t i = 0; i < m * nb; ++i) {
+        a[i].d = float_to_half(0.01f * (float)(i + 1));
+        a[i].dmin = float_to_half(0.005f);
+        for (uint32_t j = 0; j < 12; ++j) {
+            a[i].scales[j] = (uint8_t)(i * 7 + j * 13);
+        }
+        for (uint32_t j = 0; j < 128; ++j) {
+            a[i].qs[j] = (uint8_t)(i * 31 + j * 17);
+        }
+    }
+    for (uint32_t i = 0; i < n * k; ++i) {
+        b[i] = (float)((int)((i * 37u) % 101u) - 50) * 0.013f;
+    }
+    struct op_context ctx = {0};
+    assert(op_quantize_q8_k(&ctx, b, bq, n, k) == 0);
+    assert(op_quantize_q8_k(&ctx, b, bq, n, 100) != 0);
+
+    // Round trip: each value within half a quantization step of the input.
+    const size_t block_bytes = op_q8_k_row_size(k) / nb;
+    for (uint32_t blk = 0; blk < n * nb; ++blk) {
+        const uint8_t *raw = (const uint8_t *)bq + blk * block_bytes;
+        float d;
+        memcpy(&d, raw, sizeof(d));
+        const int8_t *qs = (const int8_t *)(raw + sizeof(float));
+        int16_t bsum0;
+        memcpy(&bsum0, raw + sizeof(float) + 256, sizeof(bsum0));
+        int32_t sum0 = 0;
+        for (uint32_t i = 0; i < 256; ++i) {
+            back[blk * 256 + i] = d * (float)qs[i];
+            assert(approx_eq(back[blk * 256 + i], b[blk * 256 + i], 0.5f * d + 1e-6f));
+            if (i < 16) {
+                sum0 += qs[i];
+            }
+        }
+        assert(sum0 == bsum0);
+    }
+
+    // Integer kernels match the fp32 GEMV on the dequantized activations.
+    assert(op_matmul_q4_k_q8_k(&ctx, a, bq, c, m, n, k) == 0);
+    for (uint32_t j = 0; j < n; ++j) {
+        float ref[3];
+        assert(op_matmul_q4_k(&ctx, a, back + (size_t)j * k, ref, m, k) == 0);
+        for (uint32_t r = 0; r < m; ++r) {
+            assert(approx_eq(c[j * m + r], ref[r], 1e-4f * (1.0f + fabsf(ref[r]))));
+        }
+    }
+    free(a);
+    free(b);
+    free(back);
+    free(c);
+    free(bq);
+}
+
+// Row bands of a matrix, multiplied one at a time, reproduce the whole-matrix
+// GEMV, GEMM and Q8_K results exactly.
+static void test_op_matmul_k_quant_rows(void) {
+    const uint32_t m = 5;
+    const uint32_t k = 512;
+    const uint32_t n = 3;
+    const uint32_t nb = k / 256;
+    const uint32_t band = 2;
+    struct block_q4_k *a = (struct block_q4_k *)calloc(m * nb, sizeof(struct block_q4_k));
+    float *b = (float *)malloc((size_t)n * k * sizeof(float));
+    float *ref = (float *)malloc((size_t)n * m * sizeof(float));
+    float *c = (float *)malloc((size_t)n * m * sizeof(float));
+    void *bq = malloc(n * op_q8_k_row_size(k));
+    assert(a && b && ref && c && bq);
+    for (uint32_t i = 0; i < m * nb; ++i) {
+        a[i].d = float_to_half(0.01f * (float)(i + 1));
+        a[i].dmin = float_to_half(0.005f);
+        for (uint32_t j = 0; j < 12; ++j) {
+            a[i].scales[j] = (uint8_t)(i * 5 + j * 11);
+        }
+        for (uint32_t j = 0; j < 128; ++j) {
+            a[i].qs[j] = (uint8_t)(i * 29 + j * 13);
+        }
+    }
+    for (uint32_t i = 0; i < n * k; ++i) {
+        b[i] = (float)((int)(i % 23) - 11) * 0.04f;
+    }
+    struct op_context ctx = {0};
+    const size_t row_bytes = op_k_quant_row_size(12, k);
+    assert(row_bytes == nb * sizeof(struct block_q4_k));
+    assert(op_k_quant_row_size(2, k) == 0);
+    assert(op_quantize_q8_k(&ctx, b, bq, n, k) == 0);
+
+    for (int mode = 0; mode < 3; ++mode) {
+        uint32_t cols = mode == 0 ? 1 : n;
+        const void *b_q8 = mode == 2 ? bq : NULL;
+        if (mode == 0) {
+            assert(op_matmul_q4_k(&ctx, a, b, ref, m, k) == 0);
+        } else if (mode == 1) {
+            assert(op_matmul_q4_k_gemm(&ctx, a, b, ref, m, n, k) == 0);
+        } else {
+            assert(op_matmul_q4_k_q8_k(&ctx, a, bq, ref, m, n, k) == 0);
+        }
+        memset(c, 0, (size_t)n * m * sizeof(float));
+        for (uint32_t r0 = 0; r0 < m; r0 += band) {
+            uint32_t nr = m - r0 < band ? m - r0 : band;
+            const uint8_t *rows = (const uint8_t *)a + (size_t)r0 * row_bytes;
+            assert(op_matmul_k_quant_rows(&ctx, 12, rows, b, b_q8, c, r0, nr, m, cols, k) == 0);
+        }
+        for (uint32_t i = 0; i < cols * m; ++i) {
+            assert(c[i] == ref[i]);
+        }
+    }
+    assert(op_matmul_k_quant_rows(&ctx, 12, a, b, NULL, c, 4, 2, m, 1, k) != 0);
+    free(a);
+    free(b);
+    free(ref);
+    free(c);
+    free(bq);
+}
+
+#if defined(OPS_X86_SIMD)
+// Checks the fused SIMD dot kernels against the scalar reference path, which
+// main() selects by setting SHUKUCHI_SIMD=scalar before the first matmul.
+static void test_x86_dot_kernels(void) {
+    const uint32_t nb = 4;
+    const uint32_t k = nb * 256;
+    const size_t block_sizes[3] = {144, 176, 210};
+    int level = x86_simd_detect();
+    // x and xr are the two columns of one GEMM activation block.
+    float *cols = (float *)malloc(2 * k * sizeof(float));
+    float *x = cols;
+    float *xr = cols + k;
+    float deq[256];
+    uint8_t *w = (uint8_t *)malloc(nb * 210);
+    void *xq = malloc(op_q8_k_row_size(k));
+    assert(cols && w && xq);
+    for (uint32_t i = 0; i < k; ++i) {
+        x[i] = (float)((int)((i * 37u) % 101u) - 50) * 0.02f;
+    }
+    assert(op_quantize_q8_k(NULL, x, xq, 1, k) == 0);
+    for (int t = 0; t < 3; ++t) {
+        size_t bb = block_sizes[t];
+        fill_k_quant_blocks(w, nb, t);
+        float ref = 0.0f;
+        struct op_context ctx = {0};
+        if (t == 0) assert(op_matmul_q4_k(&ctx, w, x, &ref, 1, k) == 0);
+        if (t == 1) assert(op_matmul_q5_k(&ctx, w, x, &ref, 1, k) == 0);
+        if (t == 2) assert(op_matmul_q6_k(&ctx, w, x, &ref, 1, k) == 0);
+        float tol = 1e-3f * (1.0f + fabsf(ref));
+        if (level >= X86_SIMD_AVX2) {
+            float got = t == 0 ? x86_avx2_dot_q4_k(w, x, nb)
+                      : t == 1 ? x86_avx2_dot_q5_k(w, x, nb)
+                               : x86_avx2_dot_q6_k(w, x, nb);
+            assert(approx_eq(got, ref, tol));
+        }
+        if (level >= X86_SIMD_AVX512) {
+            float got = t == 0 ? x86_avx512_dot_q4_k(w, x, nb)
+                      : t == 1 ? x86_avx512_dot_q5_k(w, x, nb)
+                               : x86_avx512_dot_q6_k(w, x, nb);
+            assert(approx_eq(got, ref, tol));
+        }
+        // GEMM kernels: each super-block dequantized once, then dotted with
+        // every column (here x and its reverse).
+        float cols_ref[2] = {ref, 0.0f};
+        for (uint32_t i = 0; i < k; ++i) {
+            xr[i] = x[k - 1 - i];
+        }
+        if (t == 0) assert(op_matmul_q4_k(&ctx, w, xr, &cols_ref[1], 1, k) == 0);
+        if (t == 1) assert(op_matmul_q5_k(&ctx, w, xr, &cols_ref[1], 1, k) == 0);
+        if (t == 2) assert(op_matmul_q6_k(&ctx, w, xr, &cols_ref[1], 1, k) == 0);
+        for (int simd = X86_SIMD_AVX2; simd <= level; ++simd) {
+            float acc[2] = {0.0f, 0.0f};
+            for (uint32_t b = 0; b < nb; ++b) {
+                const uint8_t *blk = w + b * bb;
+                if (t == 0) x86_avx2_dequant_q4_k(blk, deq);
+                if (t == 1) x86_avx2_dequant_q5_k(blk, deq);
+                if (t == 2) x86_avx2_dequant_q6_k(blk, deq);
+                if (simd == X86_SIMD_AVX2) {
+                    x86_avx2_dot_cols_256(deq, cols + b * 256, k, acc, 2);
+                } else {
+                    x86_avx512_dot_cols_256(deq, cols + b * 256, k, acc, 2);
+                }
+            }
+            for (int j = 0; j < 2; ++j) {
+                assert(approx_eq(acc[j], cols_ref[j], 1e-3f * (1.0f + fabsf(cols_ref[j]))));
+            }
+        }
+        float ref_q8 = 0.0f;
+        if (t == 0) assert(op_matmul_q4_k_q8_k(&ctx, w, xq, &ref_q8, 1, 1, k) == 0);
+        if (t == 1) assert(op_matmul_q5_k_q8_k(&ctx, w, xq, &ref_q8, 1, 1, k) == 0);
+        if (t == 2) assert(op_matmul_q6_k_q8_k(&ctx, w, xq, &ref_q8, 1, 1, k) == 0);
+        if (level >= X86_SIMD_AVX2) {
+            float got = t == 0 ? x86_avx2_dot_q4_k_q8_k(w, xq, nb)
+                      : t == 1 ? x86_avx2_dot_q5_k_q8_k(w, xq, nb)
+                               : x86_avx2_dot_q6_k_q8_k(w, xq, nb);
+            assert(approx_eq(got, ref_q8, 1e-4f * (1.0f + fabsf(ref_q8))));
+        }
+    }
+    free(cols);
+    free(w);
+    free(xq);
+}
+
+// The AVX2 KV quantizers must reproduce the scalar ones (selected by main)
+// byte for byte, including ties, all-zero groups and a zero-padded tail.
+static void test_x86_kv_quantizers(void) {
+    if (x86_simd_detect() < X86_SIMD_AVX2) {
+        return;
+    }
+    const uint32_t n = 4 * 32 + 20;
+    float x[4 * 32 + 20];
+    for (uint32_t i = 0; i < n; ++i) {
+        x[i] = sinf((float)i * 0.53f) * (float)(1 + i % 7);
+    }
+    for (uint32_t i = 32; i < 64; ++i) {
+        x[i] = 0.0f;
+    }
+    x[70] = 3.0f;
+    x[71] = -3.0f;
+    x[72] = 0.1875f;  // half a Q4 step (3 / 8 / 2): rounds to even
+    uint8_t ref[4 * 36 + 36];
+    uint8_t got[4 * 36 + 36];
+    for (uint32_t kq = 0; kq < 2; ++kq) {
+        size_t full = op_kv_row_size(kq, 4 * 32);
+        op_quantize_kv_row(kq, x, ref, n);
+        if (kq == KV_Q4_0) {
+            x86_avx2_quantize_q4_0(x, got, 4);
+        } else {
+            x86_avx2_quantize_q8_0(x, got, 4);
+        }
+        assert(memcmp(ref, got, full) == 0);
+    }
+}
+#endif
+
 static void test_op_attention(void) {
     float q[2] = {1.0f, 0.0f};
     float k[2 * 2] = {
@@ -140,6 +475,805 @@ static void test_op_attention(void) {
     assert(approx_eq(out[1], exp1, 1e-5f));
 }
 
+// Rows/heads are split across the pool without changing per-row arithmetic,
+// so pooled results must match the single-thread ones bit for bit.
+struct span_list {
+    struct op_kv_span spans[64];
+    uint32_t n;
+};
+
+static void collect_span(uint32_t pos0, const void *k, const void *v, uint32_t n_tokens, void *user) {
+    (void)pos0;
+    struct span_list *l = (struct span_list *)user;
+    assert(l->n < 64);
+    l->spans[l->n].k = k;
+    l->spans[l->n].v = v;
+    l->spans[l->n].n_tokens = n_tokens;
+    l->n++;
+}
+
+// The fused kernel reads the Q8 cache in place, one KV group per work item,
+// and must match op_attention on the dequantized cache for every GQA ratio,
+// serial and pooled. head_dim 48 makes heads straddle q8 groups and
+// block_size 96 spans more than one softmax tile.
+static void test_op_attention_q8_kv(void) {
+    const uint32_t heads[4][2] = { {2, 2}, {4, 2}, {8, 2}, {8, 1} };
+    const uint32_t head_dim = 48;
+    const uint32_t max_kv_dim = 2 * head_dim;
+    const uint32_t seq = 150;
+    const uint32_t block_sizes[2] = {4, 96};
+    float *k = (float *)malloc((size_t)seq * max_kv_dim * sizeof(float));
+    float *v = (float *)malloc((size_t)seq * max_kv_dim * sizeof(float));
+    float *k_deq = (float *)malloc((size_t)seq * max_kv_dim * sizeof(float));
+    float *v_deq = (float *)malloc((size_t)seq * max_kv_dim * sizeof(float));
+    float q[8 * 48];
+    float ref[8 * 48];
+    float out[8 * 48];
+    assert(k && v && k_deq && v_deq);
+    for (uint32_t i = 0; i < seq * max_kv_dim; ++i) {
+        k[i] = sinf((float)i * 0.37f) * 1.5f;
+        v[i] = cosf((float)i * 0.11f) * 2.0f;
+    }
+    for (uint32_t i = 0; i < 8 * head_dim; ++i) {
+        q[i] = sinf((float)i * 0.73f);
+    }
+    struct op_context ctxs[2] = { {0}, {0} };
+    ctxs[1].pool = thread_pool_create(3);
+    ctxs[1].n_threads = thread_pool_size(ctxs[1].pool);
+    float scale = 1.0f / sqrtf((float)head_dim);
+    for (uint32_t hc = 0; hc < 4; ++hc) {
+        const uint32_t n_heads = heads[hc][0];
+        const uint32_t n_kv_heads = heads[hc][1];
+        for (uint32_t b = 0; b < 2; ++b) {
+            struct kv_cache_config cfg;
+            memset(&cfg, 0, sizeof(cfg));
+            cfg.n_layers = 1;
+            cfg.n_kv_heads = n_kv_heads;
+            cfg.head_dim = head_dim;
+            cfg.block_size = block_sizes[b];
+            cfg.max_seq_len = 256;
+            cfg.quant = KV_Q8_0;
+            kv_cache_t *c = kv_cache_create(&cfg);
+            assert(c);
+            assert(kv_cache_append_batch(c, 0, 0, seq, k, v) == 0);
+            assert(kv_cache_read_range(c, 0, 0, seq, k_deq, v_deq) == 0);
+            struct span_list spans;
+            spans.n = 0;
+            assert(kv_cache_iterate_quant(c, 0, 0, seq, collect_span, &spans) == 0);
+            uint32_t total = 0;
+            for (uint32_t i = 0; i < spans.n; ++i) {
+                total += spans.spans[i].n_tokens;
+            }
+            assert(total == seq);
+            const uint32_t lens[3] = {1, 70, seq};
+            for (uint32_t li = 0; li < 3; ++li) {
+                assert(op_attention(&ctxs[0], q, k_deq, v_deq, ref, n_heads, n_kv_heads, head_dim,
+                                    lens[li], scale, NULL) == 0);
+                for (uint32_t ci = 0; ci < 2; ++ci) {
+                    assert(op_attention_q8_kv(&ctxs[ci], q, spans.spans, spans.n, out, n_heads,
+                                              n_kv_heads, head_dim, lens[li], scale) == 0);
+                    for (uint32_t i = 0; i < n_heads * head_dim; ++i) {
+                        assert(approx_eq(out[i], ref[i], 1e-4f));
+                    }
+                }
+            }
+            assert(op_attention_q8_kv(&ctxs[0], q, spans.spans, spans.n, out, n_heads, n_kv_heads,
+                                      head_dim, seq + 1, scale) != 0);
+            spans.n = 0;
+            assert(kv_cache_iterate_quant(c, 0, 0, seq + 1, collect_span, &spans) != 0);
+            kv_cache_destroy(c);
+        }
+    }
+    // Query heads must split evenly into KV groups.
+    struct op_kv_span one = { k, v, 1 };
+    assert(op_attention_q8_kv(&ctxs[0], q, &one, 1, out, 3, 2, head_dim, 1, scale) != 0);
+    thread_pool_destroy(ctxs[1].pool);
+    free(k);
+    free(v);
+    free(k_deq);
+    free(v_deq);
+}
+
+// A prefill chunk of n_q rows through the blocked causal kernel must match
+// op_attention run row by row over that row's own prefix. 37 rows leave a
+// partial row block, and 53 cached tokens ahead of the chunk make the causal
+// edge fall mid-tile and mid-KV-block.
+static void test_op_attention_q8_kv_causal(void) {
+    const uint32_t heads[3][2] = { {2, 2}, {4, 2}, {8, 1} };
+    const uint32_t head_dim = 48;
+    const uint32_t max_kv_dim = 2 * head_dim;
+    const uint32_t pos0 = 53;
+    const uint32_t n_q = 37;
+    const uint32_t seq = pos0 + n_q;
+    float *k = (float *)malloc((size_t)seq * max_kv_dim * sizeof(float));
+    float *v = (float *)malloc((size_t)seq * max_kv_dim * sizeof(float));
+    float *k_deq = (float *)malloc((size_t)seq * max_kv_dim * sizeof(float));
+    float *v_deq = (float *)malloc((size_t)seq * max_kv_dim * sizeof(float));
+    float *q = (float *)malloc((size_t)n_q * 8 * head_dim * sizeof(float));
+    float *out = (float *)malloc((size_t)n_q * 8 * head_dim * sizeof(float));
+    float ref[8 * 48];
+    assert(k && v && k_deq && v_deq && q && out);
+    for (uint32_t i = 0; i < seq * max_kv_dim; ++i) {
+        k[i] = sinf((float)i * 0.29f) * 1.5f;
+        v[i] = cosf((float)i * 0.13f) * 2.0f;
+    }
+    for (uint32_t i = 0; i < n_q * 8 * head_dim; ++i) {
+        q[i] = sinf((float)i * 0.71f);
+    }
+    struct op_context ctxs[2] = { {0}, {0} };
+    ctxs[1].pool = thread_pool_create(3);
+    ctxs[1].n_threads = thread_pool_size(ctxs[1].pool);
+    float scale = 1.0f / sqrtf((float)head_dim);
+    for (uint32_t hc = 0; hc < 3; ++hc) {
+        const uint32_t n_heads = heads[hc][0];
+        const uint32_t n_kv_heads = heads[hc][1];
+        const uint32_t q_dim = n_heads * head_dim;
+        struct kv_cache_config cfg;
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.n_layers = 1;
+        cfg.n_kv_heads = n_kv_heads;
+        cfg.head_dim = head_dim;
+        cfg.block_size = 16;
+        cfg.max_seq_len = 128;
+        cfg.quant = KV_Q8_0;
+        kv_cache_t *c = kv_cache_create(&cfg);
+        assert(c);
+        assert(kv_cache_append_batch(c, 0, 0, seq, k, v) == 0);
+        assert(kv_cache_read_range(c, 0, 0, seq, k_deq, v_deq) == 0);
+        struct span_list spans;
+        spans.n = 0;
+        assert(kv_cache_iterate_quant(c, 0, 0, seq, collect_span, &spans) == 0);
+        for (uint32_t ci = 0; ci < 2; ++ci) {
+            assert(op_attention_q8_kv_causal(&ctxs[ci], q, n_q, spans.spans, spans.n, out,
+                                             n_heads, n_kv_heads, head_dim, seq, scale) == 0);
+            for (uint32_t r = 0; r < n_q; ++r) {
+                assert(op_attention(&ctxs[0], q + (size_t)r * q_dim, k_deq, v_deq, ref, n_heads,
+                                    n_kv_heads, head_dim, pos0 + r + 1, scale, NULL) == 0);
+                for (uint32_t i = 0; i < q_dim; ++i) {
+                    assert(approx_eq(out[(size_t)r * q_dim + i], ref[i], 1e-4f));
+                }
+            }
+        }
+        // The chunk cannot be longer than the sequence it ends.
+        assert(op_attention_q8_kv_causal(&ctxs[0], q, seq + 1, spans.spans, spans.n, out,
+                                         n_heads, n_kv_heads, head_dim, seq, scale) != 0);
+        kv_cache_destroy(c);
+    }
+    thread_pool_destroy(ctxs[1].pool);
+    free(k);
+    free(v);
+    free(k_deq);
+    free(v_deq);
+    free(q);
+    free(out);
+}
+
+// Q4_0 halves the KV footprint of Q8_0 for a bounded loss: both caches are
+// filled from the same rows and scored against fp32 attention on the
+// originals. The fused Q4 kernel must also match op_attention on its own
+// dequantized cache as tightly as the Q8 one does.
+static void test_op_attention_q4_kv(void) {
+    const uint32_t n_heads = 8;
+    const uint32_t n_kv_heads = 2;
+    const uint32_t head_dim = 64;
+    const uint32_t kv_dim = n_kv_heads * head_dim;
+    const uint32_t seq = 200;
+    const uint32_t n_q = 20;
+    float *k = (float *)malloc((size_t)seq * kv_dim * sizeof(float));
+    float *v = (float *)malloc((size_t)seq * kv_dim * sizeof(float));
+    float *k_deq = (float *)malloc((size_t)seq * kv_dim * sizeof(float));
+    float *v_deq = (float *)malloc((size_t)seq * kv_dim * sizeof(float));
+    float *q = (float *)malloc((size_t)n_q * n_heads * head_dim * sizeof(float));
+    float *out = (float *)malloc((size_t)n_q * n_heads * head_dim * sizeof(float));
+    float ref[8 * 64];
+    float deq_ref[8 * 64];
+    assert(k && v && k_deq && v_deq && q && out);
+    for (uint32_t i = 0; i < seq * kv_dim; ++i) {
+        k[i] = sinf((float)i * 0.31f) + 0.5f * cosf((float)i * 0.017f);
+        v[i] = cosf((float)i * 0.19f) * 1.5f;
+    }
+    for (uint32_t i = 0; i < n_q * n_heads * head_dim; ++i) {
+        q[i] = sinf((float)i * 0.67f) * 0.5f;
+    }
+    struct op_context ctx = {0};
+    float scale = 1.0f / sqrtf((float)head_dim);
+    float max_err[2] = {0.0f, 0.0f};
+    size_t mem[2];
+    for (uint32_t kq = 0; kq < 2; ++kq) {
+        struct kv_cache_config cfg;
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.n_layers = 1;
+        cfg.n_kv_heads = n_kv_heads;
+        cfg.head_dim = head_dim;
+        cfg.block_size = 32;
+        cfg.max_seq_len = 256;
+        cfg.quant = kq == 0 ? KV_Q8_0 : KV_Q4_0;
+        kv_cache_t *c = kv_cache_create(&cfg);
+        assert(c);
+        assert(kv_cache_append_batch(c, 0, 0, seq, k, v) == 0);
+        mem[kq] = kv_cache_memory_size(c);
+        assert(kv_cache_read_range(c, 0, 0, seq, k_deq, v_deq) == 0);
+        struct span_list spans;
+        spans.n = 0;
+        assert(kv_cache_iterate_quant(c, 0, 0, seq, collect_span, &spans) == 0);
+        if (kq == 0) {
+            assert(op_attention_q8_kv_causal(&ctx, q, n_q, spans.spans, spans.n, out, n_heads,
+                                             n_kv_heads, head_dim, seq, scale) == 0);
+        } else {
+            assert(op_attention_q4_kv_causal(&ctx, q, n_q, spans.spans, spans.n, out, n_heads,
+                                             n_kv_heads, head_dim, seq, scale) == 0);
+        }
+        for (uint32_t r = 0; r < n_q; ++r) {
+            const float *qr = q + (size_t)r * n_heads * head_dim;
+            const float *orow = out + (size_t)r * n_heads * head_dim;
+            uint32_t len = seq - n_q + r + 1;
+            assert(op_attention(&ctx, qr, k, v, ref, n_heads, n_kv_heads, head_dim, len,
+                                scale, NULL) == 0);
+            assert(op_attention(&ctx, qr, k_deq, v_deq, deq_ref, n_heads, n_kv_heads, head_dim,
+                                len, scale, NULL) == 0);
+            for (uint32_t i = 0; i < n_heads * head_dim; ++i) {
+                assert(approx_eq(orow[i], deq_ref[i], 1e-4f));
+                float err = fabsf(orow[i] - ref[i]);
+                max_err[kq] = err > max_err[kq] ? err : max_err[kq];
+            }
+        }
+        kv_cache_destroy(c);
+    }
+    assert(max_err[0] < 2e-3f);
+    assert(max_err[1] < 3e-2f);
+    assert(max_err[1] > max_err[0]);
+    assert(mem[1] * 10 < mem[0] * 6);
+    free(k);
+    free(v);
+    free(k_deq);
+    free(v_deq);
+    free(q);
+    free(out);
+}
+
+struct head_span_list {
+    struct op_kv_head_span spans[64];
+    uint32_t n;
+};
+
+static void collect_head_span(uint32_t pos0, const struct op_kv_head_span *span, void *user) {
+    (void)pos0;
+    struct head_span_list *l = (struct head_span_list *)user;
+    assert(l->n < 64);
+    l->spans[l->n++] = *span;
+}
+
+// The head-major cache holds the same quantized values as the token-major
+// one whenever heads are whole groups, so attention over its tiles must agree
+// exactly there (head_dim 64) and closely otherwise (head_dim 48, where the
+// groups restart at each head). Tiles of a block start cache-line aligned.
+static void test_op_attention_kv_heads(void) {
+    const uint32_t heads[2][2] = { {4, 2}, {6, 3} };
+    const uint32_t head_dims[2] = {64, 48};
+    const uint32_t seq = 100;
+    const uint32_t n_q = 19;
+    const uint32_t max_kv_dim = 3 * 64;
+    float *k = (float *)malloc((size_t)seq * max_kv_dim * sizeof(float));
+    float *v = (float *)malloc((size_t)seq * max_kv_dim * sizeof(float));
+    float *k_deq = (float *)malloc((size_t)seq * max_kv_dim * sizeof(float));
+    float *v_deq = (float *)malloc((size_t)seq * max_kv_dim * sizeof(float));
+    float *q = (float *)malloc((size_t)n_q * 6 * 64 * sizeof(float));
+    float *ref = (float *)malloc((size_t)n_q * 6 * 64 * sizeof(float));
+    float *out = (float *)malloc((size_t)n_q * 6 * 64 * sizeof(float));
+    float row_ref[6 * 64];
+    assert(k && v && k_deq && v_deq && q && ref && out);
+    for (uint32_t i = 0; i < seq * max_kv_dim; ++i) {
+        k[i] = sinf((float)i * 0.23f) * 1.2f;
+        v[i] = cosf((float)i * 0.41f);
+    }
+    for (uint32_t i = 0; i < n_q * 6 * 64; ++i) {
+        q[i] = cosf((float)i * 0.59f);
+    }
+    struct op_context ctxs[2] = { {0}, {0} };
+    ctxs[1].pool = thread_pool_create(3);
+    ctxs[1].n_threads = thread_pool_size(ctxs[1].pool);
+    for (uint32_t hc = 0; hc < 2; ++hc) {
+        for (uint32_t di = 0; di < 2; ++di) {
+            for (uint32_t kq = 0; kq < 2; ++kq) {
+                const uint32_t n_heads = heads[hc][0];
+                const uint32_t n_kv_heads = heads[hc][1];
+                const uint32_t head_dim = head_dims[di];
+                const uint32_t q_dim = n_heads * head_dim;
+                float scale = 1.0f / sqrtf((float)head_dim);
+                struct kv_cache_config cfg;
+                memset(&cfg, 0, sizeof(cfg));
+                cfg.n_layers = 1;
+                cfg.n_kv_heads = n_kv_heads;
+                cfg.head_dim = head_dim;
+                cfg.block_size = 24;
+                cfg.max_seq_len = 128;
+                cfg.quant = kq == 0 ? KV_Q8_0 : KV_Q4_0;
+                kv_cache_t *tok = kv_cache_create(&cfg);
+                cfg.layout = KV_LAYOUT_HEAD_MAJOR;
+                kv_cache_t *hm = kv_cache_create(&cfg);
+                assert(tok && hm);
+                assert(kv_cache_append_batch(tok, 0, 0, seq, k, v) == 0);
+                assert(kv_cache_append_batch(hm, 0, 0, seq, k, v) == 0);
+                struct span_list spans;
+                struct head_span_list hspans;
+                spans.n = 0;
+                hspans.n = 0;
+                assert(kv_cache_iterate_quant(tok, 0, 0, seq, collect_span, &spans) == 0);
+                assert(kv_cache_iterate_heads(hm, 0, 0, seq, collect_head_span, &hspans) == 0);
+                assert(kv_cache_iterate_heads(tok, 0, 0, seq, collect_head_span, &hspans) != 0);
+                assert(kv_cache_iterate_quant(hm, 0, 0, seq, collect_span, &spans) != 0);
+                assert(hspans.n == spans.n);
+                for (uint32_t i = 0; i < hspans.n; ++i) {
+                    assert(((uintptr_t)hspans.spans[i].k % 64u) == 0);
+                    assert(((uintptr_t)hspans.spans[i].v % 64u) == 0);
+                    assert((hspans.spans[i].head_stride % 64u) == 0);
+                }
+                assert(kv_cache_read_range(hm, 0, 0, seq, k_deq, v_deq) == 0);
+                if (kq == 0) {
+                    assert(op_attention_q8_kv_causal(&ctxs[0], q, n_q, spans.spans, spans.n, ref,
+                                                     n_heads, n_kv_heads, head_dim, seq, scale) == 0);
+                } else {
+                    assert(op_attention_q4_kv_causal(&ctxs[0], q, n_q, spans.spans, spans.n, ref,
+                                                     n_heads, n_kv_heads, head_dim, seq, scale) == 0);
+                }
+                for (uint32_t ci = 0; ci < 2; ++ci) {
+                    assert(op_attention_kv_heads_causal(&ctxs[ci], q, n_q, hspans.spans,
+                                                        hspans.n, out, n_heads, n_kv_heads, head_dim,
+                                                        seq, scale, 0.0f, NULL) == 0);
+                    for (uint32_t i = 0; i < n_q * q_dim; ++i) {
+                        if (head_dim % 32u == 0) {
+                            assert(out[i] == ref[i]);
+                        } else {
+                            assert(approx_eq(out[i], ref[i], kq == 0 ? 2e-3f : 3e-2f));
+                        }
+                    }
+                }
+                // And exactly the math of op_attention on its own dequantized rows.
+                for (uint32_t r = 0; r < n_q; r += 6) {
+                    assert(op_attention(&ctxs[0], q + (size_t)r * q_dim, k_deq, v_deq, row_ref,
+                                        n_heads, n_kv_heads, head_dim, seq - n_q + r + 1, scale,
+                                        NULL) == 0);
+                    for (uint32_t i = 0; i < q_dim; ++i) {
+                        assert(approx_eq(out[(size_t)r * q_dim + i], row_ref[i], 1e-4f));
+                    }
+                }
+                kv_cache_destroy(tok);
+                kv_cache_destroy(hm);
+            }
+        }
+    }
+    thread_pool_destroy(ctxs[1].pool);
+    free(k);
+    free(v);
+    free(k_deq);
+    free(v_deq);
+    free(q);
+    free(ref);
+    free(out);
+}
+
+// A window-evicting cache fed token by token the way the engine does it
+// (keys rotated at kv_cache_rope_pos) must attend like a dense cache whose
+// keys sit at their current positions, however far the run has moved: the
+// kernel turns the queries by each run's rope_shift. The attention mass per
+// run matches the softmax over the dequantized keys and sums to one per
+// query head and row.
+static void test_op_attention_kv_evicted(void) {
+    const uint32_t n_heads = 4;
+    const uint32_t n_kv_heads = 2;
+    const uint32_t head_dim = 64;
+    const uint32_t q_dim = n_heads * head_dim;
+    const uint32_t kv_dim = n_kv_heads * head_dim;
+    const uint32_t bs = 16;
+    const uint32_t max_seq = 64;
+    const uint32_t n_stream = 150;
+    const uint32_t n_q = 5;
+    const float theta = 10000.0f;
+    const float scale = 1.0f / sqrtf((float)head_dim);
+    float *k_raw = (float *)malloc((size_t)n_stream * kv_dim * sizeof(float));
+    float *v_raw = (float *)malloc((size_t)n_stream * kv_dim * sizeof(float));
+    float *k_ref = (float *)malloc((size_t)max_seq * kv_dim * sizeof(float));
+    float *v_ref = (float *)malloc((size_t)max_seq * kv_dim * sizeof(float));
+    float *q = (float *)malloc((size_t)n_q * q_dim * sizeof(float));
+    float *out = (float *)malloc((size_t)n_q * q_dim * sizeof(float));
+    float ref[4 * 64];
+    float row[2 * 64];
+    uint32_t orig[64];
+    assert(k_raw && v_raw && k_ref && v_ref && q && out);
+    for (uint32_t i = 0; i < n_stream * kv_dim; ++i) {
+        k_raw[i] = sinf((float)i * 0.37f);
+        v_raw[i] = cosf((float)i * 0.53f);
+    }
+    struct kv_cache_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.n_layers = 1;
+    cfg.n_kv_heads = n_kv_heads;
+    cfg.head_dim = head_dim;
+    cfg.block_size = bs;
+    cfg.max_seq_len = max_seq;
+    cfg.quant = KV_Q8_0;
+    cfg.layout = KV_LAYOUT_HEAD_MAJOR;
+    cfg.evict = KV_EVICT_WINDOW;
+    cfg.n_sink = 4;
+    kv_cache_t *c = kv_cache_create(&cfg);
+    assert(c);
+    size_t mem_full = 0;
+    for (uint32_t i = 0; i < n_stream; ++i) {
+        uint32_t before = kv_cache_get_seq_len(c, 0);
+        assert(kv_cache_reserve(c, 1) == 0);
+        uint32_t pos = kv_cache_get_seq_len(c, 0);
+        if (pos < before) {
+            // The oldest block after the sink block went.
+            assert(before - pos == bs);
+            memmove(&orig[bs], &orig[2 * bs], (pos - bs) * sizeof(uint32_t));
+        }
+        orig[pos] = i;
+        memcpy(row, k_raw + (size_t)i * kv_dim, kv_dim * sizeof(float));
+        assert(op_rope(NULL, row, n_kv_heads, head_dim, kv_cache_rope_pos(c, 0, pos), theta) == 0);
+        assert(kv_cache_append(c, 0, pos, row, v_raw + (size_t)i * kv_dim) == 0);
+        if (pos + 1 == max_seq && mem_full == 0) {
+            mem_full = kv_cache_memory_size(c);
+        }
+    }
+    uint32_t seq = kv_cache_get_seq_len(c, 0);
+    assert(seq <= max_seq && seq > max_seq - bs);
+    assert(kv_cache_memory_size(c) == mem_full);
+    assert(orig[0] == 0 && orig[seq - 1] == n_stream - 1);
+
+    struct head_span_list hspans;
+    hspans.n = 0;
+    assert(kv_cache_iterate_heads(c, 0, 0, seq, collect_head_span, &hspans) == 0);
+    uint32_t shifted = 0;
+    for (uint32_t i = 0; i < hspans.n; ++i) {
+        shifted += hspans.spans[i].rope_shift != 0;
+    }
+    assert(shifted > 1);
+    // Reference: the surviving tokens rotated at their current positions.
+    for (uint32_t p = 0; p < seq; ++p) {
+        memcpy(k_ref + (size_t)p * kv_dim, k_raw + (size_t)orig[p] * kv_dim, kv_dim * sizeof(float));
+        memcpy(v_ref + (size_t)p * kv_dim, v_raw + (size_t)orig[p] * kv_dim, kv_dim * sizeof(float));
+        assert(op_rope(NULL, k_ref + (size_t)p * kv_dim, n_kv_heads, head_dim, p, theta) == 0);
+    }
+    for (uint32_t i = 0; i < n_q * q_dim; ++i) {
+        q[i] = cosf((float)i * 0.29f);
+    }
+    for (uint32_t r = 0; r < n_q; ++r) {
+        assert(op_rope(NULL, q + (size_t)r * q_dim, n_heads, head_dim, seq - n_q + r, theta) == 0);
+    }
+    struct op_context ctxs[2] = { {0}, {0} };
+    ctxs[1].pool = thread_pool_create(3);
+    ctxs[1].n_threads = thread_pool_size(ctxs[1].pool);
+    for (uint32_t ci = 0; ci < 2; ++ci) {
+        float mass[8] = {0};
+        assert(op_attention_kv_heads_causal(&ctxs[ci], q, n_q, hspans.spans, hspans.n, out,
+                                            n_heads, n_kv_heads, head_dim, seq, scale, 0.0f,
+                                            NULL) != 0);
+        assert(op_attention_kv_heads_causal(&ctxs[ci], q, n_q, hspans.spans, hspans.n, out,
+                                            n_heads, n_kv_heads, head_dim, seq, scale, theta,
+                                            mass) == 0);
+        float total = 0.0f;
+        for (uint32_t i = 0; i < hspans.n; ++i) {
+            total += mass[i];
+        }
+        assert(approx_eq(total, (float)(n_heads * n_q), 1e-3f));
+        for (uint32_t r = 0; r < n_q; ++r) {
+            assert(op_attention(NULL, q + (size_t)r * q_dim, k_ref, v_ref, ref, n_heads, n_kv_heads,
+                                head_dim, seq - n_q + r + 1, scale, NULL) == 0);
+            for (uint32_t i = 0; i < q_dim; ++i) {
+                assert(approx_eq(out[(size_t)r * q_dim + i], ref[i], 3e-2f));
+            }
+        }
+    }
+    thread_pool_destroy(ctxs[1].pool);
+    kv_cache_destroy(c);
+
+    // Run masses against the softmax over the dequantized rows of a cache
+    // that never evicted (decode row, one query head per KV head).
+    cfg.evict = KV_EVICT_NONE;
+    c = kv_cache_create(&cfg);
+    assert(c && kv_cache_append_batch(c, 0, 0, 40, k_raw, v_raw) == 0);
+    assert(kv_cache_read_range(c, 0, 0, 40, k_ref, v_ref) == 0);
+    hspans.n = 0;
+    assert(kv_cache_iterate_heads(c, 0, 0, 40, collect_head_span, &hspans) == 0);
+    assert(hspans.n == 3);
+    float mass[3] = {0};
+    assert(op_attention_kv_heads_causal(NULL, q, 1, hspans.spans, hspans.n, out, 2, 2,
+                                        head_dim, 40, scale, theta, mass) == 0);
+    float want[3] = {0};
+    for (uint32_t h = 0; h < 2; ++h) {
+        float sc[40];
+        float mx = -INFINITY;
+        float sum = 0.0f;
+        for (uint32_t t = 0; t < 40; ++t) {
+            float dot = 0.0f;
+            for (uint32_t d = 0; d < head_dim; ++d) {
+                dot += q[h * head_dim + d] * k_ref[(size_t)t * kv_dim + h * head_dim + d];
+            }
+            sc[t] = dot * scale;
+            mx = sc[t] > mx ? sc[t] : mx;
+        }
+        for (uint32_t t = 0; t < 40; ++t) {
+            sc[t] = expf(sc[t] - mx);
+            sum += sc[t];
+        }
+        for (uint32_t t = 0; t < 40; ++t) {
+            want[t / bs] += sc[t] / sum;
+        }
+    }
+    for (uint32_t i = 0; i < 3; ++i) {
+        assert(approx_eq(mass[i], want[i], 1e-4f));
+    }
+    kv_cache_destroy(c);
+    free(k_raw);
+    free(v_raw);
+    free(k_ref);
+    free(v_ref);
+    free(q);
+    free(out);
+}
+
+// Tiered caches keep the newest block in F16, then Q8_0, then Q4_0 as the
+// background compaction catches up. Attention over the mixed runs is the
+// math of op_attention on the cache's own dequantized rows, lands closer to
+// the fp32 result than an all-Q4_0 cache, and needs less memory than Q8_0.
+static void test_op_attention_kv_tiered(void) {
+    const uint32_t n_heads = 4;
+    const uint32_t n_kv_heads = 2;
+    const uint32_t head_dim = 64;
+    const uint32_t q_dim = n_heads * head_dim;
+    const uint32_t kv_dim = n_kv_heads * head_dim;
+    const uint32_t seq = 240;
+    const uint32_t chunk = 16;
+    const float scale = 1.0f / sqrtf((float)head_dim);
+    float *k = (float *)malloc((size_t)seq * kv_dim * sizeof(float));
+    float *v = (float *)malloc((size_t)seq * kv_dim * sizeof(float));
+    float *k_deq = (float *)malloc((size_t)seq * kv_dim * sizeof(float));
+    float *v_deq = (float *)malloc((size_t)seq * kv_dim * sizeof(float));
+    float q[4 * 64];
+    float out[4 * 64];
+    float ref[4 * 64];
+    float exact[4 * 64];
+    assert(k && v && k_deq && v_deq);
+    for (uint32_t i = 0; i < seq * kv_dim; ++i) {
+        k[i] = (float)((i * 2654435761u) >> 16 & 0xFFFFu) / 65536.0f * 3.0f - 1.5f;
+        v[i] = (float)((i * 2246822519u) >> 16 & 0xFFFFu) / 65536.0f * 2.0f - 1.0f;
+    }
+    // Queries resembling the latest keys, so recent tokens draw most of the
+    // attention as they do in practice.
+    for (uint32_t i = 0; i < q_dim; ++i) {
+        uint32_t kvh = (i / head_dim) / (n_heads / n_kv_heads);
+        q[i] = k[(size_t)(seq - 1 - i / head_dim) * kv_dim + kvh * head_dim + i % head_dim] * 0.5f;
+    }
+    // F16 rows: exact where representable, small values flush to zero.
+    const float halves[4] = {1.5f, -0.0078125f, 65504.0f, 1e-6f};
+    uint16_t h16[4];
+    float back[4];
+    op_quantize_kv_row(KV_F16, halves, h16, 4);
+    op_dequantize_kv_row(KV_F16, h16, back, 4);
+    assert(back[0] == 1.5f && back[1] == -0.0078125f && back[2] == 65504.0f && back[3] == 0.0f);
+    assert(op_attention(NULL, q, k, v, exact, n_heads, n_kv_heads, head_dim, seq, scale, NULL) == 0);
+
+    struct kv_cache_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.n_layers = 1;
+    cfg.n_kv_heads = n_kv_heads;
+    cfg.head_dim = head_dim;
+    cfg.block_size = 16;
+    cfg.max_seq_len = 256;
+    cfg.layout = KV_LAYOUT_HEAD_MAJOR;
+    float err[2];
+    size_t mem[2];
+    for (uint32_t mode = 0; mode < 2; ++mode) {
+        cfg.tiered = mode == 0;
+        cfg.tier_f16 = 1;
+        cfg.tier_q8 = 2;
+        cfg.quant = KV_Q4_0;
+        kv_cache_t *c = kv_cache_create(&cfg);
+        assert(c);
+        for (uint32_t p = 0; p < seq; p += chunk) {
+            assert(kv_cache_append_batch(c, 0, p, chunk, k + (size_t)p * kv_dim, v + (size_t)p * kv_dim) == 0);
+            assert(kv_cache_compact(c, 0) == 0);
+        }
+        struct head_span_list hspans;
+        hspans.n = 0;
+        assert(kv_cache_iterate_heads(c, 0, 0, seq, collect_head_span, &hspans) == 0);
+        assert(hspans.n == 15);
+        for (uint32_t i = 0; i < hspans.n; ++i) {
+            uint32_t want = mode == 1 ? KV_Q4_0 : i == 14 ? KV_F16 : i >= 12 ? KV_Q8_0 : KV_Q4_0;
+            assert(hspans.spans[i].quant == want);
+        }
+        assert(kv_cache_read_range(c, 0, 0, seq, k_deq, v_deq) == 0);
+        assert(op_attention(NULL, q, k_deq, v_deq, ref, n_heads, n_kv_heads, head_dim, seq, scale,
+                            NULL) == 0);
+        assert(op_attention_kv_heads_causal(NULL, q, 1, hspans.spans, hspans.n, out, n_heads,
+                                            n_kv_heads, head_dim, seq, scale, 0.0f, NULL) == 0);
+        err[mode] = 0.0f;
+        for (uint32_t i = 0; i < q_dim; ++i) {
+            assert(approx_eq(out[i], ref[i], 1e-4f));
+            err[mode] += fabsf(out[i] - exact[i]);
+        }
+        mem[mode] = kv_cache_memory_size(c);
+        kv_cache_destroy(c);
+    }
+    assert(err[0] < err[1]);
+    cfg.tiered = 0;
+    cfg.quant = KV_Q8_0;
+    kv_cache_t *q8 = kv_cache_create(&cfg);
+    assert(q8 && kv_cache_append_batch(q8, 0, 0, seq, k, v) == 0);
+    assert(mem[0] < kv_cache_memory_size(q8) && mem[1] < mem[0]);
+    kv_cache_destroy(q8);
+    cfg.tiered = 1;
+    cfg.layout = KV_LAYOUT_TOKEN_MAJOR;
+    assert(kv_cache_create(&cfg) == NULL);
+    free(k);
+    free(v);
+    free(k_deq);
+    free(v_deq);
+}
+
+// Needle in a haystack: one token per KV head matches its heads' query
+// among 60 blocks of random keys. Key bounds must rank both needle blocks
+// into a 6-block budget, so sparse decode matches full attention where a
+// recent window of the same size misses them.
+static void test_op_kv_select_spans(void) {
+    const uint32_t n_heads = 4;
+    const uint32_t n_kv_heads = 2;
+    const uint32_t head_dim = 64;
+    const uint32_t q_dim = n_heads * head_dim;
+    const uint32_t kv_dim = n_kv_heads * head_dim;
+    const uint32_t seq = 960;
+    const uint32_t needle[2] = {200, 610};
+    const float scale = 1.0f / sqrtf((float)head_dim);
+    float *k = (float *)malloc((size_t)seq * kv_dim * sizeof(float));
+    float *v = (float *)malloc((size_t)seq * kv_dim * sizeof(float));
+    float q[4 * 64];
+    float full[4 * 64];
+    float out[4 * 64];
+    assert(k && v);
+    for (uint32_t i = 0; i < seq * kv_dim; ++i) {
+        k[i] = (float)((i * 2654435761u) >> 16 & 0xFFFFu) / 65536.0f * 2.0f - 1.0f;
+        v[i] = (float)((i * 2246822519u) >> 16 & 0xFFFFu) / 65536.0f * 2.0f - 1.0f;
+    }
+    for (uint32_t g = 0; g < n_kv_heads; ++g) {
+        for (uint32_t d = 0; d < head_dim; ++d) {
+            float sign = ((d * 40503u + g * 7u) >> 3) & 1u ? 1.0f : -1.0f;
+            k[(size_t)needle[g] * kv_dim + g * head_dim + d] = 1.5f * sign;
+            v[(size_t)needle[g] * kv_dim + g * head_dim + d] = 2.0f;
+            for (uint32_t j = 0; j < n_heads / n_kv_heads; ++j) {
+                q[(g * (n_heads / n_kv_heads) + j) * head_dim + d] = sign;
+            }
+        }
+    }
+
+    struct kv_cache_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.n_layers = 1;
+    cfg.n_kv_heads = n_kv_heads;
+    cfg.head_dim = head_dim;
+    cfg.block_size = 16;
+    cfg.max_seq_len = seq;
+    cfg.quant = KV_Q8_0;
+    cfg.layout = KV_LAYOUT_HEAD_MAJOR;
+    cfg.key_bounds = 1;
+    kv_cache_t *c = kv_cache_create(&cfg);
+    assert(c && kv_cache_append_batch(c, 0, 0, seq, k, v) == 0);
+    struct head_span_list hspans;
+    hspans.n = 0;
+    assert(kv_cache_iterate_heads(c, 0, 0, seq, collect_head_span, &hspans) == 0);
+    assert(hspans.n == 60 && hspans.spans[0].k_min && hspans.spans[0].k_max);
+    assert(op_attention_kv_heads_causal(NULL, q, 1, hspans.spans, hspans.n, full, n_heads,
+                                        n_kv_heads, head_dim, seq, scale, 0.0f, NULL) == 0);
+
+    uint32_t keep[64];
+    uint32_t n_keep = 0;
+    assert(op_kv_select_spans(NULL, q, hspans.spans, hspans.n, n_heads, n_kv_heads, head_dim,
+                              10000.0f, 100, 1, 1, keep, &n_keep) == 0);
+    assert(n_keep == 60 && keep[59] == 59);
+    assert(op_kv_select_spans(NULL, q, hspans.spans, hspans.n, n_heads, n_kv_heads, head_dim,
+                              10000.0f, 6, 1, 1, keep, &n_keep) == 0);
+    assert(n_keep == 6 && keep[0] == 0 && keep[5] == 59);
+    int found[2] = {0, 0};
+    for (uint32_t i = 0; i < n_keep; ++i) {
+        assert(i == 0 || keep[i] > keep[i - 1]);
+        found[0] |= keep[i] == needle[0] / 16;
+        found[1] |= keep[i] == needle[1] / 16;
+    }
+    assert(found[0] && found[1]);
+
+    // Sparse decode over the kept blocks against the newest six.
+    float err[2];
+    for (uint32_t mode = 0; mode < 2; ++mode) {
+        struct op_kv_head_span sel[6];
+        uint32_t len = 0;
+        for (uint32_t i = 0; i < 6; ++i) {
+            sel[i] = hspans.spans[mode == 0 ? keep[i] : hspans.n - 6 + i];
+            len += sel[i].n_tokens;
+        }
+        assert(op_attention_kv_heads_causal(NULL, q, 1, sel, 6, out, n_heads, n_kv_heads,
+                                            head_dim, len, scale, 0.0f, NULL) == 0);
+        err[mode] = 0.0f;
+        for (uint32_t i = 0; i < q_dim; ++i) {
+            err[mode] += fabsf(out[i] - full[i]);
+        }
+    }
+    assert(err[0] < 0.02f * q_dim && err[0] * 50 < err[1]);
+    kv_cache_destroy(c);
+    free(k);
+    free(v);
+}
+
+static void test_op_thread_pool(void) {
+    const uint32_t m = 37;
+    const uint32_t k = 512;
+    const uint32_t n = 3;
+    const uint32_t nb = k / 256;
+    struct block_q4_k *a = (struct block_q4_k *)calloc(m * nb, sizeof(struct block_q4_k));
+    float *b = (float *)malloc((size_t)n * k * sizeof(float));
+    void *bq = malloc(n * op_q8_k_row_size(k));
+    float *c1 = (float *)malloc((size_t)n * m * sizeof(float));
+    float *c2 = (float *)malloc((size_t)n * m * sizeof(float));
+    assert(a && b && bq && c1 && c2);
+    for (uint32_t i = 0; i < m * nb; ++i) {
+        a[i].d = float_to_half(0.01f);
+        a[i].dmin = float_to_half(0.002f);
+        for (uint32_t j = 0; j < 12; ++j) {
+            a[i].scales[j] = (uint8_t)(i * 5 + j * 11);
+        }
+        for (uint32_t j = 0; j < 128; ++j) {
+            a[i].qs[j] = (uint8_t)(i * 29 + j * 7);
+        }
+    }
+    for (uint32_t i = 0; i < n * k; ++i) {
+        b[i] = (float)((int)(i % 23) - 11) * 0.03f;
+    }
+    struct op_context serial = {0};
+    struct op_context pooled = {0};
+    pooled.pool = thread_pool_create(3);
+    assert(pooled.pool && thread_pool_size(pooled.pool) == 3);
+    pooled.n_threads = 3;
+    assert(op_quantize_q8_k(&serial, b, bq, n, k) == 0);
+
+    assert(op_matmul_q4_k(&serial, a, b, c1, m, k) == 0);
+    assert(op_matmul_q4_k(&pooled, a, b, c2, m, k) == 0);
+    assert(memcmp(c1, c2, m * sizeof(float)) == 0);
+
+    assert(op_matmul_q4_k_gemm(&serial, a, b, c1, m, n, k) == 0);
+    assert(op_matmul_q4_k_gemm(&pooled, a, b, c2, m, n, k) == 0);
+    assert(memcmp(c1, c2, (size_t)n * m * sizeof(float)) == 0);
+
+    assert(op_matmul_q4_k_q8_k(&serial, a, bq, c1, m, n, k) == 0);
+    assert(op_matmul_q4_k_q8_k(&pooled, a, bq, c2, m, n, k) == 0);
+    assert(memcmp(c1, c2, (size_t)n * m * sizeof(float)) == 0);
+
+    // 5 query heads over 2 KV heads, 7 positions of head_dim 8.
+    const uint32_t n_heads = 5;
+    const uint32_t n_kv = 1;
+    const uint32_t hd = 8;
+    const uint32_t seq = 7;
+    float q[5 * 8];
+    float kc[7 * 2 * 8];
+    float vc[7 * 2 * 8];
+    float o1[5 * 8];
+    float o2[5 * 8];
+    for (uint32_t i = 0; i < n_heads * hd; ++i) {
+        q[i] = (float)((int)(i % 7) - 3) * 0.1f;
+    }
+    for (uint32_t i = 0; i < seq * n_kv * hd; ++i) {
+        kc[i] = (float)((int)(i % 5) - 2) * 0.2f;
+        vc[i] = (float)((int)(i % 9) - 4) * 0.1f;
+    }
+    assert(op_attention(&serial, q, kc, vc, o1, n_heads, n_kv, hd, seq, 0.35f, NULL) == 0);
+    assert(op_attention(&pooled, q, kc, vc, o2, n_heads, n_kv, hd, seq, 0.35f, NULL) == 0);
+    assert(memcmp(o1, o2, sizeof(o1)) == 0);
+
+    thread_pool_destroy(pooled.pool);
+    free(a);
+    free(b);
+    free(bq);
+    free(c1);
+    free(c2);
+}
+
 static void test_op_mlp_swiglu(void) {
     const uint32_t d_in = 256;
     const uint32_t d_ff = 256;
@@ -172,12 +1306,31 @@ static void test_op_mlp_swiglu(void) {
 }
 
 int main(void) {
+#if defined(OPS_X86_SIMD)
+    setenv("SHUKUCHI_SIMD", "scalar", 1);
+#endif
     test_op_embed_f16();
     test_op_rmsnorm();
     test_op_rope();
     test_op_softmax();
     test_op_matmul_q4_k();
+    test_op_matmul_q4_k_gemm();
+    test_op_matmul_q5_q6_k_gemm();
+    test_op_matmul_q8_k();
+    test_op_matmul_k_quant_rows();
+#if defined(OPS_X86_SIMD)
+    test_x86_dot_kernels();
+    test_x86_kv_quantizers();
+#endif
     test_op_attention();
+    test_op_attention_q8_kv();
+    test_op_attention_q8_kv_causal();
+    test_op_attention_q4_kv();
+    test_op_attention_kv_heads();
+    test_op_attention_kv_evicted();
+    test_op_attention_kv_tiered();
+    test_op_kv_select_spans();
+    test_op_thread_pool();
     test_op_mlp_swiglu();
     printf("PASS\n");
     return 0;
@@ -1,4 +1,7 @@
 #include <stdio.h>
+#include <string.h>
+// The checks call the code under test, so they must run in every build.
+#undef NDEBUG
 #include <assert.h>
 
 #include "prefetch.h"
@@ -18,6 +21,9 @@ int main(int argc, char **argv) {
     struct prefetcher_config pcfg = {0};
     pcfg.depth = 2;
     pcfg.model = m;
+    // Small chunks and several readers so each layer is read in pieces.
+    pcfg.io_depth = 4;
+    pcfg.io_chunk_size = 4096;
     prefetcher_t *p = prefetcher_create(&pcfg);
     assert(p && "prefetcher_create failed");
 
@@ -37,10 +43,68 @@ int main(int argc, char **argv) {
         assert(buf->view.attn_q && buf->view.attn_k && buf->view.attn_v);
         printf("got layer %u, data=%p size=%zu\n", i, buf->data, buf->size);
 
+        const struct layer_view *ref = NULL;
+        assert(model_get_layer_view(m, i, &ref) == 0 && ref);
+        assert(buf->view.attn_q_size == ref->attn_q_size);
+        assert(memcmp(buf->view.attn_q, ref->attn_q, ref->attn_q_size) == 0);
+        assert(memcmp(buf->view.ffn_down, ref->ffn_down, ref->ffn_down_size) == 0);
+
         prefetcher_release(p, buf);
         printf("released layer %u\n", i);
     }
 
+    // Group readiness: attention tensors first, FFN once waited for.
+    for (uint32_t i = 0; i < n_layers; i++) {
+        prefetch_request_t *req = prefetcher_request(p, i);
+        struct layer_buffer *buf = prefetcher_wait_partial(req, LAYER_GROUP_ATTN);
+        assert(buf && buf->state == BUF_IN_USE);
+        const struct layer_view *ref = NULL;
+        assert(model_get_layer_view(m, i, &ref) == 0 && ref);
+        assert(memcmp(buf->view.attn_o, ref->attn_o, ref->attn_o_size) == 0);
+        // Byte ranges become readable chunk by chunk, before the group is.
+        size_t half = ref->ffn_down_size / 2;
+        assert(prefetcher_wait_range(p, buf, buf->view.ffn_down, half) == 0);
+        assert(memcmp(buf->view.ffn_down, ref->ffn_down, half) == 0);
+        assert(prefetcher_wait_groups(p, buf, LAYER_GROUP_FFN) == 0);
+        assert(prefetcher_ready_groups(p, buf) == LAYER_GROUP_ALL);
+        assert(memcmp(buf->view.ffn_gate, ref->ffn_gate, ref->ffn_gate_size) == 0);
+        assert(memcmp(buf->view.ffn_down, ref->ffn_down, ref->ffn_down_size) == 0);
+        prefetcher_release(p, buf);
+    }
+
+    prefetcher_stop(p);
+
+    // Ring arena: keep requesting ahead until it is full, consume in FIFO
+    // order, and run the layer stream twice so allocations wrap around.
+    pcfg.depth = 3;
+    p = prefetcher_create(&pcfg);
+    assert(p && "prefetcher_create (ring) failed");
+    prefetcher_start(p);
+    uint32_t max_req = prefetcher_max_requests(p);
+    assert(max_req >= 3);
+    prefetch_request_t *queue[256];
+    uint32_t head = 0, count = 0, next = 0, total = 2 * n_layers;
+    for (uint32_t done = 0; done < total; ++done) {
+        while (next < total && count < max_req) {
+            prefetch_request_t *req = prefetcher_request(p, next % n_layers);
+            if (!req) {
+                break;
+            }
+            queue[(head + count) % 256] = req;
+            count++;
+            next++;
+        }
+        assert(count > 0);
+        struct layer_buffer *buf = prefetcher_wait(queue[head]);
+        head = (head + 1) % 256;
+        count--;
+        assert(buf && buf->view.layer_id == done % n_layers);
+        const struct layer_view *ref = NULL;
+        assert(model_get_layer_view(m, done % n_layers, &ref) == 0 && ref);
+        assert(memcmp(buf->view.attn_v, ref->attn_v, ref->attn_v_size) == 0);
+        prefetcher_release(p, buf);
+    }
+    printf("ring: max_requests=%u\n", max_req);
     prefetcher_stop(p);
     model_close(m);
     printf("PASS\n");